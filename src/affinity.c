@@ -0,0 +1,284 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "affinity.h"
+#include "utils.h"
+
+#define MAX_CPUS 1024
+
+/* Topology, read once from sysfs. CPUs are listed grouped by node, so
+ * that consecutive thread indexes fill a node before moving to the next
+ * one and share its weight replica. Threads may pin themselves
+ * concurrently, so it is loaded through pthread_once. */
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int node_count = 1;
+static int cpu_count = 0;
+static int cpus[MAX_CPUS];
+static int cpu_nodes[MAX_CPUS];
+
+static int parseCPUList(const char * list, int * dest, int max) {
+    int count = 0;
+    const char * p = list;
+    while (*p && *p != '\n') {
+        char * end;
+        int first = (int) strtol(p, &end, 10), last;
+        if (end == p) break;
+        last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = (int) strtol(p, &end, 10);
+            p = end;
+        }
+        for (; first <= last && count < max; first++) dest[count++] = first;
+        if (*p == ',') p++;
+    }
+    return count;
+}
+
+#ifdef __linux__
+/* CPUs the process may run on, filled by readTopology */
+static cpu_set_t allowed;
+static int allowed_loaded = 0;
+#endif
+
+static int isAllowedCPU(int cpu) {
+#ifdef __linux__
+    /* cpu_set_t cannot hold CPUs beyond CPU_SETSIZE */
+    if (cpu < 0 || cpu >= CPU_SETSIZE) return 0;
+    if (!allowed_loaded) return 1;
+    return CPU_ISSET(cpu, &allowed);
+#else
+    return 1;
+#endif
+}
+
+static void readTopology() {
+#ifdef __linux__
+    CPU_ZERO(&allowed);
+    allowed_loaded = (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) == 0);
+#endif
+    int node, nodes_found = 0, i;
+    char path[255], list[4096];
+    int node_cpus[MAX_CPUS];
+    for (node = 0; node < PS_MAX_NUMA_NODES; node++) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE * f = fopen(path, "r");
+        if (f == NULL) continue;
+        int read = (fgets(list, sizeof(list), f) != NULL);
+        fclose(f);
+        if (!read) continue;
+        int count = parseCPUList(list, node_cpus, MAX_CPUS);
+        int added = 0;
+        for (i = 0; i < count && cpu_count < MAX_CPUS; i++) {
+            if (!isAllowedCPU(node_cpus[i])) continue;
+            cpus[cpu_count] = node_cpus[i];
+            cpu_nodes[cpu_count++] = nodes_found;
+            added++;
+        }
+        if (added) nodes_found++;
+    }
+    if (nodes_found > 0) {
+        node_count = nodes_found;
+        return;
+    }
+    /* No sysfs topology: a single node with every online CPU */
+    node_count = 1;
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    if (online < 1) online = 1;
+    for (i = 0; i < online && i < MAX_CPUS; i++) {
+        if (!isAllowedCPU(i)) continue;
+        cpus[cpu_count] = i;
+        cpu_nodes[cpu_count++] = 0;
+    }
+    if (cpu_count == 0) {
+        cpus[0] = 0;
+        cpu_nodes[0] = 0;
+        cpu_count = 1;
+    }
+}
+
+static void loadTopology() {
+    pthread_once(&topology_once, readTopology);
+}
+
+int PSGetNUMANodeCount() {
+    loadTopology();
+    return node_count;
+}
+
+int PSGetCPUCount() {
+    loadTopology();
+    return cpu_count;
+}
+
+int PSGetCPUNode(int cpu) {
+    loadTopology();
+    int i;
+    for (i = 0; i < cpu_count; i++) {
+        if (cpus[i] == cpu) return cpu_nodes[i];
+    }
+    return 0;
+}
+
+int PSGetCurrentNode() {
+    if (PSGetNUMANodeCount() < 2) return 0;
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0) return PSGetCPUNode(cpu);
+#endif
+    return 0;
+}
+
+/* Node of the CPU PSPinThread(index) pins to */
+
+int PSGetThreadNode(int index) {
+    loadTopology();
+    if (index < 0) return 0;
+    return cpu_nodes[index % cpu_count];
+}
+
+/* Pin the calling thread to the index-th usable CPU (wrapping around).
+ * Returns 1 on success, 0 if pinning is not supported or failed. */
+
+int PSPinThread(int index) {
+    loadTopology();
+    if (index < 0) return 0;
+#ifdef __linux__
+    cpu_set_t set;
+    int cpu = cpus[index % cpu_count];
+    if (cpu >= CPU_SETSIZE) return 0;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return (sched_setaffinity(0, sizeof(cpu_set_t), &set) == 0);
+#else
+    return 0;
+#endif
+}
+
+int PSPinThreadToNode(int node) {
+    loadTopology();
+    if (node < 0 || node >= node_count) return 0;
+#ifdef __linux__
+    cpu_set_t set;
+    int i, found = 0;
+    CPU_ZERO(&set);
+    for (i = 0; i < cpu_count; i++) {
+        if (cpu_nodes[i] != node || cpus[i] >= CPU_SETSIZE) continue;
+        CPU_SET(cpus[i], &set);
+        found++;
+    }
+    if (!found) return 0;
+    return (sched_setaffinity(0, sizeof(cpu_set_t), &set) == 0);
+#else
+    return 0;
+#endif
+}
+
+/* Replicas */
+
+PSReplicaSet * PSCreateReplicas(PSNeuralNetwork * network) {
+    if (network == NULL) return NULL;
+    char * func = "PSCreateReplicas";
+    PSReplicaSet * replicas = malloc(sizeof(PSReplicaSet));
+    if (replicas == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    int count = PSGetNUMANodeCount(), i;
+    replicas->count = count;
+    replicas->master = network;
+    replicas->networks = calloc(count, sizeof(PSNeuralNetwork*));
+    if (replicas->networks == NULL) {
+        printMemoryErrorMsg();
+        free(replicas);
+        return NULL;
+    }
+    replicas->networks[0] = network;
+    if (count < 2) return replicas;
+#ifdef __linux__
+    cpu_set_t previous;
+    int restore = (sched_getaffinity(0, sizeof(cpu_set_t), &previous) == 0);
+    int home = PSGetCurrentNode();
+    replicas->networks[0] = NULL;
+    replicas->networks[home] = network;
+    for (i = 0; i < count; i++) {
+        if (i == home) continue;
+        /* Run on the target node while cloning, so the clone's pages are
+         * first-touched there. */
+        if (!PSPinThreadToNode(i))
+            PSErr(func, "Could not move to node %d", i);
+        PSNeuralNetwork * clone = PSCloneNetwork(network, 0);
+        if (clone == NULL) {
+            PSErr(func, "Could not create replica for node %d", i);
+            if (restore)
+                sched_setaffinity(0, sizeof(cpu_set_t), &previous);
+            PSDeleteReplicas(replicas);
+            return NULL;
+        }
+        replicas->networks[i] = clone;
+    }
+    if (restore) sched_setaffinity(0, sizeof(cpu_set_t), &previous);
+#endif
+    return replicas;
+}
+
+PSNeuralNetwork * PSGetLocalReplica(PSReplicaSet * replicas) {
+    if (replicas == NULL) return NULL;
+    int node = PSGetCurrentNode();
+    if (node >= replicas->count || replicas->networks[node] == NULL)
+        return replicas->master;
+    return replicas->networks[node];
+}
+
+/* Copy the master weights into every other replica; call it after each
+ * weight update. */
+
+int PSSyncReplicas(PSReplicaSet * replicas) {
+    if (replicas == NULL) return 0;
+    int i;
+    for (i = 0; i < replicas->count; i++) {
+        PSNeuralNetwork * replica = replicas->networks[i];
+        if (replica == NULL || replica == replicas->master) continue;
+        if (!PSCopyNetworkWeights(replica, replicas->master)) return 0;
+    }
+    return 1;
+}
+
+void PSDeleteReplicas(PSReplicaSet * replicas) {
+    if (replicas == NULL) return;
+    int i;
+    for (i = 0; i < replicas->count; i++) {
+        PSNeuralNetwork * replica = replicas->networks[i];
+        if (replica == NULL || replica == replicas->master) continue;
+        PSDeleteNetwork(replica);
+    }
+    free(replicas->networks);
+    free(replicas);
+}
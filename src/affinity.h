@@ -0,0 +1,53 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_AFFINITY_H
+#define __PS_AFFINITY_H
+
+#include "psyc.h"
+
+#define PS_MAX_NUMA_NODES   64
+
+/* Per-node copies of a network. Each replica is allocated while the
+ * calling thread runs on that node, so its pages are first-touched
+ * locally. On single-node machines the only replica is the network
+ * itself and synchronisation is a no-op.
+ * Replicas only serve inference engines (see inference.h). Training
+ * updates the master network (Hogwild workers share its weights, local
+ * SGD workers average their own copies into it) and PSSyncReplicas then
+ * copies it to the replicas. */
+
+typedef struct {
+    int count;
+    PSNeuralNetwork * master;
+    PSNeuralNetwork ** networks;
+} PSReplicaSet;
+
+int PSGetNUMANodeCount();
+int PSGetCPUCount();
+int PSGetCPUNode(int cpu);
+int PSGetCurrentNode();
+int PSGetThreadNode(int index);
+int PSPinThread(int index);
+int PSPinThreadToNode(int node);
+
+PSReplicaSet * PSCreateReplicas(PSNeuralNetwork * network);
+PSNeuralNetwork * PSGetLocalReplica(PSReplicaSet * replicas);
+int PSSyncReplicas(PSReplicaSet * replicas);
+void PSDeleteReplicas(PSReplicaSet * replicas);
+
+#endif //__PS_AFFINITY_H
@@ -240,3 +240,254 @@ void avx_diff4(double * x, double * y, double * dest, int mode) {
     }
     _mm256_storeu_pd(dest, xy);
 }
+
+/* Aligned variants: callers must guarantee 32-byte aligned operands */
+
+double avx_dot_product2_aligned(double * x, double * y) {
+    __m128d xv = _mm_load_pd(x);
+    __m128d yv = _mm_load_pd(y);
+    __m128d xy = _mm_mul_pd(xv, yv);
+    __m128d dotproduct = _mm_hadd_pd(xy, xy);
+    double * d = (double*) &dotproduct;
+    return *d;
+}
+
+double avx_dot_product4_aligned(double * x, double * y) {
+    __m256d xv = _mm256_load_pd(x);
+    __m256d yv = _mm256_load_pd(y);
+    __m256d xy = _mm256_mul_pd(xv, yv);
+    __m256d temp = _mm256_hadd_pd(xy, xy);
+    __m128d lo128 = _mm256_extractf128_pd( temp, 0 );
+    __m128d hi128 = _mm256_extractf128_pd( temp, 1 );
+    __m128d dotproduct = _mm_add_pd( lo128, hi128 );
+    double * d = (double*) &dotproduct;
+    return *d;
+}
+
+double avx_dot_product8_aligned(double * x, double * y) {
+    __m256d xv = _mm256_load_pd(x);
+    __m256d yv = _mm256_load_pd(y);
+    __m256d wv = _mm256_load_pd(x + AVX_IDX1);
+    __m256d zv = _mm256_load_pd(y + AVX_IDX1);
+    __m256d xy = _mm256_mul_pd(xv, yv);
+    __m256d zw = _mm256_mul_pd(zv, wv);
+    __m256d temp = _mm256_hadd_pd( xy, zw );
+    __m128d lo128 = _mm256_extractf128_pd( temp, 0 );
+    __m128d hi128 = _mm256_extractf128_pd( temp, 1 );
+    __m128d dotproduct = _mm_add_pd( lo128, hi128 );
+    double * d = (double*) &dotproduct;
+    return d[0] + d[1];
+}
+
+double avx_dot_product16_aligned(double * x, double * y) {
+    __m256d xv0 = _mm256_load_pd(x);
+    __m256d yv0 = _mm256_load_pd(y);
+    __m256d xv1 = _mm256_load_pd(x + AVX_IDX1);
+    __m256d yv1 = _mm256_load_pd(y + AVX_IDX1);
+    __m256d xv2 = _mm256_load_pd(x + AVX_IDX2);
+    __m256d yv2 = _mm256_load_pd(y + AVX_IDX2);
+    __m256d xv3 = _mm256_load_pd(x + AVX_IDX3);
+    __m256d yv3 = _mm256_load_pd(y + AVX_IDX3);
+    
+    __m256d xy0 = _mm256_mul_pd(xv0, yv0);
+    __m256d xy1 = _mm256_mul_pd(xv1, yv1);
+    __m256d xy2 = _mm256_mul_pd(xv2, yv2);
+    __m256d xy3 = _mm256_mul_pd(xv3, yv3);
+    
+    __m256d temp01 = _mm256_hadd_pd(xy0, xy1);
+    __m256d temp23 = _mm256_hadd_pd(xy2, xy3);
+    __m256d swapped = _mm256_permute2f128_pd(temp01, temp23, 0x21);
+    __m256d blended = _mm256_blend_pd(temp01, temp23, 0b1100);
+    __m256d dotproduct = _mm256_add_pd(swapped, blended);
+    
+    double * d = (double*) &dotproduct;
+    return d[0] + d[1] + d[2] + d[3];
+}
+
+void avx_multiply_value2_aligned(double * x, double value, double * dest,
+                                 int mode)
+{
+    __m128d xv = _mm_load_pd(x);
+    __m128d yv = _mm_set_pd(value, value);
+    __m128d xy = _mm_mul_pd(xv, yv);
+    if (mode != AVX_STORE_MODE_NORM) {
+        __m128d temp = _mm_load_pd(dest);
+        if (mode == AVX_STORE_MODE_ADD)
+            xy = _mm_add_pd(temp, xy);
+        else if (mode == AVX_STORE_MODE_SUB)
+            xy = _mm_sub_pd(temp, xy);
+    }
+    _mm_store_pd(dest, xy);
+}
+
+void avx_multiply_value4_aligned(double * x, double value, double * dest,
+                                 int mode)
+{
+    __m256d xv = _mm256_load_pd(x);
+    __m256d yv = _mm256_set_pd(value, value, value, value);
+    __m256d xy = _mm256_mul_pd(xv, yv);
+    if (mode != AVX_STORE_MODE_NORM) {
+        __m256d temp = _mm256_load_pd(dest);
+        if (mode == AVX_STORE_MODE_ADD)
+            xy = _mm256_add_pd(temp, xy);
+        else if (mode == AVX_STORE_MODE_SUB)
+            xy = _mm256_sub_pd(temp, xy);
+    }
+    _mm256_store_pd(dest, xy);
+}
+
+void avx_sum2_aligned(double * x, double * y, double * dest, int mode) {
+    __m128d xv = _mm_load_pd(x);
+    __m128d yv = _mm_load_pd(y);
+    __m128d xy = _mm_add_pd(xv, yv);
+    if (mode != AVX_STORE_MODE_NORM) {
+        __m128d temp = _mm_load_pd(dest);
+        if (mode == AVX_STORE_MODE_ADD)
+            xy = _mm_add_pd(temp, xy);
+        else if (mode == AVX_STORE_MODE_SUB)
+            xy = _mm_sub_pd(temp, xy);
+    }
+    _mm_store_pd(dest, xy);
+}
+
+void avx_sum4_aligned(double * x, double * y, double * dest, int mode) {
+    __m256d xv = _mm256_load_pd(x);
+    __m256d yv = _mm256_load_pd(y);
+    __m256d xy = _mm256_add_pd(xv, yv);
+    if (mode != AVX_STORE_MODE_NORM) {
+        __m256d temp = _mm256_load_pd(dest);
+        if (mode == AVX_STORE_MODE_ADD)
+            xy = _mm256_add_pd(temp, xy);
+        else if (mode == AVX_STORE_MODE_SUB)
+            xy = _mm256_sub_pd(temp, xy);
+    }
+    _mm256_store_pd(dest, xy);
+}
+
+static double avx_hsum4(__m256d v) {
+    __m128d lo128 = _mm256_extractf128_pd(v, 0);
+    __m128d hi128 = _mm256_extractf128_pd(v, 1);
+    __m128d sum = _mm_add_pd(lo128, hi128);
+    sum = _mm_hadd_pd(sum, sum);
+    return _mm_cvtsd_f64(sum);
+}
+
+/* Add to dest[0..3] the dot products of x with the four n-long rows
+ * starting at rows, rows + stride, ... so that x is loaded once for all
+ * of them. */
+
+void avx_dot_product_rows4(double * x, double * rows, int stride, int n,
+                           double * dest)
+{
+    double * r0 = rows, * r1 = rows + stride;
+    double * r2 = rows + (2 * stride), * r3 = rows + (3 * stride);
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd(), s3 = _mm256_setzero_pd();
+    int i, step = (int) _AVX_VECTOR_SIZE;
+    for (i = 0; i + step <= n; i += step) {
+        __m256d xv = _mm256_loadu_pd(x + i);
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(r0 + i), xv, s0);
+        s1 = _mm256_fmadd_pd(_mm256_loadu_pd(r1 + i), xv, s1);
+        s2 = _mm256_fmadd_pd(_mm256_loadu_pd(r2 + i), xv, s2);
+        s3 = _mm256_fmadd_pd(_mm256_loadu_pd(r3 + i), xv, s3);
+    }
+    double d0 = avx_hsum4(s0), d1 = avx_hsum4(s1);
+    double d2 = avx_hsum4(s2), d3 = avx_hsum4(s3);
+    for (; i < n; i++) {
+        double xi = x[i];
+        d0 += r0[i] * xi;
+        d1 += r1[i] * xi;
+        d2 += r2[i] * xi;
+        d3 += r3[i] * xi;
+    }
+    dest[0] += d0;
+    dest[1] += d1;
+    dest[2] += d2;
+    dest[3] += d3;
+}
+
+/* Same as avx_dot_product_rows4, for three rows (GRU gates). */
+
+void avx_dot_product_rows3(double * x, double * rows, int stride, int n,
+                           double * dest)
+{
+    double * r0 = rows, * r1 = rows + stride, * r2 = rows + (2 * stride);
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    __m256d s2 = _mm256_setzero_pd();
+    int i, step = (int) _AVX_VECTOR_SIZE;
+    for (i = 0; i + step <= n; i += step) {
+        __m256d xv = _mm256_loadu_pd(x + i);
+        s0 = _mm256_fmadd_pd(_mm256_loadu_pd(r0 + i), xv, s0);
+        s1 = _mm256_fmadd_pd(_mm256_loadu_pd(r1 + i), xv, s1);
+        s2 = _mm256_fmadd_pd(_mm256_loadu_pd(r2 + i), xv, s2);
+    }
+    double d0 = avx_hsum4(s0), d1 = avx_hsum4(s1), d2 = avx_hsum4(s2);
+    for (; i < n; i++) {
+        double xi = x[i];
+        d0 += r0[i] * xi;
+        d1 += r1[i] * xi;
+        d2 += r2[i] * xi;
+    }
+    dest[0] += d0;
+    dest[1] += d1;
+    dest[2] += d2;
+}
+
+/* The 16 dot products of 4 x vectors by 4 y vectors (n values each) into
+ * dest[i * 4 + j] = x[i] . y[j]: every load serves 4 products. */
+
+#define AVX_FMA_ROW(s, xv, y0, y1, y2, y3) do { \
+    s##0 = _mm256_fmadd_pd(xv, y0, s##0); \
+    s##1 = _mm256_fmadd_pd(xv, y1, s##1); \
+    s##2 = _mm256_fmadd_pd(xv, y2, s##2); \
+    s##3 = _mm256_fmadd_pd(xv, y3, s##3); \
+} while (0)
+
+void avx_dot_product4x4(double ** x, double ** y, int n, double * dest) {
+    double * x0 = x[0], * x1 = x[1], * x2 = x[2], * x3 = x[3];
+    double * y0 = y[0], * y1 = y[1], * y2 = y[2], * y3 = y[3];
+    __m256d a0 = _mm256_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+    __m256d b0 = a0, b1 = a0, b2 = a0, b3 = a0;
+    __m256d c0 = a0, c1 = a0, c2 = a0, c3 = a0;
+    __m256d d0 = a0, d1 = a0, d2 = a0, d3 = a0;
+    int i, j, k, step = (int) _AVX_VECTOR_SIZE;
+    for (k = 0; k + step <= n; k += step) {
+        __m256d yv0 = _mm256_loadu_pd(y0 + k), yv1 = _mm256_loadu_pd(y1 + k);
+        __m256d yv2 = _mm256_loadu_pd(y2 + k), yv3 = _mm256_loadu_pd(y3 + k);
+        AVX_FMA_ROW(a, _mm256_loadu_pd(x0 + k), yv0, yv1, yv2, yv3);
+        AVX_FMA_ROW(b, _mm256_loadu_pd(x1 + k), yv0, yv1, yv2, yv3);
+        AVX_FMA_ROW(c, _mm256_loadu_pd(x2 + k), yv0, yv1, yv2, yv3);
+        AVX_FMA_ROW(d, _mm256_loadu_pd(x3 + k), yv0, yv1, yv2, yv3);
+    }
+    __m256d sums[16] = {a0, a1, a2, a3, b0, b1, b2, b3,
+                        c0, c1, c2, c3, d0, d1, d2, d3};
+    for (i = 0; i < 4; i++) {
+        for (j = 0; j < 4; j++) {
+            double d = avx_hsum4(sums[i * 4 + j]);
+            int kk;
+            for (kk = k; kk < n; kk++) d += x[i][kk] * y[j][kk];
+            dest[i * 4 + j] = d;
+        }
+    }
+}
+
+/* The 4 dot products of one x vector by 4 y vectors, for the rows left
+ * over by avx_dot_product4x4. */
+
+void avx_dot_product1x4(double * x, double ** y, int n, double * dest) {
+    double * y0 = y[0], * y1 = y[1], * y2 = y[2], * y3 = y[3];
+    __m256d a0 = _mm256_setzero_pd(), a1 = a0, a2 = a0, a3 = a0;
+    int j, k, step = (int) _AVX_VECTOR_SIZE;
+    for (k = 0; k + step <= n; k += step) {
+        AVX_FMA_ROW(a, _mm256_loadu_pd(x + k), _mm256_loadu_pd(y0 + k),
+                    _mm256_loadu_pd(y1 + k), _mm256_loadu_pd(y2 + k),
+                    _mm256_loadu_pd(y3 + k));
+    }
+    __m256d sums[4] = {a0, a1, a2, a3};
+    for (j = 0; j < 4; j++) {
+        double d = avx_hsum4(sums[j]);
+        int kk;
+        for (kk = k; kk < n; kk++) d += x[kk] * y[j][kk];
+        dest[j] = d;
+    }
+}
@@ -34,6 +34,18 @@
     avx_sum2)
 #define AVXGetDiffFunc(s) (s >= AVX_VECTOR_SIZE ? avx_diff4 : \
     avx_diff2)
+#define AVXGetAlignedDotProductFunc(s) (s >= AVX_VECTOR4_SIZE ? \
+    avx_dot_product16_aligned : \
+    (s >= AVX_VECTOR2_SIZE ? avx_dot_product8_aligned : \
+    (s >= AVX_VECTOR_SIZE ? avx_dot_product4_aligned : \
+    avx_dot_product2_aligned)))
+#define AVXGetAlignedMultiplyValFunc(s) (s >= AVX_VECTOR_SIZE ? \
+    avx_multiply_value4_aligned : avx_multiply_value2_aligned)
+#define AVXGetAlignedSumFunc(s) (s >= AVX_VECTOR_SIZE ? avx_sum4_aligned : \
+    avx_sum2_aligned)
+
+#define AVX_ALIGNMENT   32
+#define AVXIsAligned(p) ((((unsigned long) (p)) & (AVX_ALIGNMENT - 1)) == 0)
 
 #define AVX_STORE_MODE_NORM 0
 #define AVX_STORE_MODE_ADD  1
@@ -64,4 +76,26 @@ void avx_sum4(double * x, double * y, double * dest, int mode);
 void avx_diff2(double * x, double * y, double * dest, int mode);
 void avx_diff4(double * x, double * y, double * dest, int mode);
 
+/* Aligned variants: x, y and dest must be AVX_ALIGNMENT aligned */
+
+double avx_dot_product2_aligned(double * x, double * y);
+double avx_dot_product4_aligned(double * x, double * y);
+double avx_dot_product8_aligned(double * x, double * y);
+double avx_dot_product16_aligned(double * x, double * y);
+
+void avx_multiply_value2_aligned(double * x, double value, double * dest,
+                                 int mode);
+void avx_multiply_value4_aligned(double * x, double value, double * dest,
+                                 int mode);
+
+void avx_sum2_aligned(double * x, double * y, double * dest, int mode);
+void avx_sum4_aligned(double * x, double * y, double * dest, int mode);
+
+void avx_dot_product_rows4(double * x, double * rows, int stride, int n,
+                           double * dest);
+void avx_dot_product_rows3(double * x, double * rows, int stride, int n,
+                           double * dest);
+void avx_dot_product4x4(double ** x, double ** y, int n, double * dest);
+void avx_dot_product1x4(double * x, double ** y, int n, double * dest);
+
 #endif //__PS_AVX_H
@@ -30,6 +30,7 @@
 #include "utils.h"
 #include "convolutional.h"
 #include "recurrent.h"
+#include "threadpool.h"
 
 double getDeltaForConvolutionalNeuron(PSNeuron * neuron,
                                       PSLayer * layer,
@@ -187,7 +188,7 @@ int PSInitConvolutionalLayer(PSNeuralNetwork * network, PSLayer * layer,
         return 0;
     }
 #ifdef USE_AVX
-    layer->avx_activation_cache = calloc(size, sizeof(double));
+    layer->avx_activation_cache = PSAlignedAlloc(size);
     if (layer->avx_activation_cache == NULL) {
         printMemoryErrorMsg();
         PSAbortLayer(network, layer);
@@ -213,7 +214,7 @@ int PSInitConvolutionalLayer(PSNeuralNetwork * network, PSLayer * layer,
     int i, j, w;
     for (i = 0; i < feature_count; i++) {
         shared->biases[i] = gaussian_random(0, 1);
-        shared->weights[i] = malloc(shared->weights_size * sizeof(double));
+        shared->weights[i] = PSAlignedAlloc(shared->weights_size);
         if (shared->weights[i] == NULL) {
             PSErr(func, "Layer[%d]: Could not allocate weights!", index);
             PSAbortLayer(network, layer);
@@ -313,7 +314,7 @@ int PSInitPoolingLayer(PSNeuralNetwork * network, PSLayer * layer,
         return 0;
     }
 #ifdef USE_AVX
-    layer->avx_activation_cache = calloc(size, sizeof(double));
+    layer->avx_activation_cache = PSAlignedAlloc(size);
     if (layer->avx_activation_cache == NULL) {
         printMemoryErrorMsg();
         PSAbortLayer(network, layer);
@@ -347,68 +348,46 @@ int PSInitPoolingLayer(PSNeuralNetwork * network, PSLayer * layer,
 
 /* Feedforward Functions */
 
-int PSConvolve(void * _net, void * _layer, ...) {
-    PSNeuralNetwork * net = (PSNeuralNetwork*) _net;
-    PSLayer * layer = (PSLayer*) _layer;
-    int size = layer->size;
-    if (layer->neurons == NULL) {
-        PSErr(NULL, "Layer[%d] has no neurons!", layer->index);
-        return 0;
-    }
-    if (layer->index == 0) {
-        PSErr(NULL, "Cannot feedforward on layer 0!");
-        return 0;
-    }
-    PSLayer * previous = net->layers[layer->index - 1];
-    if (previous == NULL) {
-        PSErr(NULL, "Layer[%d]: previous layer is NULL!", layer->index);
-        return 0;
-    }
+typedef struct {
+    PSLayer * layer;
+    PSLayer * previous;
+    PSSharedParams * shared;
+    int is_recurrent;
+    int t;
+    int stride;
+    int feature_size;
+    int previous_feature_size;
+    int prev_features;
+    int prev_features_step;
+    double region_size;
+    double input_w;
+    double output_w;
+} PSConvolveTask;
+
+/* Convolve feature maps [start, end): every feature only reads its own
+ * shared weights and the previous layer, so features can run on
+ * different threads. */
+
+static void convolveFeatures(void * data, int start, int end) {
+    PSConvolveTask * task = (PSConvolveTask *) data;
+    PSLayer * layer = task->layer;
+    PSLayer * previous = task->previous;
+    PSSharedParams * shared = task->shared;
+#ifdef USE_AVX
+    int is_recurrent = task->is_recurrent, t = task->t;
+#endif
+    int stride = task->stride, feature_size = task->feature_size;
+    double region_size = task->region_size;
+    double input_w = task->input_w;
+    double output_w = task->output_w;
     int i, j, x, y, row, col;
-    PSLayerParameters * parameters = layer->parameters;
-    if (parameters == NULL) {
-        PSErr(NULL, "Layer[%d]: parameters are NULL!", layer->index);
-        return 0;
-    }
-    PSLayerParameters * previous_parameters = previous->parameters;
-    if (previous_parameters == NULL) {
-        PSErr(NULL, "Layer[%d]: parameters are invalid!", layer->index);
-        return 0;
-    }
-    int is_recurrent = (net->flags & FLAG_RECURRENT), times, t;
-    if (is_recurrent) {
-        va_list args;
-        va_start(args, _layer);
-        times = va_arg(args, int);
-        t = va_arg(args, int);
-        va_end(args);
-    }
-    double * params = parameters->parameters;
-    double * previous_params = previous_parameters->parameters;
-    int feature_count = (int) (params[PARAM_FEATURE_COUNT]);
-    int stride = (int) (params[PARAM_STRIDE]);
-    double region_size = params[PARAM_REGION_SIZE];
-    double input_w = previous_params[PARAM_OUTPUT_WIDTH];
-    double output_w = params[PARAM_OUTPUT_WIDTH];
-    int feature_size = size / feature_count;
-    PSSharedParams * shared = getConvSharedParams(layer);
-    if (shared == NULL) {
-        PSErr(NULL, "Layer[%d]: shared params are NULL!", layer->index);
-        return 0;
-    }
-    int previous_feature_size = 0, prev_features = 1, prev_features_step = 1;
-    if (previous->type == Pooling) {
-        prev_features = (int) (previous_params[PARAM_FEATURE_COUNT]);
-        previous_feature_size = previous->size / prev_features;
-        prev_features_step = feature_count / prev_features;
-    }
-    for (i = 0; i < feature_count; i++) {
+    for (i = start; i < end; i++) {
         double bias = shared->biases[i];
         double * weights = shared->weights[i];
         int previous_feature = 0, feature_offset = 0;
-        if (prev_features > 1) {
-            previous_feature = i / prev_features_step;
-            feature_offset = previous_feature * previous_feature_size;
+        if (task->prev_features > 1) {
+            previous_feature = i / task->prev_features_step;
+            feature_offset = previous_feature * task->previous_feature_size;
         }
         row = 0;
         col = 0;
@@ -454,13 +433,85 @@ int PSConvolve(void * _net, void * _layer, ...) {
             if (!is_recurrent)
                 layer->avx_activation_cache[idx] = neuron->activation;
 #endif
-            if (is_recurrent) {
-                PSAddRecurrentState(neuron, neuron->activation, times, t);
-                if (neuron->extra == NULL) {
-                    PSErr("convolve", "Failed to allocate Recurrent Cell!");
-                    return 0;
-                }
-            }
+        }
+    }
+}
+
+int PSConvolve(void * _net, void * _layer, ...) {
+    PSNeuralNetwork * net = (PSNeuralNetwork*) _net;
+    PSLayer * layer = (PSLayer*) _layer;
+    int size = layer->size;
+    if (layer->neurons == NULL) {
+        PSErr(NULL, "Layer[%d] has no neurons!", layer->index);
+        return 0;
+    }
+    if (layer->index == 0) {
+        PSErr(NULL, "Cannot feedforward on layer 0!");
+        return 0;
+    }
+    PSLayer * previous = net->layers[layer->index - 1];
+    if (previous == NULL) {
+        PSErr(NULL, "Layer[%d]: previous layer is NULL!", layer->index);
+        return 0;
+    }
+    int i;
+    PSLayerParameters * parameters = layer->parameters;
+    if (parameters == NULL) {
+        PSErr(NULL, "Layer[%d]: parameters are NULL!", layer->index);
+        return 0;
+    }
+    PSLayerParameters * previous_parameters = previous->parameters;
+    if (previous_parameters == NULL) {
+        PSErr(NULL, "Layer[%d]: parameters are invalid!", layer->index);
+        return 0;
+    }
+    int is_recurrent = (net->flags & FLAG_RECURRENT), times, t = 0;
+    if (is_recurrent) {
+        va_list args;
+        va_start(args, _layer);
+        times = va_arg(args, int);
+        t = va_arg(args, int);
+        va_end(args);
+    }
+    double * params = parameters->parameters;
+    double * previous_params = previous_parameters->parameters;
+    int feature_count = (int) (params[PARAM_FEATURE_COUNT]);
+    PSSharedParams * shared = getConvSharedParams(layer);
+    if (shared == NULL) {
+        PSErr(NULL, "Layer[%d]: shared params are NULL!", layer->index);
+        return 0;
+    }
+    PSConvolveTask task;
+    task.layer = layer;
+    task.previous = previous;
+    task.shared = shared;
+    task.is_recurrent = is_recurrent;
+    task.t = t;
+    task.stride = (int) (params[PARAM_STRIDE]);
+    task.region_size = params[PARAM_REGION_SIZE];
+    task.input_w = previous_params[PARAM_OUTPUT_WIDTH];
+    task.output_w = params[PARAM_OUTPUT_WIDTH];
+    task.feature_size = size / feature_count;
+    task.previous_feature_size = 0;
+    task.prev_features = 1;
+    task.prev_features_step = 1;
+    if (previous->type == Pooling) {
+        task.prev_features = (int) (previous_params[PARAM_FEATURE_COUNT]);
+        task.previous_feature_size = previous->size / task.prev_features;
+        task.prev_features_step = feature_count / task.prev_features;
+    }
+    int work = size * shared->weights_size;
+    if (!is_recurrent && PSShouldRunParallel(work))
+        PSParallelFor(PSGlobalThreadPool, feature_count, convolveFeatures,
+                      &task);
+    else
+        convolveFeatures(&task, 0, feature_count);
+    if (!is_recurrent) return 1;
+    for (i = 0; i < size; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        if (!PSAddRecurrentState(neuron, neuron->activation, times, t)) {
+            PSErr("convolve", "Failed to allocate Recurrent Cell!");
+            return 0;
         }
     }
     return 1;
@@ -542,8 +593,8 @@ int PSPool(void * _net, void * _layer, ...) {
                 layer->avx_activation_cache[idx] = neuron->activation;
 #endif
             if (is_recurrent) {
-                PSAddRecurrentState(neuron, neuron->activation, times, t);
-                if (neuron->extra == NULL) {
+                if (!PSAddRecurrentState(neuron, neuron->activation,
+                                         times, t)) {
                     PSErr("pool", "Failed to allocate Recurrent Cell!");
                     return 0;
                 }
@@ -603,9 +654,12 @@ double * PSPoolingBackprop(PSLayer * pooling_layer,
     return new_delta;
 }
 
-double * PSConvolutionalBackprop(PSLayer* convolutional_layer,
-                                 PSLayer * prev_layer, double * delta,
-                                 PSGradient * lgradients) {
+/* Accumulate the shared weight gradients of features [start, end). */
+
+void PSConvolutionalGradients(PSLayer * convolutional_layer,
+                              PSLayer * prev_layer, double * delta,
+                              PSGradient * lgradients, int start, int end)
+{
     int size = convolutional_layer->size;
     PSLayerParameters * params = convolutional_layer->parameters;
     int feature_count = (int) (params->parameters[PARAM_FEATURE_COUNT]);
@@ -623,7 +677,7 @@ double * PSConvolutionalBackprop(PSLayer* convolutional_layer,
         prev_features_step = feature_count / prev_features;
     }
     int i, j, row, col, x, y;
-    for (i = 0; i < feature_count; i++) {
+    for (i = start; i < end; i++) {
         PSGradient * feature_gradient = &(lgradients[i]);
         int previous_feature = 0, feature_offset = 0;
         if (prev_features > 1) {
@@ -655,5 +709,14 @@ double * PSConvolutionalBackprop(PSLayer* convolutional_layer,
             }
         }
     }
+}
+
+double * PSConvolutionalBackprop(PSLayer* convolutional_layer,
+                                 PSLayer * prev_layer, double * delta,
+                                 PSGradient * lgradients) {
+    PSLayerParameters * params = convolutional_layer->parameters;
+    int feature_count = (int) (params->parameters[PARAM_FEATURE_COUNT]);
+    PSConvolutionalGradients(convolutional_layer, prev_layer, delta,
+                             lgradients, 0, feature_count);
     return delta;
 }
@@ -63,5 +63,8 @@ double * PSPoolingBackprop(PSLayer * pooling_layer,
 double * PSConvolutionalBackprop(PSLayer* convolutional_layer,
                                  PSLayer * prev_layer, double * delta,
                                  PSGradient * lgradients);
+void PSConvolutionalGradients(PSLayer * convolutional_layer,
+                              PSLayer * prev_layer, double * delta,
+                              PSGradient * lgradients, int start, int end);
 
 #endif //__PS_CONVOLUTIONAL_H
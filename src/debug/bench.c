@@ -0,0 +1,238 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/* Microbenchmark for the fully connected hot path: compares the unaligned
+ * AVX kernels (with scalar tail) against the aligned, padded ones and
+ * times PSFeedforward on 784xN layers, both with the aligned buffers and
+ * with copies of them shifted by one double.
+ * It also compares the per-token latency of greedy and beam decoding. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../psyc.h"
+#include "../utils.h"
+#include "../decoder.h"
+#ifdef USE_AVX
+#include "../avx.h"
+#endif
+
+#define INPUT_SIZE (28 * 28)
+#define KERNEL_ITERATIONS 200000
+#define FEEDFORWARD_ITERATIONS 200
+#define DECODE_HIDDEN_SIZE 512
+#define DECODE_LENGTH 24
+#define DECODE_ITERATIONS 3
+#define DECODE_BEAM_WIDTH 8
+
+static double elapsed(struct timespec * start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double) (end.tv_sec - start->tv_sec) +
+           ((double) (end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+#ifdef USE_AVX
+
+static double unalignedDot(double * x, double * y, int size) {
+    double sum = 0.0;
+    int i = 0;
+    int step = AVXGetDotStepLen(size);
+    avx_dot_product dot_product = AVXGetDotProductFunc(size);
+    for (; i + step <= size; i += step) sum += dot_product(x + i, y + i);
+    for (; i < size; i++) sum += (x[i] * y[i]);
+    return sum;
+}
+
+static double alignedDot(double * x, double * y, int size) {
+    double sum = 0.0;
+    int i = 0;
+    AVXDotProduct(size, x, y, sum, i, 0, 0);
+    return sum;
+}
+
+static void benchKernels(int size) {
+    struct timespec start;
+    int padded = PSPaddedSize(size), i, n;
+    double * ux = malloc((size + 1) * sizeof(double));
+    double * uy = malloc((size + 1) * sizeof(double));
+    double * ax = PSAlignedAlloc(size);
+    double * ay = PSAlignedAlloc(size);
+    if (ux == NULL || uy == NULL || ax == NULL || ay == NULL) {
+        printMemoryErrorMsg();
+        exit(1);
+    }
+    for (i = 0; i < size; i++) {
+        ux[i + 1] = ax[i] = normalized_random();
+        uy[i + 1] = ay[i] = normalized_random();
+    }
+    /* Offset by one double so that loads are never 32-byte aligned */
+    double * x = ux + 1, * y = uy + 1;
+    volatile double res = 0.0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < KERNEL_ITERATIONS; n++) res += unalignedDot(x, y, size);
+    double t_unaligned = elapsed(&start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < KERNEL_ITERATIONS; n++) res += alignedDot(ax, ay, padded);
+    double t_aligned = elapsed(&start);
+    printf("dot[%d]: unaligned %.3fs, aligned+padded %.3fs (%.2fx)\n",
+           size, t_unaligned, t_aligned, t_unaligned / t_aligned);
+    free(ux);
+    free(uy);
+    PSAlignedFree(ax);
+    PSAlignedFree(ay);
+}
+
+#endif
+
+static double timeFeedforward(PSNeuralNetwork * network, double * input) {
+    struct timespec start;
+    int n;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < FEEDFORWARD_ITERATIONS; n++) PSFeedforward(network, input);
+    return (elapsed(&start) * 1000.0) / FEEDFORWARD_ITERATIONS;
+}
+
+#ifdef USE_AVX
+
+/* Copy count doubles into a buffer that is never 32-byte aligned, so that
+ * PSFeedforward falls back to the unaligned kernels. */
+
+static double * misalignedCopy(double * src, int count, double ** block) {
+    int padded = PSPaddedSize(count), i;
+    *block = malloc((padded + 1) * sizeof(double));
+    if (*block == NULL) {
+        printMemoryErrorMsg();
+        exit(1);
+    }
+    double * dest = *block + (AVXIsAligned(*block) ? 1 : 0);
+    for (i = 0; i < padded; i++) dest[i] = src[i];
+    return dest;
+}
+
+static double timeMisalignedFeedforward(PSNeuralNetwork * network,
+                                        double * input)
+{
+    PSLayer * first = network->layers[0], * layer = network->layers[1];
+    int size = layer->size, i;
+    double * weights[size], * blocks[size + 2];
+    double * caches[2] = {first->avx_activation_cache,
+                          layer->avx_activation_cache};
+    for (i = 0; i < size; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        weights[i] = neuron->weights;
+        neuron->weights = misalignedCopy(weights[i], neuron->weights_size,
+                                         &(blocks[i]));
+    }
+    first->avx_activation_cache = misalignedCopy(caches[0], first->size,
+                                                 &(blocks[size]));
+    layer->avx_activation_cache = misalignedCopy(caches[1], size,
+                                                 &(blocks[size + 1]));
+    double t = timeFeedforward(network, input);
+    for (i = 0; i < size; i++) layer->neurons[i]->weights = weights[i];
+    first->avx_activation_cache = caches[0];
+    layer->avx_activation_cache = caches[1];
+    for (i = 0; i < size + 2; i++) free(blocks[i]);
+    return t;
+}
+
+#endif
+
+static void benchFeedforward(int size) {
+    int i;
+    PSNeuralNetwork * network = PSCreateNetwork("Benchmark Network");
+    if (network == NULL) exit(1);
+    PSAddLayer(network, FullyConnected, INPUT_SIZE, NULL);
+    PSAddLayer(network, FullyConnected, size, NULL);
+    double input[INPUT_SIZE];
+    for (i = 0; i < INPUT_SIZE; i++) input[i] = normalized_random();
+    double t = timeFeedforward(network, input);
+#ifdef USE_AVX
+    double t_unaligned = timeMisalignedFeedforward(network, input);
+    printf("feedforward[%dx%d]: unaligned %.3fms/iter, aligned %.3fms/iter "
+           "(%.2fx)\n", INPUT_SIZE, size, t_unaligned, t, t_unaligned / t);
+#else
+    printf("feedforward[%dx%d]: %.3fms/iter\n", INPUT_SIZE, size, t);
+#endif
+    PSDeleteNetwork(network);
+}
+
+static PSNeuralNetwork * createDecodeNetwork(PSLayerType * types, int count,
+                                              int vocab, int hierarchical)
+{
+    int i;
+    PSNeuralNetwork * network = PSCreateNetwork("Benchmark Decoder");
+    if (network == NULL) exit(1);
+    network->flags |= FLAG_ONEHOT;
+    PSAddLayer(network, FullyConnected, vocab, NULL);
+    for (i = 0; i < count; i++)
+        PSAddLayer(network, types[i], DECODE_HIDDEN_SIZE, NULL);
+    PSLayer * output = PSAddLayer(network, SoftMax, vocab, NULL);
+    if (output == NULL) exit(1);
+    output->flags |= FLAG_ONEHOT;
+    if (hierarchical) output->flags |= FLAG_HIERARCHICAL;
+    return network;
+}
+
+/* Milliseconds per generated token */
+
+static double timeDecode(PSNeuralNetwork * network, PSDecodeMode mode,
+                         int width)
+{
+    struct timespec start;
+    PSDecodeOptions options = {mode, width, 0.0, 0, -1, 1};
+    int prefix[] = {1, 2}, n;
+    PSDeleteDecodeResult(PSDecode(network, NULL, prefix, 2, 2, &options));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (n = 0; n < DECODE_ITERATIONS; n++) {
+        PSDecodeResult * result = PSDecode(network, NULL, prefix, 2,
+                                           DECODE_LENGTH, &options);
+        if (result == NULL) exit(1);
+        PSDeleteDecodeResult(result);
+    }
+    return (elapsed(&start) * 1000.0) /
+           (DECODE_ITERATIONS * DECODE_LENGTH);
+}
+
+static void benchDecode(const char * name, PSLayerType * types, int count,
+                        int vocab, int hierarchical)
+{
+    PSNeuralNetwork * network = createDecodeNetwork(types, count, vocab,
+                                                    hierarchical);
+    double greedy = timeDecode(network, PSDecodeGreedy, 1);
+    double beam = timeDecode(network, PSDecodeBeam, DECODE_BEAM_WIDTH);
+    printf("decode[%s]: greedy %.3fms/token, beam %d %.3fms/token "
+           "(%.2fx)\n", name, greedy, DECODE_BEAM_WIDTH, beam,
+           beam / greedy);
+    PSDeleteNetwork(network);
+}
+
+int main(int argc, char** argv) {
+    int sizes[] = {30, 100, 300};
+    int i, count = sizeof(sizes) / sizeof(int);
+#ifdef USE_AVX
+    benchKernels(INPUT_SIZE);
+    benchKernels(INPUT_SIZE + 3);
+#endif
+    for (i = 0; i < count; i++) benchFeedforward(sizes[i]);
+    PSLayerType lstm[] = {LSTM}, gru[] = {GRU}, stacked[] = {LSTM, LSTM};
+    benchDecode("LSTM 512, V=256", lstm, 1, 256, 0);
+    benchDecode("GRU 512, V=256", gru, 1, 256, 0);
+    benchDecode("LSTM 2x512, V=256", stacked, 2, 256, 0);
+    benchDecode("LSTM 512, hierarchical V=16384", lstm, 1, 16384, 1);
+    return 0;
+}
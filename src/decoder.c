@@ -0,0 +1,775 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "decoder.h"
+#include "recurrent.h"
+#include "lstm.h"
+#include "gru.h"
+#include "embedding.h"
+#include "softmax.h"
+#include "threadpool.h"
+#include "utils.h"
+
+/* Running hypotheses are the lanes of the decoder. Networks made of
+ * Embedding, FullyConnected, Recurrent, LSTM and GRU layers below a Softmax
+ * output advance all of them as one two-step PSSequenceBatch: slot 0 of
+ * every lane gets the state of the hypothesis it extends and slot 1
+ * computes the next one, every layer being one matrix product over the
+ * lanes, so that each weights row is read once per step for the whole
+ * beam. Hierarchical outputs are only queried for the tokens a step needs
+ * (see PSHierarchicalTopK). Other networks step every lane with PSStep.
+ * Hypotheses extending the same one share its state until a step needs it
+ * in their own lane, and tokens are only kept as back pointers. */
+
+typedef struct {
+    double score;
+    int lane;
+    int token;
+} PSDecodeCandidate;
+
+typedef struct {
+    PSNeuralNetwork * network;
+    int width;
+    int lanes;
+    int vocab;
+    int input_size;
+    int onehot;
+    int tree; // Lanes query the hierarchical output instead of probs
+    PSSequenceBatch * batch;
+    PSStepState ** states;
+    PSStepState ** spare;
+    double ** rows; // Output layer inputs of every lane
+    double ** out_weights;
+    double * probs;
+    double * x;
+    int * classes;
+    double * class_probs;
+} PSDecoder;
+
+/* Tokens are fed as the onehot index or as a one-hot input vector */
+
+static int getInputTokens(PSNeuralNetwork * network) {
+    PSLayer * input = network->layers[0];
+    if (!(input->flags & FLAG_ONEHOT)) return input->size;
+    PSLayerParameters * params = input->parameters;
+    if (params == NULL || params->count < 1) {
+        PSErr("PSDecode", "Onehot input layer params are missing!");
+        return 0;
+    }
+    return (int) params->parameters[0];
+}
+
+static int canBatchDecoder(PSNeuralNetwork * network) {
+    int i;
+    if (network->size < 3) return 0;
+    for (i = 1; i < network->size - 1; i++) {
+        PSLayer * layer = network->layers[i];
+        PSLayerType ltype = layer->type;
+        if (ltype == FullyConnected) {
+            if (network->layers[i - 1]->flags & FLAG_ONEHOT) return 0;
+        } else if (ltype != Recurrent && ltype != LSTM && ltype != GRU &&
+                   ltype != Embedding) return 0;
+    }
+    return 1;
+}
+
+/* Arrays a layer keeps for every lane, and the ones carried over to the
+ * next step (as in PSStepState). */
+
+static int getBatchArrays(PSLayer * layer) {
+    if (layer->type == LSTM) return LSTM_STATE_ARRAYS;
+    if (layer->type == GRU) return GRU_STATE_ARRAYS;
+    return 1;
+}
+
+static int getStateArrays(PSLayer * layer) {
+    if (layer->type == LSTM) return 2;
+    return (layer->type == Recurrent || layer->type == GRU);
+}
+
+static void deleteDecoderBatch(PSSequenceBatch * batch, int layers) {
+    int i;
+    if (batch == NULL) return;
+    if (batch->values != NULL) {
+        for (i = 0; i < layers; i++) free(batch->values[i]);
+        free(batch->values);
+    }
+    free(batch->lengths);
+    free(batch->active);
+    free(batch->lanes);
+    free(batch);
+}
+
+/* The output layer has no values in the batch: lanes get their
+ * probabilities in decoder->probs. */
+
+static PSSequenceBatch * createDecoderBatch(PSNeuralNetwork * network,
+                                            int width)
+{
+    int netsize = network->size, i;
+    PSSequenceBatch * batch = calloc(1, sizeof(PSSequenceBatch));
+    if (batch == NULL) return NULL;
+    batch->count = width;
+    batch->times = 2;
+    batch->lengths = malloc(width * sizeof(int));
+    batch->lanes = malloc(width * sizeof(int));
+    batch->active = calloc(2, sizeof(int));
+    batch->values = calloc(netsize, sizeof(double*));
+    if (batch->lengths == NULL || batch->lanes == NULL ||
+        batch->active == NULL || batch->values == NULL) {
+        deleteDecoderBatch(batch, netsize);
+        return NULL;
+    }
+    for (i = 0; i < width; i++) {
+        batch->lengths[i] = 2;
+        batch->lanes[i] = i;
+    }
+    for (i = 0; i < netsize - 1; i++) {
+        PSLayer * layer = network->layers[i];
+        size_t size = (size_t) getBatchArrays(layer) * 2 * width * layer->size;
+        batch->values[i] = calloc(size, sizeof(double));
+        if (batch->values[i] == NULL) {
+            deleteDecoderBatch(batch, netsize);
+            return NULL;
+        }
+    }
+    return batch;
+}
+
+static void deleteDecoder(PSDecoder * decoder) {
+    int i;
+    if (decoder->batch != NULL)
+        deleteDecoderBatch(decoder->batch, decoder->network->size);
+    for (i = 0; i < decoder->width; i++) {
+        if (decoder->states != NULL) PSDeleteStepState(decoder->states[i]);
+        if (decoder->spare != NULL) PSDeleteStepState(decoder->spare[i]);
+    }
+    free(decoder->states);
+    free(decoder->spare);
+    free(decoder->rows);
+    free(decoder->out_weights);
+    free(decoder->probs);
+    free(decoder->x);
+    free(decoder->classes);
+    free(decoder->class_probs);
+}
+
+static int initDecoderBatch(PSDecoder * decoder, PSStepState * state) {
+    PSNeuralNetwork * network = decoder->network;
+    PSLayer * out = network->layers[network->size - 1];
+    int width = decoder->width, vocab = decoder->vocab, i, j, k;
+    decoder->batch = createDecoderBatch(network, width);
+    decoder->rows = malloc(width * sizeof(double*));
+    if (decoder->batch == NULL || decoder->rows == NULL) return 0;
+    if (out->flags & FLAG_HIERARCHICAL) {
+        decoder->classes = malloc(vocab * sizeof(int));
+        decoder->class_probs = malloc(vocab * sizeof(double));
+        if (decoder->classes == NULL || decoder->class_probs == NULL)
+            return 0;
+    } else {
+        decoder->out_weights = malloc(vocab * sizeof(double*));
+        if (decoder->out_weights == NULL) return 0;
+        for (i = 0; i < vocab; i++)
+            decoder->out_weights[i] = out->neurons[i]->weights;
+    }
+    /* Lane 0 starts from state */
+    double * values = state->values;
+    for (i = 1; i < network->size - 1; i++) {
+        PSLayer * layer = network->layers[i];
+        for (j = 0; j < getStateArrays(layer); j++) {
+            double * dest = GetBatchArray(decoder->batch, layer, j, 1, 0);
+            for (k = 0; k < layer->size; k++) dest[k] = *values++;
+        }
+    }
+    return 1;
+}
+
+/* Lane 0 starts from state, the others are only filled by decoderGather */
+
+static int initDecoder(PSDecoder * decoder, PSNeuralNetwork * network,
+                       PSStepState * state, int width)
+{
+    PSLayer * input = network->layers[0];
+    int i;
+    memset(decoder, 0, sizeof(PSDecoder));
+    decoder->network = network;
+    decoder->width = width;
+    decoder->lanes = 1;
+    decoder->vocab = network->output_size;
+    decoder->onehot = (input->flags & FLAG_ONEHOT);
+    decoder->input_size = getInputTokens(network);
+    if (decoder->vocab > decoder->input_size) {
+        PSErr("PSDecode", "Output size %d exceeds the %d input tokens",
+              decoder->vocab, decoder->input_size);
+        return 0;
+    }
+    decoder->probs = malloc(width * decoder->vocab * sizeof(double));
+    decoder->x = calloc(input->size, sizeof(double));
+    if (decoder->probs == NULL || decoder->x == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    memcpy(decoder->probs, state->output, decoder->vocab * sizeof(double));
+    if (canBatchDecoder(network)) {
+        if (!initDecoderBatch(decoder, state)) {
+            printMemoryErrorMsg();
+            return 0;
+        }
+        return 1;
+    }
+    decoder->states = calloc(width, sizeof(PSStepState*));
+    decoder->spare = calloc(width, sizeof(PSStepState*));
+    if (decoder->states == NULL || decoder->spare == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    for (i = 0; i < width; i++) {
+        decoder->states[i] = PSCloneStepState(state);
+        decoder->spare[i] = PSCloneStepState(state);
+        if (decoder->states[i] == NULL || decoder->spare[i] == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/* Give lane b the state and outputs of lane parents[b] */
+
+static void decoderGather(PSDecoder * decoder, int * parents, int lanes) {
+    PSNeuralNetwork * network = decoder->network;
+    int b, i, j;
+    if (decoder->batch != NULL) {
+        PSSequenceBatch * batch = decoder->batch;
+        for (i = 1; i < network->size - 1; i++) {
+            PSLayer * layer = network->layers[i];
+            for (j = 0; j < getStateArrays(layer); j++) {
+                for (b = 0; b < lanes; b++) {
+                    memcpy(GetBatchArray(batch, layer, j, 0, b),
+                           GetBatchArray(batch, layer, j, 1, parents[b]),
+                           layer->size * sizeof(double));
+                }
+            }
+        }
+    } else {
+        for (b = 0; b < lanes; b++) {
+            PSStepState * src = decoder->states[parents[b]];
+            PSStepState * dest = decoder->spare[b];
+            memcpy(dest->values, src->values, src->size * sizeof(double));
+            dest->steps = src->steps;
+        }
+        PSStepState ** states = decoder->states;
+        decoder->states = decoder->spare;
+        decoder->spare = states;
+    }
+    decoder->lanes = lanes;
+}
+
+static void setTokenInput(PSDecoder * decoder, double * x, int token) {
+    if (decoder->onehot) {
+        x[0] = (double) token;
+        return;
+    }
+    memset(x, 0, decoder->network->layers[0]->size * sizeof(double));
+    x[token] = 1.0;
+}
+
+/* Products of the rows x vectors by the cols w ones, split among the
+ * threads of the pool by columns. */
+
+typedef struct {
+    double ** x;
+    double ** w;
+    double * dest;
+    int rows;
+    int size;
+    int stride;
+} PSLanesProductTask;
+
+static void lanesProductColumns(void * data, int start, int end) {
+    PSLanesProductTask * task = (PSLanesProductTask *) data;
+    PSMatrixProduct(task->x, task->rows, task->w + start, end - start,
+                    task->size, task->dest + start, task->stride);
+}
+
+static void lanesProduct(double ** x, int rows, double ** w, int cols,
+                         int size, double * dest, int stride)
+{
+    PSLanesProductTask task = {x, w, dest, rows, size, stride};
+    if (PSShouldRunParallel(rows * cols * size))
+        PSParallelFor(PSGlobalThreadPool, cols, lanesProductColumns, &task);
+    else
+        lanesProductColumns(&task, 0, cols);
+}
+
+static int batchFullyConnected(PSDecoder * decoder, PSLayer * layer,
+                               PSLayer * previous)
+{
+    PSSequenceBatch * batch = decoder->batch;
+    int size = layer->size, lanes = decoder->lanes, b, i;
+    double ** w = malloc(size * sizeof(double*));
+    if (w == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    for (b = 0; b < lanes; b++)
+        decoder->rows[b] = GetBatchValues(batch, previous, 1, b);
+    for (i = 0; i < size; i++) w[i] = layer->neurons[i]->weights;
+    lanesProduct(decoder->rows, lanes, w, size, previous->size,
+                 GetBatchValues(batch, layer, 1, 0), size);
+    for (b = 0; b < lanes; b++) {
+        double * a = GetBatchValues(batch, layer, 1, b);
+        for (i = 0; i < size; i++) {
+            a[i] += layer->neurons[i]->bias;
+            if (layer->activate != NULL) a[i] = layer->activate(a[i]);
+        }
+    }
+    free(w);
+    return 1;
+}
+
+static void batchEmbedding(PSLayer * layer, PSLayer * previous,
+                           PSSequenceBatch * batch, int lanes)
+{
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    int size = layer->size, b, row;
+    for (b = 0; b < lanes; b++) {
+        double * x = GetBatchValues(batch, previous, 1, b);
+        double * dest = GetBatchValues(batch, layer, 1, b);
+        if (previous->flags & FLAG_ONEHOT) {
+            memcpy(dest, GetEmbeddingRow(table, (int) x[0]),
+                   size * sizeof(double));
+            continue;
+        }
+        memset(dest, 0, size * sizeof(double));
+        for (row = 0; row < table->rows; row++) {
+            if (x[row] != 0.0)
+                PSAddScaled(dest, GetEmbeddingRow(table, row), x[row], size);
+        }
+    }
+}
+
+/* Flat outputs get the Softmax of every lane into decoder->probs, while
+ * hierarchical ones are left to the queries of the next tokens. */
+
+static void batchSoftmax(PSDecoder * decoder, PSLayer * out,
+                         PSLayer * previous)
+{
+    int size = out->size, lanes = decoder->lanes, b, o;
+    for (b = 0; b < lanes; b++)
+        decoder->rows[b] = GetBatchValues(decoder->batch, previous, 1, b);
+    if (out->flags & FLAG_HIERARCHICAL) {
+        decoder->tree = 1;
+        return;
+    }
+    lanesProduct(decoder->rows, lanes, decoder->out_weights, size,
+                 previous->size, decoder->probs, size);
+    for (b = 0; b < lanes; b++) {
+        double * a = decoder->probs + (b * size);
+        double max = 0.0, esum = 0.0;
+        for (o = 0; o < size; o++) {
+            a[o] += out->neurons[o]->bias;
+            if (o == 0 || a[o] > max) max = a[o];
+        }
+        for (o = 0; o < size; o++) {
+            a[o] = exp(a[o] - max);
+            esum += a[o];
+        }
+        for (o = 0; o < size; o++) a[o] /= esum;
+    }
+}
+
+static int batchLayerStep(PSDecoder * decoder, PSLayer * layer,
+                          PSLayer * previous)
+{
+    PSSequenceBatch * batch = decoder->batch;
+    if (layer->type == Recurrent)
+        return PSRecurrentBatchFeedforward(layer, previous, batch, 1);
+    if (layer->type == LSTM)
+        return PSLSTMBatchFeedforward(layer, previous, batch, 1);
+    if (layer->type == GRU)
+        return PSGRUBatchFeedforward(layer, previous, batch, 1);
+    if (layer->type == Embedding) {
+        batchEmbedding(layer, previous, batch, decoder->lanes);
+        return 1;
+    }
+    return batchFullyConnected(decoder, layer, previous);
+}
+
+/* Feed tokens[b] to every lane, leaving the next token probabilities in
+ * decoder->probs (or the lanes ready for hierarchical queries). */
+
+static int decoderStep(PSDecoder * decoder, int * tokens) {
+    PSNeuralNetwork * network = decoder->network;
+    int lanes = decoder->lanes, b, i, ok = 1;
+    if (decoder->batch != NULL) {
+        PSSequenceBatch * batch = decoder->batch;
+        PSLayer * input = network->layers[0];
+        batch->active[0] = batch->active[1] = lanes;
+        for (b = 0; b < lanes; b++)
+            setTokenInput(decoder, GetBatchValues(batch, input, 1, b),
+                          tokens[b]);
+        for (i = 1; i < network->size - 1 && ok; i++) {
+            ok = batchLayerStep(decoder, network->layers[i],
+                                network->layers[i - 1]);
+        }
+        if (ok) batchSoftmax(decoder, network->layers[network->size - 1],
+                             network->layers[network->size - 2]);
+        return ok;
+    }
+    for (b = 0; b < lanes && ok; b++) {
+        PSStepState * state = decoder->states[b];
+        setTokenInput(decoder, decoder->x, tokens[b]);
+        ok = PSStep(network, state, decoder->x);
+        if (ok) memcpy(decoder->probs + (b * decoder->vocab), state->output,
+                       decoder->vocab * sizeof(double));
+    }
+    return ok;
+}
+
+static int compareCandidates(const void * a, const void * b) {
+    double sa = ((PSDecodeCandidate *) a)->score;
+    double sb = ((PSDecodeCandidate *) b)->score;
+    if (sa == sb) return 0;
+    return (sa < sb ? 1 : -1);
+}
+
+/* Fill top with the (up to) k likeliest next tokens of lane b, likeliest
+ * first, scored by their probability. Returns how many were found, 0 on
+ * error. */
+
+static int laneTopK(PSDecoder * decoder, int b, int k,
+                    PSDecodeCandidate * top)
+{
+    int vocab = decoder->vocab, count = 0, i, j;
+    if (k > vocab) k = vocab;
+    if (decoder->tree) {
+        PSNeuralNetwork * network = decoder->network;
+        PSLayer * out = network->layers[network->size - 1];
+        count = PSHierarchicalTopK(out, decoder->rows[b], k,
+                                   decoder->classes, decoder->class_probs);
+        for (i = 0; i < count; i++) {
+            top[i].score = decoder->class_probs[i];
+            top[i].lane = b;
+            top[i].token = decoder->classes[i];
+        }
+        return count;
+    }
+    double * probs = decoder->probs + (b * vocab);
+    for (i = 0; i < vocab; i++) {
+        double p = probs[i];
+        if (count == k && p <= top[k - 1].score) continue;
+        if (count < k) count++;
+        for (j = count - 1; j > 0 && top[j - 1].score < p; j--)
+            top[j] = top[j - 1];
+        top[j].score = p;
+        top[j].lane = b;
+        top[j].token = i;
+    }
+    return count;
+}
+
+static double temperedProbability(double p, double max, double temperature)
+{
+    return (p > 0 ? exp(log(p / max) / temperature) : 0.0);
+}
+
+/* Draw one of the count candidates, their probabilities sharpened or
+ * flattened by temperature, and return its index. */
+
+static int sampleCandidates(PSDecodeCandidate * candidates, int count,
+                            double temperature, unsigned int * seed)
+{
+    double max = 0.0, sum = 0.0;
+    int i, best = 0;
+    for (i = 0; i < count; i++) {
+        if (candidates[i].score <= max) continue;
+        max = candidates[i].score;
+        best = i;
+    }
+    if (max <= 0) return best;
+    for (i = 0; i < count; i++)
+        sum += temperedProbability(candidates[i].score, max, temperature);
+    double r = sum * ((double) rand_r(seed) / ((double) RAND_MAX + 1.0));
+    for (i = 0; i < count - 1; i++) {
+        r -= temperedProbability(candidates[i].score, max, temperature);
+        if (r < 0) break;
+    }
+    return i;
+}
+
+/* Pick the next token of a single lane hypothesis, setting p to its
+ * probability. Returns -1 on error. */
+
+static int selectToken(PSDecoder * decoder, PSDecodeOptions * options,
+                       PSDecodeCandidate * candidates, unsigned int * seed,
+                       double * p)
+{
+    PSNeuralNetwork * network = decoder->network;
+    PSLayer * out = network->layers[network->size - 1];
+    int vocab = decoder->vocab, k = 1, count, i;
+    double temperature = options->temperature;
+    if (temperature <= 0) temperature = 1.0;
+    if (options->mode == PSDecodeSample) {
+        k = options->top_k;
+        if (k <= 0 || k > vocab) k = vocab;
+    }
+    if (k == vocab && decoder->tree && temperature == 1.0)
+        return PSHierarchicalSample(out, decoder->rows[0], seed, p);
+    if (k == vocab && !decoder->tree) {
+        /* Sampling among all the tokens needs no sorting */
+        for (i = 0; i < vocab; i++) {
+            candidates[i].score = decoder->probs[i];
+            candidates[i].token = i;
+        }
+        count = vocab;
+    } else count = laneTopK(decoder, 0, k, candidates);
+    if (count == 0) return -1;
+    i = 0;
+    if (options->mode == PSDecodeSample)
+        i = sampleCandidates(candidates, count, temperature, seed);
+    *p = candidates[i].score;
+    return candidates[i].token;
+}
+
+/* Hypotheses are read back from the tokens and parents kept per step */
+
+static int * traceTokens(int * tokens, int * parents, int width, int step,
+                         int lane, int length)
+{
+    int * path = malloc((length + 1) * sizeof(int)), i;
+    if (path == NULL) return NULL;
+    for (i = length - 1; i >= 0; i--, step--) {
+        path[i] = tokens[(step * width) + lane];
+        lane = parents[(step * width) + lane];
+    }
+    return path;
+}
+
+/* Keep the width best finished hypotheses, best first */
+
+static int addHypothesis(PSDecodeResult * result, int width, int * path,
+                         int length, double score)
+{
+    int i = result->count;
+    if (i == width) {
+        if (score <= result->scores[width - 1]) {
+            free(path);
+            return 1;
+        }
+        free(result->tokens[--i]);
+    } else result->count++;
+    for (; i > 0 && result->scores[i - 1] < score; i--) {
+        result->tokens[i] = result->tokens[i - 1];
+        result->lengths[i] = result->lengths[i - 1];
+        result->scores[i] = result->scores[i - 1];
+    }
+    result->tokens[i] = path;
+    result->lengths[i] = length;
+    result->scores[i] = score;
+    return 1;
+}
+
+static PSDecodeResult * createDecodeResult(int width) {
+    PSDecodeResult * result = calloc(1, sizeof(PSDecodeResult));
+    if (result == NULL) return NULL;
+    result->lengths = calloc(width, sizeof(int));
+    result->tokens = calloc(width, sizeof(int*));
+    result->scores = calloc(width, sizeof(double));
+    if (result->lengths == NULL || result->tokens == NULL ||
+        result->scores == NULL) {
+        PSDeleteDecodeResult(result);
+        return NULL;
+    }
+    return result;
+}
+
+void PSDeleteDecodeResult(PSDecodeResult * result) {
+    int i;
+    if (result == NULL) return;
+    if (result->tokens != NULL) {
+        for (i = 0; i < result->count; i++) free(result->tokens[i]);
+        free(result->tokens);
+    }
+    free(result->lengths);
+    free(result->scores);
+    free(result);
+}
+
+static int runPrefix(PSNeuralNetwork * network, PSStepState * state,
+                     int * prefix, int prefix_len)
+{
+    PSLayer * input = network->layers[0];
+    double x[input->size];
+    int i, tokens = getInputTokens(network);
+    for (i = 0; i < prefix_len; i++) {
+        if (prefix[i] < 0 || prefix[i] >= tokens) {
+            PSErr("PSDecode", "Invalid prefix token %d", prefix[i]);
+            return 0;
+        }
+        if (input->flags & FLAG_ONEHOT) x[0] = (double) prefix[i];
+        else {
+            memset(x, 0, input->size * sizeof(double));
+            x[prefix[i]] = 1.0;
+        }
+        if (!PSStep(network, state, x)) return 0;
+    }
+    return 1;
+}
+
+/* Generate up to max_len tokens after prefix (the input token indices)
+ * from state, or from a new one if state is NULL. The prefix runs once,
+ * whatever the beam width, and state itself is left untouched. Without a
+ * prefix, state must have run at least one step. Greedy and sampled
+ * decoding return one hypothesis, beam search up to beam_width. NULL
+ * options mean greedy decoding without an end token. */
+
+PSDecodeResult * PSDecode(PSNeuralNetwork * network, PSStepState * state,
+                          int * prefix, int prefix_len, int max_len,
+                          PSDecodeOptions * options)
+{
+    char * func = "PSDecode";
+    PSDecodeOptions greedy = {PSDecodeGreedy, 0, 0.0, 0, -1, 0};
+    if (network == NULL) return NULL;
+    if (options == NULL) options = &greedy;
+    if (!(network->flags & FLAG_RECURRENT) ||
+        network->layers[network->size - 1]->type != SoftMax) {
+        PSErr(func, "Decoding requires a recurrent network with a Softmax "
+              "output layer");
+        return NULL;
+    }
+    if (prefix_len <= 0 && (state == NULL || state->steps == 0)) {
+        PSErr(func, "Either a prefix or a state that ran is required");
+        return NULL;
+    }
+    int width = 1;
+    if (options->mode == PSDecodeBeam) {
+        width = options->beam_width;
+        if (width <= 0) width = PS_DEFAULT_BEAM_WIDTH;
+    }
+    PSStepState * start = (state != NULL ? PSCloneStepState(state) :
+                           PSCreateStepState(network));
+    if (start == NULL) return NULL;
+    if (!runPrefix(network, start, prefix, prefix_len)) {
+        PSDeleteStepState(start);
+        return NULL;
+    }
+    PSDecoder decoder;
+    int ok = initDecoder(&decoder, network, start, width);
+    PSDeleteStepState(start);
+    int vocab = decoder.vocab, alive = 1, step, b, i;
+    int candidates_count = width * (width + 1);
+    if (candidates_count < vocab) candidates_count = vocab;
+    unsigned int seed = options->seed;
+    double * scores = calloc(width, sizeof(double));
+    double * next_scores = malloc(width * sizeof(double));
+    int * next_tokens = malloc(width * sizeof(int));
+    int * tokens = malloc((size_t) (max_len > 0 ? max_len : 1) * width *
+                          sizeof(int));
+    int * parents = malloc((size_t) (max_len > 0 ? max_len : 1) * width *
+                           sizeof(int));
+    PSDecodeCandidate * candidates = malloc(candidates_count *
+                                            sizeof(PSDecodeCandidate));
+    PSDecodeResult * result = createDecodeResult(width);
+    if (ok && (scores == NULL || next_scores == NULL ||
+               next_tokens == NULL || tokens == NULL || parents == NULL ||
+               candidates == NULL || result == NULL)) {
+        printMemoryErrorMsg();
+        ok = 0;
+    }
+    for (step = 0; ok && step < max_len; step++) {
+        int * step_tokens = tokens + (step * width);
+        int * step_parents = parents + (step * width);
+        int count = 0;
+        if (options->mode == PSDecodeBeam) {
+            /* Only the width best tokens of a lane, and its end token,
+             * can make it into the beam */
+            int k = width + (options->end_token >= 0);
+            for (b = 0; b < alive && ok; b++) {
+                PSDecodeCandidate * top = candidates + count;
+                int found = laneTopK(&decoder, b, k, top);
+                if (found == 0) ok = 0;
+                for (i = 0; i < found && top[i].score > 0; i++, count++)
+                    top[i].score = scores[b] + log(top[i].score);
+            }
+            qsort(candidates, count, sizeof(PSDecodeCandidate),
+                  compareCandidates);
+        } else {
+            double p = 0.0;
+            int token = selectToken(&decoder, options, candidates, &seed,
+                                    &p);
+            if (token < 0) ok = 0;
+            candidates[0].score = scores[0] + log(p);
+            candidates[0].lane = 0;
+            candidates[0].token = token;
+            count = 1;
+        }
+        int lanes = 0;
+        for (i = 0; i < count && lanes < width && ok; i++) {
+            PSDecodeCandidate * c = &(candidates[i]);
+            if (c->token != options->end_token) {
+                step_tokens[lanes] = c->token;
+                step_parents[lanes] = c->lane;
+                next_scores[lanes] = c->score;
+                next_tokens[lanes++] = c->token;
+                continue;
+            }
+            int * path = traceTokens(tokens, parents, width, step - 1,
+                                     c->lane, step);
+            if (path == NULL) {
+                printMemoryErrorMsg();
+                ok = 0;
+            } else addHypothesis(result, width, path, step, c->score);
+        }
+        alive = lanes;
+        memcpy(scores, next_scores, alive * sizeof(double));
+        if (!ok || alive == 0 || step == max_len - 1) break;
+        /* Nothing left can beat the finished ones */
+        if (result->count == width &&
+            scores[0] <= result->scores[width - 1]) {
+            alive = 0;
+            break;
+        }
+        decoderGather(&decoder, step_parents, alive);
+        ok = decoderStep(&decoder, next_tokens);
+    }
+    for (b = 0; b < alive && ok && max_len > 0; b++) {
+        int length = step + 1;
+        int * path = traceTokens(tokens, parents, width, length - 1, b,
+                                 length);
+        if (path == NULL) {
+            printMemoryErrorMsg();
+            ok = 0;
+        } else addHypothesis(result, width, path, length, scores[b]);
+    }
+    deleteDecoder(&decoder);
+    free(scores);
+    free(next_scores);
+    free(next_tokens);
+    free(tokens);
+    free(parents);
+    free(candidates);
+    if (!ok) {
+        PSDeleteDecodeResult(result);
+        return NULL;
+    }
+    return result;
+}
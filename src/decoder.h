@@ -0,0 +1,57 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#ifndef __PS_DECODER_H
+#define __PS_DECODER_H
+
+#include "psyc.h"
+
+#define PS_DEFAULT_BEAM_WIDTH   8
+
+typedef enum {
+    PSDecodeGreedy,
+    PSDecodeSample,
+    PSDecodeBeam
+} PSDecodeMode;
+
+typedef struct {
+    PSDecodeMode mode;
+    int beam_width; // PSDecodeBeam, 0 = PS_DEFAULT_BEAM_WIDTH
+    double temperature; // PSDecodeSample, 0 = 1.0
+    int top_k; // PSDecodeSample: sample among the k likeliest, 0 = all
+    int end_token; // Token ending a sequence, < 0 = none
+    unsigned int seed; // PSDecodeSample random seed
+} PSDecodeOptions;
+
+/* Hypotheses found by PSDecode, likeliest first: tokens[i] holds the
+ * lengths[i] tokens generated after the prefix (without the end token)
+ * and scores[i] their log probability. */
+
+typedef struct {
+    int count;
+    int * lengths;
+    int ** tokens;
+    double * scores;
+} PSDecodeResult;
+
+PSDecodeResult * PSDecode(PSNeuralNetwork * network, PSStepState * state,
+                          int * prefix, int prefix_len, int max_len,
+                          PSDecodeOptions * options);
+void PSDeleteDecodeResult(PSDecodeResult * result);
+
+#endif //__PS_DECODER_H
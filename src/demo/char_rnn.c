@@ -1,8 +1,11 @@
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 #include "../psyc.h"
+#include "../decoder.h"
 #include "char_training_data.h"
 
 #define EPOCHS 300
@@ -20,39 +23,23 @@ void TrainCallback (void * _net, int epoch, double loss,
     //if ((epoch % 2) != 0) return;
     PSNeuralNetwork * network = (PSNeuralNetwork*) _net;
     int i;
-    double inputs[256];
-    srand ( time(NULL) - i);
-    int p = (rand() % 10) / 10.0f;
-    inputs[0] = 1.0;
-    inputs[1] = (double)(rand() % INPUT_SIZE);
-    printf("\nSample:\n%s", characters[(int) inputs[1]]);
-    for (i = 0; i < 254; i++) {
-        srand ( time(NULL) + i);
-        float p = (rand() % 10) / 10.0f;
-        int idx = PSClassify(network, inputs);
-        if (p <= 0.25f) {
-            PSLayer * out = network->layers[network->size - 1];
-            int o = 0;
-            double omax = 0.0;
-            int oidx = 0;
-            for (; o < out->size; o++) {
-                if (o == idx) continue;
-                double a = out->neurons[o]->activation;
-                if (a > omax) {
-                    omax = a;
-                    oidx = o;
-                }
-            }
-            idx = oidx;
-        }
-        if (idx >= INPUT_SIZE) {
-            fprintf(stderr, "Index %d >= %d", idx, INPUT_SIZE);
-            return;
-        }
-        printf("%s", characters[idx]);
-        inputs[0] += 1.0;
-        inputs[(int) inputs[0]] = (double) idx;
-    }
+    /* Sample one character at a time after a random one, the temperature
+     * favouring the likeliest ones. */
+    srand ( time(NULL));
+    int first = rand() % INPUT_SIZE;
+    PSDecodeOptions options = {
+        .mode = PSDecodeSample,
+        .temperature = 0.75,
+        .end_token = -1,
+        .seed = (unsigned int) time(NULL)
+    };
+    PSDecodeResult * sample = PSDecode(network, NULL, &first, 1, 254,
+                                       &options);
+    if (sample == NULL) return;
+    printf("\nSample:\n%s", characters[first]);
+    for (i = 0; i < sample->lengths[0]; i++)
+        printf("%s", characters[sample->tokens[0][i]]);
+    PSDeleteDecodeResult(sample);
     printf("\n");
 }
 
@@ -69,6 +56,7 @@ int main(int argc, char**argv){
     double * tdataset = test_data;
     int tdlen = TEST_DATALEN;*/
     int pretest = 0 ;
+    int hogwild_threads = -1;
     
     int i;
     for (i = 0; i < argc; i++) {
@@ -100,6 +88,8 @@ int main(int argc, char**argv){
             }
             if (strEq("--l2-decay", arg))
                 l2_decay = (double) atof(next);
+            if (strEq("--hogwild", arg))
+                hogwild_threads = atoi(next);
         }
     }
     //printf("CHAR: %s\n", characters[6]);return 0;
@@ -125,9 +115,21 @@ int main(int argc, char**argv){
         .flags = TRAINING_NO_SHUFFLE,
         .l2_decay = l2_decay
     };
+    if (hogwild_threads >= 0) {
+        options.flags |= TRAINING_HOGWILD;
+        options.threads = hogwild_threads;
+        printf("Hogwild threads: %d\n", hogwild_threads);
+    }
     printf("L2 Decay: %.2f\n", (float) l2_decay);
+    struct timespec start_ts, end_ts;
+    clock_gettime(CLOCK_MONOTONIC, &start_ts);
     PSTrain(network, training_data, TRAIN_DATALEN, epochs, learning_rate,
             BATCHES, &options, training_data, TRAIN_DATALEN);
+    clock_gettime(CLOCK_MONOTONIC, &end_ts);
+    double elapsed = (end_ts.tv_sec - start_ts.tv_sec) +
+                     (end_ts.tv_nsec - start_ts.tv_nsec) / 1e9;
+    printf("Training time: %.3fs (%.1f epochs/s)\n", elapsed,
+           epochs / elapsed);
     
     PSTest(network, training_data, TRAIN_DATALEN);
 
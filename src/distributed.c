@@ -0,0 +1,460 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "distributed.h"
+#include "convolutional.h"
+#include "lstm.h"
+#include "gru.h"
+#include "recurrent.h"
+#include "embedding.h"
+#include "softmax.h"
+#include "utils.h"
+
+#define GROUP_HEADER_SIZE   4096
+#define JOIN_RETRY_USEC     10000
+
+#define getSlot(group, rank) (group->slots + \
+    ((size_t) (rank) * PSPaddedSize(group->count)))
+
+/* Gradients and parameters share the same flat layout: for every unit
+ * (neuron or convolutional feature) its bias followed by its weights,
+ * LSTM and GRU gate biases last. Embedding layers only have their table
+ * rows. */
+
+int PSGetParametersCount(PSNeuralNetwork * network) {
+    int count = 0, i, j;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type == Pooling) continue;
+        if (layer->type == Convolutional) {
+            PSSharedParams * shared = getConvSharedParams(layer);
+            count += shared->feature_count * (1 + shared->weights_size);
+            continue;
+        } else if (layer->type == Embedding) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            count += table->rows * table->size;
+            continue;
+        }
+        for (j = 0; j < layer->size; j++) {
+            count += 1 + layer->neurons[j]->weights_size;
+            count += GetGateBiasesCount(layer);
+        }
+    }
+    return count;
+}
+
+static void copyValues(double * dest, double * src, int count, int pack) {
+    if (pack) memcpy(dest, src, count * sizeof(double));
+    else memcpy(src, dest, count * sizeof(double));
+}
+
+/* Rows no lookup touched are packed as zeros, and only allocated on unpack
+ * if another process touched them. */
+
+static void transferEmbeddingGradients(PSLayer * layer, PSGradient * lgradients,
+                                       double * buffer, int pack)
+{
+    int rows = GetEmbeddingTable(layer)->rows, size = layer->size, j, k;
+    for (j = 0; j < rows; j++, buffer += size) {
+        PSGradient * gradient = &(lgradients[j]);
+        if (gradient->weights == NULL) {
+            if (pack) {
+                memset(buffer, 0, size * sizeof(double));
+                continue;
+            }
+            for (k = 0; k < size && buffer[k] == 0.0; k++);
+            if (k == size) continue;
+            if (PSGetEmbeddingGradientRow(layer, gradient) == NULL) continue;
+        }
+        copyValues(buffer, gradient->weights, size, pack);
+    }
+}
+
+/* Same for the units of sampled and hierarchical Softmax layers, each one
+ * its bias followed by its weights. */
+
+static void transferSoftmaxGradients(PSLayer * layer, PSGradient * lgradients,
+                                     double * buffer, int pack)
+{
+    int size = layer->neurons[0]->weights_size, j, k;
+    for (j = 0; j < layer->size; j++, buffer += size + 1) {
+        PSGradient * gradient = &(lgradients[j]);
+        if (gradient->weights == NULL) {
+            if (pack) {
+                memset(buffer, 0, (size + 1) * sizeof(double));
+                continue;
+            }
+            for (k = 0; k <= size && buffer[k] == 0.0; k++);
+            if (k > size) continue;
+            if (PSGetSoftmaxGradientRow(layer, gradient) == NULL) continue;
+        }
+        copyValues(buffer, &(gradient->bias), 1, pack);
+        copyValues(buffer + 1, gradient->weights, size, pack);
+    }
+}
+
+static void transferGradients(PSNeuralNetwork * network,
+                              PSGradient ** gradients, double * buffer,
+                              int pack)
+{
+    int i, j;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        PSGradient * lgradients = gradients[i - 1];
+        if (lgradients == NULL) continue;
+        if (layer->type == Embedding) {
+            transferEmbeddingGradients(layer, lgradients, buffer, pack);
+            buffer += GetEmbeddingTable(layer)->rows * layer->size;
+            continue;
+        }
+        if (PSSoftmaxNeedsTargets(layer)) {
+            transferSoftmaxGradients(layer, lgradients, buffer, pack);
+            buffer += layer->size * (layer->neurons[0]->weights_size + 1);
+            continue;
+        }
+        int units = layer->size, wsize = 0;
+        if (layer->type == Convolutional) {
+            PSSharedParams * shared = getConvSharedParams(layer);
+            units = shared->feature_count;
+            wsize = shared->weights_size;
+        }
+        for (j = 0; j < units; j++) {
+            PSGradient * gradient = &(lgradients[j]);
+            if (layer->type != Convolutional) {
+                wsize = layer->neurons[j]->weights_size;
+                wsize += GetGateBiasesCount(layer);
+            }
+            copyValues(buffer++, &(gradient->bias), 1, pack);
+            copyValues(buffer, gradient->weights, wsize, pack);
+            buffer += wsize;
+        }
+    }
+}
+
+static void transferParameters(PSNeuralNetwork * network, double * buffer,
+                               int pack);
+
+void PSPackParameters(PSNeuralNetwork * network, double * buffer) {
+    transferParameters(network, buffer, 1);
+}
+
+void PSUnpackParameters(PSNeuralNetwork * network, double * buffer) {
+    transferParameters(network, buffer, 0);
+    PSInvalidateTransposedWeights(network);
+}
+
+static void transferParameters(PSNeuralNetwork * network, double * buffer,
+                               int pack)
+{
+    int i, j;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type == Pooling) continue;
+        if (layer->type == Embedding) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            copyValues(buffer, table->table, table->rows * table->size, pack);
+            buffer += table->rows * table->size;
+            continue;
+        }
+        if (layer->type == Convolutional) {
+            PSSharedParams * shared = getConvSharedParams(layer);
+            for (j = 0; j < shared->feature_count; j++) {
+                copyValues(buffer++, &(shared->biases[j]), 1, pack);
+                copyValues(buffer, shared->weights[j], shared->weights_size,
+                           pack);
+                buffer += shared->weights_size;
+            }
+            continue;
+        }
+        for (j = 0; j < layer->size; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            copyValues(buffer++, &(neuron->bias), 1, pack);
+            copyValues(buffer, neuron->weights, neuron->weights_size, pack);
+            buffer += neuron->weights_size;
+            if (layer->type == GRU) {
+                PSGRUCell * cell = GetGRUCell(neuron);
+                copyValues(buffer++, &(cell->candidate_bias), 1, pack);
+                copyValues(buffer++, &(cell->reset_bias), 1, pack);
+                copyValues(buffer++, &(cell->update_bias), 1, pack);
+                continue;
+            }
+            if (layer->type != LSTM) continue;
+            PSLSTMCell * cell = GetLSTMCell(neuron);
+            copyValues(buffer++, &(cell->candidate_bias), 1, pack);
+            copyValues(buffer++, &(cell->input_bias), 1, pack);
+            copyValues(buffer++, &(cell->output_bias), 1, pack);
+            copyValues(buffer++, &(cell->forget_bias), 1, pack);
+        }
+    }
+}
+
+/* Synchronisation. The lock is robust, so that a worker dying while
+ * holding it marks the group as failed instead of hanging the others. */
+
+static int lockGroup(PSGroupHeader * header) {
+    int err = pthread_mutex_lock(&(header->lock));
+#ifdef __linux__
+    if (err == EOWNERDEAD) {
+        header->failed = 1;
+        pthread_mutex_consistent(&(header->lock));
+        err = 0;
+    }
+#endif
+    return (err == 0);
+}
+
+static int groupBarrier(PSProcessGroup * group) {
+    PSGroupHeader * header = group->header;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += PS_GROUP_TIMEOUT;
+    if (!lockGroup(header)) return 0;
+    if (!header->failed) {
+        unsigned long generation = header->generation;
+        if (++(header->arrived) == header->size) {
+            header->arrived = 0;
+            header->generation++;
+            pthread_cond_broadcast(&(header->cond));
+        }
+        while (generation == header->generation && !header->failed) {
+            int err = pthread_cond_timedwait(&(header->cond),
+                                             &(header->lock), &deadline);
+#ifdef __linux__
+            if (err == EOWNERDEAD) {
+                header->failed = 1;
+                pthread_mutex_consistent(&(header->lock));
+            }
+#endif
+            if (err == ETIMEDOUT) {
+                PSErr("groupBarrier", "Rank %d timed out", group->rank);
+                header->failed = 1;
+                pthread_cond_broadcast(&(header->cond));
+            }
+        }
+    }
+    int ok = !header->failed;
+    pthread_mutex_unlock(&(header->lock));
+    return ok;
+}
+
+static int initGroupHeader(PSGroupHeader * header, int size, int count) {
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    int ok = (pthread_mutex_init(&(header->lock), &mattr) == 0 &&
+              pthread_cond_init(&(header->cond), &cattr) == 0);
+    pthread_mutexattr_destroy(&mattr);
+    pthread_condattr_destroy(&cattr);
+    header->size = size;
+    header->count = count;
+    header->arrived = 0;
+    header->generation = 0;
+    header->failed = 0;
+    header->owner = getpid();
+    __sync_synchronize();
+    header->ready = ok;
+    return ok;
+}
+
+/* A ready segment is stale if the rank 0 that created it is gone, or if
+ * it is no longer the one linked under the group name (a new rank 0
+ * replaced it). */
+
+static int isStaleGroup(PSProcessGroup * group, ino_t ino) {
+    struct stat st;
+    if (kill(group->header->owner, 0) != 0 && errno == ESRCH) return 1;
+    int fd = shm_open(group->name, O_RDONLY, 0600);
+    if (fd < 0) return 1;
+    int stale = (fstat(fd, &st) != 0 || st.st_ino != ino);
+    close(fd);
+    return stale;
+}
+
+/* Other ranks map the segment once it is large enough and ready, and map
+ * it again as long as it is stale. */
+
+static void * attachGroup(PSProcessGroup * group) {
+    long waited = 0, timeout = PS_GROUP_TIMEOUT * 1000000L;
+    void * addr = MAP_FAILED;
+    ino_t ino = 0;
+    struct stat st;
+    while (waited < timeout) {
+        if (addr == MAP_FAILED) {
+            int fd = shm_open(group->name, O_RDWR, 0600);
+            if (fd >= 0 && fstat(fd, &st) == 0 &&
+                (size_t) st.st_size >= group->map_size)
+            {
+                ino = st.st_ino;
+                addr = mmap(NULL, group->map_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+            }
+            if (fd >= 0) close(fd);
+        }
+        if (addr != MAP_FAILED) {
+            group->header = (PSGroupHeader *) addr;
+            __sync_synchronize();
+            if (group->header->ready) {
+                if (!isStaleGroup(group, ino)) return addr;
+                munmap(addr, group->map_size);
+                addr = MAP_FAILED;
+            }
+        }
+        usleep(JOIN_RETRY_USEC);
+        waited += JOIN_RETRY_USEC;
+    }
+    if (addr != MAP_FAILED) munmap(addr, group->map_size);
+    group->header = NULL;
+    return MAP_FAILED;
+}
+
+/* Rank 0 creates the segment (replacing any stale one), the other ranks
+ * wait for it to be ready, for at most PS_GROUP_TIMEOUT seconds. */
+
+PSProcessGroup * PSJoinProcessGroup(const char * name, int rank, int size,
+                                    PSNeuralNetwork * network)
+{
+    char * func = "PSJoinProcessGroup";
+    if (name == NULL) name = PS_DEFAULT_GROUP_NAME;
+    if (network == NULL || size < 1 || rank < 0 || rank >= size) {
+        PSErr(func, "Invalid rank %d (group size %d)", rank, size);
+        return NULL;
+    }
+    PSProcessGroup * group = calloc(1, sizeof(PSProcessGroup));
+    if (group == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    snprintf(group->name, sizeof(group->name), "%s", name);
+    group->rank = rank;
+    group->size = size;
+    group->count = PSGetParametersCount(network);
+    size_t stride = PSPaddedSize(group->count) * sizeof(double);
+    group->map_size = GROUP_HEADER_SIZE + ((size + 1) * stride);
+    void * addr = MAP_FAILED;
+    if (rank == 0) {
+        shm_unlink(group->name);
+        int fd = shm_open(group->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd >= 0 && ftruncate(fd, group->map_size) == 0) {
+            addr = mmap(NULL, group->map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0) close(fd);
+        if (addr == MAP_FAILED) shm_unlink(group->name);
+    } else addr = attachGroup(group);
+    if (addr == MAP_FAILED) {
+        PSErr(func, "Could not map shared memory %s", group->name);
+        free(group);
+        return NULL;
+    }
+    group->header = (PSGroupHeader *) addr;
+    group->slots = (double *) ((char *) addr + GROUP_HEADER_SIZE);
+    group->result = getSlot(group, size);
+    if (rank == 0) {
+        if (!initGroupHeader(group->header, size, group->count)) {
+            PSErr(func, "Could not initialize group %s", group->name);
+            PSLeaveProcessGroup(group);
+            return NULL;
+        }
+        return group;
+    }
+    if (group->header->size != size || group->header->count != group->count)
+    {
+        PSErr(func, "Group %s does not match this network or size %d",
+              group->name, size);
+        PSLeaveProcessGroup(group);
+        return NULL;
+    }
+    return group;
+}
+
+void PSLeaveProcessGroup(PSProcessGroup * group) {
+    if (group == NULL) return;
+    if (group->header != NULL) munmap(group->header, group->map_size);
+    if (group->rank == 0) shm_unlink(group->name);
+    free(group);
+}
+
+/* Copy the parameters of rank 0 to every other rank, so that all of them
+ * start from the same weights. */
+
+int PSBroadcastWeights(PSProcessGroup * group, PSNeuralNetwork * network) {
+    if (group == NULL || network == NULL) return 0;
+    if (group->rank == 0) transferParameters(network, group->result, 1);
+    if (!groupBarrier(group)) return 0;
+    if (group->rank != 0) transferParameters(network, group->result, 0);
+    return groupBarrier(group);
+}
+
+/* Slots are only written before the first barrier and read before the
+ * second one, and the result is only read after it, so two barriers per
+ * step suffice. */
+
+static int averageSlots(PSProcessGroup * group) {
+    int count = group->count, size = group->size, i, r;
+    if (!groupBarrier(group)) return 0;
+    int start = (int) (((long) count * group->rank) / size);
+    int end = (int) (((long) count * (group->rank + 1)) / size);
+    for (i = start; i < end; i++) {
+        double sum = 0.0;
+        for (r = 0; r < size; r++) sum += getSlot(group, r)[i];
+        group->result[i] = sum / (double) size;
+    }
+    return groupBarrier(group);
+}
+
+/* Replace the gradients of every rank with their average. */
+
+int PSAllreduceGradients(PSProcessGroup * group, PSNeuralNetwork * network,
+                         PSGradient ** gradients)
+{
+    if (group == NULL || network == NULL || gradients == NULL) return 0;
+    if (group->size == 1) return 1;
+    transferGradients(network, gradients, getSlot(group, group->rank), 1);
+    if (!averageSlots(group)) return 0;
+    transferGradients(network, gradients, group->result, 0);
+    return 1;
+}
+
+/* Local SGD: replace the parameters of every rank with their average. */
+
+int PSAllreduceWeights(PSProcessGroup * group, PSNeuralNetwork * network) {
+    if (group == NULL || network == NULL) return 0;
+    if (group->size == 1) return 1;
+    transferParameters(network, getSlot(group, group->rank), 1);
+    if (!averageSlots(group)) return 0;
+    transferParameters(network, group->result, 0);
+    return 1;
+}
@@ -0,0 +1,75 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_DISTRIBUTED_H
+#define __PS_DISTRIBUTED_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "psyc.h"
+
+#define PS_DEFAULT_GROUP_NAME   "/psyc-group"
+/* Seconds a process waits for the others at a barrier before giving the
+ * group up as failed: rank 0 also validates at the end of every epoch. */
+#define PS_GROUP_TIMEOUT        300
+
+/* Processes on the same host training one network on different shards
+ * of the dataset. Gradients are averaged at every step through a POSIX
+ * shared memory segment: each rank writes its gradients into its own
+ * slot, sums one slice of all the slots (reduce-scatter) and then reads
+ * the whole result (allgather). */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int size;
+    int count;
+    int arrived;
+    unsigned long generation;
+    int failed;
+    int ready;
+    pid_t owner; // Rank 0 process that created the segment
+} PSGroupHeader;
+
+typedef struct {
+    char name[255];
+    int rank;
+    int size;
+    int count;
+    size_t map_size;
+    PSGroupHeader * header;
+    double * slots;
+    double * result;
+} PSProcessGroup;
+
+PSProcessGroup * PSJoinProcessGroup(const char * name, int rank, int size,
+                                    PSNeuralNetwork * network);
+int PSBroadcastWeights(PSProcessGroup * group, PSNeuralNetwork * network);
+int PSAllreduceGradients(PSProcessGroup * group, PSNeuralNetwork * network,
+                         PSGradient ** gradients);
+int PSAllreduceWeights(PSProcessGroup * group, PSNeuralNetwork * network);
+void PSLeaveProcessGroup(PSProcessGroup * group);
+
+/* Flat copy of every weight and bias of a network (see distributed.c for
+ * the layout) */
+
+int PSGetParametersCount(PSNeuralNetwork * network);
+void PSPackParameters(PSNeuralNetwork * network, double * buffer);
+void PSUnpackParameters(PSNeuralNetwork * network, double * buffer);
+
+#endif //__PS_DISTRIBUTED_H
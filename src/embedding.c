@@ -0,0 +1,236 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "embedding.h"
+#include "recurrent.h"
+#include "utils.h"
+
+/* Init Functions */
+
+int PSInitEmbeddingLayer(PSNeuralNetwork * network, PSLayer * layer,
+                         int size, int rows) {
+    int i;
+    char * func = "PSInitEmbeddingLayer";
+    layer->neurons = malloc(sizeof(PSNeuron*) * size);
+    if (layer->neurons == NULL) {
+        PSErr(func, "Could not allocate layer neurons!");
+        PSAbortLayer(network, layer);
+        return 0;
+    }
+#ifdef USE_AVX
+    layer->avx_activation_cache = PSAlignedAlloc(size);
+    if (layer->avx_activation_cache == NULL) {
+        printMemoryErrorMsg();
+        PSAbortLayer(network, layer);
+        return 0;
+    }
+#endif
+    for (i = 0; i < size; i++) {
+        PSNeuron * neuron = malloc(sizeof(PSNeuron));
+        if (neuron == NULL) {
+            PSErr(func, "Could not allocate neuron!");
+            PSAbortLayer(network, layer);
+            return 0;
+        }
+        neuron->index = i;
+        neuron->weights_size = 0;
+        neuron->bias = 0;
+        neuron->weights = NULL;
+        neuron->activation = 0;
+        neuron->z_value = 0;
+        neuron->extra = NULL;
+        neuron->layer = layer;
+        layer->neurons[i] = neuron;
+    }
+    PSEmbeddingTable * table = malloc(sizeof(PSEmbeddingTable));
+    if (table == NULL) {
+        PSErr(func, "Could not allocate embedding table!");
+        PSAbortLayer(network, layer);
+        return 0;
+    }
+    table->rows = rows;
+    table->size = size;
+    table->table = PSAlignedAlloc(rows * size);
+    layer->extra = table;
+    if (table->table == NULL) {
+        PSErr(func, "Could not allocate embedding table!");
+        PSAbortLayer(network, layer);
+        return 0;
+    }
+    for (i = 0; i < rows * size; i++)
+        table->table[i] = gaussian_random(0, 1);
+    layer->activate = NULL;
+    layer->derivative = NULL;
+    layer->feedforward = PSEmbeddingFeedforward;
+    return 1;
+}
+
+/* Feedforward Functions */
+
+static double getInputValue(PSLayer * previous, int i, int is_recurrent,
+                            int t)
+{
+    PSNeuron * neuron = previous->neurons[i];
+    return (is_recurrent ? GetRecurrentState(neuron, t) : neuron->activation);
+}
+
+/* Table row indexed by a onehot input, -1 if the input is a vector. */
+
+static int getInputRow(PSLayer * layer, PSLayer * previous, int is_recurrent,
+                       int t, int * row)
+{
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    *row = -1;
+    if (!(previous->flags & FLAG_ONEHOT)) return 1;
+    double x = getInputValue(previous, 0, is_recurrent, t);
+    if (x < 0 || x >= table->rows) {
+        PSErr(NULL, "Layer[%d]: input %d is out of the embedding table "
+              "(%d rows)", layer->index, (int) x, table->rows);
+        return 0;
+    }
+    *row = (int) x;
+    return 1;
+}
+
+/* Onehot inputs copy their row, vectors sum the rows of their non-zero
+ * values weighted by them. */
+
+int PSEmbeddingFeedforward(void * _net, void * _layer, ...) {
+    PSNeuralNetwork * network = (PSNeuralNetwork*) _net;
+    PSLayer * layer = (PSLayer*) _layer;
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    char * func = "PSEmbeddingFeedforward";
+    PSLayer * previous = network->layers[layer->index - 1];
+    int is_recurrent = (network->flags & FLAG_RECURRENT), times = 0, t = 0;
+    if (is_recurrent) {
+        va_list args;
+        va_start(args, _layer);
+        times = va_arg(args, int);
+        t = va_arg(args, int);
+        va_end(args);
+    }
+    int size = layer->size, row, i;
+    double values[size];
+    if (!getInputRow(layer, previous, is_recurrent, t, &row)) return 0;
+    if (row >= 0)
+        memcpy(values, GetEmbeddingRow(table, row), size * sizeof(double));
+    else {
+        memset(values, 0, size * sizeof(double));
+        for (row = 0; row < table->rows; row++) {
+            double x = getInputValue(previous, row, is_recurrent, t);
+            if (x == 0.0) continue;
+            PSAddScaled(values, GetEmbeddingRow(table, row), x, size);
+        }
+    }
+    for (i = 0; i < size; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        neuron->z_value = values[i];
+        neuron->activation = values[i];
+        if (!is_recurrent) {
+#ifdef USE_AVX
+            layer->avx_activation_cache[i] = values[i];
+#endif
+            continue;
+        }
+        if (!PSAddRecurrentState(neuron, values[i], times, t)) {
+            PSErr(func, "Failed to allocate Recurrent Cell!");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Backpropagation Functions */
+
+double * PSGetEmbeddingGradientRow(PSLayer * layer, PSGradient * gradient) {
+    if (gradient->weights == NULL) {
+        gradient->weights = PSAlignedAlloc(layer->size);
+        if (gradient->weights == NULL) printMemoryErrorMsg();
+    }
+    return gradient->weights;
+}
+
+/* Add delta, the layer delta at t, to the gradients of the rows the
+ * input looked up. */
+
+int PSEmbeddingBackprop(PSLayer * layer, PSLayer * previous, double * delta,
+                        PSGradient * lgradients, int is_recurrent, int t)
+{
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    int size = layer->size, row;
+    double * grow;
+    if (!getInputRow(layer, previous, is_recurrent, t, &row)) return 0;
+    if (row >= 0) {
+        grow = PSGetEmbeddingGradientRow(layer, &(lgradients[row]));
+        if (grow == NULL) return 0;
+        PSAddScaled(grow, delta, 1.0, size);
+        return 1;
+    }
+    for (row = 0; row < table->rows; row++) {
+        double x = getInputValue(previous, row, is_recurrent, t);
+        if (x == 0.0) continue;
+        grow = PSGetEmbeddingGradientRow(layer, &(lgradients[row]));
+        if (grow == NULL) return 0;
+        PSAddScaled(grow, delta, x, size);
+    }
+    return 1;
+}
+
+/* Rows only src touched are moved into dest instead of being added. */
+
+void PSMergeEmbeddingGradients(PSLayer * layer, PSGradient * dest,
+                               PSGradient * src)
+{
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    int row;
+    for (row = 0; row < table->rows; row++) {
+        if (src[row].weights == NULL) continue;
+        if (dest[row].weights == NULL) {
+            dest[row].weights = src[row].weights;
+            src[row].weights = NULL;
+        } else PSAddScaled(dest[row].weights, src[row].weights, 1.0,
+                           layer->size);
+    }
+}
+
+/* Only the rows the batch looked up are updated, weight decay included. */
+
+double PSUpdateEmbeddingTable(PSLayer * layer, PSGradient * lgradients,
+                              double rate, double l2)
+{
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    int size = layer->size, row, k;
+    double l2_loss = 0.0;
+    for (row = 0; row < table->rows; row++) {
+        double * g = lgradients[row].weights;
+        if (g == NULL) continue;
+        double * weights = GetEmbeddingRow(table, row);
+        for (k = 0; k < size; k++) {
+            if (l2 != 0.0) {
+                weights[k] *= l2;
+                l2_loss += (g[k] * g[k]);
+            }
+            weights[k] -= (rate * g[k]);
+        }
+    }
+    return l2_loss;
+}
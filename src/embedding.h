@@ -0,0 +1,59 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_EMBEDDING_H
+#define __PS_EMBEDDING_H
+
+#include "psyc.h"
+
+/* Embedding layers map the input of layer 0 (a onehot index or a vector as
+ * wide as the vocabulary) to a row of a [rows x size] table, stored
+ * contiguously in layer->extra. Their neurons have no weights nor bias.
+ * Gradients hold one PSGradient per table row, whose weights are only
+ * allocated when the row is looked up (see PSGetEmbeddingGradientRow), so
+ * that merging and updating them only touches the rows a batch used. */
+
+#define GetEmbeddingTable(layer) ((PSEmbeddingTable*) layer->extra)
+#define GetEmbeddingRow(table, row) \
+    (table->table + ((size_t) (row) * table->size))
+
+typedef struct {
+    int rows;
+    int size;
+    double * table;
+} PSEmbeddingTable;
+
+/* Init Functions */
+
+int PSInitEmbeddingLayer(PSNeuralNetwork * network, PSLayer * layer,
+                         int size, int rows);
+
+/* Feedforward Functions */
+
+int PSEmbeddingFeedforward(void * _net, void * _layer, ...);
+
+/* Backpropagation Functions */
+
+double * PSGetEmbeddingGradientRow(PSLayer * layer, PSGradient * gradient);
+int PSEmbeddingBackprop(PSLayer * layer, PSLayer * previous, double * delta,
+                        PSGradient * lgradients, int is_recurrent, int t);
+void PSMergeEmbeddingGradients(PSLayer * layer, PSGradient * dest,
+                               PSGradient * src);
+double PSUpdateEmbeddingTable(PSLayer * layer, PSGradient * lgradients,
+                              double rate, double l2);
+
+#endif // __PS_EMBEDDING_H
@@ -0,0 +1,525 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef USE_AVX
+#include "avx.h"
+#endif
+
+#include "gru.h"
+#include "recurrent.h"
+#include "utils.h"
+#include "memory.h"
+#include "threadpool.h"
+
+#define CANDIDATE_IDX   0
+#define RESET_IDX       1
+#define UPDATE_IDX      2
+#define GRU_GATES       3
+
+#define FreeGRUDeltas() do {\
+    if (delta_gates != NULL) free(delta_gates);\
+    if (gru_delta != NULL) free(gru_delta);\
+} while(0)
+
+/* Add to gates the products of x with the three gate rows of cell, which
+ * are stored one after the other in neuron->weights (weights_size apart),
+ * starting from column offset. */
+
+static void addGateProducts(PSGRUCell * cell, int offset, double * x, int n,
+                            double * gates)
+{
+    double * rows = cell->candidate_weights + offset;
+    int stride = cell->weights_size;
+#ifdef USE_AVX
+    avx_dot_product_rows3(x, rows, stride, n, gates);
+#else
+    int i;
+    for (i = 0; i < n; i++) {
+        double xi = x[i];
+        gates[CANDIDATE_IDX] += rows[i] * xi;
+        gates[RESET_IDX] += rows[stride + i] * xi;
+        gates[UPDATE_IDX] += rows[(2 * stride) + i] * xi;
+    }
+#endif
+}
+
+/* The reset gate scales the recurrent product of the candidate instead of
+ * the previous state, so that the three gates only need the products of
+ * the same x = [input at t | layer states at t - 1]. gates holds the
+ * products of the input part, followed by the ones of the recurrent part.
+ * Cell values are in PSReserveLayerStates order: state, candidate, reset
+ * gate, update gate and recurrent candidate product. */
+
+static void GRUGateValues(PSLayer * layer, PSGRUCell * cell, double * gates,
+                          double last_h, double * values)
+{
+    double * rgates = gates + GRU_GATES;
+    double reset_gate = sigmoid(gates[RESET_IDX] + rgates[RESET_IDX] +
+                                cell->reset_bias);
+    double update_gate = sigmoid(gates[UPDATE_IDX] + rgates[UPDATE_IDX] +
+                                 cell->update_bias);
+    double candidate = gates[CANDIDATE_IDX] + cell->candidate_bias +
+                       (reset_gate * rgates[CANDIDATE_IDX]);
+    if (layer->activate != NULL) candidate = layer->activate(candidate);
+    values[0] = ((1 - update_gate) * candidate) + (update_gate * last_h);
+    values[1] = candidate;
+    values[2] = reset_gate;
+    values[3] = update_gate;
+    values[4] = rgates[CANDIDATE_IDX];
+}
+
+static void GRUCellUpdate(PSLayer * layer, PSNeuron * neuron, double * gates,
+                          int t)
+{
+    PSGRUCell * cell = GetGRUCell(neuron);
+    double last_h = (t > 0 ? cell->states[t - 1] : 0.0);
+    double values[GRU_STATE_ARRAYS];
+    GRUGateValues(layer, cell, gates, last_h, values);
+    
+    cell->candidates[t] = values[1];
+    cell->reset_gates[t] = values[2];
+    cell->update_gates[t] = values[3];
+    cell->recurrent_candidates[t] = values[4];
+    
+    neuron->z_value = values[0];
+    neuron->activation = values[0];
+    cell->states[t] = values[0];
+}
+
+PSGRUCell * PSCreateGRUCell(PSNeuron * neuron, int weight_size) {
+    
+    PSGRUCell * cell = malloc(sizeof(PSGRUCell));
+    if (cell == NULL) return NULL;
+    cell->states_count = 0;
+    cell->states = NULL;
+    cell->candidates = NULL;
+    cell->reset_gates = NULL;
+    cell->update_gates = NULL;
+    cell->recurrent_candidates = NULL;
+    
+    cell->candidate_bias = gaussian_random(0, 1);
+    cell->reset_bias = gaussian_random(0, 1);
+    cell->update_bias = gaussian_random(0, 1);
+    
+    cell->weights_size = weight_size;
+    cell->candidate_weights = neuron->weights;
+    cell->reset_weights = neuron->weights + weight_size;
+    cell->update_weights = neuron->weights + (weight_size * UPDATE_IDX);
+    return cell;
+}
+
+void PSUpdateGRUBiases(PSNeuron * neuron, PSGradient * gradient, double rate) {
+    double * biases = GetGRUGradientBiases(neuron, gradient);
+    PSGRUCell *cell = GetGRUCell(neuron);
+    cell->candidate_bias -= (rate * biases[CANDIDATE_IDX]);
+    cell->reset_bias -= (rate * biases[RESET_IDX]);
+    cell->update_bias -= (rate * biases[UPDATE_IDX]);
+}
+
+/* Init Functions */
+
+int PSInitGRULayer(PSNeuralNetwork * network, PSLayer * layer,
+                   int size, int ws) {
+    int i, j;
+    ws += size;
+    int tot_ws = ws * GRU_GATES; //Weights for candidate, reset and update gates
+    char * func = "PSInitGRULayer";
+    layer->neurons = malloc(sizeof(PSNeuron*) * size);
+    if (layer->neurons == NULL) {
+        PSErr(func, "Could not allocate layer neurons!");
+        PSAbortLayer(network, layer);
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        PSNeuron * neuron = malloc(sizeof(PSNeuron));
+        if (neuron == NULL) {
+            PSErr(func, "Could not allocate neuron!");
+            PSAbortLayer(network, layer);
+            return 0;
+        }
+        neuron->index = i;
+        neuron->weights_size = tot_ws;
+        neuron->bias = gaussian_random(0, 1);
+        neuron->weights = PSAlignedAlloc(tot_ws);
+        if (neuron->weights ==  NULL) {
+            PSAbortLayer(network, layer);
+            PSErr(func, "Could not allocate neuron weights!");
+            return 0;
+        }
+        for (j = 0; j < tot_ws; j++) {
+            neuron->weights[j] = gaussian_random(0, 1);
+        }
+        neuron->activation = 0;
+        neuron->z_value = 0;
+        layer->neurons[i] = neuron;
+        neuron->extra = PSCreateGRUCell(neuron, ws);
+        if (neuron->extra == NULL) {
+            PSAbortLayer(network, layer);
+            return 0;
+        }
+        neuron->layer = layer;
+    }
+    layer->flags |= FLAG_RECURRENT;
+    layer->activate = tanh;
+    layer->derivative = tanh_derivative;
+    layer->feedforward = PSGRUFeedforward;
+    network->flags |= FLAG_RECURRENT;
+    return 1;
+}
+
+/* Feedforward Functions */
+
+/* As for LSTM layers, all gates of the layer are computed at once from
+ * x = [input at t | layer states at t - 1], gathered once per step, with
+ * three gate rows per neuron instead of four. */
+
+typedef struct {
+    PSLayer * layer;
+    double * x;
+    double * gates;
+    int onehot_idx;
+    int t;
+} PSGRUFeedforwardTask;
+
+static void GRUFeedforwardNeurons(void * data, int start, int end) {
+    PSGRUFeedforwardTask * task = (PSGRUFeedforwardTask *) data;
+    PSLayer * layer = task->layer;
+    int i, k, t = task->t, onehot_idx = task->onehot_idx;
+    for (i = start; i < end; i++) {
+        PSGRUCell * cell = GetGRUCell(layer->neurons[i]);
+        int wsize = cell->weights_size, prev_size = wsize - layer->size;
+        double * gates = task->gates + (2 * GRU_GATES * i);
+        for (k = 0; k < 2 * GRU_GATES; k++) gates[k] = 0.0;
+        if (onehot_idx >= 0) {
+            for (k = 0; k < GRU_GATES; k++)
+                gates[k] = cell->candidate_weights[(k * wsize) + onehot_idx];
+        } else addGateProducts(cell, 0, task->x, prev_size, gates);
+        if (t > 0)
+            addGateProducts(cell, prev_size, task->x + prev_size,
+                            layer->size, gates + GRU_GATES);
+    }
+    for (i = start; i < end; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        GRUCellUpdate(layer, neuron, task->gates + (2 * GRU_GATES * i), t);
+#ifdef USE_AVX
+        layer->avx_activation_cache[(t * layer->size) + i] =
+            neuron->activation;
+#endif
+    }
+}
+
+int PSGRUFeedforward(void * _net, void * _layer, ...) {
+    PSNeuralNetwork * net = (PSNeuralNetwork*) _net;
+    PSLayer * layer = (PSLayer*) _layer;
+    char * func = "PSGRUFeedforward";
+    va_list args;
+    va_start(args, _layer);
+    int times = va_arg(args, int);
+    int t = va_arg(args, int);
+    va_end(args);
+    if (times < 1) {
+        PSErr(func, "Layer[%d]: times must be >= 1 (found %d)",
+              layer->index, times);
+        return 0;
+    }
+    int size = layer->size;
+    if (layer->neurons == NULL) {
+        PSErr(NULL, "Layer[%d] has no neurons!", layer->index);
+        return 0;
+    }
+    if (layer->index == 0) {
+        PSErr(NULL, "Cannot feedforward on layer 0!");
+        return 0;
+    }
+    PSLayer * previous = net->layers[layer->index - 1];
+    if (previous == NULL) {
+        PSErr(NULL, "Layer[%d]: previous layer is NULL!", layer->index);
+        return 0;
+    }
+    int onehot = previous->flags & FLAG_ONEHOT;
+    PSLayerParameters * params = NULL;
+    int vector_size = 0, vector_idx = -1;
+    if (onehot) {
+        params = previous->parameters;
+        if (params == NULL) {
+            PSErr(NULL, "Layer[%d]: prev. onehot layer params are NULL!",
+                  layer->index);
+            return 0;
+        }
+        if (params->count < 1) {
+            PSErr(NULL, "Layer[%d]: prev. onehot layer params < 1!",
+                  layer->index);
+            return 0;
+        }
+        vector_size = (int) (params->parameters[0]);
+        PSNeuron * prev_neuron = previous->neurons[0];
+        vector_idx = (int) GetRecurrentState(prev_neuron, t);
+        if (vector_idx < 0 || vector_idx >= vector_size) {
+            PSErr(NULL, "Layer[%d]: invalid vector index %d (max. %d)!",
+                  previous->index, vector_idx, vector_size - 1);
+            return 0;
+        }
+    }
+    if (t == 0 && !PSReserveLayerStates(layer, times)) return 0;
+    int i, wsize = GetGRUCell(layer->neurons[0])->weights_size;
+    int prev_size = wsize - size;
+    double x[wsize], gates[2 * GRU_GATES * size];
+    if (!onehot) {
+        for (i = 0; i < prev_size; i++)
+            x[i] = GetRecurrentState(previous->neurons[i], t);
+    }
+    if (t > 0) {
+        for (i = 0; i < size; i++)
+            x[prev_size + i] = GetRecurrentState(layer->neurons[i], t - 1);
+    }
+    PSGRUFeedforwardTask task = {layer, x, gates, vector_idx, t};
+    int work = size * layer->neurons[0]->weights_size;
+    if (PSShouldRunParallel(work))
+        PSParallelFor(PSGlobalThreadPool, size, GRUFeedforwardNeurons, &task);
+    else
+        GRUFeedforwardNeurons(&task, 0, size);
+    return 1;
+}
+
+/* Batched feedforward (see PSSequenceBatch), mirroring the one above for
+ * every lane of a step: the input parts of the gate products of all the
+ * lanes are one matrix product (PSMatrixProduct) of their inputs (x) by
+ * the gate weights rows (w, three per neuron), and so are the recurrent
+ * parts, of their last states (h) by the rows in w + 3 * size. gates holds
+ * [lanes x 6 * size] products, input parts first. */
+
+typedef struct {
+    PSLayer * layer;
+    PSLayer * previous;
+    PSSequenceBatch * batch;
+    double ** x;
+    double ** h;
+    double ** w;
+    double * gates;
+    int n;
+    int lanes;
+    int t;
+} PSGRUBatchTask;
+
+static void GRUBatchFeedforwardNeurons(void * data, int start, int end) {
+    PSGRUBatchTask * task = (PSGRUBatchTask *) data;
+    PSLayer * layer = task->layer, * previous = task->previous;
+    PSSequenceBatch * batch = task->batch;
+    int size = layer->size, gsize = GRU_GATES * size, t = task->t, i, b, k;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    int first = start * GRU_GATES, cols = (end - start) * GRU_GATES;
+    if (task->n > 0) {
+        PSMatrixProduct(task->x, task->lanes, task->w + first, cols, task->n,
+                        task->gates + first, 2 * gsize);
+    }
+    if (t > 0) {
+        PSMatrixProduct(task->h, task->lanes, task->w + gsize + first, cols,
+                        size, task->gates + gsize + first, 2 * gsize);
+    }
+    for (i = start; i < end; i++) {
+        PSGRUCell * cell = GetGRUCell(layer->neurons[i]);
+        int wsize = cell->weights_size;
+        for (b = 0; b < task->lanes; b++) {
+            double * products = task->gates + (b * 2 * gsize);
+            double gates[2 * GRU_GATES], values[GRU_STATE_ARRAYS];
+            for (k = 0; k < GRU_GATES; k++) {
+                gates[k] = (task->n > 0 ? products[(i * GRU_GATES) + k] :
+                            0.0);
+                gates[GRU_GATES + k] = (t > 0 ?
+                    products[gsize + (i * GRU_GATES) + k] : 0.0);
+            }
+            if (onehot) {
+                int idx = (int) GetBatchValues(batch, previous, t, b)[0];
+                for (k = 0; k < GRU_GATES; k++)
+                    gates[k] += cell->candidate_weights[(k * wsize) + idx];
+            }
+            double last_h = (t > 0 ? task->h[b][i] : 0.0);
+            GRUGateValues(layer, cell, gates, last_h, values);
+            for (k = 0; k < GRU_STATE_ARRAYS; k++)
+                GetBatchArray(batch, layer, k, t, b)[i] = values[k];
+        }
+    }
+}
+
+int PSGRUBatchFeedforward(PSLayer * layer, PSLayer * previous,
+                          PSSequenceBatch * batch, int t)
+{
+    int size = layer->size, gsize = GRU_GATES * size;
+    int lanes = batch->active[t], b, i, k;
+    int wsize = GetGRUCell(layer->neurons[0])->weights_size;
+    int prev_size = wsize - size;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    double ** x = malloc(lanes * sizeof(double*));
+    double ** h = malloc(lanes * sizeof(double*));
+    double ** w = malloc(2 * gsize * sizeof(double*));
+    double * gates = malloc(lanes * 2 * gsize * sizeof(double));
+    if (x == NULL || h == NULL || w == NULL || gates == NULL) {
+        printMemoryErrorMsg();
+        free(x);
+        free(h);
+        free(w);
+        free(gates);
+        return 0;
+    }
+    for (b = 0; b < lanes; b++) {
+        x[b] = GetBatchValues(batch, previous, t, b);
+        h[b] = (t > 0 ? GetBatchValues(batch, layer, t - 1, b) : NULL);
+    }
+    for (i = 0; i < size; i++) {
+        PSGRUCell * cell = GetGRUCell(layer->neurons[i]);
+        for (k = 0; k < GRU_GATES; k++) {
+            double * row = cell->candidate_weights + (k * wsize);
+            w[(i * GRU_GATES) + k] = row;
+            w[gsize + (i * GRU_GATES) + k] = row + prev_size;
+        }
+    }
+    /* Onehot inputs just pick a weight: only the last states multiply */
+    PSGRUBatchTask task = {layer, previous, batch, x, h, w, gates,
+                           (onehot ? 0 : prev_size), lanes, t};
+    int work = lanes * size * layer->neurons[0]->weights_size;
+    if (PSShouldRunParallel(work))
+        PSParallelFor(PSGlobalThreadPool, size, GRUBatchFeedforwardNeurons,
+                      &task);
+    else
+        GRUBatchFeedforwardNeurons(&task, 0, size);
+    free(x);
+    free(h);
+    free(w);
+    free(gates);
+    return 1;
+}
+
+/* Backpropagation Functions */
+
+/* last_delta must not include the derivative of the layer activation,
+ * since GRU states are not squashed. The returned buffer holds the delta
+ * for the previous layer followed by the one the layer hands back to
+ * itself at t - 1, which is read from last_gru_delta at t + 1. */
+
+double * PSGRUBackprop(PSLayer * layer,
+                       PSLayer * previousLayer,
+                       double * last_delta,
+                       double * last_gru_delta,
+                       PSGradient * lgradients,
+                       int t){
+    int onehot = previousLayer->flags & FLAG_ONEHOT;
+    int lsize = layer->size, i, k, w, last_t = t - 1;
+    int previous_size = previousLayer->size;
+    if (onehot) {
+        PSLayerParameters * params = previousLayer->parameters;
+        if (params == NULL) {
+            fprintf(stderr, "Layer %d params are NULL!\n",
+                    previousLayer->index);
+            return NULL;
+        }
+        previous_size = (int) params->parameters[0];
+        assert(previous_size > 0);
+    }
+    /* Recurrent gate deltas are contiguous, in the same order as the rows
+     * of the transposed recurrent weights, and followed by the deltas of
+     * the candidate input products */
+    double * delta_gates = calloc(sizeof(double), (GRU_GATES + 1) * lsize);
+    double * gru_delta = calloc(sizeof(double), previous_size + lsize);
+    if (gru_delta == NULL || delta_gates == NULL) {
+        printMemoryErrorMsg();
+        FreeGRUDeltas();
+        return NULL;
+    }
+    double * delta_r = delta_gates + (lsize * RESET_IDX);
+    double * delta_u = delta_gates + (lsize * UPDATE_IDX);
+    double * delta_c = delta_gates + (lsize * GRU_GATES);
+    double * delta = gru_delta + previous_size;
+    if (last_gru_delta != NULL) last_gru_delta += previous_size;
+    double x[onehot ? 1 : previous_size], last_states[lsize];
+    int x_idx = -1;
+    if (onehot) {
+        x_idx = (int) GetRecurrentState(previousLayer->neurons[0], t);
+        assert(x_idx < previous_size);
+    } else {
+        for (w = 0; w < previous_size; w++)
+            x[w] = GetRecurrentState(previousLayer->neurons[w], t);
+    }
+    for (w = 0; t > 0 && w < lsize; w++)
+        last_states[w] = GetRecurrentState(layer->neurons[w], last_t);
+
+    for (i = 0; i < lsize; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        PSGRUCell * cell = GetGRUCell(neuron);
+        PSGradient * gradient = &(lgradients[i]);
+        double * gradient_biases = GetGRUGradientBiases(neuron, gradient);
+        if (last_gru_delta != NULL) last_delta[i] += last_gru_delta[i];
+        double dh = last_delta[i];
+        int cwsize = cell->weights_size;
+        int wsize = cwsize - lsize;
+        
+        double last_h = (t > 0 ? last_states[i] : 0.0);
+        double c = cell->candidates[t];
+        double rg = cell->reset_gates[t];
+        double ug = cell->update_gates[t];
+        double rc = cell->recurrent_candidates[t];
+        
+        double dc = dh * (1 - ug);
+        if (layer->derivative != NULL) dc *= layer->derivative(c);
+        double d[GRU_GATES], dx[GRU_GATES];
+        d[CANDIDATE_IDX] = dc * rg;
+        d[RESET_IDX] = dc * rc * (rg * (1 - rg)); // sigmoid_derivative
+        d[UPDATE_IDX] = dh * (last_h - c) * (ug * (1 - ug));
+        delta[i] = dh * ug;
+        
+        dx[CANDIDATE_IDX] = dc;
+        dx[RESET_IDX] = d[RESET_IDX];
+        dx[UPDATE_IDX] = d[UPDATE_IDX];
+        for (k = 0; k < GRU_GATES; k++) {
+            double * weights = gradient->weights + (k * cwsize);
+            delta_gates[(k * lsize) + i] = d[k];
+            gradient_biases[k] += dx[k];
+            if (onehot) weights[x_idx] += dx[k];
+            else PSAddScaled(weights, x, dx[k], wsize);
+            if (t > 0) PSAddScaled(weights + wsize, last_states, d[k], lsize);
+        }
+        delta_c[i] = dc;
+    }
+    
+    if (layer->index > 1) {
+        for (w = 0; w < previous_size; w++) {
+            for (i = 0; i < lsize; i++) {
+                PSGRUCell * cell = GetGRUCell(layer->neurons[i]);
+                gru_delta[w] += delta_c[i] * cell->candidate_weights[w];
+                gru_delta[w] += delta_r[i] * cell->reset_weights[w];
+                gru_delta[w] += delta_u[i] * cell->update_weights[w];
+            }
+        }
+    }
+    if (t > 0) {
+        int gsize = GRU_GATES * lsize;
+        for (i = 0; i < lsize; i++) {
+            double * rweights = layer->recurrent_weights_t + (i * gsize);
+            delta[i] += PSDotProduct(rweights, delta_gates, gsize);
+        }
+    }
+    
+    free(delta_gates);
+    return gru_delta;
+}
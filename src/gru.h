@@ -0,0 +1,69 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_GRU_H
+#define __PS_GRU_H
+
+#include "psyc.h"
+#include "recurrent.h"
+
+#define GetGRUCell(neuron) ((PSGRUCell*) neuron->extra)
+/* states, candidates, reset and update gates and recurrent candidate
+ * products */
+#define GRU_STATE_ARRAYS    5
+#define GetGRUGradientBiases(n, gradient) (gradient->weights + n->weights_size)
+
+typedef struct {
+    int states_count;
+    int weights_size;
+    double * states;
+    double * candidates;
+    double * reset_gates;
+    double * update_gates;
+    double * recurrent_candidates;
+    double candidate_bias;
+    double reset_bias;
+    double update_bias;
+    double * candidate_weights;
+    double * reset_weights;
+    double * update_weights;
+} PSGRUCell;
+
+PSGRUCell * PSCreateGRUCell(PSNeuron * neuron, int lsize);
+void PSUpdateGRUBiases(PSNeuron * neuron, PSGradient * gradient, double rate);
+
+/* Init Functions */
+
+int PSInitGRULayer(PSNeuralNetwork * network, PSLayer * layer,
+                   int size, int ws);
+
+/* Feedforward Functions */
+
+int PSGRUFeedforward(void * _net, void * _layer, ...);
+int PSGRUBatchFeedforward(PSLayer * layer, PSLayer * previous,
+                          PSSequenceBatch * batch, int t);
+
+/* Backpropagation Functions */
+
+double * PSGRUBackprop(PSLayer * layer,
+                       PSLayer * previousLayer,
+                       double * last_delta,
+                       double * last_gru_delta,
+                       PSGradient * lgradients,
+                       int t);
+
+#endif // __PS_GRU_H
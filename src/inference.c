@@ -0,0 +1,392 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include "inference.h"
+#include "recurrent.h"
+#include "sparse.h"
+#include "threadpool.h"
+#include "affinity.h"
+#include "utils.h"
+
+#define getEngine(network) ((PSInferenceEngine *) network->inference)
+
+static int getInputSize(PSNeuralNetwork * network, double * input) {
+    int size = network->layers[0]->size;
+    if (network->flags & FLAG_RECURRENT) return 1 + ((int) input[0] * size);
+    return size;
+}
+
+static void getOutputs(PSNeuralNetwork * network, PSInferenceRequest * req) {
+    PSLayer * out = network->layers[network->size - 1];
+    int size = out->size, i, t;
+    if (network->flags & FLAG_RECURRENT) {
+        int times = (int) req->input[0];
+        for (t = 0; t < times; t++) {
+            for (i = 0; i < size; i++)
+                req->output[(t * size) + i] =
+                    GetRecurrentState(out->neurons[i], t);
+        }
+    } else {
+        for (i = 0; i < size; i++)
+            req->output[i] = out->neurons[i]->activation;
+    }
+}
+
+/* Run the count requests of batch on network, setting their status. Non
+ * recurrent networks run them as a single PSFeedforwardBatch (values
+ * holding room for count inputs and outputs), recurrent ones one by one,
+ * as their series lengths differ. */
+
+static void runBatch(PSNeuralNetwork * network, PSInferenceRequest ** batch,
+                     int count, double * values, int * status)
+{
+    int i;
+    if (values != NULL && count > 1) {
+        int input_size = batch[0]->input_size;
+        int output_size = batch[0]->output_size;
+        double * outputs = values + (count * input_size);
+        for (i = 0; i < count; i++) {
+            memcpy(values + (i * input_size), batch[i]->input,
+                   input_size * sizeof(double));
+        }
+        int ok = PSFeedforwardBatch(network, values, count, outputs);
+        for (i = 0; i < count; i++) {
+            status[i] = (ok ? PS_REQUEST_DONE : PS_REQUEST_FAILED);
+            if (!ok) continue;
+            memcpy(batch[i]->output, outputs + (i * output_size),
+                   output_size * sizeof(double));
+        }
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        PSInferenceRequest * req = batch[i];
+        if (PSFeedforward(network, req->input)) {
+            getOutputs(network, req);
+            status[i] = PS_REQUEST_DONE;
+        } else status[i] = PS_REQUEST_FAILED;
+    }
+}
+
+/* Replica on the node worker index gets pinned to, or the network */
+
+static PSNeuralNetwork * getWorkerNetwork(PSInferenceEngine * engine,
+                                          int index)
+{
+    PSReplicaSet * replicas = engine->replicas;
+    if (replicas == NULL) return engine->network;
+    /* Workers pin to index + 1, see inferenceLoop */
+    int node = PSGetThreadNode(index + 1);
+    if (node >= replicas->count || replicas->networks[node] == NULL)
+        return engine->network;
+    return replicas->networks[node];
+}
+
+static void notifyEvent(PSInferenceEngine * engine, int count) {
+    if (engine->event_fd < 0) return;
+    uint64_t value = (uint64_t) count;
+    /* A full counter still leaves the descriptor readable */
+    if (write(engine->event_fd, &value, sizeof(value)) < 0) return;
+}
+
+static void * inferenceLoop(void * arg) {
+    PSInferenceWorker * worker = (PSInferenceWorker *) arg;
+    PSInferenceEngine * engine = worker->engine;
+    PSNeuralNetwork * network = worker->view->network;
+    PSInferenceRequest * batch[engine->max_batch];
+    int status[engine->max_batch];
+    int count, i;
+    /* Room for a whole batch of inputs and outputs, unless recurrent */
+    double * values = NULL;
+    if (!(network->flags & FLAG_RECURRENT)) {
+        int size = network->layers[0]->size;
+        size += network->layers[network->size - 1]->size;
+        values = malloc((size_t) engine->max_batch * size * sizeof(double));
+    }
+    /* Workers run next to the caller, which keeps the global pool */
+    PSSerialThread = 1;
+    if (PSGlobalFlags & FLAG_THREAD_AFFINITY) PSPinThread(worker->index + 1);
+    while (1) {
+        pthread_mutex_lock(&(engine->lock));
+        while (engine->head == NULL && !engine->shutdown)
+            pthread_cond_wait(&(engine->work_cond), &(engine->lock));
+        if (engine->head == NULL) {
+            pthread_mutex_unlock(&(engine->lock));
+            break;
+        }
+        int share = (engine->queued + engine->size - 1) / engine->size;
+        if (share > engine->max_batch) share = engine->max_batch;
+        for (count = 0; count < share && engine->head != NULL; count++) {
+            batch[count] = engine->head;
+            engine->head = engine->head->next;
+        }
+        if (engine->head == NULL) engine->tail = NULL;
+        engine->queued -= count;
+        pthread_mutex_unlock(&(engine->lock));
+        /* Pick up biases changed by training since the last batch */
+        PSPullViewBiases(worker->view);
+        runBatch(network, batch, count, values, status);
+        PSMergeActivationDensity(engine->network, network);
+        for (i = 0; i < count; i++) {
+            PSInferenceRequest * req = batch[i];
+            int has_callback = (req->callback != NULL);
+            pthread_mutex_lock(&(engine->lock));
+            req->in_callback = has_callback;
+            __atomic_store_n(&(req->status), status[i], __ATOMIC_RELEASE);
+            if (status[i] == PS_REQUEST_FAILED) engine->failed++;
+            engine->completed++;
+            pthread_cond_broadcast(&(engine->done_cond));
+            pthread_mutex_unlock(&(engine->lock));
+            if (!has_callback) continue;
+            req->callback(req, status[i], req->userdata);
+            pthread_mutex_lock(&(engine->lock));
+            req->in_callback = 0;
+            pthread_cond_broadcast(&(engine->done_cond));
+            pthread_mutex_unlock(&(engine->lock));
+        }
+        pthread_mutex_lock(&(engine->lock));
+        engine->batches++;
+        pthread_mutex_unlock(&(engine->lock));
+        notifyEvent(engine, count);
+    }
+    free(values);
+    return NULL;
+}
+
+/* Start workers threads (0 meaning the current thread count) serving
+ * PSFeedforwardAsync on network. Each one owns a weights view, so the
+ * engine must be restarted after the network layout or memory policy
+ * changes. */
+
+int PSStartInference(PSNeuralNetwork * network, int workers, int max_batch) {
+    char * func = "PSStartInference";
+    if (network == NULL) return 0;
+    if (network->inference != NULL) {
+        PSErr(func, "Inference already started");
+        return 0;
+    }
+    if (network->size < 2) {
+        PSErr(func, "Empty network!");
+        return 0;
+    }
+    if (workers < 1) workers = PSGetThreadCount();
+    if (max_batch < 1) max_batch = PS_DEFAULT_INFERENCE_BATCH;
+    PSInferenceEngine * engine = calloc(1, sizeof(PSInferenceEngine));
+    if (engine == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    engine->network = network;
+    engine->max_batch = max_batch;
+    engine->event_fd = -1;
+    engine->workers = calloc(workers, sizeof(PSInferenceWorker));
+    if (engine->workers == NULL) {
+        printMemoryErrorMsg();
+        free(engine);
+        return 0;
+    }
+    pthread_mutex_init(&(engine->lock), NULL);
+    pthread_cond_init(&(engine->work_cond), NULL);
+    pthread_cond_init(&(engine->done_cond), NULL);
+#ifdef __linux__
+    engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (engine->event_fd < 0)
+        PSErr(func, "Could not create completion eventfd");
+#endif
+    network->inference = engine;
+    if (PSGlobalFlags & FLAG_THREAD_AFFINITY) {
+        engine->replicas = PSCreateReplicas(network);
+        if (engine->replicas == NULL)
+            PSErr(func, "Could not create replicas, sharing the network");
+    }
+    int i;
+    for (i = 0; i < workers; i++) {
+        PSInferenceWorker * worker = &(engine->workers[i]);
+        worker->engine = engine;
+        worker->index = i;
+        worker->view = PSCreateWeightsView(getWorkerNetwork(engine, i));
+        if (worker->view == NULL) {
+            PSErr(func, "Could not create worker %d", i);
+            break;
+        }
+        if (pthread_create(&(worker->thread), NULL, inferenceLoop, worker)) {
+            PSErr(func, "Could not create thread for worker %d!", i);
+            PSDeleteWeightsView(worker->view);
+            worker->view = NULL;
+            break;
+        }
+        engine->size++;
+    }
+    if (engine->size < workers) {
+        PSStopInference(network);
+        return 0;
+    }
+    return 1;
+}
+
+/* Run the requests still queued, then join the workers. No thread may be
+ * waiting on a request while the engine is stopped. */
+
+void PSStopInference(PSNeuralNetwork * network) {
+    if (network == NULL || network->inference == NULL) return;
+    PSInferenceEngine * engine = getEngine(network);
+    int i;
+    pthread_mutex_lock(&(engine->lock));
+    engine->shutdown = 1;
+    pthread_cond_broadcast(&(engine->work_cond));
+    pthread_mutex_unlock(&(engine->lock));
+    for (i = 0; i < engine->size; i++)
+        pthread_join(engine->workers[i].thread, NULL);
+    for (i = 0; i < engine->size; i++)
+        PSDeleteWeightsView(engine->workers[i].view);
+    PSDeleteReplicas(engine->replicas);
+    if (engine->event_fd >= 0) close(engine->event_fd);
+    pthread_mutex_destroy(&(engine->lock));
+    pthread_cond_destroy(&(engine->work_cond));
+    pthread_cond_destroy(&(engine->done_cond));
+    free(engine->workers);
+    free(engine);
+    network->inference = NULL;
+}
+
+/* Descriptor becoming readable (e.g. under epoll) whenever requests
+ * complete: reading it returns how many did since the last read. */
+
+int PSGetInferenceEventFD(PSNeuralNetwork * network) {
+    if (network == NULL || network->inference == NULL) return -1;
+    return getEngine(network)->event_fd;
+}
+
+/* Copy the network weights into the replicas its workers read, if any:
+ * training calls it after every update. */
+
+int PSSyncInferenceReplicas(PSNeuralNetwork * network) {
+    if (network == NULL || network->inference == NULL) return 1;
+    PSReplicaSet * replicas = getEngine(network)->replicas;
+    if (replicas == NULL) return 1;
+    return PSSyncReplicas(replicas);
+}
+
+/* Queue input for the network's workers, starting them with the default
+ * settings if needed, and return immediately. The input is copied, so it
+ * can be reused as soon as the call returns. */
+
+PSInferenceRequest * PSFeedforwardAsync(PSNeuralNetwork * network,
+                                        double * input,
+                                        PSInferenceCallback callback,
+                                        void * userdata)
+{
+    char * func = "PSFeedforwardAsync";
+    if (network == NULL || input == NULL) return NULL;
+    if (network->inference == NULL && !PSStartInference(network, 0, 0))
+        return NULL;
+    PSInferenceEngine * engine = getEngine(network);
+    int output_size = network->layers[network->size - 1]->size;
+    if (network->flags & FLAG_RECURRENT) {
+        int times = (int) input[0];
+        if (times <= 0) {
+            PSErr(func, "Recurrent times must be > 0 (found %d)", times);
+            return NULL;
+        }
+        output_size *= times;
+    }
+    PSInferenceRequest * req = calloc(1, sizeof(PSInferenceRequest));
+    if (req == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    req->engine = engine;
+    req->input_size = getInputSize(network, input);
+    req->output_size = output_size;
+    req->input = malloc(req->input_size * sizeof(double));
+    req->output = calloc(output_size, sizeof(double));
+    if (req->input == NULL || req->output == NULL) {
+        printMemoryErrorMsg();
+        free(req->input);
+        free(req->output);
+        free(req);
+        return NULL;
+    }
+    memcpy(req->input, input, req->input_size * sizeof(double));
+    req->status = PS_REQUEST_PENDING;
+    req->callback = callback;
+    req->userdata = userdata;
+    pthread_mutex_lock(&(engine->lock));
+    if (engine->tail != NULL) engine->tail->next = req;
+    else engine->head = req;
+    engine->tail = req;
+    engine->queued++;
+    engine->submitted++;
+    pthread_cond_signal(&(engine->work_cond));
+    pthread_mutex_unlock(&(engine->lock));
+    return req;
+}
+
+int PSPollRequest(PSInferenceRequest * request) {
+    if (request == NULL) return PS_REQUEST_FAILED;
+    return __atomic_load_n(&(request->status), __ATOMIC_ACQUIRE);
+}
+
+/* Block until request completes: returns 1 if it succeeded. */
+
+int PSWaitRequest(PSInferenceRequest * request) {
+    if (request == NULL) return 0;
+    int status = PSPollRequest(request);
+    if (status == PS_REQUEST_PENDING) {
+        PSInferenceEngine * engine = request->engine;
+        pthread_mutex_lock(&(engine->lock));
+        while ((status = request->status) == PS_REQUEST_PENDING)
+            pthread_cond_wait(&(engine->done_cond), &(engine->lock));
+        pthread_mutex_unlock(&(engine->lock));
+    }
+    return (status == PS_REQUEST_DONE);
+}
+
+/* Deleting a pending request waits for it (and its callback) first */
+
+void PSDeleteRequest(PSInferenceRequest * request) {
+    if (request == NULL) return;
+    PSWaitRequest(request);
+    PSInferenceEngine * engine = request->engine;
+    pthread_mutex_lock(&(engine->lock));
+    while (request->in_callback)
+        pthread_cond_wait(&(engine->done_cond), &(engine->lock));
+    pthread_mutex_unlock(&(engine->lock));
+    free(request->input);
+    free(request->output);
+    free(request);
+}
+
+void PSPrintInferenceStats(PSNeuralNetwork * network) {
+    if (network == NULL || network->inference == NULL) return;
+    PSInferenceEngine * engine = getEngine(network);
+    pthread_mutex_lock(&(engine->lock));
+    unsigned long completed = engine->completed, batches = engine->batches;
+    printf("Inference: %d workers, %lu requests completed (%lu failed) "
+           "in %lu batches (%.1f requests/batch)\n", engine->size, completed,
+           engine->failed, batches,
+           (batches ? completed / (double) batches : 0.0));
+    pthread_mutex_unlock(&(engine->lock));
+}
@@ -0,0 +1,104 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_INFERENCE_H
+#define __PS_INFERENCE_H
+
+#include <pthread.h>
+#include "psyc.h"
+#include "memory.h"
+#include "affinity.h"
+
+#define PS_DEFAULT_INFERENCE_BATCH  32
+
+#define PS_REQUEST_PENDING  0
+#define PS_REQUEST_DONE     1
+#define PS_REQUEST_FAILED   2
+
+struct PSInferenceRequest;
+struct PSInferenceEngine;
+
+/* Called on a worker thread right after the request status and output
+ * are published (waiters may already be running), before the completion
+ * event fires. PSDeleteRequest waits for it to return, so it must not
+ * delete the request itself. */
+typedef void (*PSInferenceCallback) (struct PSInferenceRequest * request,
+                                     int status, void * userdata);
+
+/* output holds the output layer activations (times * output_size of them
+ * for recurrent networks, one row per time step). */
+
+typedef struct PSInferenceRequest {
+    struct PSInferenceEngine * engine;
+    double * input;
+    int input_size;
+    double * output;
+    int output_size;
+    int status;
+    int in_callback;
+    PSInferenceCallback callback;
+    void * userdata;
+    struct PSInferenceRequest * next;
+} PSInferenceRequest;
+
+typedef struct {
+    struct PSInferenceEngine * engine;
+    int index;
+    PSWeightsView * view;
+    pthread_t thread;
+} PSInferenceWorker;
+
+/* Requests are queued in submission order: every worker wakes up, takes
+ * its share of the queue (at most max_batch requests) and runs them on its
+ * own view of the network, as one PSFeedforwardBatch unless recurrent.
+ * With FLAG_THREAD_AFFINITY, views share the weights of the replica on
+ * their worker's node, which training syncs after every update. */
+
+typedef struct PSInferenceEngine {
+    PSNeuralNetwork * network;
+    int size;
+    int max_batch;
+    PSInferenceWorker * workers;
+    PSReplicaSet * replicas;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    PSInferenceRequest * head;
+    PSInferenceRequest * tail;
+    int queued;
+    int shutdown;
+    int event_fd;
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long failed;
+    unsigned long batches;
+} PSInferenceEngine;
+
+int PSStartInference(PSNeuralNetwork * network, int workers, int max_batch);
+void PSStopInference(PSNeuralNetwork * network);
+int PSGetInferenceEventFD(PSNeuralNetwork * network);
+int PSSyncInferenceReplicas(PSNeuralNetwork * network);
+PSInferenceRequest * PSFeedforwardAsync(PSNeuralNetwork * network,
+                                        double * input,
+                                        PSInferenceCallback callback,
+                                        void * userdata);
+int PSPollRequest(PSInferenceRequest * request);
+int PSWaitRequest(PSInferenceRequest * request);
+void PSDeleteRequest(PSInferenceRequest * request);
+void PSPrintInferenceStats(PSNeuralNetwork * network);
+
+#endif //__PS_INFERENCE_H
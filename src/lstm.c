@@ -27,7 +27,10 @@
 #endif
 
 #include "lstm.h"
+#include "recurrent.h"
 #include "utils.h"
+#include "memory.h"
+#include "threadpool.h"
 
 #define CANDIDATE_IDX   0
 #define INPUT_IDX       1
@@ -35,144 +38,71 @@
 #define FORGET_IDX      3
 
 #define FreeLSTMDeltas() do {\
-    if (delta_c != NULL) free(delta_c);\
-    if (delta_i != NULL) free(delta_i);\
-    if (delta_o != NULL) free(delta_o);\
-    if (delta_f != NULL) free(delta_f);\
+    if (delta_gates != NULL) free(delta_gates);\
     if (lstm_delta != NULL) free(lstm_delta);\
 } while(0)
 
-static int LSTMCellFeedforward(PSLayer * layer, PSLayer * previous,
-                               PSNeuron * neuron, int onehot_idx,
-                               int times, int t)
+/* Add to gates the products of x with the four gate rows of cell, which
+ * are stored one after the other in neuron->weights (weights_size apart),
+ * starting from column offset. */
+
+static void addGateProducts(PSLSTMCell * cell, int offset, double * x, int n,
+                            double * gates)
 {
-    PSLSTMCell * cell = GetLSTMCell(neuron);
-    if (cell == NULL) {
-        PSErr(NULL, "Layer[%d]: neuron[%d] cell is NULL!",
-              layer->index, neuron->index);
-        return 0;
-    }
-    int wsize = cell->weights_size;
-    int prev_size = wsize - layer->size;
-    
-    double candidate = 0.0;
-    double input_gate = 0.0;
-    double output_gate = 0.0;
-    double forget_gate = 0.0;
-    
-    double last_z = 0.0;
-    
-    if (onehot_idx >= 0) {
-        candidate = cell->candidate_weights[onehot_idx];
-        input_gate = cell->input_weights[onehot_idx];
-        output_gate = cell->output_weights[onehot_idx];
-        forget_gate = cell->forget_weights[onehot_idx];
-    } else {
-        int i = 0;
+    double * rows = cell->candidate_weights + offset;
+    int stride = cell->weights_size;
 #ifdef USE_AVX
-        int j = 0, o = 0, f = 0;
-        AVXDotProduct(previous->size, previous->avx_activation_cache,
-                      cell->candidate_weights, candidate, i, 1, t);
-        AVXDotProduct(previous->size, previous->avx_activation_cache,
-                      cell->input_weights, input_gate, j, 1, t);
-        AVXDotProduct(previous->size, previous->avx_activation_cache,
-                      cell->output_weights, output_gate, o, 1, t);
-        AVXDotProduct(previous->size, previous->avx_activation_cache,
-                      cell->forget_weights, forget_gate, f, 1, t);
-#endif
-        for (; i < previous->size; i++) {
-            PSNeuron * prev_neuron = previous->neurons[i];
-            if (prev_neuron == NULL) return 0;
-            double a = prev_neuron->activation;
-            candidate += (a * cell->candidate_weights[i]);
-            input_gate += (a * cell->input_weights[i]);
-            output_gate += (a * cell->output_weights[i]);
-            forget_gate += (a * cell->forget_weights[i]);
-        }
+    avx_dot_product_rows4(x, rows, stride, n, gates);
+#else
+    int i;
+    for (i = 0; i < n; i++) {
+        double xi = x[i];
+        gates[CANDIDATE_IDX] += rows[i] * xi;
+        gates[INPUT_IDX] += rows[stride + i] * xi;
+        gates[OUTPUT_IDX] += rows[(2 * stride) + i] * xi;
+        gates[FORGET_IDX] += rows[(3 * stride) + i] * xi;
     }
-    
-    if (t > 0) {
-        int last_t = t - 1;
-        last_z = cell->z_values[last_t];
-        int i = 0;
-#ifdef USE_AVX
-        int j = 0, o = 0, f = 0;
-        AVXDotProduct(layer->size, layer->avx_activation_cache,
-                      cell->candidate_weights + prev_size,
-                      candidate, i, 1, last_t);
-        AVXDotProduct(layer->size, layer->avx_activation_cache,
-                      cell->input_weights + prev_size,
-                      input_gate, j, 1, last_t);
-        AVXDotProduct(layer->size, layer->avx_activation_cache,
-                      cell->output_weights + prev_size,
-                      output_gate, o, 1, last_t);
-        AVXDotProduct(layer->size, layer->avx_activation_cache,
-                      cell->forget_weights + prev_size,
-                      forget_gate, f, 1, last_t);
 #endif
-        for (; i < layer->size; i++) {
-            int w = i + prev_size;
-            PSNeuron * n = layer->neurons[i];
-            PSLSTMCell * c = GetLSTMCell(n);
-            if (c == NULL) return 0;
-            double last_state = c->states[last_t];
-            candidate += (cell->candidate_weights[w] * last_state);
-            input_gate += (cell->input_weights[w] * last_state);
-            output_gate += (cell->output_weights[w] * last_state);
-            forget_gate += (cell->forget_weights[w] * last_state);
-        }
-    } else {
-        if (cell->states != NULL) free(cell->states);
-        if (cell->z_values != NULL) free(cell->z_values);
-        if (cell->candidates != NULL) free(cell->candidates);
-        if (cell->input_gates != NULL) free(cell->input_gates);
-        if (cell->output_gates != NULL) free(cell->output_gates);
-        if (cell->forget_gates != NULL) free(cell->forget_gates);
-        cell->states_count = times;
-        cell->states = calloc(times, sizeof(double));
-        cell->z_values = calloc(times, sizeof(double));
-        cell->candidates = calloc(times, sizeof(double));
-        cell->input_gates = calloc(times, sizeof(double));
-        cell->output_gates = calloc(times, sizeof(double));
-        cell->forget_gates = calloc(times, sizeof(double));
-        if (cell->states == NULL) return 0;
-        if (cell->z_values == NULL) return 0;
-        if (cell->candidates == NULL) return 0;
-        if (cell->input_gates == NULL) return 0;
-        if (cell->output_gates == NULL) return 0;
-        if (cell->forget_gates == NULL) return 0;
-#ifdef USE_AVX
-        if (neuron->index == 0) {
-            if (layer->avx_activation_cache != NULL)
-                free(layer->avx_activation_cache);
-            layer->avx_activation_cache = calloc(times * layer->size,
-                                                 sizeof(double));
-            if (layer->avx_activation_cache == NULL) {
-                printMemoryErrorMsg();
-                return 0;
-            }
-        }
-#endif
-    }
-    candidate = tanh(candidate + cell->candidate_bias);
-    input_gate = sigmoid(input_gate + cell->input_bias);
-    output_gate = sigmoid(output_gate + cell->output_bias);
-    forget_gate = sigmoid(forget_gate + cell->forget_bias);
+}
+
+/* Cell values for gate products gates, in PSReserveLayerStates order:
+ * state, z-value, candidate, input, output and forget gate. */
+
+static void LSTMGateValues(PSLayer * layer, PSLSTMCell * cell, double * gates,
+                           double last_z, double * values)
+{
+    double candidate = tanh(gates[CANDIDATE_IDX] + cell->candidate_bias);
+    double input_gate = sigmoid(gates[INPUT_IDX] + cell->input_bias);
+    double output_gate = sigmoid(gates[OUTPUT_IDX] + cell->output_bias);
+    double forget_gate = sigmoid(gates[FORGET_IDX] + cell->forget_bias);
+    double z = candidate * input_gate + last_z * forget_gate;
+    double activation = z;
+    if (layer->activate != NULL) activation = layer->activate(activation);
+    values[0] = output_gate * activation;
+    values[1] = z;
+    values[2] = candidate;
+    values[3] = input_gate;
+    values[4] = output_gate;
+    values[5] = forget_gate;
+}
+
+static void LSTMCellUpdate(PSLayer * layer, PSNeuron * neuron, double * gates,
+                           int t)
+{
+    PSLSTMCell * cell = GetLSTMCell(neuron);
+    double last_z = (t > 0 ? cell->z_values[t - 1] : 0.0);
+    double values[LSTM_STATE_ARRAYS];
+    LSTMGateValues(layer, cell, gates, last_z, values);
     
-    cell->candidates[t] = candidate;
-    cell->input_gates[t] = input_gate;
-    cell->output_gates[t] = output_gate;
-    cell->forget_gates[t] = forget_gate;
+    cell->candidates[t] = values[2];
+    cell->input_gates[t] = values[3];
+    cell->output_gates[t] = values[4];
+    cell->forget_gates[t] = values[5];
     
-    neuron->z_value = candidate * input_gate + last_z * forget_gate;
+    neuron->z_value = values[1];
     cell->z_values[t] = neuron->z_value;
-    
-    double activation = neuron->z_value;
-    if (layer->activate != NULL) activation = layer->activate(activation);
-    activation = output_gate * activation;
-    neuron->activation = activation;
-    cell->states[t] = activation;
-    return 1;
+    neuron->activation = values[0];
+    cell->states[t] = values[0];
 }
 
 PSLSTMCell * PSCreateLSTMCell(PSNeuron * neuron, int weight_size) {
@@ -202,13 +132,9 @@ PSLSTMCell * PSCreateLSTMCell(PSNeuron * neuron, int weight_size) {
     return cell;
 }
 
+/* Per-timestep buffers belong to the layer (see PSReserveLayerStates) */
+
 void PSDeleteLSTMCell(PSLSTMCell * cell) {
-    if (cell->candidates != NULL) free(cell->candidates);
-    if (cell->input_gates != NULL) free(cell->input_gates);
-    if (cell->output_gates != NULL) free(cell->output_gates);
-    if (cell->forget_gates != NULL) free(cell->forget_gates);
-    if (cell->z_values != NULL) free(cell->z_values);
-    if (cell->states != NULL) free(cell->states);
     free(cell);
 }
 
@@ -245,7 +171,7 @@ int PSInitLSTMLayer(PSNeuralNetwork * network, PSLayer * layer,
         neuron->index = i;
         neuron->weights_size = tot_ws;
         neuron->bias = gaussian_random(0, 1);
-        neuron->weights = malloc(sizeof(double) * tot_ws);
+        neuron->weights = PSAlignedAlloc(tot_ws);
         if (neuron->weights ==  NULL) {
             PSAbortLayer(network, layer);
             PSErr(func, "Could not allocate neuron weights!");
@@ -274,6 +200,47 @@ int PSInitLSTMLayer(PSNeuralNetwork * network, PSLayer * layer,
 
 /* Feedforward Functions */
 
+/* All gates of the layer are computed at once, as the product of the
+ * stacked [4 * size x (previous size + size)] gate weights with
+ * x = [input at t | layer states at t - 1], which is gathered once per
+ * step. Onehot inputs just pick a column of the input weights instead. */
+
+typedef struct {
+    PSLayer * layer;
+    double * x;
+    double * gates;
+    int onehot_idx;
+    int t;
+} PSLSTMFeedforwardTask;
+
+static void LSTMFeedforwardNeurons(void * data, int start, int end) {
+    PSLSTMFeedforwardTask * task = (PSLSTMFeedforwardTask *) data;
+    PSLayer * layer = task->layer;
+    int i, k, t = task->t, onehot_idx = task->onehot_idx;
+    for (i = start; i < end; i++) {
+        PSLSTMCell * cell = GetLSTMCell(layer->neurons[i]);
+        int wsize = cell->weights_size, prev_size = wsize - layer->size;
+        double * gates = task->gates + (4 * i);
+        for (k = 0; k < 4; k++) gates[k] = 0.0;
+        if (onehot_idx >= 0) {
+            for (k = 0; k < 4; k++)
+                gates[k] = cell->candidate_weights[(k * wsize) + onehot_idx];
+            if (t > 0)
+                addGateProducts(cell, prev_size, task->x + prev_size,
+                                layer->size, gates);
+        } else addGateProducts(cell, 0, task->x, (t > 0 ? wsize : prev_size),
+                               gates);
+    }
+    for (i = start; i < end; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        LSTMCellUpdate(layer, neuron, task->gates + (4 * i), t);
+#ifdef USE_AVX
+        layer->avx_activation_cache[(t * layer->size) + i] =
+            neuron->activation;
+#endif
+    }
+}
+
 int PSLSTMFeedforward(void * _net, void * _layer, ...) {
     PSNeuralNetwork * net = (PSNeuralNetwork*) _net;
     PSLayer * layer = (PSLayer*) _layer;
@@ -319,26 +286,142 @@ int PSLSTMFeedforward(void * _net, void * _layer, ...) {
         }
         vector_size = (int) (params->parameters[0]);
         PSNeuron * prev_neuron = previous->neurons[0];
-        vector_idx = (int) (prev_neuron->activation);
+        vector_idx = (int) GetRecurrentState(prev_neuron, t);
         if (vector_size == 0 && vector_idx >= vector_size) {
             PSErr(NULL, "Layer[%d]: invalid vector index %d (max. %d)!",
                   previous->index, vector_idx, vector_size - 1);
             return 0;
         }
     }
-    int i = 0;
-    for (; i < size; i++) {
-        PSNeuron * neuron = layer->neurons[i];
-        int ok = LSTMCellFeedforward(layer, previous, neuron,
-                                     vector_idx, times, t);
-        if (!ok) {
-            //TODO: handle
-            return 0;
+    if (t == 0 && !PSReserveLayerStates(layer, times)) return 0;
+    int i, wsize = GetLSTMCell(layer->neurons[0])->weights_size;
+    int prev_size = wsize - size;
+    double x[wsize], gates[4 * size];
+    if (!onehot) {
+        for (i = 0; i < prev_size; i++)
+            x[i] = GetRecurrentState(previous->neurons[i], t);
+    }
+    if (t > 0) {
+        for (i = 0; i < size; i++)
+            x[prev_size + i] = GetRecurrentState(layer->neurons[i], t - 1);
+    }
+    PSLSTMFeedforwardTask task = {layer, x, gates, vector_idx, t};
+    int work = size * layer->neurons[0]->weights_size;
+    if (PSShouldRunParallel(work))
+        PSParallelFor(PSGlobalThreadPool, size, LSTMFeedforwardNeurons, &task);
+    else
+        LSTMFeedforwardNeurons(&task, 0, size);
+    return 1;
+}
+
+/* Batched feedforward and backprop (see PSSequenceBatch), mirroring the
+ * ones above for every lane of a step: x then holds [lanes x weights_size]
+ * gathered inputs, and the gate products of all the lanes are one matrix
+ * product (PSMatrixProduct) of their rows (rows) by the gate weights rows
+ * (w, four per neuron), into gates [lanes x 4 * size]. */
+
+typedef struct {
+    PSLayer * layer;
+    PSLayer * previous;
+    PSSequenceBatch * batch;
+    double * x;
+    double * delta;
+    double * carry;
+    double * delta_gates;
+    PSGradient * lgradients;
+    double ** rows;
+    double ** w;
+    double * gates;
+    int n;
+    int lanes;
+    int t;
+} PSLSTMBatchTask;
+
+static void LSTMBatchFeedforwardNeurons(void * data, int start, int end) {
+    PSLSTMBatchTask * task = (PSLSTMBatchTask *) data;
+    PSLayer * layer = task->layer, * previous = task->previous;
+    PSSequenceBatch * batch = task->batch;
+    int size = layer->size, gsize = 4 * size, t = task->t, i, b, k;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    if (task->n > 0) {
+        PSMatrixProduct(task->rows, task->lanes, task->w + (start * 4),
+                        (end - start) * 4, task->n,
+                        task->gates + (start * 4), gsize);
+    }
+    for (i = start; i < end; i++) {
+        PSLSTMCell * cell = GetLSTMCell(layer->neurons[i]);
+        int wsize = cell->weights_size;
+        for (b = 0; b < task->lanes; b++) {
+            double gates[4] = {0.0, 0.0, 0.0, 0.0};
+            double values[LSTM_STATE_ARRAYS];
+            if (task->n > 0) {
+                for (k = 0; k < 4; k++)
+                    gates[k] = task->gates[(b * gsize) + (i * 4) + k];
+            }
+            if (onehot) {
+                int idx = (int) GetBatchValues(batch, previous, t, b)[0];
+                for (k = 0; k < 4; k++)
+                    gates[k] += cell->candidate_weights[(k * wsize) + idx];
+            }
+            double last_z = 0.0;
+            if (t > 0) last_z = GetBatchArray(batch, layer, 1, t - 1, b)[i];
+            LSTMGateValues(layer, cell, gates, last_z, values);
+            for (k = 0; k < LSTM_STATE_ARRAYS; k++)
+                GetBatchArray(batch, layer, k, t, b)[i] = values[k];
         }
-#ifdef USE_AVX
-        layer->avx_activation_cache[(t * size) + i] = neuron->activation;
-#endif
     }
+}
+
+int PSLSTMBatchFeedforward(PSLayer * layer, PSLayer * previous,
+                           PSSequenceBatch * batch, int t)
+{
+    int size = layer->size, lanes = batch->active[t], b, i, k;
+    int wsize = GetLSTMCell(layer->neurons[0])->weights_size;
+    int prev_size = wsize - size;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    /* Onehot inputs just pick a weight: only the last outputs multiply */
+    int offset = (onehot ? prev_size : 0), n;
+    if (onehot) n = (t > 0 ? size : 0);
+    else n = (t > 0 ? wsize : prev_size);
+    double * x = malloc(lanes * wsize * sizeof(double));
+    double * gates = malloc(lanes * 4 * size * sizeof(double));
+    double ** rows = malloc(lanes * sizeof(double*));
+    double ** w = malloc(4 * size * sizeof(double*));
+    if (x == NULL || gates == NULL || rows == NULL || w == NULL) {
+        printMemoryErrorMsg();
+        free(x);
+        free(gates);
+        free(rows);
+        free(w);
+        return 0;
+    }
+    for (b = 0; b < lanes; b++) {
+        double * lane_x = x + (b * wsize);
+        if (!onehot)
+            memcpy(lane_x, GetBatchValues(batch, previous, t, b),
+                   prev_size * sizeof(double));
+        if (t > 0)
+            memcpy(lane_x + prev_size, GetBatchValues(batch, layer, t - 1, b),
+                   size * sizeof(double));
+        rows[b] = lane_x + offset;
+    }
+    for (i = 0; i < size; i++) {
+        PSLSTMCell * cell = GetLSTMCell(layer->neurons[i]);
+        for (k = 0; k < 4; k++)
+            w[(i * 4) + k] = cell->candidate_weights + (k * wsize) + offset;
+    }
+    PSLSTMBatchTask task = {layer, previous, batch, x, NULL, NULL, NULL,
+                            NULL, rows, w, gates, n, lanes, t};
+    int work = lanes * size * layer->neurons[0]->weights_size;
+    if (PSShouldRunParallel(work))
+        PSParallelFor(PSGlobalThreadPool, size, LSTMBatchFeedforwardNeurons,
+                      &task);
+    else
+        LSTMBatchFeedforwardNeurons(&task, 0, size);
+    free(x);
+    free(gates);
+    free(rows);
+    free(w);
     return 1;
 }
 
@@ -364,21 +447,23 @@ double * PSLSTMBackprop(PSLayer * layer,
         assert(previous_size > 0);
     }
     //double * delta = malloc(sizeof(double) * lsize);
-    double * delta_c = calloc(sizeof(double), lsize);
-    double * delta_i = calloc(sizeof(double), lsize);
-    double * delta_o = calloc(sizeof(double), lsize);
-    double * delta_f = calloc(sizeof(double), lsize);
+    /* Gate deltas are contiguous, in the same order as the rows of the
+     * transposed recurrent weights */
+    double * delta_gates = calloc(sizeof(double), 4 * lsize);
     // lstm_delta has room for: LSTM additional delta for prev. layer,
     //                          LSTM additional delta for itself,
     //                          Delta z
     double * lstm_delta = calloc(sizeof(double),
                                  previous_size + (2 * lsize));
-    if (lstm_delta == NULL || delta_c == NULL || delta_i == NULL ||
-        delta_o == NULL || delta_f == NULL) {
+    if (lstm_delta == NULL || delta_gates == NULL) {
         printMemoryErrorMsg();
         FreeLSTMDeltas();
         return NULL;
     }
+    double * delta_c = delta_gates;
+    double * delta_i = delta_gates + (lsize * INPUT_IDX);
+    double * delta_o = delta_gates + (lsize * OUTPUT_IDX);
+    double * delta_f = delta_gates + (lsize * FORGET_IDX);
     double * delta = lstm_delta + previous_size;
     double * delta_z = delta + lsize;
     double * last_delta_z = NULL;
@@ -498,54 +583,149 @@ double * PSLSTMBackprop(PSLayer * layer,
         
     }
     
-    if (t > 0) {
-        if (layer->index > 1) {
-            for (i = 0; i < previous_size; i++) {
-                for (w = 0; w < lsize; w++) {
-                    PSNeuron * rn = layer->neurons[w];
-                    PSLSTMCell * rc = GetLSTMCell(rn);
-                    double cw = rc->candidate_weights[i];
-                    double iw = rc->input_weights[i];
-                    double ow = rc->output_weights[i];
-                    double fw = rc->forget_weights[i];
-                    delta[i] += delta_c[rn->index] * cw;
-                    delta[i] += delta_i[rn->index] * iw;
-                    delta[i] += delta_o[rn->index] * ow;
-                    delta[i] += delta_f[rn->index] * fw;
-                }
-                /*if (layer->derivative != NULL)
-                 delta[i] *= layer->derivative(prev_a); //?
-                 */
-            }
-        }
-        for (i = 0; i < lsize; i++) {
-            PSNeuron * neuron = layer->neurons[i];
-            PSLSTMCell * cell = GetLSTMCell(neuron);
-            int cwsize = cell->weights_size;
-            int wsize = cwsize - layer->size;
-            //double prev_a = cell->states[last_t];
+    if (layer->index > 1) {
+        // Delta for the previous layer, at the start of lstm_delta
+        for (i = 0; i < previous_size; i++) {
             for (w = 0; w < lsize; w++) {
                 PSNeuron * rn = layer->neurons[w];
                 PSLSTMCell * rc = GetLSTMCell(rn);
-                int widx = neuron->index + wsize;
-                double cw = rc->candidate_weights[widx];
-                double iw = rc->input_weights[widx];
-                double ow = rc->output_weights[widx];
-                double fw = rc->forget_weights[widx];
-                delta[neuron->index] += delta_c[rn->index] * cw;
-                delta[neuron->index] += delta_i[rn->index] * iw;
-                delta[neuron->index] += delta_o[rn->index] * ow;
-                delta[neuron->index] += delta_f[rn->index] * fw;
+                double cw = rc->candidate_weights[i];
+                double iw = rc->input_weights[i];
+                double ow = rc->output_weights[i];
+                double fw = rc->forget_weights[i];
+                lstm_delta[i] += delta_c[rn->index] * cw;
+                lstm_delta[i] += delta_i[rn->index] * iw;
+                lstm_delta[i] += delta_o[rn->index] * ow;
+                lstm_delta[i] += delta_f[rn->index] * fw;
             }
+        }
+    }
+    if (t > 0) {
+        int gsize = 4 * lsize;
+        for (i = 0; i < lsize; i++) {
+            double * rweights = layer->recurrent_weights_t + (i * gsize);
+            double sum = 0.0;
+            w = 0;
+#ifdef USE_AVX
+            AVXDotProduct(gsize, rweights, delta_gates, sum, w, 0, 0);
+#endif
+            for (; w < gsize; w++) sum += (delta_gates[w] * rweights[w]);
+            delta[i] += sum;
             /*if (layer->derivative != NULL)
-                delta[neuron->index] *= layer->derivative(prev_a); //?
+                delta[i] *= layer->derivative(cell->states[last_t]); //?
              */
         }
     }
     
-    free(delta_c);
-    free(delta_i);
-    free(delta_o);
-    free(delta_f);
+    free(delta_gates);
     return lstm_delta;
 }
+
+/* Batched PSLSTMBackprop: delta holds the [lanes x size] deltas from the
+ * layer above of the lanes still running at t, carry the [lanes x 2 size]
+ * deltas each lane hands back to itself (the one for its previous state
+ * and delta z), which are read and replaced. Lanes that are not running
+ * yet must have a zeroed carry. */
+
+static void LSTMBatchGateDeltas(void * data, int start, int end) {
+    PSLSTMBatchTask * task = (PSLSTMBatchTask *) data;
+    PSLayer * layer = task->layer, * previous = task->previous;
+    PSSequenceBatch * batch = task->batch;
+    int size = layer->size, t = task->t, i, b, k;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    for (i = start; i < end; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        PSLSTMCell * cell = GetLSTMCell(neuron);
+        PSGradient * gradient = &(task->lgradients[i]);
+        double * gradient_biases = GetLSTMGradientBiases(neuron, gradient);
+        int cwsize = cell->weights_size, wsize = cwsize - size;
+        for (b = 0; b < task->lanes; b++) {
+            double * carry = task->carry + (b * 2 * size);
+            double dv = task->delta[(b * size) + i] + carry[i];
+            double z = GetBatchArray(batch, layer, 1, t, b)[i];
+            double last_z = 0.0;
+            if (t > 0) last_z = GetBatchArray(batch, layer, 1, t - 1, b)[i];
+            double c = GetBatchArray(batch, layer, 2, t, b)[i];
+            double ig = GetBatchArray(batch, layer, 3, t, b)[i];
+            double og = GetBatchArray(batch, layer, 4, t, b)[i];
+            double fg = GetBatchArray(batch, layer, 5, t, b)[i];
+            double z_multiplier = 1, zz = z;
+            if (layer->activate != NULL) {
+                z_multiplier = layer->activate(z);
+                zz = z_multiplier;
+                z_multiplier = layer->derivative(z_multiplier);
+            }
+            double dz = og * dv * z_multiplier + carry[size + i];
+            double d[4];
+            d[OUTPUT_IDX] = zz * dv * (og * (1 - og));
+            d[INPUT_IDX] = c * dz * (ig * (1 - ig));
+            d[FORGET_IDX] = last_z * dz * (fg * (1 - fg));
+            d[CANDIDATE_IDX] = ig * dz * tanh_derivative(c);
+            carry[size + i] = dz * fg;
+            double * delta_gates = task->delta_gates + (b * 4 * size);
+            double * x = GetBatchValues(batch, previous, t, b);
+            for (k = 0; k < 4; k++) {
+                double * weights = gradient->weights + (k * cwsize);
+                delta_gates[(k * size) + i] = d[k];
+                gradient_biases[k] += d[k];
+                if (onehot) weights[(int) x[0]] += d[k];
+                else PSAddScaled(weights, x, d[k], wsize);
+                if (t > 0)
+                    PSAddScaled(weights + wsize,
+                                GetBatchValues(batch, layer, t - 1, b), d[k],
+                                size);
+            }
+        }
+    }
+}
+
+/* Carried deltas: the product of the gate deltas by the rows of the
+ * transposed recurrent weights (task->w). */
+
+static void LSTMBatchCarryDeltas(void * data, int start, int end) {
+    PSLSTMBatchTask * task = (PSLSTMBatchTask *) data;
+    int size = task->layer->size, i, b;
+    if (task->t > 0) {
+        PSMatrixProduct(task->rows, task->lanes, task->w + start,
+                        end - start, 4 * size, task->carry + start, 2 * size);
+        return;
+    }
+    for (b = 0; b < task->lanes; b++) {
+        for (i = start; i < end; i++) task->carry[(b * 2 * size) + i] = 0.0;
+    }
+}
+
+int PSLSTMBatchBackprop(PSLayer * layer, PSLayer * previous,
+                        PSSequenceBatch * batch, double * delta,
+                        double * carry, PSGradient * lgradients, int t)
+{
+    int size = layer->size, lanes = batch->active[t], gsize = 4 * size, i;
+    double * delta_gates = malloc(lanes * gsize * sizeof(double));
+    double ** rows = malloc(lanes * sizeof(double*));
+    double ** w = malloc(size * sizeof(double*));
+    if (delta_gates == NULL || rows == NULL || w == NULL) {
+        printMemoryErrorMsg();
+        free(delta_gates);
+        free(rows);
+        free(w);
+        return 0;
+    }
+    for (i = 0; i < lanes; i++) rows[i] = delta_gates + (i * gsize);
+    for (i = 0; i < size; i++)
+        w[i] = layer->recurrent_weights_t + (i * gsize);
+    PSLSTMBatchTask task = {layer, previous, batch, NULL, delta, carry,
+                            delta_gates, lgradients, rows, w, NULL, gsize,
+                            lanes, t};
+    int work = lanes * size * layer->neurons[0]->weights_size;
+    if (PSShouldRunParallel(work)) {
+        PSParallelFor(PSGlobalThreadPool, size, LSTMBatchGateDeltas, &task);
+        PSParallelFor(PSGlobalThreadPool, size, LSTMBatchCarryDeltas, &task);
+    } else {
+        LSTMBatchGateDeltas(&task, 0, size);
+        LSTMBatchCarryDeltas(&task, 0, size);
+    }
+    free(delta_gates);
+    free(rows);
+    free(w);
+    return 1;
+}
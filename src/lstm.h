@@ -19,8 +19,11 @@
 #define __PS_LSTM_H
 
 #include "psyc.h"
+#include "recurrent.h"
 
 #define GetLSTMCell(neuron) ((PSLSTMCell*) neuron->extra)
+/* states, z_values, candidates and input, output and forget gates */
+#define LSTM_STATE_ARRAYS   6
 #define GetLSTMGradientBiases(n, gradient) (gradient->weights + n->weights_size)
 
 typedef struct {
@@ -54,6 +57,8 @@ int PSInitLSTMLayer(PSNeuralNetwork * network, PSLayer * layer,
 /* Feedforward Functions */
 
 int PSLSTMFeedforward(void * _net, void * _layer, ...);
+int PSLSTMBatchFeedforward(PSLayer * layer, PSLayer * previous,
+                           PSSequenceBatch * batch, int t);
 
 /* Backpropagation Functions */
 
@@ -63,6 +68,8 @@ double * PSLSTMBackprop(PSLayer * layer,
                         double * last_lstm_delta,
                         PSGradient * lgradients,
                         int t);
-
+int PSLSTMBatchBackprop(PSLayer * layer, PSLayer * previous,
+                        PSSequenceBatch * batch, double * delta,
+                        double * carry, PSGradient * lgradients, int t);
 
 #endif // __PS_LSTM_H
@@ -0,0 +1,425 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "memory.h"
+#include "convolutional.h"
+#include "recurrent.h"
+#include "lstm.h"
+#include "gru.h"
+#include "embedding.h"
+#include "utils.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+static size_t roundUp(size_t size, size_t unit) {
+    return ((size + unit - 1) / unit) * unit;
+}
+
+static void * mapHugePages(size_t size) {
+    void * addr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    /* Explicit huge pages only succeed if the admin reserved some
+     * (vm.nr_hugepages), so failure here is expected and not an error. */
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) return addr;
+#endif
+#ifdef MADV_HUGEPAGE
+    /* Transparent huge pages: over-map so that the returned range starts
+     * on a huge page boundary, then give the excess back. */
+    size_t mapped = size + PS_HUGE_PAGE_SIZE;
+    char * base = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return MAP_FAILED;
+    char * start = (char *) roundUp((size_t) (uintptr_t) base,
+                                    PS_HUGE_PAGE_SIZE);
+    size_t head = start - base;
+    size_t tail = mapped - head - size;
+    if (head) munmap(base, head);
+    if (tail) munmap(start + size, tail);
+    if (madvise(start, size, MADV_HUGEPAGE) != 0)
+        PSErr("PSCreateMemoryBlock", "Transparent huge pages not available");
+    addr = start;
+#endif
+    return addr;
+}
+
+PSMemoryBlock * PSCreateMemoryBlock(size_t size, int flags) {
+    char * func = "PSCreateMemoryBlock";
+    PSMemoryBlock * block = malloc(sizeof(PSMemoryBlock));
+    if (block == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    void * addr = MAP_FAILED;
+    if (flags & MEMORY_HUGE_PAGES) {
+        size = roundUp(size, PS_HUGE_PAGE_SIZE);
+        addr = mapHugePages(size);
+    }
+    if (addr == MAP_FAILED) {
+        size = roundUp(size, page_size);
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (addr == MAP_FAILED) {
+        PSErr(func, "Could not map %lu bytes!", (unsigned long) size);
+        free(block);
+        return NULL;
+    }
+    block->addr = addr;
+    block->size = size;
+    block->used = 0;
+    block->flags = flags;
+    if ((flags & MEMORY_LOCK) && mlock(addr, size) != 0) {
+        PSErr(func, "Could not lock %lu bytes (check RLIMIT_MEMLOCK)",
+              (unsigned long) size);
+        block->flags &= ~MEMORY_LOCK;
+    }
+    if (flags & MEMORY_PREFAULT) {
+        volatile char * p = (volatile char *) addr;
+        size_t offset;
+        for (offset = 0; offset < size; offset += page_size) p[offset] = 0;
+    }
+    return block;
+}
+
+double * PSMemoryBlockAlloc(PSMemoryBlock * block, int count) {
+    size_t size = PSPaddedSize(count) * sizeof(double);
+    if (size == 0) size = PS_PADDING_SIZE * sizeof(double);
+    if (block->used + size > block->size) return NULL;
+    double * ptr = (double *) ((char *) block->addr + block->used);
+    block->used += size;
+    return ptr;
+}
+
+int PSMemoryBlockContains(PSMemoryBlock * block, void * ptr) {
+    if (block == NULL || ptr == NULL) return 0;
+    char * start = (char *) block->addr;
+    return ((char *) ptr >= start && (char *) ptr < start + block->size);
+}
+
+void PSDeleteMemoryBlock(PSMemoryBlock * block) {
+    if (block == NULL) return;
+    if (block->flags & MEMORY_LOCK) munlock(block->addr, block->size);
+    munmap(block->addr, block->size);
+    free(block);
+}
+
+void PSFreeNetworkMemory(PSNeuralNetwork * network, double * ptr) {
+    if (ptr == NULL) return;
+    if (network != NULL &&
+        PSMemoryBlockContains(getNetworkMemory(network), ptr)) return;
+    PSAlignedFree(ptr);
+}
+
+static size_t getNetworkMemorySize(PSNeuralNetwork * network) {
+    size_t count = 0;
+    int i, j;
+#ifdef USE_AVX
+    int is_recurrent = (network->flags & FLAG_RECURRENT);
+#endif
+    for (i = 0; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+#ifdef USE_AVX
+        if (!is_recurrent && layer->avx_activation_cache != NULL)
+            count += PSPaddedSize(layer->size);
+#endif
+        if (layer->type == Convolutional) {
+            PSSharedParams * shared = getConvSharedParams(layer);
+            if (shared == NULL) continue;
+            count += shared->feature_count *
+                     PSPaddedSize(shared->weights_size);
+        } else if (layer->type == Embedding) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            count += PSPaddedSize(table->rows * table->size);
+        } else if (layer->type != Pooling) {
+            for (j = 0; j < layer->size; j++) {
+                PSNeuron * neuron = layer->neurons[j];
+                if (neuron->weights == NULL) continue;
+                count += PSPaddedSize(neuron->weights_size);
+            }
+        }
+    }
+    return count * sizeof(double);
+}
+
+static double * moveRow(PSNeuralNetwork * network, PSMemoryBlock * block,
+                        double * row, int count)
+{
+    double * dest = PSMemoryBlockAlloc(block, count);
+    if (dest == NULL) return NULL;
+    memcpy(dest, row, PSPaddedSize(count) * sizeof(double));
+    PSFreeNetworkMemory(network, row);
+    return dest;
+}
+
+/* Point the neuron (and its LSTM, GRU or recurrent cell) at a new weights row
+ * with the same layout as the current one. */
+
+static void setNeuronWeights(PSLayer * layer, PSNeuron * neuron,
+                             double * weights)
+{
+    double * old = neuron->weights;
+    neuron->weights = weights;
+    if (neuron->extra == NULL || old == NULL) return;
+    if (layer->type == LSTM) {
+        PSLSTMCell * cell = GetLSTMCell(neuron);
+        cell->candidate_weights = weights + (cell->candidate_weights - old);
+        cell->input_weights = weights + (cell->input_weights - old);
+        cell->output_weights = weights + (cell->output_weights - old);
+        cell->forget_weights = weights + (cell->forget_weights - old);
+    } else if (layer->type == GRU) {
+        PSGRUCell * cell = GetGRUCell(neuron);
+        cell->candidate_weights = weights + (cell->candidate_weights - old);
+        cell->reset_weights = weights + (cell->reset_weights - old);
+        cell->update_weights = weights + (cell->update_weights - old);
+    } else if (layer->type == Recurrent) {
+        PSRecurrentCell * cell = GetRecurrentCell(neuron);
+        if (cell->weights != NULL)
+            cell->weights = weights + (cell->weights - old);
+    }
+}
+
+static void moveNeuronWeights(PSNeuralNetwork * network, PSLayer * layer,
+                              PSNeuron * neuron, PSMemoryBlock * block)
+{
+    double * weights = moveRow(network, block, neuron->weights,
+                               neuron->weights_size);
+    setNeuronWeights(layer, neuron, weights);
+}
+
+/* Move the weights (and, on non-recurrent networks, the activation caches)
+ * of every layer into a single memory block honouring network->memory_flags.
+ * Recurrent activation caches are reallocated on every sequence, so they
+ * stay on the heap. */
+
+int PSApplyMemoryPolicy(PSNeuralNetwork * network) {
+    if (network == NULL) return 0;
+    char * func = "PSApplyMemoryPolicy";
+    PSMemoryBlock * old_block = getNetworkMemory(network);
+    if (!network->memory_flags && old_block == NULL) return 1;
+    size_t size = getNetworkMemorySize(network);
+    if (size == 0) return 1;
+    PSMemoryBlock * block = PSCreateMemoryBlock(size, network->memory_flags);
+    if (block == NULL) {
+        PSErr(func, "Could not create memory block!");
+        return 0;
+    }
+    int i, j;
+#ifdef USE_AVX
+    int is_recurrent = (network->flags & FLAG_RECURRENT);
+#endif
+    for (i = 0; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+#ifdef USE_AVX
+        if (!is_recurrent && layer->avx_activation_cache != NULL) {
+            layer->avx_activation_cache =
+                moveRow(network, block, layer->avx_activation_cache,
+                        layer->size);
+        }
+#endif
+        if (layer->type == Convolutional) {
+            PSSharedParams * shared = getConvSharedParams(layer);
+            if (shared == NULL) continue;
+            for (j = 0; j < shared->feature_count; j++) {
+                shared->weights[j] = moveRow(network, block,
+                                             shared->weights[j],
+                                             shared->weights_size);
+            }
+        } else if (layer->type == Embedding) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            table->table = moveRow(network, block, table->table,
+                                   table->rows * table->size);
+        } else if (layer->type != Pooling) {
+            for (j = 0; j < layer->size; j++) {
+                PSNeuron * neuron = layer->neurons[j];
+                if (neuron->weights == NULL) continue;
+                moveNeuronWeights(network, layer, neuron, block);
+            }
+        }
+    }
+    network->memory = block;
+    PSDeleteMemoryBlock(old_block);
+    return 1;
+}
+
+/* Weights Views */
+
+static int getBiasPointers(PSNeuralNetwork * network, double ** biases) {
+    int count = 0, i, j;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type == Pooling || layer->type == Embedding) continue;
+        if (layer->type == Convolutional) {
+            PSSharedParams * shared = getConvSharedParams(layer);
+            if (shared == NULL) continue;
+            for (j = 0; j < shared->feature_count; j++) {
+                if (biases != NULL) biases[count] = &(shared->biases[j]);
+                count++;
+            }
+            continue;
+        }
+        for (j = 0; j < layer->size; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            if (biases != NULL) biases[count] = &(neuron->bias);
+            count++;
+            if (neuron->extra == NULL) continue;
+            if (layer->type == GRU) {
+                PSGRUCell * cell = GetGRUCell(neuron);
+                if (biases != NULL) {
+                    biases[count] = &(cell->candidate_bias);
+                    biases[count + 1] = &(cell->reset_bias);
+                    biases[count + 2] = &(cell->update_bias);
+                }
+                count += 3;
+                continue;
+            }
+            if (layer->type != LSTM) continue;
+            PSLSTMCell * cell = GetLSTMCell(neuron);
+            if (biases != NULL) {
+                biases[count] = &(cell->candidate_bias);
+                biases[count + 1] = &(cell->input_bias);
+                biases[count + 2] = &(cell->output_bias);
+                biases[count + 3] = &(cell->forget_bias);
+            }
+            count += 4;
+        }
+    }
+    return count;
+}
+
+/* Make every weights row of the view point at the master's one, or
+ * detach them (master == NULL) before the view gets deleted. */
+
+static void shareWeights(PSNeuralNetwork * view, PSNeuralNetwork * master) {
+    int i, j;
+    for (i = 1; i < view->size; i++) {
+        PSLayer * layer = view->layers[i];
+        PSLayer * master_layer = (master ? master->layers[i] : NULL);
+        if (layer->type == Pooling) continue;
+        if (layer->type == Convolutional) {
+            PSSharedParams * shared = getConvSharedParams(layer);
+            if (shared == NULL) continue;
+            PSSharedParams * master_shared = NULL;
+            if (master_layer) master_shared = getConvSharedParams(master_layer);
+            for (j = 0; j < shared->feature_count; j++) {
+                if (master_shared != NULL)
+                    PSFreeNetworkMemory(view, shared->weights[j]);
+                shared->weights[j] = (master_shared ?
+                                      master_shared->weights[j] : NULL);
+            }
+            continue;
+        } else if (layer->type == Embedding) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            if (master_layer != NULL)
+                PSFreeNetworkMemory(view, table->table);
+            table->table = (master_layer ?
+                            GetEmbeddingTable(master_layer)->table : NULL);
+            continue;
+        }
+        for (j = 0; j < layer->size; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            if (master_layer == NULL) {
+                neuron->weights = NULL;
+                continue;
+            }
+            double * old = neuron->weights;
+            setNeuronWeights(layer, neuron, master_layer->neurons[j]->weights);
+            PSFreeNetworkMemory(view, old);
+        }
+    }
+}
+
+PSWeightsView * PSCreateWeightsView(PSNeuralNetwork * master) {
+    if (master == NULL) return NULL;
+    char * func = "PSCreateWeightsView";
+    PSWeightsView * view = calloc(1, sizeof(PSWeightsView));
+    if (view == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    view->master = master;
+    view->network = PSCloneNetwork(master, 0);
+    if (view->network == NULL) {
+        PSErr(func, "Could not clone network!");
+        free(view);
+        return NULL;
+    }
+    int count = getBiasPointers(master, NULL);
+    view->biases_count = count;
+    view->master_biases = malloc(count * sizeof(double*));
+    view->biases = malloc(count * sizeof(double*));
+    view->pulled = malloc(count * sizeof(double));
+    if (view->master_biases == NULL || view->biases == NULL ||
+        view->pulled == NULL)
+    {
+        printMemoryErrorMsg();
+        PSDeleteWeightsView(view);
+        return NULL;
+    }
+    getBiasPointers(master, view->master_biases);
+    getBiasPointers(view->network, view->biases);
+    shareWeights(view->network, master);
+    return view;
+}
+
+/* Copy the current master biases into the view, call it before training
+ * the view on a batch. */
+
+void PSPullViewBiases(PSWeightsView * view) {
+    int i;
+    for (i = 0; i < view->biases_count; i++) {
+        double bias = *(view->master_biases[i]);
+        view->pulled[i] = bias;
+        *(view->biases[i]) = bias;
+    }
+}
+
+/* Add the bias changes since the last pull to the master ones: like the
+ * shared weights, without any lock. */
+
+void PSPushViewBiases(PSWeightsView * view) {
+    int i;
+    for (i = 0; i < view->biases_count; i++) {
+        double delta = *(view->biases[i]) - view->pulled[i];
+        *(view->master_biases[i]) += delta;
+    }
+}
+
+void PSDeleteWeightsView(PSWeightsView * view) {
+    if (view == NULL) return;
+    if (view->network != NULL) {
+        shareWeights(view->network, NULL);
+        PSDeleteNetwork(view->network);
+    }
+    free(view->master_biases);
+    free(view->biases);
+    free(view->pulled);
+    free(view);
+}
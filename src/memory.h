@@ -0,0 +1,67 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_MEMORY_H
+#define __PS_MEMORY_H
+
+#include <stddef.h>
+#include "psyc.h"
+
+#define PS_HUGE_PAGE_SIZE   (2 * 1024 * 1024)
+
+#define getNetworkMemory(network) ((PSMemoryBlock*) network->memory)
+
+/* A single anonymous mapping holding the weights and activation caches of
+ * a network, optionally backed by huge pages, locked and prefaulted.
+ * Rows are carved out of it sequentially, aligned and padded like the
+ * ones returned by PSAlignedAlloc. */
+
+typedef struct {
+    void * addr;
+    size_t size;
+    size_t used;
+    int flags;
+} PSMemoryBlock;
+
+PSMemoryBlock * PSCreateMemoryBlock(size_t size, int flags);
+double * PSMemoryBlockAlloc(PSMemoryBlock * block, int count);
+int PSMemoryBlockContains(PSMemoryBlock * block, void * ptr);
+void PSDeleteMemoryBlock(PSMemoryBlock * block);
+
+int PSApplyMemoryPolicy(PSNeuralNetwork * network);
+void PSFreeNetworkMemory(PSNeuralNetwork * network, double * ptr);
+
+/* A clone of a network sharing its weights rows, so that many threads
+ * can train the same weights without locks (Hogwild). Biases are stored
+ * inside neurons and cells, so they are merged into the master ones as
+ * deltas by PSPushViewBiases. */
+
+typedef struct {
+    PSNeuralNetwork * master;
+    PSNeuralNetwork * network;
+    int biases_count;
+    double ** master_biases;
+    double ** biases;
+    double * pulled;
+} PSWeightsView;
+
+PSWeightsView * PSCreateWeightsView(PSNeuralNetwork * master);
+void PSPullViewBiases(PSWeightsView * view);
+void PSPushViewBiases(PSWeightsView * view);
+void PSDeleteWeightsView(PSWeightsView * view);
+
+#endif //__PS_MEMORY_H
@@ -0,0 +1,386 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "memory.h"
+#include "sparse.h"
+#include "threadpool.h"
+#include "affinity.h"
+#include "distributed.h"
+#include "utils.h"
+
+static double getTimeSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+/* Hogwild: every worker trains its own view of the network on the next
+ * free batch, writing the shared weights without any lock. A single
+ * worker trains exactly like gradientDescent does. */
+
+typedef struct {
+    PSWeightsView * view;
+    double * training_data;
+    double ** series;
+    int element_size;
+    int elements_count;
+    int batch_size;
+    int batches_count;
+    int epochs;
+    int * next_batch;
+    PSTrainingOptions * options;
+    double rate;
+    double err;
+    int index;
+    int ok;
+} PSHogwildWorker;
+
+static void * hogwildWorkerLoop(void * arg) {
+    PSHogwildWorker * worker = (PSHogwildWorker *) arg;
+    PSNeuralNetwork * network = worker->view->network;
+    /* Worker 0 is the calling thread, which keeps its own affinity */
+    if ((PSGlobalFlags & FLAG_THREAD_AFFINITY) && worker->index > 0)
+        PSPinThread(worker->index);
+    /* Workers replace intra-layer parallelism: the pool cannot serve
+     * several of them at once. */
+    int serial = PSSerialThread;
+    PSSerialThread = 1;
+    while (1) {
+        int batch = __sync_fetch_and_add(worker->next_batch, 1);
+        if (batch >= worker->batches_count) break;
+        double * data = worker->training_data;
+        double ** series = worker->series;
+        if (series != NULL) series += (batch * worker->batch_size);
+        else data += (batch * worker->batch_size * worker->element_size);
+        if (worker->index == 0) {
+            printf("\rEpoch %d/%d: batch %d/%d",
+                   worker->view->master->current_epoch + 1, worker->epochs,
+                   batch + 1, worker->batches_count);
+            fflush(stdout);
+        }
+        PSPullViewBiases(worker->view);
+        worker->err += updateWeights(network, data, worker->batch_size,
+                                     worker->elements_count, worker->options,
+                                     worker->rate, series);
+        if (network->status == STATUS_ERROR) {
+            worker->ok = 0;
+            __sync_fetch_and_add(worker->next_batch, worker->batches_count);
+            break;
+        }
+        PSPushViewBiases(worker->view);
+    }
+    PSSerialThread = serial;
+    return NULL;
+}
+
+double PSHogwildDescent(PSNeuralNetwork * network, double * training_data,
+                        double ** series, int element_size,
+                        int elements_count, double learning_rate,
+                        int batch_size, PSTrainingOptions * options,
+                        int epochs)
+{
+    char * func = "PSHogwildDescent";
+    int batches_count = elements_count / batch_size;
+    int threads = options->threads, next_batch = 0, i, ok = 1;
+    if (threads < 1) threads = PSGetCPUCount();
+    if (threads > batches_count) threads = batches_count;
+    if (threads < 1) threads = 1;
+    PSHogwildWorker workers[threads];
+    pthread_t thread_ids[threads];
+    int started = 0;
+    for (i = 0; i < threads; i++) {
+        PSHogwildWorker * worker = &(workers[i]);
+        worker->view = PSCreateWeightsView(network);
+        if (worker->view == NULL) {
+            PSErr(func, "Could not create weights view %d", i);
+            threads = i;
+            ok = 0;
+            break;
+        }
+        worker->training_data = training_data;
+        worker->series = series;
+        worker->element_size = element_size;
+        worker->elements_count = elements_count;
+        worker->batch_size = batch_size;
+        worker->batches_count = batches_count;
+        worker->epochs = epochs;
+        worker->next_batch = &next_batch;
+        worker->options = options;
+        worker->rate = learning_rate;
+        worker->err = 0.0;
+        worker->index = i;
+        worker->ok = 1;
+    }
+    for (i = 1; i < threads && ok; i++) {
+        if (pthread_create(&(thread_ids[i]), NULL, hogwildWorkerLoop,
+                           &(workers[i])))
+        {
+            PSErr(func, "Could not create thread %d!", i);
+            break;
+        }
+        started++;
+    }
+    if (ok) hogwildWorkerLoop(&(workers[0]));
+    for (i = 1; i <= started; i++) pthread_join(thread_ids[i], NULL);
+    double err = 0.0;
+    for (i = 0; i < threads; i++) {
+        err += workers[i].err;
+        ok = ok && workers[i].ok;
+        PSMergeActivationDensity(network, workers[i].view->network);
+        PSDeleteWeightsView(workers[i].view);
+    }
+    network->current_batch = batches_count - 1;
+    if (!ok) {
+        network->status = STATUS_ERROR;
+        return -999.00;
+    }
+    return err / (double) batches_count;
+}
+
+int PSGetLocalSteps(PSNeuralNetwork * network, PSTrainingOptions * options) {
+    if (network->current_epoch < options->local_warmup_epochs) return 1;
+    return (options->local_steps > 1 ? options->local_steps : 1);
+}
+
+void PSPrintLocalSGDStats(int syncs, int steps, double compute_t,
+                          double sync_t)
+{
+    double total = compute_t + sync_t;
+    printf("\nLocal SGD: %d syncs every %d batches, compute %.3fs, "
+           "sync %.3fs (%.1f%%)\n", syncs, steps, compute_t, sync_t,
+           (total > 0 ? 100.0 * sync_t / total : 0.0));
+}
+
+/* Local SGD with threads: every worker trains its own copy of the network
+ * (worker 0 the network itself) on a contiguous range of batches, and
+ * every few batches all the copies are replaced by their average. Each
+ * worker averages one slice of the parameters. Workers wait until every
+ * thread is created, so that batches and the barrier only count the ones
+ * that could be started. */
+
+typedef struct {
+    PSNeuralNetwork * network;
+    double ** params;
+    double * result;
+    int params_count;
+    int workers;
+    pthread_barrier_t barrier;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    int ready;
+    double * training_data;
+    double ** series;
+    int element_size;
+    int elements_count;
+    int batch_size;
+    int batches_count;
+    int epochs;
+    int steps;
+    int rounds;
+    PSTrainingOptions * options;
+    double rate;
+    int failed;
+} PSLocalSGD;
+
+typedef struct {
+    PSLocalSGD * shared;
+    PSNeuralNetwork * network;
+    int index;
+    int first_batch;
+    int last_batch;
+    int syncs;
+    double err;
+    double compute_time;
+    double sync_time;
+} PSLocalSGDWorker;
+
+static void * localSGDWorkerLoop(void * arg) {
+    PSLocalSGDWorker * worker = (PSLocalSGDWorker *) arg;
+    PSLocalSGD * shared = worker->shared;
+    PSNeuralNetwork * network = worker->network;
+    int round, batch, i, r;
+    if ((PSGlobalFlags & FLAG_THREAD_AFFINITY) && worker->index > 0)
+        PSPinThread(worker->index);
+    pthread_mutex_lock(&(shared->lock));
+    while (!shared->ready)
+        pthread_cond_wait(&(shared->start_cond), &(shared->lock));
+    pthread_mutex_unlock(&(shared->lock));
+    int start = (int) (((long) shared->params_count * worker->index) /
+                       shared->workers);
+    int end = (int) (((long) shared->params_count * (worker->index + 1)) /
+                     shared->workers);
+    /* Workers replace intra-layer parallelism, as with Hogwild */
+    int serial = PSSerialThread;
+    PSSerialThread = 1;
+    for (round = 0; round < shared->rounds; round++) {
+        double t = getTimeSeconds();
+        int first = worker->first_batch + (round * shared->steps);
+        int last = first + shared->steps;
+        if (last > worker->last_batch) last = worker->last_batch;
+        for (batch = first; batch < last && !shared->failed; batch++) {
+            double * data = shared->training_data;
+            double ** series = shared->series;
+            if (series != NULL) series += (batch * shared->batch_size);
+            else data += (batch * shared->batch_size * shared->element_size);
+            if (worker->index == 0) {
+                printf("\rEpoch %d/%d: batch %d/%d",
+                       network->current_epoch + 1, shared->epochs,
+                       batch + 1, worker->last_batch);
+                fflush(stdout);
+            }
+            worker->err += updateWeights(network, data, shared->batch_size,
+                                         shared->elements_count,
+                                         shared->options, shared->rate,
+                                         series);
+            if (network->status == STATUS_ERROR) shared->failed = 1;
+        }
+        double sync_t = getTimeSeconds();
+        worker->compute_time += (sync_t - t);
+        PSPackParameters(network, shared->params[worker->index]);
+        pthread_barrier_wait(&(shared->barrier));
+        for (i = start; i < end; i++) {
+            double sum = 0.0;
+            for (r = 0; r < shared->workers; r++) sum += shared->params[r][i];
+            shared->result[i] = sum / (double) shared->workers;
+        }
+        pthread_barrier_wait(&(shared->barrier));
+        PSUnpackParameters(network, shared->result);
+        worker->sync_time += (getTimeSeconds() - sync_t);
+        worker->syncs++;
+    }
+    PSSerialThread = serial;
+    return NULL;
+}
+
+/* Split the batches into contiguous ranges, one per worker */
+
+static void assignLocalSGDBatches(PSLocalSGD * shared,
+                                  PSLocalSGDWorker * workers, int count)
+{
+    int batches_count = shared->batches_count, i;
+    for (i = 0; i < count; i++) {
+        workers[i].first_batch = (int) (((long) batches_count * i) / count);
+        workers[i].last_batch = (int) (((long) batches_count * (i + 1)) /
+                                       count);
+    }
+    int max_batches = (batches_count + count - 1) / count;
+    shared->workers = count;
+    shared->rounds = (max_batches + shared->steps - 1) / shared->steps;
+}
+
+double PSLocalSGDDescent(PSNeuralNetwork * network, double * training_data,
+                         double ** series, int element_size,
+                         int elements_count, double learning_rate,
+                         int batch_size, PSTrainingOptions * options,
+                         int epochs)
+{
+    char * func = "PSLocalSGDDescent";
+    int batches_count = elements_count / batch_size, i, ok = 1;
+    int threads = options->threads;
+    if (threads < 1) threads = PSGetCPUCount();
+    if (threads > batches_count) threads = batches_count;
+    if (threads < 1) threads = 1;
+    PSLocalSGD shared;
+    shared.network = network;
+    shared.params_count = PSGetParametersCount(network);
+    shared.workers = threads;
+    shared.training_data = training_data;
+    shared.series = series;
+    shared.element_size = element_size;
+    shared.elements_count = elements_count;
+    shared.batch_size = batch_size;
+    shared.batches_count = batches_count;
+    shared.epochs = epochs;
+    shared.steps = PSGetLocalSteps(network, options);
+    shared.options = options;
+    shared.rate = learning_rate;
+    shared.failed = 0;
+    shared.ready = 0;
+    shared.result = PSAlignedAlloc(shared.params_count);
+    shared.params = calloc(threads, sizeof(double*));
+    PSLocalSGDWorker workers[threads];
+    pthread_t thread_ids[threads];
+    memset(workers, 0, sizeof(workers));
+    if (shared.result == NULL || shared.params == NULL) {
+        printMemoryErrorMsg();
+        ok = 0;
+    }
+    for (i = 0; i < threads && ok; i++) {
+        PSLocalSGDWorker * worker = &(workers[i]);
+        worker->shared = &shared;
+        worker->index = i;
+        worker->network = (i == 0 ? network : PSCloneNetwork(network, 0));
+        shared.params[i] = PSAlignedAlloc(shared.params_count);
+        if (worker->network == NULL || shared.params[i] == NULL) {
+            PSErr(func, "Could not create worker %d", i);
+            ok = 0;
+        }
+    }
+    int started = 0;
+    if (ok) {
+        pthread_mutex_init(&(shared.lock), NULL);
+        pthread_cond_init(&(shared.start_cond), NULL);
+        for (i = 1; i < threads; i++) {
+            if (pthread_create(&(thread_ids[i]), NULL, localSGDWorkerLoop,
+                               &(workers[i])))
+            {
+                PSErr(func, "Could not create thread %d!", i);
+                break;
+            }
+            started++;
+        }
+        /* Go on with the workers that could be started */
+        assignLocalSGDBatches(&shared, workers, started + 1);
+        pthread_barrier_init(&(shared.barrier), NULL, started + 1);
+        pthread_mutex_lock(&(shared.lock));
+        shared.ready = 1;
+        pthread_cond_broadcast(&(shared.start_cond));
+        pthread_mutex_unlock(&(shared.lock));
+        localSGDWorkerLoop(&(workers[0]));
+        for (i = 1; i <= started; i++) pthread_join(thread_ids[i], NULL);
+        pthread_barrier_destroy(&(shared.barrier));
+        pthread_cond_destroy(&(shared.start_cond));
+        pthread_mutex_destroy(&(shared.lock));
+        ok = !shared.failed;
+    }
+    double err = 0.0;
+    for (i = 0; i < threads; i++) {
+        err += workers[i].err;
+        if (i > 0 && workers[i].network != NULL) {
+            PSMergeActivationDensity(network, workers[i].network);
+            PSDeleteNetwork(workers[i].network);
+        }
+        if (shared.params != NULL) PSAlignedFree(shared.params[i]);
+    }
+    free(shared.params);
+    PSAlignedFree(shared.result);
+    network->current_batch = batches_count - 1;
+    if (!ok) {
+        network->status = STATUS_ERROR;
+        return -999.00;
+    }
+    PSPrintLocalSGDStats(workers[0].syncs, shared.steps,
+                         workers[0].compute_time, workers[0].sync_time);
+    return err / (double) batches_count;
+}
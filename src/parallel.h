@@ -0,0 +1,51 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_PARALLEL_H
+#define __PS_PARALLEL_H
+
+#include "psyc.h"
+
+/* Data-parallel training with threads, one batch at a time per worker:
+ * Hogwild (TRAINING_HOGWILD) and local SGD (TRAINING_LOCAL_SGD without a
+ * process group). Both take the arguments of gradientDescent, after the
+ * recurrent series have been built. */
+
+double PSHogwildDescent(PSNeuralNetwork * network, double * training_data,
+                        double ** series, int element_size,
+                        int elements_count, double learning_rate,
+                        int batch_size, PSTrainingOptions * options,
+                        int epochs);
+double PSLocalSGDDescent(PSNeuralNetwork * network, double * training_data,
+                         double ** series, int element_size,
+                         int elements_count, double learning_rate,
+                         int batch_size, PSTrainingOptions * options,
+                         int epochs);
+
+/* Shared with local SGD over a process group (see gradientDescent) */
+
+int PSGetLocalSteps(PSNeuralNetwork * network, PSTrainingOptions * options);
+void PSPrintLocalSGDStats(int syncs, int steps, double compute_t,
+                          double sync_t);
+
+/* Batch update run by every worker (psyc.c) */
+
+double updateWeights(PSNeuralNetwork * network, double * training_data,
+                     int batch_size, int elements_count,
+                     PSTrainingOptions* opts, double rate, ...);
+
+#endif //__PS_PARALLEL_H
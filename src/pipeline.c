@@ -0,0 +1,381 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "sparse.h"
+#include "threadpool.h"
+#include "affinity.h"
+#include "utils.h"
+
+/* Busy-wait iterations before a waiting thread yields its CPU */
+#define SPIN_LIMIT  256
+
+/* Sample index telling a stage to forward it and exit */
+#define STOP_SAMPLE -1
+
+static double getTimeSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void relax(int * spins) {
+    if ((*spins)++ >= SPIN_LIMIT) sched_yield();
+}
+
+/* Rings */
+
+static PSRing * createRing(int capacity, int size) {
+    PSRing * ring = NULL;
+    if (posix_memalign((void **) &ring, PS_CACHE_LINE, sizeof(PSRing))) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    memset(ring, 0, sizeof(PSRing));
+    ring->capacity = capacity;
+    ring->size = size;
+    ring->stride = PSPaddedSize(size);
+    ring->values = PSAlignedAlloc(capacity * ring->stride);
+    ring->samples = calloc(capacity, sizeof(int));
+    if (ring->values == NULL || ring->samples == NULL) {
+        printMemoryErrorMsg();
+        PSAlignedFree(ring->values);
+        free(ring->samples);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+static void deleteRing(PSRing * ring) {
+    if (ring == NULL) return;
+    PSAlignedFree(ring->values);
+    free(ring->samples);
+    free(ring);
+}
+
+static int ringIsFull(PSRing * ring) {
+    unsigned long tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    return (ring->head - tail) == (unsigned long) ring->capacity;
+}
+
+static int ringIsEmpty(PSRing * ring) {
+    unsigned long head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+    return (head == ring->tail);
+}
+
+/* Producer side: fill the slot returned by ringHead, then publish it. */
+
+static double * ringHead(PSRing * ring) {
+    return ring->values + ((ring->head % ring->capacity) * ring->stride);
+}
+
+static void ringPush(PSRing * ring, int sample) {
+    ring->samples[ring->head % ring->capacity] = sample;
+    __atomic_store_n(&(ring->head), ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Consumer side: read the slot returned by ringTail, then release it. */
+
+static double * ringTail(PSRing * ring, int * sample) {
+    int idx = ring->tail % ring->capacity;
+    *sample = ring->samples[idx];
+    return ring->values + (idx * ring->stride);
+}
+
+static void ringPop(PSRing * ring) {
+    __atomic_store_n(&(ring->tail), ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Stages */
+
+static int setActivations(PSLayer * layer, double * values) {
+    int i;
+    for (i = 0; i < layer->size; i++) {
+        layer->neurons[i]->activation = values[i];
+#ifdef USE_AVX
+        layer->avx_activation_cache[i] = values[i];
+#endif
+    }
+    /* Layers get the same sparse products as in PSFeedforward */
+    return PSUpdateNonzeroActivations(layer);
+}
+
+static void getActivations(PSLayer * layer, double * values) {
+    int i;
+    for (i = 0; i < layer->size; i++)
+        values[i] = layer->neurons[i]->activation;
+}
+
+static void * stageLoop(void * arg) {
+    PSPipelineStage * stage = (PSPipelineStage *) arg;
+    PSNeuralNetwork * network = stage->view->network;
+    PSLayer * first = network->layers[stage->first_layer - 1];
+    PSLayer * last = network->layers[stage->last_layer];
+    int sample = 0, spins, i;
+    /* The calling thread takes CPU 0 */
+    if (PSGlobalFlags & FLAG_THREAD_AFFINITY) PSPinThread(stage->index + 1);
+    /* Stages replace intra-layer parallelism: the pool cannot serve
+     * several of them at once. */
+    PSSerialThread = 1;
+    while (sample != STOP_SAMPLE) {
+        spins = 0;
+        while (ringIsEmpty(stage->input)) relax(&spins);
+        double start_t = getTimeSeconds();
+        double * values = ringTail(stage->input, &sample);
+        if (sample != STOP_SAMPLE && !setActivations(first, values))
+            stage->ok = 0;
+        ringPop(stage->input);
+        for (i = stage->first_layer; i <= stage->last_layer; i++) {
+            if (sample == STOP_SAMPLE || !stage->ok) break;
+            PSLayer * layer = network->layers[i];
+            if (!layer->feedforward(network, layer) ||
+                !PSUpdateNonzeroActivations(layer)) stage->ok = 0;
+        }
+        double busy_t = getTimeSeconds() - start_t;
+        spins = 0;
+        while (ringIsFull(stage->output)) relax(&spins);
+        start_t = getTimeSeconds();
+        if (sample != STOP_SAMPLE) {
+            getActivations(last, ringHead(stage->output));
+            stage->samples++;
+        }
+        ringPush(stage->output, sample);
+        stage->busy_time += busy_t + (getTimeSeconds() - start_t);
+    }
+    return NULL;
+}
+
+static double getLayerCost(PSLayer * layer) {
+    int weights = layer->neurons[0]->weights_size;
+    return (double) layer->size * (weights > 1 ? weights : 1);
+}
+
+/* Split layers into contiguous groups of roughly the same cost: a stage
+ * ends once the cost accumulated so far reaches its share, as long as
+ * every following stage can still get a layer. */
+
+static void balanceStages(PSNeuralNetwork * network, int stages,
+                          int * firsts)
+{
+    int n = network->size, s = 1, l;
+    double total = 0.0, acc = 0.0;
+    for (l = 1; l < n; l++) total += getLayerCost(network->layers[l]);
+    firsts[0] = 1;
+    for (l = 1; l < n && s < stages; l++) {
+        if (l > firsts[s - 1]) {
+            int left = n - l;
+            if (left == stages - s ||
+                (left > stages - s && acc >= (total * s) / stages))
+                firsts[s++] = l;
+        }
+        acc += getLayerCost(network->layers[l]);
+    }
+}
+
+/* Create a pipeline running network over stages threads. boundaries
+ * holds the first layer of stages 1..stages-1, or NULL to balance the
+ * layers by their number of multiply-adds. */
+
+PSPipeline * PSCreatePipeline(PSNeuralNetwork * network, int stages,
+                              int * boundaries, int ring_size)
+{
+    char * func = "PSCreatePipeline";
+    if (network == NULL) return NULL;
+    if (network->flags & FLAG_RECURRENT) {
+        PSErr(func, "Recurrent networks cannot be pipelined");
+        return NULL;
+    }
+    int layers = network->size - 1, i;
+    if (stages < 1 || layers < 1) {
+        PSErr(func, "Invalid stages count %d", stages);
+        return NULL;
+    }
+    if (stages > layers) stages = layers;
+    if (ring_size < 1) ring_size = PS_DEFAULT_RING_SIZE;
+    int firsts[stages];
+    if (boundaries != NULL) {
+        firsts[0] = 1;
+        for (i = 1; i < stages; i++) {
+            firsts[i] = boundaries[i - 1];
+            if (firsts[i] <= firsts[i - 1] || firsts[i] > layers) {
+                PSErr(func, "Invalid stage boundary %d", firsts[i]);
+                return NULL;
+            }
+        }
+    } else balanceStages(network, stages, firsts);
+    PSPipeline * pipeline = calloc(1, sizeof(PSPipeline));
+    if (pipeline == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    pipeline->network = network;
+    pipeline->size = stages;
+    pipeline->stages = calloc(stages, sizeof(PSPipelineStage));
+    pipeline->rings = calloc(stages + 1, sizeof(PSRing*));
+    if (pipeline->stages == NULL || pipeline->rings == NULL) {
+        printMemoryErrorMsg();
+        PSDeletePipeline(pipeline);
+        return NULL;
+    }
+    for (i = 0; i <= stages; i++) {
+        int boundary = (i < stages ? firsts[i] - 1 : layers);
+        pipeline->rings[i] = createRing(ring_size,
+                                        network->layers[boundary]->size);
+        if (pipeline->rings[i] == NULL) {
+            PSDeletePipeline(pipeline);
+            return NULL;
+        }
+    }
+    for (i = 0; i < stages; i++) {
+        PSPipelineStage * stage = &(pipeline->stages[i]);
+        stage->index = i;
+        stage->first_layer = firsts[i];
+        stage->last_layer = (i < stages - 1 ? firsts[i + 1] - 1 : layers);
+        stage->input = pipeline->rings[i];
+        stage->output = pipeline->rings[i + 1];
+        stage->view = PSCreateWeightsView(network);
+        if (stage->view == NULL) {
+            PSErr(func, "Could not create stage %d", i);
+            PSDeletePipeline(pipeline);
+            return NULL;
+        }
+    }
+    return pipeline;
+}
+
+/* Stream count samples (element_size values apart, 0 meaning the input
+ * size) through the pipeline, writing the output layer activations of
+ * each one into outputs. Stage threads only live during the call. */
+
+int PSPipelineFeedforward(PSPipeline * pipeline, double * inputs, int count,
+                          int element_size, double * outputs)
+{
+    char * func = "PSPipelineFeedforward";
+    if (pipeline == NULL) return 0;
+    PSNeuralNetwork * network = pipeline->network;
+    int input_size = network->input_size, output_size = network->output_size;
+    int i, started = 0, ok = 1;
+    if (element_size <= 0) element_size = input_size;
+    for (i = 0; i <= pipeline->size; i++) {
+        pipeline->rings[i]->head = 0;
+        pipeline->rings[i]->tail = 0;
+    }
+    for (i = 0; i < pipeline->size; i++) {
+        PSPipelineStage * stage = &(pipeline->stages[i]);
+        /* Pick up biases changed by training since the last run */
+        PSPullViewBiases(stage->view);
+        stage->samples = 0;
+        stage->busy_time = 0.0;
+        stage->utilisation = 0.0;
+        stage->ok = 1;
+    }
+    double start_t = getTimeSeconds();
+    for (i = 0; i < pipeline->size; i++) {
+        PSPipelineStage * stage = &(pipeline->stages[i]);
+        if (pthread_create(&(stage->thread), NULL, stageLoop, stage)) {
+            PSErr(func, "Could not create thread for stage %d!", i);
+            ok = 0;
+            break;
+        }
+        started++;
+    }
+    PSRing * in = pipeline->rings[0];
+    PSRing * out = pipeline->rings[started];
+    int pushed = 0, done = 0, spins = 0, sample;
+    /* Feed the samples and then the stop marker, collecting results as
+     * they come out so that neither side of the pipe fills up. */
+    if (!ok) count = 0;
+    while (!done) {
+        int progress = 0;
+        if (pushed <= count && !ringIsFull(in)) {
+            if (pushed < count) {
+                memcpy(ringHead(in), inputs + (pushed * element_size),
+                       input_size * sizeof(double));
+                ringPush(in, pushed);
+            } else ringPush(in, STOP_SAMPLE);
+            pushed++;
+            progress = 1;
+        }
+        if (started > 0 && !ringIsEmpty(out)) {
+            double * values = ringTail(out, &sample);
+            if (sample == STOP_SAMPLE) done = 1;
+            else memcpy(outputs + (sample * output_size), values,
+                        output_size * sizeof(double));
+            ringPop(out);
+            progress = 1;
+        }
+        if (started == 0 && pushed > count) done = 1;
+        if (progress) spins = 0;
+        else relax(&spins);
+    }
+    for (i = 0; i < started; i++)
+        pthread_join(pipeline->stages[i].thread, NULL);
+    pipeline->run_time = getTimeSeconds() - start_t;
+    for (i = 0; i < pipeline->size; i++) {
+        PSPipelineStage * stage = &(pipeline->stages[i]);
+        PSNeuralNetwork * view = stage->view->network;
+        /* The previous stage already counted the input layer */
+        if (stage->first_layer > 1) {
+            view->layers[stage->first_layer - 1]->activations_seen = 0;
+            view->layers[stage->first_layer - 1]->nonzero_seen = 0;
+        }
+        PSMergeActivationDensity(network, view);
+        if (pipeline->run_time > 0)
+            stage->utilisation = stage->busy_time / pipeline->run_time;
+        if (!stage->ok) {
+            PSErr(func, "Stage %d failed", i);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+void PSPrintPipelineStats(PSPipeline * pipeline) {
+    if (pipeline == NULL) return;
+    int samples = pipeline->stages[pipeline->size - 1].samples, i;
+    double t = pipeline->run_time;
+    printf("Pipeline: %d samples in %.3fs (%.1f samples/s)\n", samples, t,
+           (t > 0 ? samples / t : 0.0));
+    for (i = 0; i < pipeline->size; i++) {
+        PSPipelineStage * stage = &(pipeline->stages[i]);
+        printf("    Stage %d: layers %d-%d, busy %.3fs (%.1f%%)\n", i,
+               stage->first_layer, stage->last_layer, stage->busy_time,
+               100.0 * stage->utilisation);
+    }
+}
+
+void PSDeletePipeline(PSPipeline * pipeline) {
+    if (pipeline == NULL) return;
+    int i;
+    if (pipeline->stages != NULL) {
+        for (i = 0; i < pipeline->size; i++)
+            PSDeleteWeightsView(pipeline->stages[i].view);
+    }
+    if (pipeline->rings != NULL) {
+        for (i = 0; i <= pipeline->size; i++) deleteRing(pipeline->rings[i]);
+    }
+    free(pipeline->stages);
+    free(pipeline->rings);
+    free(pipeline);
+}
@@ -0,0 +1,74 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_PIPELINE_H
+#define __PS_PIPELINE_H
+
+#include <pthread.h>
+#include "psyc.h"
+#include "memory.h"
+
+#define PS_DEFAULT_RING_SIZE    16
+#define PS_CACHE_LINE           64
+
+/* Single-producer/single-consumer ring of activation vectors. Each side
+ * only writes its own index, so no lock is needed. */
+
+typedef struct {
+    int capacity;
+    int size;
+    int stride;
+    double * values;
+    int * samples;
+    unsigned long head __attribute__((aligned(PS_CACHE_LINE)));
+    unsigned long tail __attribute__((aligned(PS_CACHE_LINE)));
+} PSRing;
+
+/* A stage runs layers [first_layer, last_layer] of its own view of the
+ * network: views share the weights rows, but not the activations, so
+ * each stage can work on a different sample. */
+
+typedef struct {
+    int index;
+    int first_layer;
+    int last_layer;
+    PSWeightsView * view;
+    PSRing * input;
+    PSRing * output;
+    pthread_t thread;
+    int samples;
+    double busy_time;
+    double utilisation;
+    int ok;
+} PSPipelineStage;
+
+typedef struct {
+    PSNeuralNetwork * network;
+    int size;
+    PSPipelineStage * stages;
+    PSRing ** rings;
+    double run_time;
+} PSPipeline;
+
+PSPipeline * PSCreatePipeline(PSNeuralNetwork * network, int stages,
+                              int * boundaries, int ring_size);
+int PSPipelineFeedforward(PSPipeline * pipeline, double * inputs, int count,
+                          int element_size, double * outputs);
+void PSPrintPipelineStats(PSPipeline * pipeline);
+void PSDeletePipeline(PSPipeline * pipeline);
+
+#endif //__PS_PIPELINE_H
@@ -32,6 +32,16 @@
 #include "convolutional.h"
 #include "recurrent.h"
 #include "lstm.h"
+#include "gru.h"
+#include "embedding.h"
+#include "softmax.h"
+#include "sparse.h"
+#include "memory.h"
+#include "threadpool.h"
+#include "affinity.h"
+#include "distributed.h"
+#include "parallel.h"
+#include "inference.h"
 
 int PSGlobalFlags = 0;
 
@@ -54,6 +64,78 @@ void PSDeleteGradients(PSGradient ** gradients, PSNeuralNetwork * network);
 
 /* Feedforward Functions */
 
+typedef struct {
+    PSLayer * layer;
+    PSLayer * previous;
+    int is_recurrent;
+    int t;
+    int ok;
+} PSFeedforwardTask;
+
+/* Compute z-values (and activations, if the layer has an activation
+ * function) for neurons in [start, end). Neurons only read the previous
+ * layer, so ranges can run on different threads. */
+
+static void fullFeedforwardNeurons(void * data, int start, int end) {
+    PSFeedforwardTask * task = (PSFeedforwardTask *) data;
+    PSLayer * layer = task->layer;
+    PSLayer * previous = task->previous;
+    int is_recurrent = task->is_recurrent, t = task->t;
+    int i, j, previous_size = previous->size;
+    int sparse = (!is_recurrent && IsSparseLayer(previous));
+#ifdef USE_AVX
+    /* Weights and activation caches are zero-padded, so non-recurrent
+     * layers can run the dot product over the padded size with no tail. */
+    int avx_size = (is_recurrent ? previous_size : PSPaddedSize(previous_size));
+#endif
+    for (i = start; i < end; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        double sum = 0.0;
+        j = 0;
+        if (sparse) {
+            sum = PSSparseDotProduct(previous, neuron->weights);
+            j = previous_size;
+        }
+#ifdef USE_AVX
+        else AVXDotProduct(avx_size, previous->avx_activation_cache,
+                           neuron->weights, sum, j, is_recurrent, t);
+#endif
+        for (; j < previous_size; j++) {
+            PSNeuron * prev_neuron = previous->neurons[j];
+            if (prev_neuron == NULL) {
+                PSErr(NULL, "Layer[%d]: previous layer's neuron[%d] is NULL!",
+                      layer->index, j);
+                task->ok = 0;
+                return;
+            }
+            double a = (is_recurrent ? GetRecurrentState(prev_neuron, t) :
+                        prev_neuron->activation);
+            sum += (a * neuron->weights[j]);
+        }
+        neuron->z_value = sum + neuron->bias;
+        if (layer->activate == NULL) continue;
+        neuron->activation = layer->activate(neuron->z_value);
+#ifdef USE_AVX
+        if (!is_recurrent)
+            layer->avx_activation_cache[i] = neuron->activation;
+#endif
+    }
+}
+
+static int feedforwardNeurons(PSLayer * layer, PSLayer * previous,
+                              int is_recurrent, int t)
+{
+    PSFeedforwardTask task = {layer, previous, is_recurrent, t, 1};
+    int size = layer->size;
+    /* Recurrent layers reallocate their state buffers while running, so
+     * they always stay on the calling thread. */
+    if (!is_recurrent && PSShouldRunParallel(size * previous->size))
+        PSParallelFor(PSGlobalThreadPool, size, fullFeedforwardNeurons, &task);
+    else
+        fullFeedforwardNeurons(&task, 0, size);
+    return task.ok;
+}
+
 static int fullFeedforward(void * _net, void * _layer, ...) {
     PSNeuralNetwork * network = (PSNeuralNetwork*) _net;
     PSLayer * layer = (PSLayer*) _layer;
@@ -72,8 +154,8 @@ static int fullFeedforward(void * _net, void * _layer, ...) {
         PSErr(NULL, "Layer[%d]: previous layer is NULL!", layer->index);
         return 0;
     }
-    int i, j, previous_size = previous->size;
-    int is_recurrent = (network->flags & FLAG_RECURRENT), times, t;
+    int i;
+    int is_recurrent = (network->flags & FLAG_RECURRENT), times, t = 0;
     if (is_recurrent) {
         va_list args;
         va_start(args, _layer);
@@ -81,36 +163,13 @@ static int fullFeedforward(void * _net, void * _layer, ...) {
         t = va_arg(args, int);
         va_end(args);
     }
+    if (!feedforwardNeurons(layer, previous, is_recurrent, t)) return 0;
+    if (!is_recurrent) return 1;
     for (i = 0; i < size; i++) {
         PSNeuron * neuron = layer->neurons[i];
-        double sum = 0.0;
-        j = 0;
-#ifdef USE_AVX
-        AVXDotProduct(previous_size, previous->avx_activation_cache,
-                      neuron->weights, sum, j, is_recurrent, t);
-#endif
-        for (; j < previous_size; j++) {
-            PSNeuron * prev_neuron = previous->neurons[j];
-            if (prev_neuron == NULL) {
-                PSErr(NULL, "Layer[%d]: previous layer's neuron[%d] is NULL!",
-                      layer->index, j);
-                return 0;
-            }
-            double a = prev_neuron->activation;
-            sum += (a * neuron->weights[j]);
-        }
-        neuron->z_value = sum + neuron->bias;
-        neuron->activation = layer->activate(neuron->z_value);
-#ifdef USE_AVX
-        if (!is_recurrent)
-            layer->avx_activation_cache[i] = neuron->activation;
-#endif
-        if (is_recurrent) {
-            PSAddRecurrentState(neuron, neuron->activation, times, t);
-            if (neuron->extra == NULL) {
-                PSErr(func, "Failed to allocate Recurrent Cell!");
-                return 0;
-            }
+        if (!PSAddRecurrentState(neuron, neuron->activation, times, t)) {
+            PSErr(func, "Failed to allocate Recurrent Cell!");
+            return 0;
         }
     }
     return 1;
@@ -134,8 +193,8 @@ static int softmaxFeedforward(void * _net, void * _layer, ...) {
         PSErr(NULL, "Layer[%d]: previous layer is NULL!", layer->index);
         return 0;
     }
-    int i, j, previous_size = previous->size;
-    int is_recurrent = (net->flags & FLAG_RECURRENT), times, t;
+    int i;
+    int is_recurrent = (net->flags & FLAG_RECURRENT), times, t = 0;
     if (is_recurrent) {
         va_list args;
         va_start(args, _layer);
@@ -144,31 +203,17 @@ static int softmaxFeedforward(void * _net, void * _layer, ...) {
         va_end(args);
     }
     double max = 0.0, esum = 0.0;
-    for (i = 0; i < size; i++) {
+    int hierarchical = (layer->flags & FLAG_HIERARCHICAL);
+    if (!feedforwardNeurons(layer, previous, is_recurrent, t)) return 0;
+    if (hierarchical) PSHierarchicalActivations(layer);
+    for (i = 0; i < size && !hierarchical; i++) {
         PSNeuron * neuron = layer->neurons[i];
-        double sum = 0;
-        j = 0;
-#ifdef USE_AVX
-        AVXDotProduct(previous_size, previous->avx_activation_cache,
-                      neuron->weights, sum, j, is_recurrent, t);
-#endif
-        for (; j < previous_size; j++) {
-            PSNeuron * prev_neuron = previous->neurons[j];
-            if (prev_neuron == NULL) {
-                PSErr(NULL, "Layer[%d]: previous layer's neuron[%d] is NULL!",
-                      layer->index, j);
-                return 0;
-            }
-            double a = prev_neuron->activation;
-            sum += (a * neuron->weights[j]);
-        }
-        neuron->z_value = sum + neuron->bias;
         if (i == 0)
             max = neuron->z_value;
         else if (neuron->z_value > max)
             max = neuron->z_value;
     }
-    for (i = 0; i < size; i++) {
+    for (i = 0; i < size && !hierarchical; i++) {
         PSNeuron * neuron = layer->neurons[i];
         double z = neuron->z_value;
         double e = exp(z - max);
@@ -177,14 +222,13 @@ static int softmaxFeedforward(void * _net, void * _layer, ...) {
     }
     for (i = 0; i < size; i++) {
         PSNeuron * neuron = layer->neurons[i];
-        neuron->activation /= esum;
+        if (!hierarchical) neuron->activation /= esum;
 #ifdef USE_AVX
         if (!is_recurrent)
             layer->avx_activation_cache[i] = neuron->activation;
 #endif
         if (is_recurrent) {
-            PSAddRecurrentState(neuron, neuron->activation, times, t);
-            if (neuron->extra == NULL) {
+            if (!PSAddRecurrentState(neuron, neuron->activation, times, t)) {
                 PSErr(func, "Failed to allocate Recurrent Cell!");
                 return 0;
             }
@@ -225,9 +269,8 @@ static void shuffle ( double * array, int size, int element_size )
     }
 }
 
-static void shuffleSeries ( double ** series, int size)
+static void permuteSeries ( double ** series, int size)
 {
-    srand ( time(NULL) );
     for (int i = size - 1; i > 0; i--) {
         int j = rand() % (i+1);
         //printf("Shuffle cycle %d: random is %d\n", i, j);
@@ -238,6 +281,12 @@ static void shuffleSeries ( double ** series, int size)
     }
 }
 
+static void shuffleSeries ( double ** series, int size)
+{
+    srand ( time(NULL) );
+    permuteSeries(series, size);
+}
+
 static double ** getRecurrentSeries(double * array, int series_count,
                                     int x_size, int y_size)
 {
@@ -261,6 +310,62 @@ static double ** getRecurrentSeries(double * array, int series_count,
     return series;
 }
 
+static int compareSeriesLength(const void * a, const void * b)
+{
+    double la = **((double **) a), lb = **((double **) b);
+    return (la > lb) - (la < lb);
+}
+
+/* Fraction of the timesteps computed by batches of padded series that
+ * belong to real series: 1 means no padding at all. */
+double seriesPaddingEfficiency(double ** series, int count, int batch_size)
+{
+    double used = 0.0, padded = 0.0;
+    int i, j, batches = count / batch_size;
+    for (i = 0; i < batches; i++) {
+        double ** batch = series + (i * batch_size);
+        double longest = 0.0;
+        for (j = 0; j < batch_size; j++) {
+            used += *(batch[j]);
+            if (*(batch[j]) > longest) longest = *(batch[j]);
+        }
+        padded += longest * batch_size;
+    }
+    return (padded > 0.0 ? used / padded : 1.0);
+}
+
+/* Length bucketing: series are sorted by length and split into buckets of
+ * bucket_batches batches, so that every batch groups series of similar
+ * length. When shuffling, series are shuffled within each bucket and the
+ * resulting batches across the whole epoch. Series left out of the last
+ * full batch are picked at random beforehand. */
+void bucketSeries(double ** series, int count, int batch_size,
+                  int bucket_batches, int shuffle)
+{
+    int i, batches = count / batch_size;
+    if (batches < 1) return;
+    if (shuffle) shuffleSeries(series, count);
+    count = batches * batch_size;
+    qsort(series, count, sizeof(double *), compareSeriesLength);
+    if (!shuffle) return;
+    int bucket_size = bucket_batches * batch_size;
+    for (i = 0; i < count; i += bucket_size) {
+        int size = count - i;
+        if (size > bucket_size) size = bucket_size;
+        permuteSeries(series + i, size);
+    }
+    double * tmp[batch_size];
+    int bytes = batch_size * sizeof(double *);
+    for (i = batches - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        double ** batch_a = series + (i * batch_size);
+        double ** batch_b = series + (j * batch_size);
+        memcpy(tmp, batch_a, bytes);
+        memcpy(batch_a, batch_b, bytes);
+        memcpy(batch_b, tmp, bytes);
+    }
+}
+
 static int arrayMaxIndex(double * array, int len) {
     int i;
     double max = 0;
@@ -316,6 +421,8 @@ static double getDeltaForNeuron(PSNeuron * neuron,
 {
     int index = neuron->index, i;
     double dv = 0;
+    /* Inactive ReLU units have a zero derivative */
+    if (layer->activate == relu && neuron->activation == 0.0) return 0.0;
     for (i = 0; i < nextLayer->size; i++) {
         PSNeuron * nextNeuron = nextLayer->neurons[i];
         double weight = nextNeuron->weights[index];
@@ -327,6 +434,48 @@ static double getDeltaForNeuron(PSNeuron * neuron,
     return dv;
 }
 
+typedef struct {
+    PSLayer * layer;
+    PSLayer * previous;
+    PSLayer * next;
+    double * last_delta;
+    double * delta;
+    PSGradient * gradients;
+} PSBackpropTask;
+
+/* Deltas and gradients of fully connected neurons in [start, end). */
+
+static void fullBackpropNeurons(void * data, int start, int end) {
+    PSBackpropTask * task = (PSBackpropTask *) data;
+    PSLayer * layer = task->layer;
+    PSLayer * previousLayer = task->previous;
+    int j, w;
+    for (j = start; j < end; j++) {
+        PSNeuron * neuron = layer->neurons[j];
+        double d = getDeltaForNeuron(neuron, layer, task->next,
+                                     task->last_delta);
+        task->delta[j] = d;
+        PSGradient * gradient = &(task->gradients[j]);
+        gradient->bias = d;
+        if (d == 0.0) continue; // Gradients start zeroed
+        if (IsSparseLayer(previousLayer)) {
+            PSSparseMultiplyValue(previousLayer, d, gradient->weights, 0);
+            continue;
+        }
+        w = 0;
+        int wsize = neuron->weights_size;
+#ifdef USE_AVX
+        AVXMultiplyValue(PSPaddedSize(wsize),
+                         previousLayer->avx_activation_cache, d,
+                         gradient->weights, w, 0, 0, 0);
+#endif
+        for (; w < wsize; w++) {
+            double prev_a = previousLayer->neurons[w]->activation;
+            gradient->weights[w] = d * prev_a;
+        }
+    }
+}
+
 static int compareVersion(const char* vers1, const char* vers2) {
     int major1 = 0, minor1 = 0, patch1 = 0;
     int major2 = 0, minor2 = 0, patch2 = 0;
@@ -355,6 +504,10 @@ char * PSGetLabelForType(PSLayerType type) {
             return "LSTM";
         case SoftMax:
             return "Softmax";
+        case GRU:
+            return "GRU";
+        case Embedding:
+            return "Embedding";
     }
     return "UNKOWN";
 }
@@ -412,6 +565,12 @@ static void printLayerInfo(PSLayer * layer) {
         printf(", input size = %dx%d, features = %d", input_w, input_h, fcount);
         printf(", region = %dx%d, stride = %d, activation = %s\n",
                rsize, rsize, stride, actv);
+    } else if (ltype == Embedding && layer->extra != NULL) {
+        printf(", rows = %d\n", GetEmbeddingTable(layer)->rows);
+    } else if (ltype == SoftMax && (layer->flags & FLAG_HIERARCHICAL)) {
+        printf(", hierarchical\n");
+    } else if (ltype == SoftMax && PSGetSoftmaxSamples(layer) > 0) {
+        printf(", samples = %d\n", PSGetSoftmaxSamples(layer));
     } else printf("\n");
 }
 
@@ -492,6 +651,9 @@ PSNeuralNetwork * PSCreateNetwork(const char* name) {
     network->flags = FLAG_NONE;
     network->loss = PSQuadraticLoss;
     network->onEpochTrained = NULL;
+    network->memory_flags = 0;
+    network->memory = NULL;
+    network->inference = NULL;
     return network;
 }
 
@@ -507,6 +669,7 @@ PSNeuralNetwork * PSCloneNetwork(PSNeuralNetwork * network, int layout_only) {
     }
     clone->flags = network->flags;
     clone->loss = network->loss;
+    clone->memory_flags = network->memory_flags;
     
     int i, j, k, w;
     for (i = 0; i < network->size; i++) {
@@ -537,6 +700,9 @@ PSNeuralNetwork * PSCloneNetwork(PSNeuralNetwork * network, int layout_only) {
             return NULL;
         }
         cloned_layer->flags = layer->flags;
+        /* Keep activations changed after the layer got added */
+        cloned_layer->activate = layer->activate;
+        cloned_layer->derivative = layer->derivative;
         if (!layout_only) {
             void * extra = layer->extra;
             if (Convolutional == type && extra) {
@@ -549,6 +715,11 @@ PSNeuralNetwork * PSCloneNetwork(PSNeuralNetwork * network, int layout_only) {
                     for (w = 0; w < cshared->weights_size; w++)
                         cshared->weights[k][w] = oshared->weights[k][w];
                 }
+            } else if (Embedding == type) {
+                PSEmbeddingTable * otable = GetEmbeddingTable(layer);
+                PSEmbeddingTable * ctable = GetEmbeddingTable(cloned_layer);
+                memcpy(ctable->table, otable->table,
+                       (size_t) otable->rows * otable->size * sizeof(double));
             }
             for (j = 0; j < layer->size; j++) {
                 PSNeuron * orig_n = layer->neurons[j];
@@ -568,13 +739,15 @@ PSNeuralNetwork * PSCloneNetwork(PSNeuralNetwork * network, int layout_only) {
                     PSRecurrentCell * ocell = GetRecurrentCell(orig_n);
                     PSRecurrentCell * ccell = GetRecurrentCell(clone_n);
                     int sc = ocell->states_count;
-                    ccell->states_count = sc;
-                    if (sc > 0) {
-                        ccell->states = malloc(sc * sizeof(double));
-                        if (ccell->states == NULL) {
-                            printMemoryErrorMsg();
-                            PSDeleteNetwork(clone);
-                            return NULL;
+                    if (sc > 0 && ocell->states != NULL) {
+                        if (ccell == NULL || ccell->states == NULL ||
+                            ccell->states_count != sc)
+                        {
+                            if (!PSReserveLayerStates(cloned_layer, sc)) {
+                                PSDeleteNetwork(clone);
+                                return NULL;
+                            }
+                            ccell = GetRecurrentCell(clone_n);
                         }
                         for (k = 0; k < sc; k++)
                             ccell->states[k] = ocell->states[k];
@@ -587,13 +760,84 @@ PSNeuralNetwork * PSCloneNetwork(PSNeuralNetwork * network, int layout_only) {
                     ccell->input_bias = ocell->input_bias;
                     ccell->output_bias = ocell->output_bias;
                     ccell->forget_bias = ocell->forget_bias;
+                } else if (layer->type == GRU) {
+                    PSGRUCell * ocell = GetGRUCell(orig_n);
+                    PSGRUCell * ccell = GetGRUCell(clone_n);
+                    ccell->candidate_bias = ocell->candidate_bias;
+                    ccell->reset_bias = ocell->reset_bias;
+                    ccell->update_bias = ocell->update_bias;
                 }
             }
         }
     }
+    if (clone->memory_flags && !PSApplyMemoryPolicy(clone)) {
+        PSDeleteNetwork(clone);
+        return NULL;
+    }
     return clone;
 }
 
+int PSCopyNetworkWeights(PSNeuralNetwork * dest, PSNeuralNetwork * src) {
+    if (dest == NULL || src == NULL) return 0;
+    char * func = "PSCopyNetworkWeights";
+    if (dest->size != src->size) {
+        PSErr(func, "Network size differs!");
+        return 0;
+    }
+    int i, j;
+    for (i = 1; i < src->size; i++) {
+        PSLayer * slayer = src->layers[i];
+        PSLayer * dlayer = dest->layers[i];
+        if (slayer->type != dlayer->type || slayer->size != dlayer->size) {
+            PSErr(func, "Layer %d differs!", i);
+            return 0;
+        }
+        if (Convolutional == slayer->type) {
+            PSSharedParams * sshared = getConvSharedParams(slayer);
+            PSSharedParams * dshared = getConvSharedParams(dlayer);
+            int ws = sshared->weights_size;
+            for (j = 0; j < sshared->feature_count; j++) {
+                dshared->biases[j] = sshared->biases[j];
+                memcpy(dshared->weights[j], sshared->weights[j],
+                       ws * sizeof(double));
+            }
+            continue;
+        } else if (Embedding == slayer->type) {
+            PSEmbeddingTable * stable = GetEmbeddingTable(slayer);
+            PSEmbeddingTable * dtable = GetEmbeddingTable(dlayer);
+            if (stable->rows != dtable->rows) {
+                PSErr(func, "Layer %d differs!", i);
+                return 0;
+            }
+            memcpy(dtable->table, stable->table,
+                   (size_t) stable->rows * stable->size * sizeof(double));
+            continue;
+        } else if (Pooling == slayer->type) continue;
+        for (j = 0; j < slayer->size; j++) {
+            PSNeuron * sn = slayer->neurons[j];
+            PSNeuron * dn = dlayer->neurons[j];
+            dn->bias = sn->bias;
+            memcpy(dn->weights, sn->weights, sn->weights_size * sizeof(double));
+            if (LSTM == slayer->type) {
+                PSLSTMCell * scell = GetLSTMCell(sn);
+                PSLSTMCell * dcell = GetLSTMCell(dn);
+                dcell->candidate_bias = scell->candidate_bias;
+                dcell->input_bias = scell->input_bias;
+                dcell->output_bias = scell->output_bias;
+                dcell->forget_bias = scell->forget_bias;
+            } else if (GRU == slayer->type) {
+                PSGRUCell * scell = GetGRUCell(sn);
+                PSGRUCell * dcell = GetGRUCell(dn);
+                dcell->candidate_bias = scell->candidate_bias;
+                dcell->reset_bias = scell->reset_bias;
+                dcell->update_bias = scell->update_bias;
+            }
+        }
+    }
+    PSInvalidateTransposedWeights(dest);
+    return 1;
+}
+
 int PSLoadNetwork(PSNeuralNetwork * network, const char* filename) {
     if (network == NULL) return 0;
     FILE * f = fopen(filename, "r");
@@ -762,6 +1006,7 @@ int PSLoadNetwork(PSNeuralNetwork * network, const char* filename) {
         layer = network->layers[i];
         int lsize = 0;
         PSSharedParams * shared = NULL;
+        PSEmbeddingTable * table = NULL;
         if (layer->type == Convolutional) {
             shared = getConvSharedParams(layer);
             if (shared == NULL) {
@@ -772,24 +1017,33 @@ int PSLoadNetwork(PSNeuralNetwork * network, const char* filename) {
             lsize = shared->feature_count;
         } else if (layer->type == Pooling) {
             continue;
+        } else if (layer->type == Embedding) {
+            table = GetEmbeddingTable(layer);
+            lsize = table->rows;
         } else lsize = layer->size;
-        int is_lstm = (LSTM == layer->type);
+        int is_lstm = (LSTM == layer->type), is_gru = (GRU == layer->type);
         for (j = 0; j < lsize; j++) {
             double bias = 0;
             int wsize = 0;
             double * weights = NULL;
-            //LSTM biases
+            //LSTM biases (candidate, reset and update ones for GRU)
             double cb = 0.0, ib = 0.0, ob = 0.0, fb = 0.0;
-            if (!is_lstm)
-                matched = fscanf(f, "%lf|", &bias);
-            else
+            if (is_lstm)
                 matched = fscanf(f, "%lf,%lf,%lf,%lf|", &cb, &ib, &ob, &fb);
+            else if (is_gru)
+                matched = fscanf(f, "%lf,%lf,%lf|", &cb, &ib, &ob);
+            else if (table == NULL)
+                matched = fscanf(f, "%lf|", &bias);
+            else matched = 1; // Embedding rows have no bias
             if (!matched) {
                 PSErr(func, "Layer %d, neuron %d: invalid bias!", i, j);
                 fclose(f);
                 return 0;
             }
-            if (shared == NULL) {
+            if (table != NULL) {
+                wsize = table->size;
+                weights = GetEmbeddingRow(table, j);
+            } else if (shared == NULL) {
                 PSNeuron * neuron = layer->neurons[j];
                 wsize = neuron->weights_size;
                 neuron->bias = bias;
@@ -801,6 +1055,12 @@ int PSLoadNetwork(PSNeuralNetwork * network, const char* filename) {
                     cell->input_bias = ib;
                     cell->output_bias = ob;
                     cell->forget_bias = fb;
+                } else if (is_gru) {
+                    PSGRUCell * cell = GetGRUCell(neuron);
+                    assert(cell != NULL);
+                    cell->candidate_bias = cb;
+                    cell->reset_bias = ib;
+                    cell->update_bias = ob;
                 }
             } else {
                 shared->biases[j] = bias;
@@ -827,9 +1087,24 @@ int PSLoadNetwork(PSNeuralNetwork * network, const char* filename) {
     }
     printf("\n");
     fclose(f);
+    PSInvalidateTransposedWeights(network);
+    if (network->memory_flags && !PSApplyMemoryPolicy(network)) {
+        PSErr(func, "Could not apply memory policy!");
+        return 0;
+    }
     return 1;
 }
 
+/* Layers added after this call stay on the heap until the policy is
+ * applied again (by PSLoadNetwork, PSCloneNetwork or a new call). */
+
+int PSSetMemoryPolicy(PSNeuralNetwork * network, int flags) {
+    if (network == NULL) return 0;
+    network->memory_flags = flags;
+    if (network->size == 0) return 1;
+    return PSApplyMemoryPolicy(network);
+}
+
 int PSSaveNetwork(PSNeuralNetwork * network, const char* filename) {
     char * func = "saveNetwork";
     if (network->size == 0) {
@@ -906,11 +1181,28 @@ int PSSaveNetwork(PSNeuralNetwork * network, const char* filename) {
             }
         }
         else if (Pooling == ltype) continue;
-        else {
-            int is_lstm = (LSTM == ltype);
+        else if (Embedding == ltype) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            for (j = 0; j < table->rows; j++) {
+                double * row = GetEmbeddingRow(table, j);
+                for (k = 0; k < table->size; k++) {
+                    if (k > 0) fprintf(f, ",");
+                    fprintf(f, "%.15e", row[k]);
+                }
+                fprintf(f, "\n");
+            }
+        } else {
+            int is_lstm = (LSTM == ltype), is_gru = (GRU == ltype);
             for (j = 0; j < lsize; j++) {
                 PSNeuron * neuron = layer->neurons[j];
-                if (!is_lstm)
+                if (is_gru) {
+                    PSGRUCell * cell = GetGRUCell(neuron);
+                    assert(cell != NULL);
+                    fprintf(f, "%.15e,%.15e,%.15e|",
+                            cell->candidate_bias,
+                            cell->reset_bias,
+                            cell->update_bias);
+                } else if (!is_lstm)
                     fprintf(f, "%.15e|", neuron->bias);
                 else {
                     PSLSTMCell * cell = GetLSTMCell(neuron);
@@ -937,26 +1229,25 @@ int PSSaveNetwork(PSNeuralNetwork * network, const char* filename) {
 void PSDeleteNetwork(PSNeuralNetwork * network) {
     int size = network->size;
     int i, is_recurrent = (network->flags & FLAG_RECURRENT);
+    PSStopInference(network);
     for (i = 0; i < size; i++) {
         PSLayer * layer = network->layers[i];
         if (is_recurrent) layer->flags |= FLAG_RECURRENT;
         PSDeleteLayer(layer);
     }
+    PSDeleteMemoryBlock(getNetworkMemory(network));
     free(network->layers);
     free(network);
 }
 
 void PSDeleteNeuron(PSNeuron * neuron, PSLayer * layer) {
-    if (neuron->weights != NULL) free(neuron->weights);
+    if (neuron->weights != NULL)
+        PSFreeNetworkMemory(getLayerNetwork(layer), neuron->weights);
     if (neuron->extra != NULL) {
         if (layer->flags & FLAG_RECURRENT) {
             if (layer->type == LSTM)
                 PSDeleteLSTMCell(GetLSTMCell(neuron));
-            else {
-                PSRecurrentCell * cell = GetRecurrentCell(neuron);
-                if (cell->states != NULL) free(cell->states);
-                free(cell);
-            }
+            else free(neuron->extra);
         } else free(neuron->extra);
     }
     free(neuron);
@@ -970,6 +1261,16 @@ PSLayer * PSAddLayer(PSNeuralNetwork * network, PSLayerType type, int size,
         PSErr(func, "First layer type must be FullyConnected");
         return NULL;
     }
+    if (type == Embedding && network->size != 1) {
+        PSErr(func, "Embedding layers must follow the input layer");
+        return NULL;
+    }
+    if (network->size == 2 && network->layers[1]->type == Embedding &&
+        (type == Convolutional || type == Pooling || type == Recurrent)) {
+        PSErr(func, "%s layers cannot follow an Embedding layer",
+              PSGetLabelForType(type));
+        return NULL;
+    }
     PSLayer * layer = malloc(sizeof(PSLayer));
     if (layer == NULL) {
         PSErr(func, "Could not allocate layer %d!", network->size);
@@ -982,6 +1283,15 @@ PSLayer * PSAddLayer(PSNeuralNetwork * network, PSLayerType type, int size,
     layer->parameters = params;
     layer->extra = NULL;
     layer->flags = FLAG_NONE;
+    layer->states_capacity = 0;
+    layer->states_buffer = NULL;
+    layer->recurrent_weights_t = NULL;
+    layer->recurrent_weights_dirty = 1;
+    layer->nonzero_count = -1;
+    layer->nonzero_indexes = NULL;
+    layer->nonzero_values = NULL;
+    layer->activations_seen = 0;
+    layer->nonzero_seen = 0;
 #ifdef USE_AVX
     layer->avx_activation_cache = NULL;
 #endif
@@ -1046,7 +1356,7 @@ PSLayer * PSAddLayer(PSNeuralNetwork * network, PSLayerType type, int size,
             return NULL;
         }
 #ifdef USE_AVX
-        layer->avx_activation_cache = calloc(size, sizeof(double));
+        layer->avx_activation_cache = PSAlignedAlloc(size);
         if (layer->avx_activation_cache == NULL) {
             printMemoryErrorMsg();
             PSAbortLayer(network, layer);
@@ -1066,7 +1376,13 @@ PSLayer * PSAddLayer(PSNeuralNetwork * network, PSLayerType type, int size,
             if (layer->index > 0) {
                 neuron->weights_size = previous_size;
                 neuron->bias = gaussian_random(0, 1);
-                neuron->weights = malloc(sizeof(double) * previous_size);
+                neuron->weights = PSAlignedAlloc(previous_size);
+                if (neuron->weights == NULL) {
+                    free(neuron);
+                    PSAbortLayer(network, layer);
+                    PSErr(func, "Could not allocate neuron weights!");
+                    return NULL;
+                }
                 for (j = 0; j < previous_size; j++) {
                     neuron->weights[j] = gaussian_random(0, 1);
                 }
@@ -1101,6 +1417,11 @@ PSLayer * PSAddLayer(PSNeuralNetwork * network, PSLayerType type, int size,
     } else if (type == LSTM) {
         initialized = PSInitLSTMLayer(network, layer, size, previous_size);
         if (initialized) network->loss = PSCrossEntropyLoss;
+    } else if (type == GRU) {
+        initialized = PSInitGRULayer(network, layer, size, previous_size);
+        if (initialized) network->loss = PSCrossEntropyLoss;
+    } else if (type == Embedding) {
+        initialized = PSInitEmbeddingLayer(network, layer, size, previous_size);
     }
     if (!initialized) {
         PSAbortLayer(network, layer);
@@ -1146,14 +1467,26 @@ void PSDeleteLayer(PSLayer* layer) {
             if (shared->biases != NULL) free(shared->biases);
             if (shared->weights != NULL) {
                 int i;
-                for (i = 0; i < fc; i++) free(shared->weights[i]);
+                for (i = 0; i < fc; i++)
+                    PSFreeNetworkMemory(getLayerNetwork(layer),
+                                        shared->weights[i]);
                 free(shared->weights);
             }
             free(extra);
+        } else if (layer->type == Embedding) {
+            PSEmbeddingTable * table = (PSEmbeddingTable*) extra;
+            PSFreeNetworkMemory(getLayerNetwork(layer), table->table);
+            free(extra);
         } else free(extra);
     }
+    free(layer->states_buffer);
+    free(layer->recurrent_weights_t);
+    free(layer->nonzero_indexes);
+    free(layer->nonzero_values);
 #ifdef USE_AVX
-    if (layer->avx_activation_cache != NULL) free(layer->avx_activation_cache);
+    if (layer->avx_activation_cache != NULL)
+        PSFreeNetworkMemory(getLayerNetwork(layer),
+                            layer->avx_activation_cache);
 #endif
     free(layer);
 }
@@ -1233,42 +1566,97 @@ void PSDeleteLayerParamenters(PSLayerParameters * params) {
     free(params);
 }
 
-int feedforwardThroughTime(PSNeuralNetwork * network, double * values,
-                           int times)
+/* Wavefront scheduling: with FLAG_WAVEFRONT and a thread pool, layer l
+ * at time t runs as soon as layer l at t - 1 and layer l - 1 at t are
+ * done, so whole anti-diagonals of the (layer, time) grid run at once.
+ * Layers read their inputs at t from the previous layer's states, never
+ * from its current activations. */
+
+static int useWavefront(PSNeuralNetwork * network, int times) {
+    return ((PSGlobalFlags & FLAG_WAVEFRONT) && PSGlobalThreadPool != NULL &&
+            !PSSerialThread && network->size > 2 && times > 1);
+}
+
+typedef struct {
+    PSNeuralNetwork * network;
+    int times;
+    int first;
+    int ok;
+} PSForwardWavefront;
+
+static int feedforwardLayerAt(PSNeuralNetwork * network, int i, int times,
+                              int t)
+{
+    char * func = "feedforwardThroughTime";
+    PSLayer * layer = network->layers[i];
+    if (layer == NULL) {
+        PSErr(func, "Layer %d is NULL", i);
+        return 0;
+    }
+    if (layer->feedforward == NULL) {
+        PSErr(func, "Layer %d feedforward function is NULL", i);
+        return 0;
+    }
+    return layer->feedforward(network, layer, times, t);
+}
+
+static void forwardWavefrontTask(void * data, int row, int t) {
+    PSForwardWavefront * ctx = (PSForwardWavefront *) data;
+    if (!ctx->ok) return;
+    if (!feedforwardLayerAt(ctx->network, row + 1, ctx->times,
+                            ctx->first + t))
+        ctx->ok = 0;
+}
+
+/* Run timesteps [first_t, times) with values holding their inputs. A
+ * first_t > 0 continues from the states already in the earlier slots.
+ * When training, outputs needing their targets are left to the backward
+ * pass (see backpropOutputAt). */
+
+static int feedforwardWindow(PSNeuralNetwork * network, double * values,
+                             int times, int first_t, int training)
 {
-    if (network == NULL) return 0;
     PSLayer * first = network->layers[0];
-    int input_size = first->size;
+    PSLayer * output = network->layers[network->size - 1];
+    int input_size = first->size, layers = network->size;
     char * func = "feedforwardThroughTime";
     int i, t;
-    for (t = 0; t < times; t++) {
+    if (training && PSSoftmaxNeedsTargets(output)) {
+        if (!PSReserveLayerStates(output, times)) return 0;
+        layers--;
+    }
+    for (t = first_t; t < times; t++) {
         for (i = 0; i < input_size; i++) {
             PSNeuron * neuron = first->neurons[i];
             neuron->activation = values[i];
-            PSAddRecurrentState(neuron, values[i], times, t);
-            if (neuron->extra == NULL) {
+            if (!PSAddRecurrentState(neuron, values[i], times, t)) {
                 PSErr(func, "Failed to allocate Recurrent Cell!");
                 return 0;
             }
         }
-        for (i = 1; i < network->size; i++) {
-            PSLayer * layer = network->layers[i];
-            if (layer == NULL) {
-                PSErr(func, "Layer %d is NULL", i);
-                return 0;
-            }
-            if (layer->feedforward == NULL) {
-                PSErr(func, "Layer %d feedforward function is NULL", i);
-                return 0;
-            }
-            int ok = layer->feedforward(network, layer, times, t);
-            if (!ok) return 0;
-        }
         values += input_size;
     }
+    if (useWavefront(network, times - first_t)) {
+        PSForwardWavefront ctx = {network, times, first_t, 1};
+        PSParallelWavefront(PSGlobalThreadPool, layers - 1, times - first_t,
+                            forwardWavefrontTask, &ctx);
+        return ctx.ok;
+    }
+    for (t = first_t; t < times; t++) {
+        for (i = 1; i < layers; i++) {
+            if (!feedforwardLayerAt(network, i, times, t)) return 0;
+        }
+    }
     return 1;
 }
 
+int feedforwardThroughTime(PSNeuralNetwork * network, double * values,
+                           int times)
+{
+    if (network == NULL) return 0;
+    return feedforwardWindow(network, values, times, 0, 0);
+}
+
 int PSFeedforward(PSNeuralNetwork * network, double * values) {
     if (network == NULL) return 0;
     char * func = "PSFeedforward";
@@ -1293,6 +1681,7 @@ int PSFeedforward(PSNeuralNetwork * network, double * values) {
         first->avx_activation_cache[i] = values[i];
 #endif
     }
+    if (!PSUpdateNonzeroActivations(first)) return 0;
     for (i = 1; i < network->size; i++) {
         PSLayer * layer = network->layers[i];
         if (layer == NULL) {
@@ -1304,11 +1693,133 @@ int PSFeedforward(PSNeuralNetwork * network, double * values) {
             return 0;
         }
         int success = layer->feedforward(network, layer);
-        if (!success) return 0;
+        if (!success || !PSUpdateNonzeroActivations(layer)) return 0;
+    }
+    return 1;
+}
+
+/* Batched Feedforward */
+
+typedef struct {
+    double ** x;
+    double ** w;
+    double * z;
+    int count;
+    int size;
+    int input_size;
+} PSBatchFeedforwardTask;
+
+static void batchFeedforwardNeurons(void * data, int start, int end) {
+    PSBatchFeedforwardTask * task = (PSBatchFeedforwardTask *) data;
+    PSMatrixProduct(task->x, task->count, task->w + start, end - start,
+                    task->input_size, task->z + start, task->size);
+}
+
+static int canFeedforwardBatch(PSNeuralNetwork * network) {
+    int i;
+    if (network->flags & FLAG_RECURRENT) return 0;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type == SoftMax) {
+            if (layer->flags & FLAG_HIERARCHICAL) return 0;
+        } else if (layer->type != FullyConnected) return 0;
     }
     return 1;
 }
 
+/* Run layer on the count rows of values (previous->size values each) at
+ * once, as the product of the inputs by the transposed weights matrix,
+ * writing count rows of activations to dest. */
+
+static void feedforwardLayerBatch(PSLayer * layer, PSLayer * previous,
+                                  double * values, int count, double * dest,
+                                  double ** x, double ** w)
+{
+    int size = layer->size, input_size = previous->size, i, b;
+    for (b = 0; b < count; b++) x[b] = values + (b * input_size);
+    for (i = 0; i < size; i++) w[i] = layer->neurons[i]->weights;
+    PSBatchFeedforwardTask task = {x, w, dest, count, size, input_size};
+    if (PSShouldRunParallel(count * size * input_size))
+        PSParallelFor(PSGlobalThreadPool, size, batchFeedforwardNeurons,
+                      &task);
+    else
+        batchFeedforwardNeurons(&task, 0, size);
+    for (b = 0; b < count; b++) {
+        double * z = dest + (b * size), max = 0.0, esum = 0.0;
+        for (i = 0; i < size; i++) {
+            z[i] += layer->neurons[i]->bias;
+            if (layer->type != SoftMax) {
+                if (layer->activate != NULL) z[i] = layer->activate(z[i]);
+            } else if (i == 0 || z[i] > max) max = z[i];
+        }
+        if (layer->type != SoftMax) continue;
+        for (i = 0; i < size; i++) {
+            z[i] = exp(z[i] - max);
+            esum += z[i];
+        }
+        for (i = 0; i < size; i++) z[i] /= esum;
+    }
+}
+
+/* Feed count inputs (stored one after the other) through the network and
+ * copy their output activations to outputs. Fully connected networks run
+ * every layer once for the whole batch, so its weights are read once per
+ * batch instead of once per input; they leave the neurons activations
+ * untouched. Other non recurrent networks run input by input. */
+
+int PSFeedforwardBatch(PSNeuralNetwork * network, double * inputs, int count,
+                       double * outputs)
+{
+    if (network == NULL) return 0;
+    char * func = "PSFeedforwardBatch";
+    if (network->size < 2) {
+        PSErr(func, "Empty network!");
+        return 0;
+    }
+    if (network->flags & FLAG_RECURRENT) {
+        PSErr(func, "Recurrent networks are not supported");
+        return 0;
+    }
+    PSLayer * out = network->layers[network->size - 1];
+    int input_size = network->layers[0]->size, i, j;
+    if (!canFeedforwardBatch(network)) {
+        for (i = 0; i < count; i++) {
+            if (!PSFeedforward(network, inputs + (i * input_size))) return 0;
+            for (j = 0; j < out->size; j++)
+                outputs[(i * out->size) + j] = out->neurons[j]->activation;
+        }
+        return 1;
+    }
+    int max_size = 0;
+    for (i = 1; i < network->size - 1; i++) {
+        if (network->layers[i]->size > max_size)
+            max_size = network->layers[i]->size;
+    }
+    double * buffers[2] = {NULL, NULL};
+    double ** x = malloc(count * sizeof(double*));
+    double ** w = malloc((max_size > out->size ? max_size : out->size) *
+                         sizeof(double*));
+    int ok = (x != NULL && w != NULL);
+    for (i = 0; i < 2 && ok && max_size > 0; i++) {
+        buffers[i] = malloc((size_t) count * max_size * sizeof(double));
+        if (buffers[i] == NULL) ok = 0;
+    }
+    if (!ok) printMemoryErrorMsg();
+    double * values = inputs;
+    for (i = 1; i < network->size && ok; i++) {
+        PSLayer * layer = network->layers[i];
+        double * dest = (layer == out ? outputs : buffers[i % 2]);
+        feedforwardLayerBatch(layer, network->layers[i - 1], values, count,
+                              dest, x, w);
+        values = dest;
+    }
+    free(x);
+    free(w);
+    free(buffers[0]);
+    free(buffers[1]);
+    return ok;
+}
+
 PSGradient * createLayerGradients(PSLayer * layer) {
     if (layer == NULL) return NULL;
     PSGradient * gradients;
@@ -1317,6 +1828,18 @@ PSGradient * createLayerGradients(PSLayer * layer) {
     if (ltype == Pooling) return NULL;
     int size = layer->size;
     PSLayerParameters * parameters = NULL;
+    if (ltype == Embedding) {
+        /* Rows are allocated on lookup, see PSGetEmbeddingGradientRow */
+        gradients = calloc(GetEmbeddingTable(layer)->rows, sizeof(PSGradient));
+        if (gradients == NULL) PSErr(func, "Could not allocate memory!");
+        return gradients;
+    }
+    if (PSSoftmaxNeedsTargets(layer)) {
+        /* Rows are allocated on use, see PSGetSoftmaxGradientRow */
+        gradients = calloc(size, sizeof(PSGradient));
+        if (gradients == NULL) PSErr(func, "Could not allocate memory!");
+        return gradients;
+    }
     if (ltype == Convolutional) {
         parameters = layer->parameters;
         if (parameters == NULL) {
@@ -1341,17 +1864,15 @@ PSGradient * createLayerGradients(PSLayer * layer) {
             }
         } else {
             ws = neuron->weights_size;
-            if (ltype == LSTM) ws += 4; // Make room for LSTM biases
+            ws += GetGateBiasesCount(layer); // Make room for gate biases
         }
         gradients[i].bias = 0;
-        int memsize = sizeof(double) * ws;
-        gradients[i].weights = malloc(memsize);
+        gradients[i].weights = PSAlignedAlloc(ws);
         if (gradients[i].weights == NULL) {
             PSErr(func, "Could not allocate memory!");
-            PSDeleteLayerGradients(gradients, size);
+            PSDeleteLayerGradients(gradients, i);
             return NULL;
         }
-        memset(gradients[i].weights, 0, memsize);
     }
     return gradients;
 }
@@ -1376,32 +1897,255 @@ int PSClassify(PSNeuralNetwork * network, double * values) {
     return max_idx;
 }
 
-PSGradient ** createGradients(PSNeuralNetwork * network) {
-    if (network == NULL) return NULL;
-    PSGradient ** gradients = malloc(sizeof(PSGradient*) * network->size - 1);
-    if (gradients == NULL) {
-        printMemoryErrorMsg();
-        return NULL;
-    }
-    int i;
+/* Stateful inference */
+
+static int getStepStateSize(PSNeuralNetwork * network) {
+    int size = 0, i;
     for (i = 1; i < network->size; i++) {
         PSLayer * layer = network->layers[i];
-        int idx = i - 1;
-        gradients[idx] = createLayerGradients(layer);
-        if (gradients[idx] == NULL && layer->type != Pooling) {
-            printMemoryErrorMsg();
-            PSDeleteGradients(gradients, network);
-            return NULL;
-        }
+        if (layer->type == Recurrent || layer->type == GRU)
+            size += layer->size;
+        else if (layer->type == LSTM) size += (2 * layer->size);
     }
-    return gradients;
+    return size;
 }
 
-void PSDeleteLayerGradients(PSGradient * gradient, int size) {
-    int i;
-    for (i = 0; i < size; i++) {
-        PSGradient g = gradient[i];
-        free(g.weights);
+PSStepState * PSCreateStepState(PSNeuralNetwork * network) {
+    char * func = "PSCreateStepState";
+    if (network == NULL) return NULL;
+    if (!(network->flags & FLAG_RECURRENT)) {
+        PSErr(func, "Network is not recurrent");
+        return NULL;
+    }
+    PSStepState * state = malloc(sizeof(PSStepState));
+    if (state == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    state->size = getStepStateSize(network);
+    state->output_size = network->output_size;
+    state->steps = 0;
+    state->values = calloc(state->size + 1, sizeof(double));
+    state->output = calloc(state->output_size, sizeof(double));
+    if (state->values == NULL || state->output == NULL) {
+        printMemoryErrorMsg();
+        PSDeleteStepState(state);
+        return NULL;
+    }
+    return state;
+}
+
+PSStepState * PSCloneStepState(PSStepState * state) {
+    if (state == NULL) return NULL;
+    PSStepState * clone = malloc(sizeof(PSStepState));
+    if (clone == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    *clone = *state;
+    clone->values = malloc((state->size + 1) * sizeof(double));
+    clone->output = malloc(state->output_size * sizeof(double));
+    if (clone->values == NULL || clone->output == NULL) {
+        printMemoryErrorMsg();
+        PSDeleteStepState(clone);
+        return NULL;
+    }
+    memcpy(clone->values, state->values, state->size * sizeof(double));
+    memcpy(clone->output, state->output, state->output_size * sizeof(double));
+    return clone;
+}
+
+/* A zero state is the one a series starts from */
+
+void PSResetStepState(PSStepState * state) {
+    if (state == NULL) return;
+    memset(state->values, 0, state->size * sizeof(double));
+    memset(state->output, 0, state->output_size * sizeof(double));
+    state->steps = 0;
+}
+
+int PSSaveStepState(PSStepState * state, const char * filename) {
+    if (state == NULL) return 0;
+    FILE * f = fopen(filename, "w");
+    if (f == NULL) {
+        PSErr("PSSaveStepState", "Cannot open %s for writing!", filename);
+        return 0;
+    }
+    int i;
+    fprintf(f, "--state,%d,%d,%d\n", state->size, state->output_size,
+            state->steps);
+    for (i = 0; i < state->size; i++)
+        fprintf(f, "%s%.15e", (i > 0 ? "," : ""), state->values[i]);
+    fprintf(f, "\n");
+    for (i = 0; i < state->output_size; i++)
+        fprintf(f, "%s%.15e", (i > 0 ? "," : ""), state->output[i]);
+    fprintf(f, "\n");
+    fclose(f);
+    return 1;
+}
+
+/* Load a state saved by PSSaveStepState into one created for a network
+ * with the same layout. */
+
+int PSLoadStepState(PSStepState * state, const char * filename) {
+    char * func = "PSLoadStepState";
+    if (state == NULL) return 0;
+    FILE * f = fopen(filename, "r");
+    if (f == NULL) {
+        PSErr(func, "Cannot open %s!", filename);
+        return 0;
+    }
+    int size = 0, output_size = 0, steps = 0, i, ok = 1;
+    if (fscanf(f, "--state,%d,%d,%d\n", &size, &output_size, &steps) != 3) {
+        PSErr(func, "Invalid state file %s", filename);
+        fclose(f);
+        return 0;
+    }
+    if (size != state->size || output_size != state->output_size) {
+        PSErr(func, "State size %d/%d does not match %d/%d", size,
+              output_size, state->size, state->output_size);
+        fclose(f);
+        return 0;
+    }
+    for (i = 0; i < size && ok; i++)
+        ok = (fscanf(f, (i > 0 ? ",%lf" : "%lf"), &(state->values[i])) == 1);
+    for (i = 0; i < output_size && ok; i++)
+        ok = (fscanf(f, (i > 0 ? ",%lf" : "\n%lf"), &(state->output[i])) == 1);
+    fclose(f);
+    if (!ok) {
+        PSErr(func, "Invalid state file %s", filename);
+        PSResetStepState(state);
+        return 0;
+    }
+    state->steps = steps;
+    return 1;
+}
+
+void PSDeleteStepState(PSStepState * state) {
+    if (state == NULL) return;
+    free(state->values);
+    free(state->output);
+    free(state);
+}
+
+/* A step runs the network as the second timestep of a two-step series
+ * whose first step is restored from the state, so that layers take the
+ * usual t > 0 path. Layers only grow their buffers if they never ran a
+ * series that long. */
+
+static int reserveStepStates(PSNeuralNetwork * network) {
+    int i;
+    for (i = 0; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->states_capacity >= 2) continue;
+        if (!PSReserveLayerStates(layer, 2)) return 0;
+    }
+    return 1;
+}
+
+static void setStepState(PSLayer * layer, int i, int t, double value) {
+    GetRecurrentState(layer->neurons[i], t) = value;
+#ifdef USE_AVX
+    layer->avx_activation_cache[(t * layer->size) + i] = value;
+#endif
+}
+
+/* Copy the state of every Recurrent, LSTM and GRU layer at time t in or out of
+ * values, laid out as in PSStepState. */
+
+static void loadStepValues(PSNeuralNetwork * network, double * values, int t)
+{
+    int i, j;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type != Recurrent && layer->type != LSTM &&
+            layer->type != GRU) continue;
+        for (j = 0; j < layer->size; j++) setStepState(layer, j, t, *values++);
+        if (layer->type != LSTM) continue;
+        for (j = 0; j < layer->size; j++)
+            GetLSTMCell(layer->neurons[j])->z_values[t] = *values++;
+    }
+}
+
+static void storeStepValues(PSNeuralNetwork * network, double * values,
+                            int t)
+{
+    int i, j;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type != Recurrent && layer->type != LSTM &&
+            layer->type != GRU) continue;
+        for (j = 0; j < layer->size; j++)
+            *values++ = GetRecurrentState(layer->neurons[j], t);
+        if (layer->type != LSTM) continue;
+        for (j = 0; j < layer->size; j++)
+            *values++ = GetLSTMCell(layer->neurons[j])->z_values[t];
+    }
+}
+
+/* Advance state by one timestep with input x (the input layer values,
+ * or the onehot index), in time independent of the steps already run. */
+
+int PSStep(PSNeuralNetwork * network, PSStepState * state, double * x) {
+    char * func = "PSStep";
+    if (network == NULL || state == NULL) return 0;
+    if (!(network->flags & FLAG_RECURRENT)) {
+        PSErr(func, "Network is not recurrent");
+        return 0;
+    }
+    if (state->size != getStepStateSize(network) ||
+        state->output_size != network->output_size) {
+        PSErr(func, "State does not match network layout");
+        return 0;
+    }
+    if (!reserveStepStates(network)) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    PSLayer * first = network->layers[0];
+    int i;
+    for (i = 0; i < first->size; i++) {
+        first->neurons[i]->activation = x[i];
+        setStepState(first, i, 1, x[i]);
+    }
+    loadStepValues(network, state->values, 0);
+    for (i = 1; i < network->size; i++) {
+        if (!feedforwardLayerAt(network, i, 2, 1)) return 0;
+    }
+    storeStepValues(network, state->values, 1);
+    PSLayer * out = network->layers[network->size - 1];
+    for (i = 0; i < out->size; i++)
+        state->output[i] = out->neurons[i]->activation;
+    state->steps++;
+    return 1;
+}
+
+PSGradient ** createGradients(PSNeuralNetwork * network) {
+    if (network == NULL) return NULL;
+    PSGradient ** gradients = malloc(sizeof(PSGradient*) * network->size - 1);
+    if (gradients == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    int i;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        int idx = i - 1;
+        gradients[idx] = createLayerGradients(layer);
+        if (gradients[idx] == NULL && layer->type != Pooling) {
+            printMemoryErrorMsg();
+            PSDeleteGradients(gradients, network);
+            return NULL;
+        }
+    }
+    return gradients;
+}
+
+void PSDeleteLayerGradients(PSGradient * gradient, int size) {
+    int i;
+    for (i = 0; i < size; i++) {
+        PSGradient g = gradient[i];
+        PSAlignedFree(g.weights);
     }
     free(gradient);
 }
@@ -1416,7 +2160,9 @@ void PSDeleteGradients(PSGradient ** gradients, PSNeuralNetwork * network) {
         if (layer->type == Convolutional) {
             PSLayerParameters * params = layer->parameters;
             lsize = (int) (params->parameters[PARAM_FEATURE_COUNT]);
-        } else lsize = layer->size;
+        } else if (layer->type == Embedding)
+            lsize = GetEmbeddingTable(layer)->rows;
+        else lsize = layer->size;
         PSDeleteLayerGradients(lgradients, lsize);
     }
     free(gradients);
@@ -1469,10 +2215,15 @@ PSGradient ** backprop(PSNeuralNetwork * network, double * x, double * y) {
         if (outputLayer->type != SoftMax) {
             PSGradient * gradient = &(lgradients[o]);
             gradient->bias = d;
+            if (IsSparseLayer(previousLayer)) {
+                PSSparseMultiplyValue(previousLayer, d, gradient->weights, 0);
+                continue;
+            }
             int wsize = neuron->weights_size;
             w = 0;
 #ifdef USE_AVX
-            AVXMultiplyValue(wsize, previousLayer->avx_activation_cache, d,
+            AVXMultiplyValue(PSPaddedSize(wsize),
+                             previousLayer->avx_activation_cache, d,
                              gradient->weights, w, 0, 0, 0);
 #endif
             for (; w < wsize; w++) {
@@ -1489,10 +2240,15 @@ PSGradient ** backprop(PSNeuralNetwork * network, double * x, double * y) {
             double d = delta[o];
             PSGradient * gradient = &(lgradients[o]);
             gradient->bias = d;
+            if (IsSparseLayer(previousLayer)) {
+                PSSparseMultiplyValue(previousLayer, d, gradient->weights, 0);
+                continue;
+            }
             int wsize = neuron->weights_size;
             w = 0;
 #ifdef USE_AVX
-            AVXMultiplyValue(wsize, previousLayer->avx_activation_cache, d,
+            AVXMultiplyValue(PSPaddedSize(wsize),
+                             previousLayer->avx_activation_cache, d,
                              gradient->weights, w, 0, 0, 0);
 #endif
             for (; w < wsize; w++) {
@@ -1517,24 +2273,14 @@ PSGradient ** backprop(PSNeuralNetwork * network, double * x, double * y) {
                 return NULL;
             }
             memset(delta, 0, sizeof(double) * lsize);
-            for (j = 0; j < lsize; j++) {
-                PSNeuron * neuron = layer->neurons[j];
-                double d = getDeltaForNeuron(neuron, layer,
-                                             nextLayer, last_delta);
-                delta[j] = d;
-                PSGradient * gradient = &(lgradients[j]);
-                gradient->bias = delta[j];
-                w = 0;
-                int wsize = neuron->weights_size;
-#ifdef USE_AVX
-                AVXMultiplyValue(wsize, previousLayer->avx_activation_cache, d,
-                                 gradient->weights, w, 0, 0, 0);
-#endif
-                for (; w < wsize; w++) {
-                    double prev_a = previousLayer->neurons[w]->activation;
-                    gradient->weights[w] = d * prev_a;
-                }
-            }
+            PSBackpropTask task = {layer, previousLayer, nextLayer,
+                                   last_delta, delta, lgradients};
+            int work = lsize * (nextLayer->size + previousLayer->size);
+            if (PSShouldRunParallel(work))
+                PSParallelFor(PSGlobalThreadPool, lsize, fullBackpropNeurons,
+                              &task);
+            else
+                fullBackpropNeurons(&task, 0, lsize);
         } else if (Pooling == ltype && Convolutional == prev_ltype) {
             delta = malloc(sizeof(double) * lsize);
             if (delta == NULL) {
@@ -1558,207 +2304,1196 @@ PSGradient ** backprop(PSNeuralNetwork * network, double * x, double * y) {
         } else if (Convolutional == ltype/* && FullyConnected == prev_ltype*/) {
             delta = PSConvolutionalBackprop(layer, previousLayer,
                                             last_delta, lgradients);
+        } else if (Embedding == ltype) {
+            delta = malloc(sizeof(double) * lsize);
+            if (delta == NULL) {
+                printMemoryErrorMsg();
+                if (last_delta != NULL) free(last_delta);
+                return NULL;
+            }
+            for (j = 0; j < lsize; j++) {
+                PSNeuron * neuron = layer->neurons[j];
+                delta[j] = getDeltaForNeuron(neuron, layer, nextLayer,
+                                             last_delta);
+            }
+            if (!PSEmbeddingBackprop(layer, previousLayer, delta, lgradients,
+                                     0, 0)) {
+                free(delta);
+                delta = NULL;
+            }
+        } else {
+            fprintf(stderr, "Backprop from %s to %s not suported!\n",
+                    PSGetLayerTypeLabel(layer),
+                    PSGetLayerTypeLabel(previousLayer));
+            PSDeleteGradients(gradients, network);
+            free(last_delta);
+            if (delta != last_delta) free(delta);
+            return NULL;
+        }
+        if (last_delta != delta) {
+            free(last_delta);
+            last_delta = delta;
+        }
+        if (delta == NULL) {
+            PSDeleteGradients(gradients, network);
+            return NULL;
+        }
+    }
+    if (delta != NULL) free(delta);
+    return gradients;
+}
+
+/* Backward pass state: deltas[(i * times) + t] is the delta layer i hands
+ * down to layer i - 1 at time t (for LSTM and GRU layers, also the one it
+ * hands back to itself at t - 1). They are all kept until the end, since
+ * with the wavefront a layer may still read one that another cell is done
+ * with. Timesteps from last down to from are backpropagated; y starts at
+ * first, below which deltas never flow.
+ */
+
+typedef struct {
+    PSNeuralNetwork * network;
+    PSGradient ** gradients;
+    double * y;
+    int times;
+    int first;
+    int from;
+    int last;
+    int truncate;
+    double ** deltas;
+    int ok;
+} PSBackwardWavefront;
+
+#define getTimeDelta(ctx, i, t) (ctx->deltas[((i) * ctx->times) + (t)])
+
+static int backpropOutputAt(PSBackwardWavefront * ctx, int t) {
+    PSNeuralNetwork * network = ctx->network;
+    int netsize = network->size, o, w;
+    PSLayer * outputLayer = network->layers[netsize - 1];
+    int onehot = (outputLayer->flags & FLAG_ONEHOT);
+    int osize = outputLayer->size;
+    int ysize = (onehot ? 1 : osize);
+    double * time_y = ctx->y + ((t - ctx->first) * ysize);
+    PSGradient * lgradients = ctx->gradients[netsize - 2];
+    PSLayer * previousLayer = network->layers[netsize - 2];
+    if (PSSoftmaxNeedsTargets(outputLayer)) {
+        /* The delta handed down is the one for the previous layer */
+        double * delta = calloc(previousLayer->size, sizeof(double));
+        if (delta == NULL) {
+            printMemoryErrorMsg();
+            return 0;
+        }
+        getTimeDelta(ctx, netsize - 1, t) = delta;
+        return PSSoftmaxTargetBackprop(outputLayer, previousLayer,
+                                       (int) *time_y, delta, lgradients, t);
+    }
+    double * delta = calloc(osize, sizeof(double));
+    if (delta == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    getTimeDelta(ctx, netsize - 1, t) = delta;
+    double softmax_sum = 0.0;
+    int apply_derivative = shouldApplyDerivative(network);
+    // Calculate output deltas, output layer must be Softmax
+    for (o = 0; o < osize; o++) {
+        PSNeuron * neuron = outputLayer->neurons[o];
+        PSRecurrentCell * cell = GetRecurrentCell(neuron);
+        double o_val = cell->states[t];
+        double y_val;
+        if (onehot)
+            y_val = ((int) *(time_y) == o);
+        else
+            y_val = time_y[o];
+        double d = 0.0;
+        y_val = (y_val < 1 ? 0 : 1);
+        d = -(y_val - o_val);
+        if (apply_derivative) d *= o_val;
+        softmax_sum += d;
+        delta[o] = d;
+    }
+    // Update gradients for output layer
+    for (o = 0; o < osize; o++) {
+        PSNeuron * neuron = outputLayer->neurons[o];
+        PSRecurrentCell * cell = GetRecurrentCell(neuron);
+        double o_val = cell->states[t];
+        if (apply_derivative) delta[o] -= (o_val * softmax_sum);
+        double d = delta[o];
+        PSGradient * gradient = &(lgradients[o]);
+        gradient->bias += d;
+        w = 0;
+#ifdef USE_AVX
+        AVXMultiplyValue(neuron->weights_size,
+                         previousLayer->avx_activation_cache, d,
+                         gradient->weights, w,
+                         1, t, AVX_STORE_MODE_ADD);
+#endif
+        for (; w < neuron->weights_size; w++) {
+            PSNeuron * prev_neuron = previousLayer->neurons[w];
+            PSRecurrentCell * prev_cell = GetRecurrentCell(prev_neuron);
+            double prev_a = prev_cell->states[t];
+            gradient->weights[w] += (d * prev_a);
+        }
+    }
+    return 1;
+}
+
+static int isGatedLayer(PSLayer * layer) {
+    return (layer->type == LSTM || layer->type == GRU);
+}
+
+/* Derivative of a hidden layer at a timestep, from the activation it
+ * stored: sigmoid_derivative takes the z-value, which is not kept for
+ * every timestep. */
+
+static double stateDerivative(PSLayer * layer, double a) {
+    if (layer->derivative == sigmoid_derivative) return a * (1 - a);
+    return layer->derivative(a);
+}
+
+/* LSTM and GRU layers, and outputs needing their targets, hand down the
+ * delta for their inputs, so it only needs the weights of the layer above
+ * for the other types. */
+
+static int embeddingBackpropAt(PSBackwardWavefront * ctx, int i, int t) {
+    PSNeuralNetwork * network = ctx->network;
+    PSLayer * layer = network->layers[i];
+    PSLayer * nextLayer = network->layers[i + 1];
+    double * last_delta = getTimeDelta(ctx, i + 1, t);
+    int lsize = layer->size, j;
+    double * delta = calloc(lsize, sizeof(double));
+    if (delta == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    getTimeDelta(ctx, i, t) = delta;
+    for (j = 0; j < lsize; j++) {
+        if (isGatedLayer(nextLayer) || PSSoftmaxNeedsTargets(nextLayer))
+            delta[j] = last_delta[j];
+        else delta[j] = getDeltaForNeuron(layer->neurons[j], layer, nextLayer,
+                                          last_delta);
+    }
+    return PSEmbeddingBackprop(layer, network->layers[i - 1], delta,
+                               ctx->gradients[i - 1], 1, t);
+}
+
+static int backpropLayerAt(PSBackwardWavefront * ctx, int i, int t) {
+    PSNeuralNetwork * network = ctx->network;
+    PSLayer * layer = network->layers[i];
+    PSLayer * previousLayer = network->layers[i - 1];
+    PSLayer * nextLayer = network->layers[i + 1];
+    PSGradient * lgradients = ctx->gradients[i - 1];
+    double * last_delta = getTimeDelta(ctx, i + 1, t);
+    int lsize = layer->size, j, k, w;
+    PSLayerType ltype = layer->type;
+    if (ltype == Embedding) return embeddingBackpropAt(ctx, i, t);
+    double * delta = calloc(lsize, sizeof(double));
+    if (delta == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    getTimeDelta(ctx, i, t) = delta;
+    int input_delta = (isGatedLayer(nextLayer) ||
+                       PSSoftmaxNeedsTargets(nextLayer));
+    // Calculate layer deltas
+    for (j = 0; j < lsize; j++) {
+        PSNeuron * neuron = layer->neurons[j];
+        PSRecurrentCell * cell = GetRecurrentCell(neuron);
+        double sum = (input_delta ? last_delta[j] : 0);
+        for (k = 0; k < nextLayer->size && !input_delta; k++) {
+            PSNeuron * nextNeuron = nextLayer->neurons[k];
+            double weight = nextNeuron->weights[j];
+            double d = last_delta[k];
+            sum += (d * weight);
+        }
+        double dv = sum;
+        if (ltype != GRU) dv *= stateDerivative(layer, cell->states[t]);
+        delta[j] = dv;
+        
+        if (ltype != Recurrent && ltype != LSTM && ltype != GRU) {
+            PSGradient * gradient = &(lgradients[j]);
+            gradient->bias += dv;
+            int wsize = neuron->weights_size;
+            if (previousLayer->flags & FLAG_ONEHOT) {
+                PSLayerParameters * params = previousLayer->parameters;
+                if (params == NULL) {
+                    fprintf(stderr, "Layer %d params are NULL!\n",
+                            previousLayer->index);
+                    return 0;
+                }
+                int vector_size = (int) params->parameters[0];
+                assert(vector_size > 0);
+                PSNeuron * prev_n = previousLayer->neurons[0];
+                PSRecurrentCell * prev_c = GetRecurrentCell(prev_n);
+                double prev_a = prev_c->states[t];
+                assert(prev_a < vector_size);
+                w = (int) prev_a;
+                gradient->weights[w] += dv;
+            } else {
+                for (w = 0; w < wsize; w++) {
+                    PSNeuron * prev_n = previousLayer->neurons[w];
+                    PSRecurrentCell * prev_c = GetRecurrentCell(prev_n);
+                    double prev_a = prev_c->states[t];
+                    gradient->weights[w] += (dv * prev_a);
+                }
+            }
+        }
+    }
+    if (ltype == Recurrent) {
+        int lowest_t = t - ctx->truncate;
+        if (lowest_t < ctx->first) lowest_t = ctx->first;
+        /* Replaces (and frees) delta with the one for the lower layer */
+        double * res = PSRecurrentBackprop(layer, previousLayer, lowest_t,
+                                           &delta, lgradients, t);
+        getTimeDelta(ctx, i, t) = delta;
+        return (res != NULL);
+    } else if (ltype == LSTM) {
+        double * last_lstm_delta = NULL;
+        if (t < ctx->times - 1) last_lstm_delta = getTimeDelta(ctx, i, t + 1);
+        double * lstm_delta = PSLSTMBackprop(layer, previousLayer, delta,
+                                             last_lstm_delta, lgradients, t);
+        free(delta);
+        getTimeDelta(ctx, i, t) = lstm_delta;
+        return (lstm_delta != NULL);
+    } else if (ltype == GRU) {
+        double * last_gru_delta = NULL;
+        if (t < ctx->times - 1) last_gru_delta = getTimeDelta(ctx, i, t + 1);
+        double * gru_delta = PSGRUBackprop(layer, previousLayer, delta,
+                                           last_gru_delta, lgradients, t);
+        free(delta);
+        getTimeDelta(ctx, i, t) = gru_delta;
+        return (gru_delta != NULL);
+    }
+    return 1;
+}
+
+/* Rows run from the output layer down, columns from the last time step
+ * back: every cell then follows the layer above and the time step after
+ * it, exactly as in the serial order. */
+
+static void backwardWavefrontTask(void * data, int row, int col) {
+    PSBackwardWavefront * ctx = (PSBackwardWavefront *) data;
+    if (!ctx->ok) return;
+    int i = ctx->network->size - 1 - row, t = ctx->last - col;
+    int ok;
+    if (row == 0) ok = backpropOutputAt(ctx, t);
+    else ok = backpropLayerAt(ctx, i, t);
+    if (!ok) ctx->ok = 0;
+}
+
+static int backwardWindow(PSBackwardWavefront * ctx) {
+    PSNeuralNetwork * network = ctx->network;
+    int netsize = network->size, i, t, steps = ctx->last - ctx->from + 1;
+    if (useWavefront(network, steps)) {
+        PSParallelWavefront(PSGlobalThreadPool, netsize - 1, steps,
+                            backwardWavefrontTask, ctx);
+    } else {
+        for (t = ctx->last; t >= ctx->from && ctx->ok; t--) {
+            ctx->ok = backpropOutputAt(ctx, t);
+            for (i = netsize - 2; i > 0 && ctx->ok; i--)
+                ctx->ok = backpropLayerAt(ctx, i, t);
+        }
+    }
+    return ctx->ok;
+}
+
+/* Forward and backward pass over timesteps [first_t, times) of a window,
+ * adding to gradients. */
+
+static int backpropWindow(PSNeuralNetwork * network, PSGradient ** gradients,
+                          double * x, double * y, int times, int first_t,
+                          int truncate)
+{
+    int netsize = network->size, i;
+    if (!feedforwardWindow(network, x, times, first_t, 1)) return 0;
+    PSBackwardWavefront ctx = {network, gradients, y, times, first_t,
+                               first_t, times - 1, truncate, NULL, 1};
+    ctx.deltas = calloc(netsize * times, sizeof(double*));
+    if (ctx.deltas == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    backwardWindow(&ctx);
+    for (i = 0; i < netsize * times; i++) free(ctx.deltas[i]);
+    free(ctx.deltas);
+    return ctx.ok;
+}
+
+static int reserveWindowStates(PSNeuralNetwork * network, int times) {
+    int i;
+    for (i = 0; i < network->size; i++) {
+        if (!PSReserveLayerStates(network->layers[i], times)) return 0;
+    }
+    return 1;
+}
+
+/* Sequences longer than chunk are run chunk timesteps at a time: each
+ * chunk starts from the states the previous one ended with (kept in slot
+ * 0, as PSStep does), but deltas never cross its first step. Layer
+ * buffers then only need to hold chunk + 1 timesteps, whatever the
+ * sequence length. Recurrent deltas flow back truncate timesteps.
+ * Windows only keep their own states, so the outputs the loss needs are
+ * copied into loss_outputs (if not NULL) while each one is in place. */
+
+/* Copy the outputs of count timesteps, starting from slot first_t, into
+ * outputs: the target probability if labels are onehot, else every output
+ * (count * size values). y points to the labels of the first timestep. */
+
+static void fetchLossOutputs(PSNeuralNetwork * network, double * y,
+                             double * outputs, int first_t, int count)
+{
+    PSLayer * out = network->layers[network->size - 1];
+    int onehot = (out->flags & FLAG_ONEHOT), size = out->size, t, j;
+    for (t = 0; t < count; t++) {
+        if (onehot) {
+            PSNeuron * neuron = out->neurons[(int) y[t]];
+            outputs[t] = GetRecurrentCell(neuron)->states[first_t + t];
+            continue;
+        }
+        for (j = 0; j < size; j++) {
+            PSRecurrentCell * cell = GetRecurrentCell(out->neurons[j]);
+            outputs[(t * size) + j] = cell->states[first_t + t];
+        }
+    }
+}
+
+static PSGradient ** backpropSeries(PSNeuralNetwork * network, double * x,
+                                    double * y, int times, int truncate,
+                                    int chunk, double * loss_outputs)
+{
+    if (network == NULL) return NULL;
+    int netsize = network->size, i;
+    PSLayer * outputLayer = network->layers[netsize - 1];
+    if (outputLayer->type != SoftMax) {
+        PSErr("backpropThroughTime",
+              "Recurrent networks require a Softmax output layer, "
+              "current one is of type %s.", PSGetLayerTypeLabel(outputLayer));
+        return NULL;
+    }
+    PSGradient ** gradients = createGradients(network);
+    if (gradients == NULL) return NULL;
+    /* Rebuilt only if the weights changed since the last pass */
+    for (i = 1; i < netsize - 1; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type != Recurrent && layer->type != LSTM &&
+            layer->type != GRU) continue;
+        if (!PSUpdateTransposedWeights(layer)) {
+            PSDeleteGradients(gradients, network);
+            return NULL;
+        }
+    }
+    if (truncate <= 0) truncate = BPTT_TRUNCATE;
+    int ok = 1;
+    if (chunk <= 0 || chunk >= times) {
+        ok = backpropWindow(network, gradients, x, y, times, 0, truncate);
+        if (ok && loss_outputs != NULL)
+            fetchLossOutputs(network, y, loss_outputs, 0, times);
+    } else {
+        int input_size = network->layers[0]->size;
+        int ysize = (outputLayer->flags & FLAG_ONEHOT ? 1 : outputLayer->size);
+        double * carry = calloc(getStepStateSize(network) + 1,
+                                sizeof(double));
+        if (carry == NULL) {
+            printMemoryErrorMsg();
+            ok = 0;
+        } else ok = reserveWindowStates(network, chunk + 1);
+        int start, len, first_t;
+        for (start = 0; ok && start < times; start += chunk) {
+            len = (times - start < chunk ? times - start : chunk);
+            first_t = (start > 0);
+            if (first_t) {
+                ok = reserveWindowStates(network, len + 1);
+                if (!ok) break;
+                loadStepValues(network, carry, 0);
+            }
+            ok = backpropWindow(network, gradients, x + (start * input_size),
+                                y + (start * ysize), len + first_t, first_t,
+                                truncate);
+            if (ok && loss_outputs != NULL) {
+                fetchLossOutputs(network, y + (start * ysize),
+                                 loss_outputs + (start * ysize), first_t,
+                                 len);
+            }
+            if (ok) storeStepValues(network, carry, len + first_t - 1);
+        }
+        free(carry);
+    }
+    if (!ok) {
+        PSDeleteGradients(gradients, network);
+        return NULL;
+    }
+    return gradients;
+}
+
+PSGradient ** backpropThroughTimeChunked(PSNeuralNetwork * network,
+                                         double * x, double * y, int times,
+                                         int truncate, int chunk)
+{
+    return backpropSeries(network, x, y, times, truncate, chunk, NULL);
+}
+
+PSGradient ** backpropThroughTime(PSNeuralNetwork * network, double * x,
+                                  double * y, int times)
+{
+    return backpropThroughTimeChunked(network, x, y, times, BPTT_TRUNCATE, 0);
+}
+
+/* Checkpointing (TRAINING_CHECKPOINT): the forward pass only keeps the
+ * state entering every interval-long segment of the series. Segments are
+ * then backpropagated last to first, each one recomputed from the nearest
+ * checkpoint that still lets Recurrent deltas flow back truncate steps,
+ * and LSTM and GRU layers hand the delta for their previous state over to
+ * the segment before. Gradients are the same as backpropThroughTime's,
+ * while layer buffers only hold about interval + truncate timesteps.
+ * Only the time dimension gets checkpointed: feedforward networks ignore
+ * the flag, and Convolutional (or Pooling) activations keep living in their
+ * neurons, so they are not recomputed. */
+
+static int getCheckpointInterval(int times, int interval) {
+    if (interval > 0) return interval;
+    interval = (int) ceil(sqrt((double) times));
+    return (interval > 0 ? interval : 1);
+}
+
+static int getCheckpointMargin(PSNeuralNetwork * network, int truncate) {
+    int i;
+    for (i = 1; i < network->size; i++) {
+        if (network->layers[i]->type == Recurrent) return truncate;
+    }
+    return 0;
+}
+
+static int getCheckpointStart(int start, int interval, int margin) {
+    start -= margin;
+    if (start < 0) start = 0;
+    return (start / interval) * interval;
+}
+
+/* Timesteps the backward pass of a series recomputes, and the most state
+ * slots one of its windows takes (if slots is not NULL). */
+
+int checkpointRecomputedSteps(PSNeuralNetwork * network, int times,
+                              int truncate, int interval, int * slots)
+{
+    if (truncate <= 0) truncate = BPTT_TRUNCATE;
+    interval = getCheckpointInterval(times, interval);
+    if (slots != NULL) *slots = times;
+    if (interval >= times) return times;
+    int margin = getCheckpointMargin(network, truncate), start, steps = 0;
+    if (slots != NULL) *slots = 0;
+    for (start = 0; start < times; start += interval) {
+        int end = (times - start < interval ? times : start + interval);
+        int window_start = getCheckpointStart(start, interval, margin);
+        int window = end - window_start + (window_start > 0);
+        steps += end - window_start;
+        if (slots != NULL && window > *slots) *slots = window;
+    }
+    return steps;
+}
+
+static PSGradient ** backpropSeriesCheckpointed(PSNeuralNetwork * network,
+                                                double * x, double * y,
+                                                int times, int truncate,
+                                                int interval,
+                                                double * loss_outputs)
+{
+    if (network == NULL) return NULL;
+    interval = getCheckpointInterval(times, interval);
+    if (interval >= times)
+        return backpropSeries(network, x, y, times, truncate, 0,
+                              loss_outputs);
+    int netsize = network->size, i;
+    PSLayer * outputLayer = network->layers[netsize - 1];
+    if (outputLayer->type != SoftMax) {
+        PSErr("backpropThroughTime",
+              "Recurrent networks require a Softmax output layer, "
+              "current one is of type %s.", PSGetLayerTypeLabel(outputLayer));
+        return NULL;
+    }
+    PSGradient ** gradients = createGradients(network);
+    if (gradients == NULL) return NULL;
+    for (i = 1; i < netsize - 1; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type != Recurrent && !isGatedLayer(layer)) continue;
+        if (!PSUpdateTransposedWeights(layer)) {
+            PSDeleteGradients(gradients, network);
+            return NULL;
+        }
+    }
+    if (truncate <= 0) truncate = BPTT_TRUNCATE;
+    int input_size = network->layers[0]->size;
+    int ysize = (outputLayer->flags & FLAG_ONEHOT ? 1 : outputLayer->size);
+    int margin = getCheckpointMargin(network, truncate);
+    int segments = (times + interval - 1) / interval;
+    int state_size = getStepStateSize(network), start, end, first_t, ok = 1;
+    double * checkpoints = calloc((size_t) segments * state_size + 1,
+                                  sizeof(double));
+    double ** carry = calloc(netsize, sizeof(double*));
+    if (checkpoints == NULL || carry == NULL) {
+        printMemoryErrorMsg();
+        ok = 0;
+    }
+    /* Forward pass, storing the checkpoints */
+    for (start = 0; ok && start < times; start += interval) {
+        end = (times - start < interval ? times : start + interval);
+        first_t = (start > 0);
+        double * checkpoint = checkpoints + ((start / interval) * state_size);
+        ok = reserveWindowStates(network, end - start + first_t);
+        if (!ok) break;
+        if (first_t) loadStepValues(network, checkpoint, 0);
+        ok = feedforwardWindow(network, x + (start * input_size),
+                               end - start + first_t, first_t, 1);
+        if (ok && end < times)
+            storeStepValues(network, checkpoint + state_size,
+                            end - start + first_t - 1);
+    }
+    /* Backward pass, recomputing every segment */
+    for (start = (segments - 1) * interval; ok && start >= 0;
+         start -= interval)
+    {
+        end = (times - start < interval ? times : start + interval);
+        int window_start = getCheckpointStart(start, interval, margin);
+        first_t = (window_start > 0);
+        int slots = end - window_start + first_t;
+        ok = reserveWindowStates(network, slots);
+        if (!ok) break;
+        if (first_t)
+            loadStepValues(network, checkpoints +
+                           ((window_start / interval) * state_size), 0);
+        ok = feedforwardWindow(network, x + (window_start * input_size),
+                               slots, first_t, 1);
+        if (!ok) break;
+        /* One more slot for the deltas carried from the next segment */
+        int from = start - window_start + first_t;
+        PSBackwardWavefront ctx = {network, gradients,
+                                   y + (window_start * ysize), slots + 1,
+                                   first_t, from, slots - 1, truncate, NULL,
+                                   1};
+        ctx.deltas = calloc(netsize * (slots + 1), sizeof(double*));
+        if (ctx.deltas == NULL) {
+            printMemoryErrorMsg();
+            ok = 0;
+            break;
+        }
+        for (i = 1; i < netsize - 1; i++) {
+            if (!isGatedLayer(network->layers[i])) continue;
+            getTimeDelta((&ctx), i, slots) = carry[i];
+            carry[i] = NULL;
+        }
+        ok = backwardWindow(&ctx);
+        if (ok && loss_outputs != NULL) {
+            fetchLossOutputs(network, y + (start * ysize),
+                             loss_outputs + (start * ysize), from,
+                             end - start);
+        }
+        for (i = 1; i < netsize - 1; i++) {
+            if (!isGatedLayer(network->layers[i])) continue;
+            carry[i] = getTimeDelta((&ctx), i, from);
+            getTimeDelta((&ctx), i, from) = NULL;
+        }
+        for (i = 0; i < netsize * (slots + 1); i++) free(ctx.deltas[i]);
+        free(ctx.deltas);
+    }
+    if (carry != NULL) {
+        for (i = 0; i < netsize; i++) free(carry[i]);
+        free(carry);
+    }
+    free(checkpoints);
+    if (!ok) {
+        PSDeleteGradients(gradients, network);
+        return NULL;
+    }
+    return gradients;
+}
+
+PSGradient ** backpropThroughTimeCheckpointed(PSNeuralNetwork * network,
+                                              double * x, double * y,
+                                              int times, int truncate,
+                                              int interval)
+{
+    return backpropSeriesCheckpointed(network, x, y, times, truncate,
+                                      interval, NULL);
+}
+
+/* Batched sequences (TRAINING_BATCH_SEQUENCES): the whole batch runs
+ * through time at once, see PSSequenceBatch, every layer step being one
+ * matrix product over the running lanes. Only networks made of an input
+ * layer, a single Recurrent or LSTM layer and a plain Softmax output are
+ * supported: stacked recurrent layers, GRU and sampled or hierarchical
+ * softmax train series by series. Gradients are the same the series would
+ * get one by one. */
+
+static int canBatchSequences(PSNeuralNetwork * network) {
+    if (network->size != 3) return 0;
+    PSLayerType ltype = network->layers[1]->type;
+    if (ltype != Recurrent && ltype != LSTM) return 0;
+    PSLayer * output = network->layers[2];
+    return (output->type == SoftMax && !PSSoftmaxNeedsTargets(output));
+}
+
+static void deleteSequenceBatch(PSSequenceBatch * batch, int layers) {
+    int i;
+    if (batch->values != NULL) {
+        for (i = 0; i < layers; i++) free(batch->values[i]);
+        free(batch->values);
+    }
+    free(batch->lengths);
+    free(batch->active);
+    free(batch->lanes);
+    free(batch);
+}
+
+static PSSequenceBatch * createSequenceBatch(PSNeuralNetwork * network,
+                                             double ** series, int count)
+{
+    char * func = "createSequenceBatch";
+    PSSequenceBatch * batch = calloc(1, sizeof(PSSequenceBatch));
+    if (batch == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    int netsize = network->size, i, j, b, t;
+    batch->count = count;
+    batch->lengths = malloc(count * sizeof(int));
+    batch->lanes = malloc(count * sizeof(int));
+    batch->values = calloc(netsize, sizeof(double*));
+    if (batch->lengths == NULL || batch->lanes == NULL ||
+        batch->values == NULL) {
+        printMemoryErrorMsg();
+        deleteSequenceBatch(batch, netsize);
+        return NULL;
+    }
+    /* Longest first, so that running lanes are always the first ones */
+    for (i = 0; i < count; i++) {
+        int len = (int) series[i][0];
+        if (len <= 0) {
+            PSErr(func, "Series len must b > 0. (batch = %d)", i);
+            deleteSequenceBatch(batch, netsize);
+            return NULL;
+        }
+        for (j = i; j > 0 && batch->lengths[j - 1] < len; j--) {
+            batch->lengths[j] = batch->lengths[j - 1];
+            batch->lanes[j] = batch->lanes[j - 1];
+        }
+        batch->lengths[j] = len;
+        batch->lanes[j] = i;
+    }
+    batch->times = batch->lengths[0];
+    batch->active = calloc(batch->times, sizeof(int));
+    if (batch->active == NULL) {
+        printMemoryErrorMsg();
+        deleteSequenceBatch(batch, netsize);
+        return NULL;
+    }
+    for (b = 0; b < count; b++) {
+        for (t = 0; t < batch->lengths[b]; t++) batch->active[t]++;
+    }
+    size_t steps = (size_t) batch->times * count;
+    for (i = 0; i < netsize; i++) {
+        PSLayer * layer = network->layers[i];
+        int arrays = (layer->type == LSTM ? LSTM_STATE_ARRAYS : 1);
+        batch->values[i] = calloc(arrays * steps * layer->size,
+                                  sizeof(double));
+        if (batch->values[i] == NULL) {
+            printMemoryErrorMsg();
+            deleteSequenceBatch(batch, netsize);
+            return NULL;
+        }
+    }
+    PSLayer * input = network->layers[0];
+    int vector_size = 0;
+    if (input->flags & FLAG_ONEHOT) {
+        PSLayerParameters * params = input->parameters;
+        if (params == NULL || params->count < 1) {
+            PSErr(func, "Onehot input layer params are missing!");
+            deleteSequenceBatch(batch, netsize);
+            return NULL;
+        }
+        vector_size = (int) params->parameters[0];
+    }
+    for (b = 0; b < count; b++) {
+        double * x = series[batch->lanes[b]] + 1;
+        for (t = 0; t < batch->lengths[b]; t++) {
+            double * values = GetBatchValues(batch, input, t, b);
+            memcpy(values, x, input->size * sizeof(double));
+            x += input->size;
+            if (!vector_size) continue;
+            if (values[0] < 0 || values[0] >= vector_size) {
+                PSErr(func, "Invalid vector index %d (max. %d)!",
+                      (int) values[0], vector_size - 1);
+                deleteSequenceBatch(batch, netsize);
+                return NULL;
+            }
+        }
+    }
+    return batch;
+}
+
+/* Softmax of the running lanes at t: their z-values are one matrix
+ * product of the previous layer outputs (rows) by the weights rows (w). */
+
+static void batchSoftmaxFeedforward(PSLayer * out, PSLayer * previous,
+                                    PSSequenceBatch * batch, int t,
+                                    double ** rows, double ** w)
+{
+    int size = out->size, lanes = batch->active[t], b, o;
+    for (b = 0; b < lanes; b++)
+        rows[b] = GetBatchValues(batch, previous, t, b);
+    PSMatrixProduct(rows, lanes, w, size, previous->size,
+                    GetBatchValues(batch, out, t, 0), size);
+    for (b = 0; b < lanes; b++) {
+        double * a = GetBatchValues(batch, out, t, b);
+        double max = 0.0, esum = 0.0;
+        for (o = 0; o < size; o++) {
+            a[o] += out->neurons[o]->bias;
+            if (o == 0 || a[o] > max) max = a[o];
+        }
+        for (o = 0; o < size; o++) {
+            a[o] = exp(a[o] - max);
+            esum += a[o];
+        }
+        for (o = 0; o < size; o++) a[o] /= esum;
+    }
+}
+
+/* Output deltas of the running lanes at t (into delta), as in
+ * backpropOutputAt. */
+
+static void batchOutputBackprop(PSNeuralNetwork * network,
+                                PSSequenceBatch * batch, double ** series,
+                                double * delta, PSGradient * lgradients,
+                                int t)
+{
+    PSLayer * previous = network->layers[1], * out = network->layers[2];
+    int size = out->size, onehot = (out->flags & FLAG_ONEHOT), b, o;
+    int ysize = (onehot ? 1 : size);
+    int apply_derivative = shouldApplyDerivative(network);
+    for (b = 0; b < batch->active[t]; b++) {
+        double * s = series[batch->lanes[b]];
+        double * y = s + 1 + ((int) s[0] * network->layers[0]->size);
+        double * time_y = y + (t * ysize);
+        double * a = GetBatchValues(batch, out, t, b);
+        double * h = GetBatchValues(batch, previous, t, b);
+        double * d = delta + (b * size);
+        double softmax_sum = 0.0;
+        for (o = 0; o < size; o++) {
+            double y_val;
+            if (onehot) y_val = ((int) *(time_y) == o);
+            else y_val = time_y[o];
+            y_val = (y_val < 1 ? 0 : 1);
+            d[o] = -(y_val - a[o]);
+            if (apply_derivative) d[o] *= a[o];
+            softmax_sum += d[o];
+        }
+        for (o = 0; o < size; o++) {
+            if (apply_derivative) d[o] -= (a[o] * softmax_sum);
+            PSGradient * gradient = &(lgradients[o]);
+            gradient->bias += d[o];
+            PSAddScaled(gradient->weights, h, d[o], previous->size);
+        }
+    }
+}
+
+/* Leave the outputs of the last series in the output layer states, as
+ * running the series one by one would. */
+
+static int storeLastSeriesOutputs(PSNeuralNetwork * network,
+                                  PSSequenceBatch * batch)
+{
+    PSLayer * out = network->layers[network->size - 1];
+    int b = 0, t, o;
+    while (batch->lanes[b] != batch->count - 1) b++;
+    if (!PSReserveLayerStates(out, batch->lengths[b])) return 0;
+    for (t = 0; t < batch->lengths[b]; t++) {
+        double * a = GetBatchValues(batch, out, t, b);
+        for (o = 0; o < out->size; o++)
+            GetRecurrentState(out->neurons[o], t) = a[o];
+    }
+    return 1;
+}
+
+PSGradient ** backpropSequenceBatch(PSNeuralNetwork * network,
+                                    double ** series, int count,
+                                    int truncate)
+{
+    if (network == NULL || !canBatchSequences(network)) return NULL;
+    PSLayer * input = network->layers[0], * layer = network->layers[1];
+    PSLayer * out = network->layers[2];
+    int netsize = network->size, is_lstm = (layer->type == LSTM), t, b, o;
+    int size = layer->size, ok = 1;
+    if (truncate <= 0) truncate = BPTT_TRUNCATE;
+    PSSequenceBatch * batch = createSequenceBatch(network, series, count);
+    if (batch == NULL) return NULL;
+    PSGradient ** gradients = createGradients(network);
+    double * delta = malloc(count * size * sizeof(double));
+    double * out_delta = malloc(count * out->size * sizeof(double));
+    double * carry = calloc(count * 2 * size, sizeof(double));
+    /* Output weights, transposed for the deltas of the recurrent layer */
+    double * out_t = malloc(size * out->size * sizeof(double));
+    double ** rows = malloc(count * sizeof(double*));
+    double ** out_w = malloc(out->size * sizeof(double*));
+    double ** out_t_rows = malloc(size * sizeof(double*));
+    if (gradients == NULL || delta == NULL || out_delta == NULL ||
+        carry == NULL || out_t == NULL || rows == NULL || out_w == NULL ||
+        out_t_rows == NULL) {
+        printMemoryErrorMsg();
+        ok = 0;
+    }
+    for (o = 0; o < out->size && ok; o++) {
+        out_w[o] = out->neurons[o]->weights;
+        for (b = 0; b < size; b++)
+            out_t[(b * out->size) + o] = out_w[o][b];
+    }
+    for (b = 0; b < size && ok; b++) out_t_rows[b] = out_t + (b * out->size);
+    if (ok) ok = PSUpdateTransposedWeights(layer);
+    for (t = 0; t < batch->times && ok; t++) {
+        if (is_lstm) ok = PSLSTMBatchFeedforward(layer, input, batch, t);
+        else ok = PSRecurrentBatchFeedforward(layer, input, batch, t);
+        if (ok) batchSoftmaxFeedforward(out, layer, batch, t, rows, out_w);
+    }
+    for (t = batch->times - 1; t >= 0 && ok; t--) {
+        int lanes = batch->active[t];
+        batchOutputBackprop(network, batch, series, out_delta,
+                            gradients[netsize - 2], t);
+        for (b = 0; b < lanes; b++) rows[b] = out_delta + (b * out->size);
+        PSMatrixProduct(rows, lanes, out_t_rows, size, out->size, delta,
+                        size);
+        for (b = 0; b < lanes; b++) {
+            double * d = delta + (b * size);
+            double * h = GetBatchValues(batch, layer, t, b);
+            for (o = 0; o < size; o++) d[o] *= layer->derivative(h[o]);
+        }
+        if (is_lstm)
+            ok = PSLSTMBatchBackprop(layer, input, batch, delta, carry,
+                                     gradients[0], t);
+        else {
+            int lowest_t = t - truncate;
+            if (lowest_t < 0) lowest_t = 0;
+            ok = PSRecurrentBatchBackprop(layer, input, batch, delta,
+                                          gradients[0], lowest_t, t);
+        }
+    }
+    if (ok) ok = storeLastSeriesOutputs(network, batch);
+    free(delta);
+    free(out_delta);
+    free(carry);
+    free(out_t);
+    free(rows);
+    free(out_w);
+    free(out_t_rows);
+    deleteSequenceBatch(batch, netsize);
+    if (!ok && gradients != NULL) {
+        PSDeleteGradients(gradients, network);
+        gradients = NULL;
+    }
+    return gradients;
+}
+
+static double updateLayerWeights(PSLayer * layer, PSGradient * lgradients,
+                                 double r, double l2)
+{
+    int j, k;
+    double l2_loss = 0.0;
+    PSLayerType ltype = layer->type;
+    int l_size;
+    PSSharedParams * shared = NULL;
+    if (ltype == Embedding)
+        return PSUpdateEmbeddingTable(layer, lgradients, r, l2);
+    if (PSSoftmaxNeedsTargets(layer))
+        return PSUpdateSoftmaxRows(layer, lgradients, r, l2);
+    if (ltype == Convolutional) {
+        PSLayerParameters * params = layer->parameters;
+        l_size = (int) (params->parameters[PARAM_FEATURE_COUNT]);
+        shared = getConvSharedParams(layer);
+    } else l_size = layer->size;
+    int is_lstm = ltype == LSTM;
+    layer->recurrent_weights_dirty = 1;
+    for (j = 0; j < l_size; j++) {
+        PSGradient * g = &(lgradients[j]);
+        if (shared == NULL) {
+            PSNeuron * neuron = layer->neurons[j];
+            neuron->bias = neuron->bias - r * g->bias;
+            int wsize = neuron->weights_size;
+            if (is_lstm) PSUpdateLSTMBiases(neuron, g, r);
+            else if (ltype == GRU) PSUpdateGRUBiases(neuron, g, r);
+            k = 0;
+#ifdef USE_AVX
+            int gated = (is_lstm || ltype == GRU);
+            int avx_size = (gated ? wsize : PSPaddedSize(wsize));
+            if (l2 != 0.0) {
+                int kk = 0;
+                AVXMultiplyValues(avx_size, neuron->weights, l2, g->weights,
+                                  r, neuron->weights, k, 0, 0,
+                                  AVX_STORE_MODE_NORM, AVX_STORE_MODE_SUB);
+                AVXDotSquare(avx_size, g->weights, l2_loss, kk, 0, 0);
+                if (kk < k) { // AVX Step Length could differ
+                    for (; kk < k; kk++) {
+                        double grad_w = g->weights[kk];
+                        l2_loss += (grad_w * grad_w);
+                    }
+                }
+            } else {
+                AVXMultiplyValue(avx_size, g->weights, r, neuron->weights,
+                                 k, 0, 0, AVX_STORE_MODE_SUB);
+            }
+#endif
+            for (; k < wsize; k++) {
+                double grad_w = g->weights[k];
+                if (l2 != 0.0) {
+                    neuron->weights[k] *= l2;
+                    l2_loss += (grad_w * grad_w);
+                }
+                neuron->weights[k] -= (r * grad_w);
+            }
         } else {
-            fprintf(stderr, "Backprop from %s to %s not suported!\n",
-                    PSGetLayerTypeLabel(layer),
-                    PSGetLayerTypeLabel(previousLayer));
-            PSDeleteGradients(gradients, network);
-            free(last_delta);
-            if (delta != last_delta) free(delta);
-            return NULL;
-        }
-        if (last_delta != delta) {
-            free(last_delta);
-            last_delta = delta;
-        }
-        if (delta == NULL) {
-            PSDeleteGradients(gradients, network);
-            return NULL;
+            shared->biases[j] -= (r * g->bias);
+            double * weights = shared->weights[j];
+            k = 0;
+#ifdef USE_AVX
+            AVXMultiplyValue(PSPaddedSize(shared->weights_size), g->weights,
+                             r, weights, k, 0, 0, AVX_STORE_MODE_SUB);
+#endif
+            for (; k < shared->weights_size; k++)
+                weights[k] -= (r * g->weights[k]);
         }
     }
-    if (delta != NULL) free(delta);
-    return gradients;
+    return l2_loss;
 }
 
-PSGradient ** backpropThroughTime(PSNeuralNetwork * network, double * x,
-                                  double * y, int times)
-{
-    if (network == NULL) return NULL;
-    PSGradient ** gradients = createGradients(network);
-    if (gradients == NULL) return NULL;
-    int netsize = network->size;
-    PSLayer * outputLayer = network->layers[netsize - 1];
-    if (outputLayer->type != SoftMax) {
-        PSErr("backpropThroughTime",
-              "Recurrent networks require a Softmax output layer, "
-              "current one is of type %s.", PSGetLayerTypeLabel(outputLayer));
-        PSDeleteGradients(gradients, network);
-        return NULL;
+/* Backward pass as a task graph: for every layer, a delta task, a few
+ * gradient tasks (each one accumulating a slice of the layer's units into
+ * the batch gradients) and, on the last element of the batch, an update
+ * task. Gradients and updates of layer l overlap with the deltas of l - 1;
+ * the update of l waits for the deltas of l - 1, since they read its
+ * weights. Tasks must not use PSParallelFor, as they already run on the
+ * pool threads. */
+
+typedef struct {
+    PSNeuralNetwork * network;
+    PSGradient ** gradients;
+    double ** deltas;
+    double * l2_losses;
+    double * y;
+    double r;
+    double l2;
+    int chunks;
+    int update;
+    int ok;
+} PSBackwardGraph;
+
+static int canUseBackwardGraph(PSNeuralNetwork * network) {
+    if (network->flags & FLAG_RECURRENT) return 0;
+    int i, last = network->size - 1;
+    for (i = 1; i <= last; i++) {
+        PSLayerType ltype = network->layers[i]->type;
+        PSLayerType prev_ltype = network->layers[i - 1]->type;
+        PSLayerType next_ltype = (i < last ? network->layers[i + 1]->type :
+                                  FullyConnected);
+        if (i == last) {
+            if (ltype != FullyConnected && ltype != SoftMax) return 0;
+        } else if (ltype == FullyConnected) {
+            if (next_ltype != FullyConnected && next_ltype != SoftMax)
+                return 0;
+        } else if (ltype == Pooling) {
+            if (prev_ltype != Convolutional) return 0;
+        } else if (ltype == Convolutional) {
+            if (next_ltype != Pooling) return 0;
+        } else return 0;
     }
-    int onehot = (outputLayer->flags & FLAG_ONEHOT);
-    int osize = outputLayer->size;
-    int bptt_truncate = BPTT_TRUNCATE;
+    return 1;
+}
 
-    int i, o, w, j, k, t;
-    int ok = feedforwardThroughTime(network, x, times);
-    if (!ok) {
-        PSDeleteGradients(gradients, network);
-        return NULL;
+static int getGradientUnits(PSLayer * layer) {
+    if (layer->type == Convolutional) {
+        PSLayerParameters * params = layer->parameters;
+        return (int) (params->parameters[PARAM_FEATURE_COUNT]);
     }
-    
-    int last_t = times - 1;
-    double * lstm_delta = NULL;
-    for (t = last_t; t >= 0; t--) {
-        int lowest_t = t - bptt_truncate;
-        if (lowest_t < 0) lowest_t = 0;
-        int ysize = (onehot ? 1 : osize);
-        int time_offset = t * ysize;
-        double * time_y = y + time_offset;
-        
-        PSGradient * lgradients = gradients[netsize - 2]; //No grad. for inputs
-        PSLayer * previousLayer = network->layers[outputLayer->index - 1];
-        PSLayer * nextLayer = NULL;
-        double * delta;
-        double * last_delta;
-        delta = malloc(sizeof(double) * osize);
-        if (delta == NULL) {
-            printMemoryErrorMsg();
-            return NULL;
-        }
-        memset(delta, 0, sizeof(double) * osize);
-        last_delta = delta;
+    return layer->size;
+}
 
-        double softmax_sum = 0.0;
+static void backwardDeltaTask(void * data, int index) {
+    PSBackwardGraph * graph = (PSBackwardGraph *) data;
+    if (!graph->ok) return;
+    PSNeuralNetwork * network = graph->network;
+    PSLayer * layer = network->layers[index];
+    double * delta = graph->deltas[index];
+    int lsize = layer->size, j;
+    if (index == network->size - 1) {
         int apply_derivative = shouldApplyDerivative(network);
-        // Calculate output deltas, output layer must be Softmax
-        for (o = 0; o < osize; o++) {
-            PSNeuron * neuron = outputLayer->neurons[o];
-            PSRecurrentCell * cell = GetRecurrentCell(neuron);
-            double o_val = cell->states[t];
-            double y_val;
-            if (onehot)
-                y_val = ((int) *(time_y) == o);
-            else
-                y_val = time_y[o];
-            double d = 0.0;
-            y_val = (y_val < 1 ? 0 : 1);
-            d = -(y_val - o_val);
-            if (apply_derivative) d *= o_val;
-            softmax_sum += d;
-            delta[o] = d;
+        double softmax_sum = 0.0;
+        for (j = 0; j < lsize; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            double o_val = neuron->activation;
+            double y_val = graph->y[j];
+            double d;
+            if (layer->type != SoftMax) {
+                d = o_val - y_val;
+                if (apply_derivative) d *= layer->derivative(neuron->z_value);
+            } else {
+                y_val = (y_val < 1 ? 0 : 1);
+                d = -(y_val - o_val);
+                if (apply_derivative) d *= o_val;
+                softmax_sum += d;
+            }
+            delta[j] = d;
         }
-        // Update gradients for output layer
-        for (o = 0; o < osize; o++) {
-            PSNeuron * neuron = outputLayer->neurons[o];
-            PSRecurrentCell * cell = GetRecurrentCell(neuron);
-            double o_val = cell->states[t];
-            if (apply_derivative) delta[o] -= (o_val * softmax_sum);
-            double d = delta[o];
-            PSGradient * gradient = &(lgradients[o]);
-            gradient->bias = d;
-            w = 0;
+        if (layer->type == SoftMax && apply_derivative) {
+            for (j = 0; j < lsize; j++)
+                delta[j] -= (layer->neurons[j]->activation * softmax_sum);
+        }
+        return;
+    }
+    PSLayer * nextLayer = network->layers[index + 1];
+    double * next_delta = graph->deltas[index + 1];
+    if (nextLayer->type == Pooling) {
+        double * pool_delta = PSPoolingBackprop(nextLayer, layer, next_delta);
+        if (pool_delta == NULL) {
+            graph->ok = 0;
+            return;
+        }
+        memcpy(delta, pool_delta, lsize * sizeof(double));
+        free(pool_delta);
+        return;
+    }
+    PSGetDeltaFunction _getDelta = getDeltaForNeuron;
+    if (nextLayer->type == Convolutional)
+        _getDelta = getDeltaForConvolutionalNeuron;
+    for (j = 0; j < lsize; j++)
+        delta[j] = _getDelta(layer->neurons[j], layer, nextLayer, next_delta);
+}
+
+static void backwardGradientTask(void * data, int arg) {
+    PSBackwardGraph * graph = (PSBackwardGraph *) data;
+    if (!graph->ok) return;
+    int index = arg / graph->chunks, chunk = arg % graph->chunks;
+    PSLayer * layer = graph->network->layers[index];
+    PSLayer * previousLayer = graph->network->layers[index - 1];
+    PSGradient * lgradients = graph->gradients[index - 1];
+    double * delta = graph->deltas[index];
+    int units = getGradientUnits(layer);
+    int start = (units * chunk) / graph->chunks;
+    int end = (units * (chunk + 1)) / graph->chunks;
+    if (layer->type == Convolutional) {
+        PSConvolutionalGradients(layer, previousLayer, delta, lgradients,
+                                 start, end);
+        return;
+    }
+    int j, w;
+    for (j = start; j < end; j++) {
+        PSNeuron * neuron = layer->neurons[j];
+        PSGradient * gradient = &(lgradients[j]);
+        double d = delta[j];
+        gradient->bias += d;
+        if (d == 0.0) continue;
+        if (IsSparseLayer(previousLayer)) {
+            PSSparseMultiplyValue(previousLayer, d, gradient->weights, 1);
+            continue;
+        }
+        int wsize = neuron->weights_size;
+        w = 0;
 #ifdef USE_AVX
-            AVXMultiplyValue(neuron->weights_size,
-                             previousLayer->avx_activation_cache, d,
-                             gradient->weights, w,
-                             1, t, AVX_STORE_MODE_ADD);
+        AVXMultiplyValue(PSPaddedSize(wsize),
+                         previousLayer->avx_activation_cache, d,
+                         gradient->weights, w, 0, 0, AVX_STORE_MODE_ADD);
 #endif
-            for (; w < neuron->weights_size; w++) {
-                PSNeuron * prev_neuron = previousLayer->neurons[w];
-                PSRecurrentCell * prev_cell = GetRecurrentCell(prev_neuron);
-                double prev_a = prev_cell->states[t];
-                gradient->weights[w] += (d * prev_a);
-            }
+        for (; w < wsize; w++) {
+            double prev_a = previousLayer->neurons[w]->activation;
+            gradient->weights[w] += (d * prev_a);
         }
-        
-        // Cycle through other layers
-        for (i = previousLayer->index; i > 0; i--) {
-            PSLayer * layer = network->layers[i];
-            previousLayer = network->layers[i - 1];
-            nextLayer = network->layers[i + 1];
-            lgradients = gradients[i - 1];
-            int lsize = layer->size;
-            PSLayerType ltype = layer->type;
-            //PSLayerType prev_ltype = previousLayer->type;
-            
-            delta = malloc(sizeof(double) * lsize);
-            if (delta == NULL) {
-                printMemoryErrorMsg();
-                if (last_delta != NULL) free(last_delta);
-                return NULL;
-            }
-            memset(delta, 0, sizeof(double) * lsize);
-            // Calculate layer deltas
-            for (j = 0; j < lsize; j++) {
-                PSNeuron * neuron = layer->neurons[j];
-                PSRecurrentCell * cell = GetRecurrentCell(neuron);
-                double sum = 0;
-                for (k = 0; k < nextLayer->size; k++) {
-                    PSNeuron * nextNeuron = nextLayer->neurons[k];
-                    double weight = nextNeuron->weights[j];
-                    double d = last_delta[k];
-                    sum += (d * weight);
-                }
-                double dv = sum * layer->derivative(cell->states[t]);
-                delta[j] = dv;
-                
-                if (ltype != Recurrent && ltype != LSTM) {
-                    PSGradient * gradient = &(lgradients[i]);
-                    gradient->bias += dv;
-                    int wsize = neuron->weights_size;
-                    if (previousLayer->flags & FLAG_ONEHOT) {
-                        PSLayerParameters * params = previousLayer->parameters;
-                        if (params == NULL) {
-                            fprintf(stderr, "Layer %d params are NULL!\n",
-                                    previousLayer->index);
-                            if (last_delta != NULL) {
-                                free(last_delta);
-                            }
-                            return NULL;
-                        }
-                        int vector_size = (int) params->parameters[0];
-                        assert(vector_size > 0);
-                        PSNeuron * prev_n = previousLayer->neurons[0];
-                        PSRecurrentCell * prev_c = GetRecurrentCell(prev_n);
-                        double prev_a = prev_c->states[t];
-                        assert(prev_a < vector_size);
-                        w = (int) prev_a;
-                        gradient->weights[w] += dv;
-                    } else {
-                        for (w = 0; w < wsize; w++) {
-                            PSNeuron * prev_n = previousLayer->neurons[w];
-                            PSRecurrentCell * prev_c = GetRecurrentCell(prev_n);
-                            double prev_a = prev_c->states[t];
-                            gradient->weights[w] += (dv * prev_a);
-                        }
-                    }
-                }
-            }
-            if (last_delta != lstm_delta) free(last_delta);
-            last_delta = delta;
-            int is_recurrent = (Recurrent == ltype);
-            int is_lstm = (LSTM == ltype);
-            if (!is_recurrent && !is_lstm) continue;
-            
-            if (is_recurrent) {
-                PSRecurrentBackprop(layer, previousLayer, lowest_t,
-                                    &last_delta, lgradients, t);
-                delta = NULL;
-            } else if (is_lstm) {
-                delta = PSLSTMBackprop(layer, previousLayer, last_delta,
-                                       lstm_delta, lgradients, t);
-                if (lstm_delta != NULL) free(lstm_delta);
-                if (last_delta != NULL && last_delta != lstm_delta) 
-                    free(last_delta);
-                lstm_delta = delta;
-                last_delta = delta;
-            }
+    }
+}
+
+static void backwardUpdateTask(void * data, int index) {
+    PSBackwardGraph * graph = (PSBackwardGraph *) data;
+    if (!graph->ok || !graph->update) return;
+    graph->l2_losses[index] =
+        updateLayerWeights(graph->network->layers[index],
+                           graph->gradients[index - 1], graph->r, graph->l2);
+}
+
+/* All delta tasks come first, so that they get queued before the gradient
+ * tasks they release: deltas are the critical path. */
+
+static PSTaskGraph * createBackwardGraph(PSBackwardGraph * ctx) {
+    PSNeuralNetwork * network = ctx->network;
+    int last = network->size - 1, i, c;
+    PSTaskGraph * graph = PSCreateTaskGraph(network->size * (ctx->chunks + 2));
+    if (graph == NULL) return NULL;
+    int delta_tasks[network->size], update_tasks[network->size];
+    int gradient_tasks[network->size * ctx->chunks];
+    int ok = 1;
+    for (i = last; i > 0; i--) {
+        delta_tasks[i] = PSAddTask(graph, backwardDeltaTask, ctx, i);
+        ok = ok && delta_tasks[i] >= 0;
+        if (ok && i < last)
+            ok = PSAddTaskDependency(graph, delta_tasks[i], delta_tasks[i + 1]);
+    }
+    for (i = last; i > 0 && ok; i--) {
+        update_tasks[i] = -1;
+        if (ctx->gradients[i - 1] == NULL) continue;
+        for (c = 0; c < ctx->chunks && ok; c++) {
+            int id = PSAddTask(graph, backwardGradientTask, ctx,
+                               (i * ctx->chunks) + c);
+            gradient_tasks[(i * ctx->chunks) + c] = id;
+            ok = (id >= 0 && PSAddTaskDependency(graph, id, delta_tasks[i]));
         }
-        if (delta != NULL && lstm_delta != delta) free(delta);
-        if (last_delta != NULL && last_delta != delta) free(last_delta);
+        if (!ok) break;
+        int id = PSAddTask(graph, backwardUpdateTask, ctx, i);
+        update_tasks[i] = id;
+        ok = (id >= 0);
+        for (c = 0; c < ctx->chunks && ok; c++) {
+            int dep = gradient_tasks[(i * ctx->chunks) + c];
+            ok = PSAddTaskDependency(graph, id, dep);
+        }
+        if (ok && i > 1)
+            ok = PSAddTaskDependency(graph, id, delta_tasks[i - 1]);
     }
-    if (lstm_delta != NULL) free(lstm_delta);
-    return gradients;
+    if (!ok) {
+        PSDeleteTaskGraph(graph);
+        return NULL;
+    }
+    return graph;
+}
+
+static void deleteBackwardGraphContext(PSBackwardGraph * ctx) {
+    int i;
+    if (ctx->deltas != NULL) {
+        for (i = 0; i < ctx->network->size; i++) free(ctx->deltas[i]);
+        free(ctx->deltas);
+    }
+    free(ctx->l2_losses);
+}
+
+static int initBackwardGraphContext(PSBackwardGraph * ctx,
+                                    PSNeuralNetwork * network,
+                                    PSGradient ** gradients, double r,
+                                    double l2)
+{
+    int i;
+    ctx->network = network;
+    ctx->gradients = gradients;
+    ctx->r = r;
+    ctx->l2 = l2;
+    ctx->y = NULL;
+    ctx->update = 0;
+    ctx->ok = 1;
+    ctx->chunks = (PSSerialThread ? 1 : PSGetThreadCount());
+    ctx->deltas = calloc(network->size, sizeof(double*));
+    ctx->l2_losses = calloc(network->size, sizeof(double));
+    if (ctx->deltas == NULL || ctx->l2_losses == NULL) {
+        printMemoryErrorMsg();
+        deleteBackwardGraphContext(ctx);
+        return 0;
+    }
+    for (i = 1; i < network->size; i++) {
+        ctx->deltas[i] = calloc(network->layers[i]->size, sizeof(double));
+        if (ctx->deltas[i] == NULL) {
+            printMemoryErrorMsg();
+            deleteBackwardGraphContext(ctx);
+            return 0;
+        }
+    }
+    return 1;
 }
 
 double updateWeights(PSNeuralNetwork * network, double * training_data,
@@ -1767,6 +3502,7 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
 {
     double r = rate / (double) batch_size;
     int i, j, k, w, netsize = network->size, dsize = netsize - 1, times;
+    int chunk = 0;
     int training_data_size = network->input_size;
     int label_data_size = network->output_size;
     PSGradient ** gradients = createGradients(network);
@@ -1777,6 +3513,7 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
     char * func = "updateWeights";
     PSGradient ** bp_gradients = NULL;
     double ** series = NULL;
+    double * loss_outputs = NULL; // Outputs of the last series
     int is_recurrent = network->flags & FLAG_RECURRENT;
     if (is_recurrent) {
         va_list args;
@@ -1790,10 +3527,75 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
             return -999.0;
         }
     }
+    double l1 = 0.0, l2 = 0.0, l2_loss = 0.0;
+    if (opts != NULL) {
+        //if (opts->l1_decay != 0.0) l1 = opts->l1_decay / elements_count;
+        if (opts->l2_decay != 0.0) {
+            l2 = opts->l2_decay / elements_count;
+            l2 = (1 - (rate * l2));
+        }
+        l1 = (1 - (rate * l1));
+    }
+    PSBackwardGraph graph_ctx;
+    PSTaskGraph * graph = NULL;
+    PSProcessGroup * group = NULL;
+    if (opts != NULL && !(opts->flags & TRAINING_LOCAL_SGD))
+        group = (PSProcessGroup *) opts->process_group;
+    if (opts != NULL && (opts->flags & TRAINING_TASK_GRAPH) &&
+        group == NULL && canUseBackwardGraph(network))
+    {
+        if (!initBackwardGraphContext(&graph_ctx, network, gradients, r, l2)) {
+            network->status = STATUS_ERROR;
+            PSDeleteGradients(gradients, network);
+            return -999.0;
+        }
+        graph = createBackwardGraph(&graph_ctx);
+        if (graph == NULL) {
+            network->status = STATUS_ERROR;
+            deleteBackwardGraphContext(&graph_ctx);
+            PSDeleteGradients(gradients, network);
+            return -999.0;
+        }
+    }
     double * x;
     double * y;
-    for (i = 0; i < batch_size; i++) {
-        if (series == NULL) {
+    int batched = (series != NULL && opts != NULL &&
+                   (opts->flags & TRAINING_BATCH_SEQUENCES) &&
+                   !(opts->flags & TRAINING_CHECKPOINT) &&
+                   opts->bptt_chunk <= 0 && canBatchSequences(network));
+    if (batched) {
+        bp_gradients = backpropSequenceBatch(network, series, batch_size,
+                                             opts->bptt_truncate);
+        if (bp_gradients == NULL) {
+            network->status = STATUS_ERROR;
+            PSDeleteGradients(gradients, network);
+            return -999.0;
+        }
+        PSDeleteGradients(gradients, network);
+        gradients = bp_gradients;
+        x = series[batch_size - 1];
+        times = (int) *(x++);
+        y = x + (times * training_data_size);
+    }
+    for (i = 0; i < batch_size && !batched; i++) {
+        if (graph != NULL) {
+            int element_size = training_data_size + label_data_size;
+            x = training_data;
+            y = training_data + training_data_size;
+            training_data += element_size;
+            graph_ctx.y = y;
+            graph_ctx.update = (i == batch_size - 1);
+            /* Hogwild and local SGD workers must not share the pool */
+            PSThreadPool * pool = (PSSerialThread ? NULL : PSGlobalThreadPool);
+            if (PSFeedforward(network, x)) PSRunTaskGraph(pool, graph);
+            else graph_ctx.ok = 0;
+            if (graph_ctx.ok) continue;
+            network->status = STATUS_ERROR;
+            PSDeleteTaskGraph(graph);
+            deleteBackwardGraphContext(&graph_ctx);
+            PSDeleteGradients(gradients, network);
+            return -999.0;
+        } else if (series == NULL) {
             int element_size = training_data_size + label_data_size;
             x = training_data;
             y = training_data + training_data_size;
@@ -1808,11 +3610,33 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
                 return -999.0;
             }
             y = x + (times * training_data_size);
-            bp_gradients = backpropThroughTime(network, x, y, times);
+            int truncate = (opts != NULL ? opts->bptt_truncate : 0);
+            if (opts != NULL) chunk = opts->bptt_chunk;
+            if (i == batch_size - 1) {
+                PSLayer * out = network->layers[netsize - 1];
+                int osize = (out->flags & FLAG_ONEHOT ? 1 : out->size);
+                loss_outputs = malloc(sizeof(double) * osize * times);
+                if (loss_outputs == NULL) {
+                    printMemoryErrorMsg();
+                    network->status = STATUS_ERROR;
+                    PSDeleteGradients(gradients, network);
+                    return -999.0;
+                }
+            }
+            if (opts != NULL && (opts->flags & TRAINING_CHECKPOINT)) {
+                bp_gradients =
+                    backpropSeriesCheckpointed(network, x, y, times, truncate,
+                                               opts->checkpoint_interval,
+                                               loss_outputs);
+            } else {
+                bp_gradients = backpropSeries(network, x, y, times, truncate,
+                                              chunk, loss_outputs);
+            }
         }
         if (bp_gradients == NULL) {
             network->status = STATUS_ERROR;
             PSDeleteGradients(gradients, network);
+            free(loss_outputs);
             return -999.0;
         }
         for (j = 0; j < dsize; j++) {
@@ -1820,6 +3644,14 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
             PSGradient * lgradients_bp = bp_gradients[j];
             PSGradient * lgradients = gradients[j];
             if (lgradients == NULL) continue;
+            if (layer->type == Embedding) {
+                PSMergeEmbeddingGradients(layer, lgradients, lgradients_bp);
+                continue;
+            }
+            if (PSSoftmaxNeedsTargets(layer)) {
+                PSMergeSoftmaxGradients(layer, lgradients, lgradients_bp);
+                continue;
+            }
             int lsize = layer->size;
             int wsize = 0;
             if (layer->type == Convolutional) {
@@ -1828,19 +3660,31 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
                 int rsize = (int) (params->parameters[PARAM_REGION_SIZE]);
                 wsize = rsize * rsize;
             }
+            /* backprop only filled the columns of sparse inputs, and left
+             * rows with a zero delta (as inactive ReLU units) empty. */
+            PSLayer * input = network->layers[j];
+            int sparse = (layer->type != Convolutional &&
+                          IsSparseLayer(input));
+            int zero_rows = (series == NULL && layer->type == FullyConnected);
             for (k = 0; k < lsize; k++) {
                 if (!wsize) {
                     PSNeuron * neuron = layer->neurons[k];
                     wsize = neuron->weights_size;
-                    if (layer->type == LSTM) wsize += 4; // LSTM biases
+                    wsize += GetGateBiasesCount(layer);
                 }
                 PSGradient * gradient_bp = &(lgradients_bp[k]);
                 PSGradient * gradient = &(lgradients[k]);
                 gradient->bias += gradient_bp->bias;
+                if (zero_rows && gradient_bp->bias == 0.0) continue;
+                if (sparse) {
+                    PSSparseSum(input, gradient->weights,
+                                gradient_bp->weights);
+                    continue;
+                }
                 w = 0;
 #ifdef USE_AVX
-                AVXSum(wsize, gradient->weights, gradient_bp->weights,
-                       gradient->weights, w, 0);
+                AVXSum(PSPaddedSize(wsize), gradient->weights,
+                       gradient_bp->weights, gradient->weights, w, 0);
 #endif
                 for (; w < wsize; w++)
                     gradient->weights[w] += gradient_bp->weights[w];
@@ -1849,74 +3693,23 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
         PSDeleteGradients(bp_gradients, network);
     }
     
-    double l1 = 0.0, l2 = 0.0, l2_loss = 0.0;
-    if (opts != NULL) {
-        //if (opts->l1_decay != 0.0) l1 = opts->l1_decay / elements_count;
-        if (opts->l2_decay != 0.0) {
-            l2 = opts->l2_decay / elements_count;
-            l2 = (1 - (rate * l2));
-        }
-        l1 = (1 - (rate * l1));
+    if (group != NULL && !PSAllreduceGradients(group, network, gradients)) {
+        PSErr(func, "Gradients allreduce failed (rank %d)", group->rank);
+        network->status = STATUS_ERROR;
+        PSDeleteGradients(gradients, network);
+        free(loss_outputs);
+        return -999.0;
     }
-    
-    for (i = 0; i < dsize; i++) {
-        PSGradient * lgradients = gradients[i];
-        if (lgradients == NULL) continue;
-        PSLayer * layer = network->layers[i + 1];
-        PSLayerType ltype = layer->type;
-        int l_size;
-        PSSharedParams * shared = NULL;
-        if (ltype == Convolutional) {
-            PSLayerParameters * params = layer->parameters;
-            l_size = (int) (params->parameters[PARAM_FEATURE_COUNT]);
-            shared = getConvSharedParams(layer);
-        } else l_size = layer->size;
-        int is_lstm = ltype == LSTM;
-        for (j = 0; j < l_size; j++) {
-            PSGradient * g = &(lgradients[j]);
-            if (shared == NULL) {
-                PSNeuron * neuron = layer->neurons[j];
-                neuron->bias = neuron->bias - r * g->bias;
-                int wsize = neuron->weights_size;
-                if (is_lstm) PSUpdateLSTMBiases(neuron, g, r);
-                k = 0;
-#ifdef USE_AVX
-                if (l2 != 0.0) {
-                    int kk = 0;
-                    AVXMultiplyValues(wsize, neuron->weights, l2, g->weights, r,
-                                      neuron->weights, k, 0, 0,
-                                      AVX_STORE_MODE_NORM, AVX_STORE_MODE_SUB);
-                    AVXDotSquare(wsize, g->weights, l2_loss, kk, 0, 0);
-                    if (kk < k) { // AVX Step Length could differ
-                        for (; kk < k; kk++) {
-                            double grad_w = g->weights[kk];
-                            l2_loss += (grad_w * grad_w);
-                        }
-                    }
-                } else {
-                    AVXMultiplyValue(wsize, g->weights, r, neuron->weights,
-                                     k, 0, 0, AVX_STORE_MODE_SUB);
-                }
-#endif
-                for (; k < wsize; k++) {
-                    double grad_w = g->weights[k];
-                    if (l2 != 0.0) {
-                        neuron->weights[k] *= l2;
-                        l2_loss += (grad_w * grad_w);
-                    }
-                    neuron->weights[k] -= (r * grad_w);
-                }
-            } else {
-                shared->biases[j] -= (r * g->bias);
-                double * weights = shared->weights[j];
-                k = 0;
-#ifdef USE_AVX
-                AVXMultiplyValue(shared->weights_size, g->weights, r, weights,
-                                 k, 0, 0, AVX_STORE_MODE_SUB);
-#endif
-                for (; k < shared->weights_size; k++)
-                    weights[k] -= (r * g->weights[k]);
-            }
+    if (graph != NULL) {
+        for (i = 1; i < netsize; i++) l2_loss += graph_ctx.l2_losses[i];
+        PSDeleteTaskGraph(graph);
+        deleteBackwardGraphContext(&graph_ctx);
+    } else {
+        for (i = 0; i < dsize; i++) {
+            PSGradient * lgradients = gradients[i];
+            if (lgradients == NULL) continue;
+            l2_loss += updateLayerWeights(network->layers[i + 1], lgradients,
+                                          r, l2);
         }
     }
     PSDeleteGradients(gradients, network);
@@ -1924,6 +3717,15 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
     int onehot = out->flags & FLAG_ONEHOT;
     if (onehot) label_data_size = 1;
     if (is_recurrent) label_data_size *= times;
+    if (l2 != 0.0) l2_loss = (0.5 * (opts->l2_decay / batch_size) * l2_loss);
+    int onehot_s = (onehot ? out->size : 0);
+    if (loss_outputs != NULL) {
+        /* Collected window by window, as chunks leave only their states */
+        double loss = network->loss(loss_outputs, y, label_data_size,
+                                    onehot_s);
+        free(loss_outputs);
+        return loss + l2_loss;
+    }
     double outputs[label_data_size];
     for (i = 0; i < label_data_size; i++) {
         if (!is_recurrent)
@@ -1937,11 +3739,38 @@ double updateWeights(PSNeuralNetwork * network, double * training_data,
             } else fetchRecurrentOutputState(out, outputs, i, 0);
         }
     }
-    if (l2 != 0.0) l2_loss = (0.5 * (opts->l2_decay / batch_size) * l2_loss);
-    int onehot_s = (onehot ? out->size : 0);
     return network->loss(outputs, y, label_data_size, onehot_s) + l2_loss;
 }
 
+static double getTimeSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+static void printCheckpointOverhead(PSNeuralNetwork * network,
+                                    double ** series, int count,
+                                    PSTrainingOptions * options)
+{
+    long steps = 0, recomputed = 0;
+    int i, longest = 0, window = 0;
+    int truncate = options->bptt_truncate;
+    if (truncate <= 0) truncate = BPTT_TRUNCATE;
+    for (i = 0; i < count; i++) {
+        int times = (int) series[i][0], slots;
+        steps += times;
+        recomputed += checkpointRecomputedSteps(network, times, truncate,
+                                                options->checkpoint_interval,
+                                                &slots);
+        if (times > longest) longest = times;
+        if (slots > window) window = slots;
+    }
+    if (steps == 0) return;
+    printf("BPTT checkpoints: %.1f%% of timesteps recomputed, buffers of %d "
+           "steps instead of %d\n", 100.0 * (double) recomputed / steps,
+           window, longest);
+}
+
 double gradientDescent(PSNeuralNetwork * network,
                        double * training_data,
                        int element_size,
@@ -1967,14 +3796,72 @@ double gradientDescent(PSNeuralNetwork * network,
                 return -999.00;
             }
         }
-        if (!(flags & TRAINING_NO_SHUFFLE))
+        if (flags & TRAINING_BUCKET_SEQUENCES) {
+            int bucket_batches = options->bucket_batches;
+            if (bucket_batches <= 0) bucket_batches = BUCKET_BATCHES;
+            bucketSeries(series, elements_count, batch_size, bucket_batches,
+                         !(flags & TRAINING_NO_SHUFFLE));
+            if (network->current_epoch == 0) {
+                printf("Length buckets: %d batches each, padding efficiency "
+                       "%.1f%%\n", bucket_batches, 100.0 *
+                       seriesPaddingEfficiency(series, elements_count,
+                                               batch_size));
+            }
+        } else if (!(flags & TRAINING_NO_SHUFFLE))
             shuffleSeries(series, elements_count);
+        if (flags & TRAINING_CHECKPOINT) {
+            if (options->bptt_chunk > 0) {
+                PSErr("gradientDescent", "BPTT checkpoints cannot be used "
+                      "with BPTT chunks");
+                network->status = STATUS_ERROR;
+                free(series);
+                return -999.00;
+            }
+            if (network->current_epoch == 0)
+                printCheckpointOverhead(network, series, elements_count,
+                                        options);
+        }
     } else {
         if (!(flags & TRAINING_NO_SHUFFLE))
             shuffle(training_data, elements_count, element_size);
     }
+    if (flags & TRAINING_HOGWILD) {
+        if (options->process_group != NULL || (flags & TRAINING_LOCAL_SGD)) {
+            PSErr("gradientDescent", "Hogwild cannot be used with a "
+                  "process group or local SGD");
+            network->status = STATUS_ERROR;
+            if (series != NULL) free(series);
+            return -999.00;
+        }
+        double err = PSHogwildDescent(network, training_data, series,
+                                      element_size, elements_count,
+                                      learning_rate, batch_size, options,
+                                      epochs);
+        if (series != NULL) free(series);
+        if (network->status != STATUS_ERROR &&
+            !PSSyncInferenceReplicas(network))
+            network->status = STATUS_ERROR;
+        return err;
+    }
+    PSProcessGroup * group = NULL;
+    if (flags & TRAINING_LOCAL_SGD) {
+        group = (PSProcessGroup *) options->process_group;
+        if (group == NULL) {
+            double err = PSLocalSGDDescent(network, training_data, series,
+                                           element_size, elements_count,
+                                           learning_rate, batch_size,
+                                           options, epochs);
+            if (series != NULL) free(series);
+            if (network->status != STATUS_ERROR &&
+                !PSSyncInferenceReplicas(network))
+                network->status = STATUS_ERROR;
+            return err;
+        }
+    }
     int offset = (element_size * batch_size), i;
-    double err = 0.0;
+    int steps = (group != NULL ? PSGetLocalSteps(network, options) : 0);
+    int syncs = 0;
+    double err = 0.0, compute_t = 0.0, sync_t = 0.0, t = getTimeSeconds();
     for (i = 0; i < batches_count; i++) {
         network->current_batch = i;
         printf("\rEpoch %d/%d: batch %d/%d", network->current_epoch + 1, epochs,
@@ -1982,14 +3869,32 @@ double gradientDescent(PSNeuralNetwork * network,
         fflush(stdout);
         err += updateWeights(network, training_data, batch_size, elements_count,
                              options, learning_rate, series);
+        if (network->status != STATUS_ERROR &&
+            !PSSyncInferenceReplicas(network))
+            network->status = STATUS_ERROR;
+        if (network->status != STATUS_ERROR && group != NULL &&
+            ((i + 1) % steps == 0 || i == batches_count - 1))
+        {
+            double now = getTimeSeconds();
+            compute_t += (now - t);
+            if (!PSAllreduceWeights(group, network)) {
+                PSErr("gradientDescent", "Weights allreduce failed "
+                      "(rank %d)", group->rank);
+                network->status = STATUS_ERROR;
+            }
+            t = getTimeSeconds();
+            sync_t += (t - now);
+            syncs++;
+        }
         if (network->status == STATUS_ERROR) {
-            if (series != NULL) free(series - (i * batches_count));
+            if (series != NULL) free(series - (i * batch_size));
             return -999.00;
         }
         if (series == NULL) training_data += offset;
         else series += batch_size;
     }
     if (series != NULL) free(series - (batch_size * batches_count));
+    if (group != NULL) PSPrintLocalSGDStats(syncs, steps, compute_t, sync_t);
     return err / (double) batches_count;
 }
 
@@ -2272,6 +4177,18 @@ int PSVerifyNetwork(PSNeuralNetwork * network) {
                   "Convolutional, but type is not Pooling", i);
             return 0;
         }
+        if (ltype == Embedding && i != 1) {
+            PSErr(func, "Layer[%d] type is Embedding, "
+                  "but it does not follow the input layer", i);
+            return 0;
+        }
+        if (previous && previous->type == Embedding &&
+            (ltype == Convolutional || ltype == Pooling || ltype == Recurrent))
+        {
+            PSErr(func, "Layer[%d] previous type is Embedding, "
+                  "but type is %s", i, PSGetLabelForType(ltype));
+            return 0;
+        }
         if (layer->activate == sigmoid &&
             layer->derivative != sigmoid_derivative) {
             PSErr(func,
@@ -2293,8 +4210,8 @@ int PSVerifyNetwork(PSNeuralNetwork * network) {
         }
         previous = layer;
     }
+    PSLayer * output = network->layers[size - 1];
     if (network->flags & FLAG_RECURRENT) {
-        PSLayer * output = network->layers[size - 1];
         if (output->type != SoftMax) {
             PSErr(func,
                   "Recurrent networks require a Softmax output layer, "
@@ -2303,5 +4220,17 @@ int PSVerifyNetwork(PSNeuralNetwork * network) {
             return 0;
         }
     }
+    if ((output->flags & FLAG_HIERARCHICAL) && output->type != SoftMax) {
+        PSErr(func, "Only Softmax layers can be hierarchical");
+        return 0;
+    }
+    if (PSSoftmaxNeedsTargets(output) &&
+        (!(network->flags & FLAG_RECURRENT) ||
+         !(output->flags & FLAG_ONEHOT) || size < 3))
+    {
+        PSErr(func, "Sampled and hierarchical Softmax layers require a "
+              "recurrent network with hidden layers and onehot labels");
+        return 0;
+    }
     return 1;
 }
@@ -20,7 +20,7 @@
 
 #define PSYC_VERSION      "0.2.2"
 
-#define LAYER_TYPES  6
+#define LAYER_TYPES  8
 
 #define STATUS_UNTRAINED    0
 #define STATUS_TRAINED      1
@@ -32,15 +32,31 @@
 #define FLAG_NONE 0
 #define FLAG_RECURRENT  (1 << 0)
 #define FLAG_ONEHOT     (1 << 1)
+#define FLAG_HIERARCHICAL (1 << 2)
 
 /* Global Flags*/
 
 #define FLAG_LOG_COLORS (1 << 0)
+#define FLAG_THREAD_AFFINITY (1 << 1)
+#define FLAG_WAVEFRONT (1 << 2)
 
 #define TRAINING_NO_SHUFFLE     (1 << 0)
 #define TRAINING_ADJUST_RATE    (1 << 1)
+#define TRAINING_TASK_GRAPH     (1 << 2)
+#define TRAINING_HOGWILD        (1 << 3)
+#define TRAINING_LOCAL_SGD      (1 << 4)
+#define TRAINING_BATCH_SEQUENCES (1 << 5)
+#define TRAINING_BUCKET_SEQUENCES (1 << 6)
+#define TRAINING_CHECKPOINT     (1 << 7) // Recurrent networks only
 
 #define BPTT_TRUNCATE   4
+#define BUCKET_BATCHES  8
+
+/* Memory Policy Flags */
+
+#define MEMORY_HUGE_PAGES   (1 << 0)
+#define MEMORY_LOCK         (1 << 1)
+#define MEMORY_PREFAULT     (1 << 2)
 
 
 typedef double  (*PSActivationFunction) (double);
@@ -62,7 +78,9 @@ typedef enum {
     Pooling,
     Recurrent,
     LSTM,
-    SoftMax
+    SoftMax,
+    GRU,
+    Embedding
 } PSLayerType;
 
 typedef struct {
@@ -80,6 +98,14 @@ typedef struct {
 typedef struct {
     int flags;
     double l2_decay;
+    int threads; // TRAINING_HOGWILD workers, 0 = one per CPU
+    void * process_group; // PSProcessGroup averaging gradients, or NULL
+    int local_steps; // TRAINING_LOCAL_SGD: batches between weight averages
+    int local_warmup_epochs; // Epochs averaging after every batch
+    int bptt_truncate; // Timesteps deltas flow back, 0 = BPTT_TRUNCATE
+    int bptt_chunk; // Timesteps per chunk of longer sequences, 0 = no chunks
+    int bucket_batches; // Batches per length bucket, 0 = BUCKET_BATCHES
+    int checkpoint_interval; // Timesteps between BPTT checkpoints, 0 = sqrt
 } PSTrainingOptions;
 
 typedef struct {
@@ -104,6 +130,15 @@ typedef struct {
     PSNeuron ** neurons;
     int flags;
     void * extra;
+    int states_capacity;
+    double * states_buffer;
+    double * recurrent_weights_t;
+    int recurrent_weights_dirty;
+    int nonzero_count;
+    int * nonzero_indexes;
+    double * nonzero_values;
+    long activations_seen;
+    long nonzero_seen;
 #ifdef USE_AVX
     double * avx_activation_cache;
 #endif
@@ -122,14 +157,32 @@ typedef struct {
     int current_epoch;
     int current_batch;
     PSTrainCallback onEpochTrained;
+    int memory_flags;
+    void * memory;
+    void * inference;
 } PSNeuralNetwork;
 
+/* Recurrent network state carried between PSStep calls: the last
+ * activation of every Recurrent, LSTM and GRU neuron (layer by layer), each
+ * LSTM layer followed by its cell values. output holds the output layer
+ * activations of the last step. */
+
+typedef struct {
+    int size;
+    int output_size;
+    int steps;
+    double * values;
+    double * output;
+} PSStepState;
+
 extern int PSGlobalFlags;
 
 PSNeuralNetwork * PSCreateNetwork(const char* name);
 PSNeuralNetwork * PSCloneNetwork(PSNeuralNetwork * network, int layout_only);
+int PSCopyNetworkWeights(PSNeuralNetwork * dest, PSNeuralNetwork * src);
 int PSLoadNetwork(PSNeuralNetwork * network, const char* filename);
 int PSSaveNetwork(PSNeuralNetwork * network, const char* filename);
+int PSSetMemoryPolicy(PSNeuralNetwork * network, int flags);
 PSLayer * PSAddLayer(PSNeuralNetwork * network, PSLayerType type, int size,
                      PSLayerParameters* params);
 PSLayer * PSAddConvolutionalLayer(PSNeuralNetwork * network,
@@ -146,7 +199,16 @@ PSLayerParameters * PSCreateConvolutionalParameters(double feature_count,
                                                     int use_relu);
 void PSDeleteLayerParamenters(PSLayerParameters * params);
 int PSFeedforward(PSNeuralNetwork * network, double * values);
+int PSFeedforwardBatch(PSNeuralNetwork * network, double * inputs, int count,
+                       double * outputs);
 int PSClassify(PSNeuralNetwork * network, double * values);
+PSStepState * PSCreateStepState(PSNeuralNetwork * network);
+PSStepState * PSCloneStepState(PSStepState * state);
+void PSResetStepState(PSStepState * state);
+int PSSaveStepState(PSStepState * state, const char * filename);
+int PSLoadStepState(PSStepState * state, const char * filename);
+void PSDeleteStepState(PSStepState * state);
+int PSStep(PSNeuralNetwork * network, PSStepState * state, double * x);
 
 void PSDeleteNetwork(PSNeuralNetwork * network);
 void PSDeleteLayer(PSLayer * layer);
@@ -22,12 +22,23 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <limits.h>
+#ifdef __linux__
+#include <stdint.h>
+#include <sys/epoll.h>
+#endif
 #include "psyc.h"
 #include "utils.h"
 #include "convolutional.h"
 #include "recurrent.h"
 #include "mnist.h"
+#include "threadpool.h"
+#include "distributed.h"
+#include "pipeline.h"
+#include "inference.h"
+#include "softmax.h"
+#include "sparse.h"
 
 #ifdef HAS_MAGICK
 #include "image_data.h"
@@ -163,6 +174,10 @@ static PSLayerType getLayerType(char * name, PSNeuralNetwork * network) {
         return Recurrent;
     else if (strcmp("lstm", name) == 0)
         return LSTM;
+    else if (strcmp("gru", name) == 0)
+        return GRU;
+    else if (strcmp("embedding", name) == 0)
+        return Embedding;
     else {
         fprintf(stderr, "Unkown layer type %s\n", name);
         PSDeleteNetwork(network);
@@ -186,6 +201,106 @@ static void getTempFileName(const char * prefix, char * buffer) {
 double * training_data = NULL;
 double * test_data = NULL;
 double * validation_data = NULL;
+static int arrayMaxIndex(double * array, int len) {
+    int i, max_idx = 0;
+    for (i = 1; i < len; i++) {
+        if (array[i] > array[max_idx]) max_idx = i;
+    }
+    return max_idx;
+}
+
+/* Classify the test dataset through a layer pipeline instead of PSTest,
+ * reporting accuracy, throughput and how busy each stage was. */
+
+static int pipelineTest(PSNeuralNetwork * network, double * test_data,
+                        int data_size, int stages)
+{
+    PSLayer * out = network->layers[network->size - 1];
+    int input_size = network->input_size, output_size = network->output_size;
+    int y_size = (out->flags & FLAG_ONEHOT ? 1 : output_size);
+    int element_size = input_size + y_size;
+    int count = data_size / element_size, correct = 0, i;
+    PSPipeline * pipeline = PSCreatePipeline(network, stages, NULL, 0);
+    if (pipeline == NULL) return 0;
+    double * outputs = malloc(count * output_size * sizeof(double));
+    if (outputs == NULL) {
+        fprintf(stderr, "Could not allocate pipeline outputs!\n");
+        PSDeletePipeline(pipeline);
+        return 0;
+    }
+    int ok = PSPipelineFeedforward(pipeline, test_data, count, element_size,
+                                   outputs);
+    for (i = 0; i < count && ok; i++) {
+        double * y = test_data + (i * element_size) + input_size;
+        int expected = (y_size == 1 ? (int) *y : arrayMaxIndex(y, y_size));
+        if (arrayMaxIndex(outputs + (i * output_size), output_size) ==
+            expected) correct++;
+    }
+    if (ok) {
+        printf("Pipeline accuracy: %.2f\n",
+               (count ? correct / (float) count : 0.0f));
+        PSPrintPipelineStats(pipeline);
+    }
+    free(outputs);
+    PSDeletePipeline(pipeline);
+    return ok;
+}
+
+/* Classify the test dataset by submitting every sample to the network's
+ * inference workers at once and collecting the results as they come. */
+
+static int asyncTest(PSNeuralNetwork * network, double * test_data,
+                     int data_size, int workers)
+{
+    PSLayer * out = network->layers[network->size - 1];
+    int input_size = network->input_size, output_size = network->output_size;
+    int y_size = (out->flags & FLAG_ONEHOT ? 1 : output_size);
+    int element_size = input_size + y_size;
+    int count = data_size / element_size, correct = 0, done = 0, ok = 1, i;
+    if (!PSStartInference(network, workers, 0)) return 0;
+    PSInferenceRequest ** requests = calloc(count, sizeof(*requests));
+    if (requests == NULL) {
+        fprintf(stderr, "Could not allocate requests!\n");
+        PSStopInference(network);
+        return 0;
+    }
+    for (i = 0; i < count && ok; i++) {
+        requests[i] = PSFeedforwardAsync(network, test_data +
+                                         (i * element_size), NULL, NULL);
+        if (requests[i] == NULL) ok = 0;
+    }
+#ifdef __linux__
+    int fd = PSGetInferenceEventFD(network), epfd = -1;
+    if (fd >= 0) epfd = epoll_create1(0);
+    if (epfd >= 0) {
+        struct epoll_event ev = {.events = EPOLLIN};
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+        while (ok && done < count && epoll_wait(epfd, &ev, 1, -1) > 0) {
+            uint64_t completed;
+            if (read(fd, &completed, sizeof(completed)) > 0)
+                done += (int) completed;
+        }
+        close(epfd);
+    }
+#endif
+    for (i = 0; i < count && ok; i++) {
+        double * y = test_data + (i * element_size) + input_size;
+        int expected = (y_size == 1 ? (int) *y : arrayMaxIndex(y, y_size));
+        if (!PSWaitRequest(requests[i])) ok = 0;
+        else if (arrayMaxIndex(requests[i]->output, output_size) == expected)
+            correct++;
+    }
+    if (ok) {
+        printf("Async accuracy: %.2f\n",
+               (count ? correct / (float) count : 0.0f));
+        PSPrintInferenceStats(network);
+    }
+    for (i = 0; i < count; i++) PSDeleteRequest(requests[i]);
+    free(requests);
+    PSStopInference(network);
+    return ok;
+}
+
 int testlen = 0;
 int datalen = 0;
 int valdlen = 0;
@@ -204,6 +319,18 @@ int main(int argc, char ** argv) {
     int i, j;
     outputFile[0] = 0;
     int training_flags = 0;
+    int worker_threads = 0;
+    int local_steps = 0, local_warmup = 0;
+    int bptt_truncate = 0, bptt_chunk = 0, bucket_batches = 0;
+    int checkpoint_interval = 0;
+    int pipeline_stages = 0;
+    int async_workers = 0;
+    int report_density = 0;
+    int memory_flags = 0;
+    int thread_count = 1;
+    int processes = 1, group_rank = -1, children = 0;
+    char * group_name = NULL;
+    PSProcessGroup * group = NULL;
 #ifdef HAS_MAGICK
     char * image_filename = NULL;
     char * image_dump_filename = NULL;
@@ -247,6 +374,24 @@ int main(int argc, char ** argv) {
             continue;
         }
         
+        if (strcmp("--hierarchical", arg) == 0) {
+            if (network->size > 0)
+                network->layers[network->size - 1]->flags |= FLAG_HIERARCHICAL;
+            continue;
+        }
+        
+        if (strcmp("--softmax-samples", arg) == 0 && ++i < argc) {
+            char * samples_s = argv[i];
+            int samples = 0;
+            int matched = sscanf(samples_s, "%d", &samples);
+            if (!matched || samples < 0 || network->size == 0) {
+                fprintf(stderr, "Invalid softmax samples %s\n", samples_s);
+                continue;
+            }
+            PSSetSoftmaxSamples(network->layers[network->size - 1], samples);
+            continue;
+        }
+        
         if (strcmp("--layer", arg) == 0 && ++i < argc) {
             char * type = argv[i];
             PSLayerType ltype = getLayerType(type, network);
@@ -487,6 +632,57 @@ int main(int argc, char ** argv) {
             continue;
         }
         
+        if (strcmp("--threads", arg) == 0 && ++i < argc) {
+            char * threads_s = argv[i];
+            int matched = sscanf(threads_s, "%d", &thread_count);
+            if (!matched)
+                fprintf(stderr, "Invalid thread count %s\n", threads_s);
+            continue;
+        }
+        
+        if (strcmp("--parallel-threshold", arg) == 0 && ++i < argc) {
+            char * threshold_s = argv[i];
+            int matched = sscanf(threshold_s, "%d", &PSParallelThreshold);
+            if (!matched)
+                fprintf(stderr, "Invalid parallel threshold %s\n",
+                        threshold_s);
+            continue;
+        }
+        
+        if (strcmp("--sparse-threshold", arg) == 0 && ++i < argc) {
+            char * threshold_s = argv[i];
+            int matched = sscanf(threshold_s, "%lf", &PSSparseThreshold);
+            if (!matched)
+                fprintf(stderr, "Invalid sparse threshold %s\n",
+                        threshold_s);
+            continue;
+        }
+        
+        if (strcmp("--processes", arg) == 0 && ++i < argc) {
+            char * processes_s = argv[i];
+            int matched = sscanf(processes_s, "%d", &processes);
+            if (!matched || processes < 1) {
+                fprintf(stderr, "Invalid processes count %s\n", processes_s);
+                processes = 1;
+            }
+            continue;
+        }
+        
+        if (strcmp("--rank", arg) == 0 && ++i < argc) {
+            char * rank_s = argv[i];
+            int matched = sscanf(rank_s, "%d", &group_rank);
+            if (!matched) {
+                fprintf(stderr, "Invalid rank %s\n", rank_s);
+                group_rank = -1;
+            }
+            continue;
+        }
+        
+        if (strcmp("--group", arg) == 0 && ++i < argc) {
+            group_name = argv[i];
+            continue;
+        }
+        
         if (strcmp("--training-no-shuffle", arg) == 0) {
             training_flags |= TRAINING_NO_SHUFFLE;
             continue;
@@ -497,6 +693,140 @@ int main(int argc, char ** argv) {
             continue;
         }
         
+        if (strcmp("--hogwild", arg) == 0 && ++i < argc) {
+            char * threads_s = argv[i];
+            int matched = sscanf(threads_s, "%d", &worker_threads);
+            if (!matched)
+                fprintf(stderr, "Invalid Hogwild threads %s\n", threads_s);
+            else training_flags |= TRAINING_HOGWILD;
+            continue;
+        }
+        
+        if (strcmp("--local-sgd", arg) == 0 && ++i < argc) {
+            char * steps_s = argv[i];
+            int matched = sscanf(steps_s, "%d", &local_steps);
+            if (!matched || local_steps < 1)
+                fprintf(stderr, "Invalid local SGD steps %s\n", steps_s);
+            else training_flags |= TRAINING_LOCAL_SGD;
+            continue;
+        }
+        
+        if (strcmp("--local-sgd-threads", arg) == 0 && ++i < argc) {
+            char * threads_s = argv[i];
+            int matched = sscanf(threads_s, "%d", &worker_threads);
+            if (!matched)
+                fprintf(stderr, "Invalid local SGD threads %s\n", threads_s);
+            continue;
+        }
+        
+        if (strcmp("--local-sgd-warmup", arg) == 0 && ++i < argc) {
+            char * epochs_s = argv[i];
+            int matched = sscanf(epochs_s, "%d", &local_warmup);
+            if (!matched)
+                fprintf(stderr, "Invalid local SGD warmup %s\n", epochs_s);
+            continue;
+        }
+        
+        if (strcmp("--bptt-truncate", arg) == 0 && ++i < argc) {
+            char * steps_s = argv[i];
+            int matched = sscanf(steps_s, "%d", &bptt_truncate);
+            if (!matched || bptt_truncate < 1) {
+                fprintf(stderr, "Invalid BPTT truncation %s\n", steps_s);
+                bptt_truncate = 0;
+            }
+            continue;
+        }
+        
+        if (strcmp("--bptt-chunk", arg) == 0 && ++i < argc) {
+            char * steps_s = argv[i];
+            int matched = sscanf(steps_s, "%d", &bptt_chunk);
+            if (!matched || bptt_chunk < 1) {
+                fprintf(stderr, "Invalid BPTT chunk %s\n", steps_s);
+                bptt_chunk = 0;
+            }
+            continue;
+        }
+        
+        if (strcmp("--bptt-checkpoint", arg) == 0 && ++i < argc) {
+            char * steps_s = argv[i];
+            int matched = sscanf(steps_s, "%d", &checkpoint_interval);
+            if (!matched || checkpoint_interval < 0) {
+                fprintf(stderr, "Invalid BPTT checkpoint %s\n", steps_s);
+                checkpoint_interval = 0;
+            } else training_flags |= TRAINING_CHECKPOINT;
+            continue;
+        }
+        
+        if (strcmp("--bucket-sequences", arg) == 0 && ++i < argc) {
+            char * batches_s = argv[i];
+            int matched = sscanf(batches_s, "%d", &bucket_batches);
+            if (!matched || bucket_batches < 1) {
+                fprintf(stderr, "Invalid bucket batches %s\n", batches_s);
+                bucket_batches = 0;
+            } else training_flags |= TRAINING_BUCKET_SEQUENCES;
+            continue;
+        }
+        
+        if (strcmp("--training-task-graph", arg) == 0) {
+            training_flags |= TRAINING_TASK_GRAPH;
+            continue;
+        }
+        
+        if (strcmp("--training-batch-sequences", arg) == 0) {
+            training_flags |= TRAINING_BATCH_SEQUENCES;
+            continue;
+        }
+        
+        if (strcmp("--pipeline", arg) == 0 && ++i < argc) {
+            char * stages_s = argv[i];
+            int matched = sscanf(stages_s, "%d", &pipeline_stages);
+            if (!matched || pipeline_stages < 1) {
+                fprintf(stderr, "Invalid pipeline stages %s\n", stages_s);
+                pipeline_stages = 0;
+            }
+            continue;
+        }
+        
+        if (strcmp("--async", arg) == 0 && ++i < argc) {
+            char * workers_s = argv[i];
+            int matched = sscanf(workers_s, "%d", &async_workers);
+            if (!matched || async_workers < 1) {
+                fprintf(stderr, "Invalid async workers %s\n", workers_s);
+                async_workers = 0;
+            }
+            continue;
+        }
+        
+        if (strcmp("--huge-pages", arg) == 0) {
+            memory_flags |= MEMORY_HUGE_PAGES;
+            continue;
+        }
+        
+        if (strcmp("--mlock", arg) == 0) {
+            memory_flags |= MEMORY_LOCK;
+            continue;
+        }
+        
+        if (strcmp("--prefault", arg) == 0) {
+            memory_flags |= MEMORY_PREFAULT;
+            continue;
+        }
+        
+        if (strcmp("--activation-density", arg) == 0) {
+            report_density = 1;
+            continue;
+        }
+        
+        if (strcmp("--thread-affinity", arg) == 0) {
+            PSGlobalFlags |= FLAG_THREAD_AFFINITY;
+            continue;
+        }
+        
+        if (strcmp("--wavefront", arg) == 0) {
+            PSGlobalFlags |= FLAG_WAVEFRONT;
+            continue;
+        }
+        
         if (strcmp("--enable-colors", arg) == 0) {
             PSGlobalFlags |= FLAG_LOG_COLORS;
         }
@@ -512,6 +842,38 @@ int main(int argc, char ** argv) {
         }
         
     }
+    if (memory_flags && !PSSetMemoryPolicy(network, memory_flags))
+        fprintf(stderr, "WARNING: could not apply memory policy!\n");
+    /* Launch (or, with --rank, join) the worker processes before creating
+     * the thread pool, since threads do not survive fork. */
+    pid_t workers[processes];
+    if (processes > 1 && training_data != NULL) {
+        int rank = (group_rank >= 0 ? group_rank : 0);
+        group = PSJoinProcessGroup(group_name, rank, processes, network);
+        if (group == NULL) {
+            fprintf(stderr, "Could not join process group!\n");
+            PSDeleteNetwork(network);
+            return 1;
+        }
+        for (j = 1; j < processes && group_rank < 0; j++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                fprintf(stderr, "Could not launch worker %d!\n", j);
+                break;
+            }
+            if (pid == 0) {
+                group->rank = j;
+                children = 0;
+                break;
+            }
+            workers[children++] = pid;
+        }
+        if (group->rank > 0 && freopen("/dev/null", "w", stdout) == NULL)
+            fprintf(stderr, "WARNING: could not silence rank %d\n",
+                    group->rank);
+    }
+    if (thread_count > 1 && !PSSetThreadCount(thread_count))
+        fprintf(stderr, "WARNING: could not create thread pool!\n");
     if (training_data != NULL) {
         int element_size = network->input_size + network->output_size;
         int element_count = datalen / element_size;
@@ -542,14 +904,74 @@ int main(int argc, char ** argv) {
         
         PSTrainingOptions options = {
             .flags = training_flags,
-            .l2_decay = (double) l2_decay
+            .l2_decay = (double) l2_decay,
+            .threads = worker_threads,
+            .process_group = group,
+            .local_steps = local_steps,
+            .local_warmup_epochs = local_warmup,
+            .bptt_truncate = bptt_truncate,
+            .bptt_chunk = bptt_chunk,
+            .bucket_batches = bucket_batches,
+            .checkpoint_interval = checkpoint_interval
         };
-        PSTrain(network, training_data, datalen, epochs, learning_rate,
-                batch_size, &options, validation_data, valdlen);
+        double * shard = training_data;
+        if (group != NULL) {
+            /* Every rank trains on its own equally sized shard, so that
+             * all of them run the same number of steps. */
+            int shard_len = train_dataset_len / processes;
+            shard += (group->rank * shard_len * element_size);
+            datalen = shard_len * element_size;
+            if (group->rank > 0) {
+                validation_data = NULL;
+                valdlen = 0;
+            }
+            if (options.flags & TRAINING_ADJUST_RATE) {
+                fprintf(stderr, "WARNING: --training-adjust-rate ignored "
+                        "with multiple processes\n");
+                options.flags &= ~TRAINING_ADJUST_RATE;
+            }
+            if (!PSBroadcastWeights(group, network)) {
+                fprintf(stderr, "Could not broadcast weights!\n");
+                network->status = STATUS_ERROR;
+            }
+        }
+        if (network->status != STATUS_ERROR)
+            PSTrain(network, shard, datalen, epochs, learning_rate,
+                    batch_size, &options, validation_data, valdlen);
         free(training_data);
     }
+    if (group != NULL) {
+        int failed = (network->status == STATUS_ERROR);
+        if (group->rank > 0) {
+            /* Only rank 0 tests and writes the checkpoint */
+            PSLeaveProcessGroup(group);
+            PSDeleteNetwork(network);
+            if (test_data != NULL) free(test_data);
+            PSSetThreadCount(1);
+            return failed;
+        }
+        for (j = 0; j < children; j++) {
+            int status = 0;
+            if (waitpid(workers[j], &status, 0) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status) != 0)
+            {
+                fprintf(stderr, "WARNING: worker %d failed!\n", j + 1);
+            }
+        }
+        PSLeaveProcessGroup(group);
+    }
     if (test_data != NULL) {
-        PSTest(network, test_data, testlen);
+        if (pipeline_stages > 0) {
+            if (!pipelineTest(network, test_data, testlen, pipeline_stages))
+                fprintf(stderr, "Pipeline test failed!\n");
+        } else if (async_workers > 0) {
+            if (!asyncTest(network, test_data, testlen, async_workers))
+                fprintf(stderr, "Async test failed!\n");
+        } else {
+            PSResetActivationDensity(network);
+            PSTest(network, test_data, testlen);
+            if (report_density) PSPrintActivationDensity(network);
+        }
         free(test_data);
     }
     
@@ -578,6 +1000,7 @@ int main(int argc, char ** argv) {
     }
 
     PSDeleteNetwork(network);
+    PSSetThreadCount(1);
     return 0;
 }
 
@@ -593,6 +1016,12 @@ void print_help(const char* program_path) {
     printf("                                    "
            "(if before 1st layer) or desired output\n");
     printf("                                    (if after output layer)\n");
+    printf("        --hierarchical              Tree-based Softmax output "
+           "(after it)\n");
+    printf("        --softmax-samples K         Train the Softmax output "
+           "on K sampled\n");
+    printf("                                    classes per timestep "
+           "(after it)\n");
     printf("        --train TRAIN_DATASET       Train network\n");
     printf("        --test TEST_DATASET         Perform tests\n");
 #ifdef HAS_MAGICK
@@ -609,6 +1038,59 @@ void print_help(const char* program_path) {
     printf("        --l2-decay SIZE             L2 Weight Decay (def. 0)\n");
     printf("        --training-no-shuffle       Prevent dataset shuffle\n");
     printf("        --training-adjust-rate      Auto-adjust learn rate\n");
+    printf("        --training-task-graph       Overlap gradients, updates "
+           "and deltas\n");
+    printf("        --training-batch-sequences  Run recurrent batches "
+           "through time at once\n");
+    printf("        --hogwild THREADS           Lock-free async training "
+           "(0 = CPUs)\n");
+    printf("        --local-sgd STEPS           Average weights every STEPS "
+           "batches\n");
+    printf("        --local-sgd-threads THREADS Local SGD threads without "
+           "--processes\n");
+    printf("        --local-sgd-warmup EPOCHS   Average after every batch "
+           "first\n");
+    printf("        --bptt-truncate STEPS       Timesteps recurrent deltas "
+           "flow back\n");
+    printf("                                    (def. %d)\n", BPTT_TRUNCATE);
+    printf("        --bptt-chunk STEPS          Train long sequences STEPS "
+           "at a time\n");
+    printf("        --bptt-checkpoint STEPS     Only keep states every STEPS "
+           "timesteps,\n");
+    printf("                                    recomputing the rest "
+           "(0 = sqrt of length)\n");
+    printf("        --bucket-sequences BATCHES  Batch sequences of similar "
+           "length,\n");
+    printf("                                    BATCHES per length bucket\n");
+    printf("        --huge-pages                Back weights with huge pages\n");
+    printf("        --mlock                     Lock weights in memory\n");
+    printf("        --prefault                  Prefault weights memory\n");
+    printf("        --processes COUNT           Train with COUNT processes "
+           "(def. 1)\n");
+    printf("        --rank RANK                 Join a group as RANK "
+           "instead of\n");
+    printf("                                    launching the processes\n");
+    printf("        --group NAME                Shared memory group name\n");
+    printf("        --threads COUNT             Threads per layer (def. 1)\n");
+    printf("        --pipeline STAGES           Test with layers pipelined "
+           "over\n");
+    printf("                                    STAGES threads\n");
+    printf("        --async WORKERS             Test through asynchronous "
+           "requests\n");
+    printf("                                    served by WORKERS threads\n");
+    printf("        --parallel-threshold OPS    Min. layer size for threads "
+           "(def. %d)\n", PS_DEFAULT_PARALLEL_THRESHOLD);
+    printf("        --sparse-threshold DENSITY  Max. layer density for sparse "
+           "products\n");
+    printf("                                    (def. %g, 0 = off)\n",
+           PS_DEFAULT_SPARSE_THRESHOLD);
+    printf("        --activation-density        Print input and ReLU "
+           "activation\n");
+    printf("                                    densities after testing\n");
+    printf("        --thread-affinity           Pin worker threads to CPUs\n");
+    printf("        --wavefront                 Run recurrent layers along "
+           "time/depth\n");
+    printf("                                    diagonals (with --threads)\n");
     printf("    -v, --version                   Print version\n");
     printf("    -h, --help                      Print this help\n");
     printf("\n");
@@ -27,7 +27,11 @@
 #endif
 
 #include "recurrent.h"
+#include "lstm.h"
+#include "gru.h"
 #include "utils.h"
+#include "memory.h"
+#include "threadpool.h"
 
 PSRecurrentCell * PSCreateRecurrentCell(PSNeuron * neuron, int lsize) {
     PSRecurrentCell * cell = malloc(sizeof(PSRecurrentCell));
@@ -40,46 +44,143 @@ PSRecurrentCell * PSCreateRecurrentCell(PSNeuron * neuron, int lsize) {
     return cell;
 }
 
+/* Per-timestep buffers of every cell of a layer (states, plus z-values
+ * and gates for LSTM ones, gates for GRU ones) live in a single block, each cell owning a
+ * capacity-long row of it for every array. The block only grows, so
+ * sequences up to the longest one seen so far need no allocation. */
+
+int PSReserveLayerStates(PSLayer * layer, int times) {
+    int size = layer->size, i;
+    if (times > layer->states_capacity) {
+        int arrays = 1;
+        if (layer->type == LSTM) arrays = LSTM_STATE_ARRAYS;
+        else if (layer->type == GRU) arrays = GRU_STATE_ARRAYS;
+        int capacity = layer->states_capacity * 2;
+        if (capacity < times) capacity = times;
+        double * buffer = calloc((size_t) arrays * size * capacity,
+                                 sizeof(double));
+        if (buffer == NULL) {
+            printMemoryErrorMsg();
+            return 0;
+        }
+#ifdef USE_AVX
+        double * cache = PSAlignedAlloc(capacity * size);
+        if (cache == NULL) {
+            printMemoryErrorMsg();
+            free(buffer);
+            return 0;
+        }
+        if (layer->avx_activation_cache != NULL)
+            PSFreeNetworkMemory(getLayerNetwork(layer),
+                                layer->avx_activation_cache);
+        layer->avx_activation_cache = cache;
+#endif
+        free(layer->states_buffer);
+        layer->states_buffer = buffer;
+        layer->states_capacity = capacity;
+        for (i = 0; i < size; i++) {
+            PSNeuron * neuron = layer->neurons[i];
+            if (neuron->extra == NULL) {
+                neuron->extra = PSCreateRecurrentCell(neuron, 0);
+                if (neuron->extra == NULL) {
+                    printMemoryErrorMsg();
+                    return 0;
+                }
+            }
+            double * row = buffer + ((size_t) i * capacity);
+            size_t stride = (size_t) size * capacity;
+            if (layer->type == GRU) {
+                PSGRUCell * cell = GetGRUCell(neuron);
+                cell->states = row;
+                cell->candidates = row + stride;
+                cell->reset_gates = row + (2 * stride);
+                cell->update_gates = row + (3 * stride);
+                cell->recurrent_candidates = row + (4 * stride);
+                continue;
+            } else if (layer->type != LSTM) {
+                GetRecurrentCell(neuron)->states = row;
+                continue;
+            }
+            PSLSTMCell * cell = GetLSTMCell(neuron);
+            cell->states = row;
+            cell->z_values = row + stride;
+            cell->candidates = row + (2 * stride);
+            cell->input_gates = row + (3 * stride);
+            cell->output_gates = row + (4 * stride);
+            cell->forget_gates = row + (5 * stride);
+        }
+    }
+    for (i = 0; i < size; i++)
+        GetRecurrentCell(layer->neurons[i])->states_count = times;
+    return 1;
+}
+
 double * PSAddRecurrentState(PSNeuron * neuron, double state, int times, int t)
 {
     PSRecurrentCell * cell = GetRecurrentCell(neuron);
-    if (cell == NULL) {
-        cell = PSCreateRecurrentCell(neuron, 0);
-        neuron->extra = cell;
-        if (cell == NULL) return NULL;
-    }
-    if (t == 0) {
-        cell->states_count = times;
-        if (cell->states != NULL) free(cell->states);
-        cell->states = malloc(times * sizeof(double));
-        if (cell->states == NULL) {
-            neuron->extra = NULL;
-            free(cell);
-            return NULL;
-        }
-    }
-    cell->states[t] = state;
-#ifdef USE_AVX
     PSLayer * layer = getNeuronLayer(neuron);
     assert(layer != NULL);
-    int lsize = layer->size;
-    if (t == 0 && neuron->index == 0) {
-        if (layer->avx_activation_cache != NULL)
-            free(layer->avx_activation_cache);
-        layer->avx_activation_cache = calloc(lsize * times, sizeof(double));
-    }
-    if (layer->avx_activation_cache == NULL) {
-        printMemoryErrorMsg();
-        neuron->extra = NULL;
-        if (cell->states != NULL) free(cell->states);
-        free(cell);
-        return NULL;
+    if (cell == NULL || cell->states == NULL ||
+        (t == 0 && cell->states_count != times))
+    {
+        if (!PSReserveLayerStates(layer, times)) return NULL;
+        cell = GetRecurrentCell(neuron);
     }
-    layer->avx_activation_cache[(t * lsize) + neuron->index] = state;
+    cell->states[t] = state;
+#ifdef USE_AVX
+    layer->avx_activation_cache[(t * layer->size) + neuron->index] = state;
 #endif
     return cell->states;
 }
 
+/* Backprop needs the recurrent weights column by column (every neuron's
+ * weight for cell j), so they are copied into a row per cell: row j holds
+ * the weight of cell j for each neuron, and for LSTM layers for each of
+ * the four gates ([candidate | input | output | forget], size long each),
+ * for GRU layers for each of the three ([candidate | reset | update]).
+ * Rows are only rebuilt when the weights changed since the last call, see
+ * PSInvalidateTransposedWeights. */
+
+int PSUpdateTransposedWeights(PSLayer * layer) {
+    if (layer->recurrent_weights_t != NULL && !layer->recurrent_weights_dirty)
+        return 1;
+    int size = layer->size, gates = 1;
+    if (layer->type == LSTM) gates = 4;
+    else if (layer->type == GRU) gates = 3;
+    int row_size = gates * size, i, j, g;
+    if (layer->recurrent_weights_t == NULL) {
+        layer->recurrent_weights_t = malloc((size_t) size * row_size *
+                                            sizeof(double));
+        if (layer->recurrent_weights_t == NULL) {
+            printMemoryErrorMsg();
+            return 0;
+        }
+    }
+    for (i = 0; i < size; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        PSRecurrentCell * cell = GetRecurrentCell(neuron);
+        int cwsize = cell->weights_size;
+        double * rweights = cell->weights;
+        if (gates > 1) rweights = neuron->weights + (cwsize - size);
+        for (g = 0; g < gates; g++) {
+            double * src = rweights + (g * cwsize);
+            double * dest = layer->recurrent_weights_t + (g * size) + i;
+            for (j = 0; j < size; j++) dest[j * row_size] = src[j];
+        }
+    }
+    layer->recurrent_weights_dirty = 0;
+    return 1;
+}
+
+/* Weight updates mark their own layers: this is for code replacing the
+ * weights of a whole network. */
+
+void PSInvalidateTransposedWeights(PSNeuralNetwork * network) {
+    int i;
+    for (i = 0; i < network->size; i++)
+        network->layers[i]->recurrent_weights_dirty = 1;
+}
+
 /* Init Functions */
 
 int PSInitRecurrentLayer(PSNeuralNetwork * network, PSLayer * layer,
@@ -107,7 +208,7 @@ int PSInitRecurrentLayer(PSNeuralNetwork * network, PSLayer * layer,
         neuron->index = i;
         neuron->weights_size = ws;
         neuron->bias = gaussian_random(0, 1);
-        neuron->weights = malloc(sizeof(double) * ws);
+        neuron->weights = PSAlignedAlloc(ws);
         if (neuron->weights ==  NULL) {
             PSAbortLayer(network, layer);
             PSErr(func, "Could not allocate neuron weights!");
@@ -182,7 +283,7 @@ int PSRecurrentFeedforward(void * _net, void * _layer, ...) {
         }
         vector_size = (int) (params->parameters[0]);
         PSNeuron * prev_neuron = previous->neurons[0];
-        vector_idx = (int) (prev_neuron->activation);
+        vector_idx = (int) GetRecurrentState(prev_neuron, t);
         if (vector_size == 0 && vector_idx >= vector_size) {
             PSErr(NULL, "Layer[%d]: invalid vector index %d (max. %d)!",
                   previous->index, vector_idx, vector_size - 1);
@@ -190,6 +291,7 @@ int PSRecurrentFeedforward(void * _net, void * _layer, ...) {
         }
     }
     int i, j, w, previous_size = previous->size;
+    if (t == 0 && !PSReserveLayerStates(layer, times)) return 0;
     for (i = 0; i < size; i++) {
         PSNeuron * neuron = layer->neurons[i];
         PSRecurrentCell * cell = GetRecurrentCell(neuron);
@@ -209,7 +311,7 @@ int PSRecurrentFeedforward(void * _net, void * _layer, ...) {
             for (; j < previous_size; j++) {
                 PSNeuron * prev_neuron = previous->neurons[j];
                 if (prev_neuron == NULL) return 0;
-                double a = prev_neuron->activation;
+                double a = GetRecurrentState(prev_neuron, t);
                 sum += (a * neuron->weights[j]);
             }
         }
@@ -228,22 +330,6 @@ int PSRecurrentFeedforward(void * _net, void * _layer, ...) {
                 double last_state = rc->states[last_t];
                 bias += (weight * last_state);
             }
-        } else {
-            if (cell->states != NULL) free(cell->states);
-            cell->states_count = times;
-            cell->states = calloc(times, sizeof(double));
-#ifdef USE_AVX
-            if (neuron->index == 0) {
-                if (layer->avx_activation_cache != NULL)
-                    free(layer->avx_activation_cache);
-                layer->avx_activation_cache = calloc(times * size,
-                                                     sizeof(double));
-                if (layer->avx_activation_cache == NULL) {
-                    printMemoryErrorMsg();
-                    return 0;
-                }
-            }
-#endif
         }
         neuron->z_value = sum + bias;
         neuron->activation = layer->activate(neuron->z_value);
@@ -255,6 +341,104 @@ int PSRecurrentFeedforward(void * _net, void * _layer, ...) {
     return 1;
 }
 
+/* Batched feedforward (see PSSequenceBatch): the z-values of all the
+ * lanes of a step are one matrix product (PSMatrixProduct) of their
+ * inputs, followed by the last outputs, by the weights rows, rather than
+ * one matrix-vector product per series. x and w hold the rows pointers,
+ * z the [lanes x size] products, n their length (0 if there is none). */
+
+typedef struct {
+    PSLayer * layer;
+    PSLayer * previous;
+    PSSequenceBatch * batch;
+    double * delta;
+    double * next_delta;
+    PSGradient * lgradients;
+    double ** x;
+    double ** w;
+    double * z;
+    int n;
+    int lanes;
+    int t;
+} PSRecurrentBatchTask;
+
+static void recurrentBatchFeedforwardNeurons(void * data, int start, int end)
+{
+    PSRecurrentBatchTask * task = (PSRecurrentBatchTask *) data;
+    PSLayer * layer = task->layer, * previous = task->previous;
+    PSSequenceBatch * batch = task->batch;
+    int size = layer->size, t = task->t, i, b;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    if (task->n > 0) {
+        PSMatrixProduct(task->x, task->lanes, task->w + start, end - start,
+                        task->n, task->z + start, size);
+    }
+    for (i = start; i < end; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        for (b = 0; b < task->lanes; b++) {
+            double sum = (task->n > 0 ? task->z[(b * size) + i] : 0.0);
+            if (onehot)
+                sum += neuron->weights[(int) GetBatchValues(batch, previous,
+                                                            t, b)[0]];
+            GetBatchValues(batch, layer, t, b)[i] = layer->activate(sum);
+        }
+    }
+}
+
+int PSRecurrentBatchFeedforward(PSLayer * layer, PSLayer * previous,
+                                PSSequenceBatch * batch, int t)
+{
+    int lanes = batch->active[t], size = layer->size, i, b;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    int wsize = layer->neurons[0]->weights_size - size, n;
+    /* Onehot inputs just pick a weight: only the last outputs multiply */
+    if (onehot) n = (t > 0 ? size : 0);
+    else n = (t > 0 ? wsize + size : wsize);
+    double ** x = malloc(lanes * sizeof(double*));
+    double ** w = malloc(size * sizeof(double*));
+    double * z = malloc(lanes * size * sizeof(double));
+    double * rows = NULL;
+    if (!onehot && t > 0) rows = malloc(lanes * n * sizeof(double));
+    if (x == NULL || w == NULL || z == NULL || (!onehot && t > 0 &&
+                                                rows == NULL)) {
+        printMemoryErrorMsg();
+        free(x);
+        free(w);
+        free(z);
+        free(rows);
+        return 0;
+    }
+    for (b = 0; b < lanes; b++) {
+        if (onehot) x[b] = (t > 0 ? GetBatchValues(batch, layer, t - 1, b) :
+                            NULL);
+        else if (t == 0) x[b] = GetBatchValues(batch, previous, t, b);
+        else {
+            x[b] = rows + (b * n);
+            memcpy(x[b], GetBatchValues(batch, previous, t, b),
+                   wsize * sizeof(double));
+            memcpy(x[b] + wsize, GetBatchValues(batch, layer, t - 1, b),
+                   size * sizeof(double));
+        }
+    }
+    for (i = 0; i < size; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        w[i] = (onehot ? GetRecurrentCell(neuron)->weights : neuron->weights);
+    }
+    PSRecurrentBatchTask task = {layer, previous, batch, NULL, NULL, NULL,
+                                 x, w, z, n, lanes, t};
+    int work = lanes * size * layer->neurons[0]->weights_size;
+    if (PSShouldRunParallel(work))
+        PSParallelFor(PSGlobalThreadPool, layer->size,
+                      recurrentBatchFeedforwardNeurons, &task);
+    else
+        recurrentBatchFeedforwardNeurons(&task, 0, layer->size);
+    free(x);
+    free(w);
+    free(z);
+    free(rows);
+    return 1;
+}
+
 /* Backpropagation Functions */
 
 double * PSRecurrentBackprop(PSLayer * layer,
@@ -325,12 +509,12 @@ double * PSRecurrentBackprop(PSLayer * layer,
                     double a = rc->states[tt - 1];
                     gradient->weights[wsize + w] += (dv * a);
                 }
-                for (w = 0; w < cell->weights_size; w++) {
-                    PSNeuron * rn = layer->neurons[w];
-                    PSRecurrentCell * rc = GetRecurrentCell(rn);
-                    double rw = rc->weights[neuron->index];
-                    rsum += (last_delta[rn->index] * rw);
-                }
+                double * rweights = layer->recurrent_weights_t + (i * lsize);
+                w = 0;
+#ifdef USE_AVX
+                AVXDotProduct(lsize, rweights, last_delta, rsum, w, 0, 0);
+#endif
+                for (; w < lsize; w++) rsum += (last_delta[w] * rweights[w]);
                 double prev_a = cell->states[tt - 1];
                 delta[neuron->index] = rsum * layer->derivative(prev_a);
             }
@@ -343,3 +527,90 @@ double * PSRecurrentBackprop(PSLayer * layer,
     }
     return last_delta;
 }
+
+/* Batched PSRecurrentBackprop: delta holds the [lanes x size] deltas of
+ * the lanes still running at t, and is overwritten. */
+
+static void recurrentBatchBackpropNeurons(void * data, int start, int end) {
+    PSRecurrentBatchTask * task = (PSRecurrentBatchTask *) data;
+    PSLayer * layer = task->layer, * previous = task->previous;
+    PSSequenceBatch * batch = task->batch;
+    int size = layer->size, tt = task->t, i, b;
+    int onehot = previous->flags & FLAG_ONEHOT;
+    for (i = start; i < end; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        PSGradient * gradient = &(task->lgradients[i]);
+        int wsize = neuron->weights_size - size;
+        for (b = 0; b < task->lanes; b++) {
+            double dv = task->delta[(b * size) + i];
+            gradient->bias += dv;
+            double * x = GetBatchValues(batch, previous, tt, b);
+            if (onehot) gradient->weights[(int) x[0]] += dv;
+            else PSAddScaled(gradient->weights, x, dv, wsize);
+            if (tt == 0) continue;
+            double * h = GetBatchValues(batch, layer, tt - 1, b);
+            PSAddScaled(gradient->weights + wsize, h, dv, size);
+        }
+    }
+}
+
+/* Deltas of the previous step: the product of the deltas by the rows of
+ * the transposed recurrent weights (task->w), times the derivative. */
+
+static void recurrentBatchPreviousDeltas(void * data, int start, int end) {
+    PSRecurrentBatchTask * task = (PSRecurrentBatchTask *) data;
+    PSLayer * layer = task->layer;
+    int size = layer->size, i, b;
+    PSMatrixProduct(task->x, task->lanes, task->w + start, end - start, size,
+                    task->next_delta + start, size);
+    for (b = 0; b < task->lanes; b++) {
+        double * h = GetBatchValues(task->batch, layer, task->t - 1, b);
+        double * d = task->next_delta + (b * size);
+        for (i = start; i < end; i++) d[i] *= layer->derivative(h[i]);
+    }
+}
+
+int PSRecurrentBatchBackprop(PSLayer * layer, PSLayer * previous,
+                             PSSequenceBatch * batch, double * delta,
+                             PSGradient * lgradients, int lowest_t, int t)
+{
+    int lanes = batch->active[t], size = layer->size, tt, i, b;
+    double * buffer = malloc(lanes * size * sizeof(double));
+    double ** x = malloc(lanes * sizeof(double*));
+    double ** w = malloc(size * sizeof(double*));
+    if (buffer == NULL || x == NULL || w == NULL) {
+        printMemoryErrorMsg();
+        free(buffer);
+        free(x);
+        free(w);
+        return 0;
+    }
+    for (i = 0; i < size; i++)
+        w[i] = layer->recurrent_weights_t + (i * size);
+    PSRecurrentBatchTask task = {layer, previous, batch, delta, buffer,
+                                 lgradients, x, w, NULL, size, lanes, t};
+    int work = lanes * size * layer->neurons[0]->weights_size;
+    int parallel = PSShouldRunParallel(work);
+    for (tt = t; tt >= lowest_t; tt--) {
+        task.t = tt;
+        if (parallel)
+            PSParallelFor(PSGlobalThreadPool, size,
+                          recurrentBatchBackpropNeurons, &task);
+        else
+            recurrentBatchBackpropNeurons(&task, 0, size);
+        if (tt == 0) break;
+        for (b = 0; b < lanes; b++) x[b] = task.delta + (b * size);
+        if (parallel)
+            PSParallelFor(PSGlobalThreadPool, size,
+                          recurrentBatchPreviousDeltas, &task);
+        else
+            recurrentBatchPreviousDeltas(&task, 0, size);
+        double * last_delta = task.delta;
+        task.delta = task.next_delta;
+        task.next_delta = last_delta;
+    }
+    free(buffer);
+    free(x);
+    free(w);
+    return 1;
+}
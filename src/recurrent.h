@@ -21,6 +21,9 @@
 #include "psyc.h"
 
 #define GetRecurrentCell(neuron) ((PSRecurrentCell*) neuron->extra)
+/* LSTM and GRU cells begin with the same fields, so this works for any neuron of
+ * a recurrent network. */
+#define GetRecurrentState(neuron, t) (GetRecurrentCell(neuron)->states[t])
 
 typedef struct {
     int states_count;
@@ -29,8 +32,37 @@ typedef struct {
     double * weights;
 } PSRecurrentCell;
 
+/* Series of a training batch packed time-major, longest first: lane b of
+ * step t starts at ((t * count) + b) * size in values[i], which holds the
+ * outputs of layer i (for LSTM and GRU layers followed by their other
+ * LSTM_STATE_ARRAYS - 1 or GRU_STATE_ARRAYS - 1 arrays, in
+ * PSReserveLayerStates order, each times * count * size long). Only the first active[t] lanes, the series
+ * longer than t, take part in step t. */
+
+typedef struct {
+    int count;
+    int times;
+    int * lengths;
+    int * active;
+    int * lanes; // Index of each lane series in the batch
+    double ** values;
+} PSSequenceBatch;
+
+#define GetBatchArray(batch, layer, array, t, b) \
+    (batch->values[layer->index] + \
+     (((size_t) (array) * batch->times * batch->count) + \
+      ((size_t) (t) * batch->count) + (b)) * layer->size)
+#define GetBatchValues(batch, layer, t, b) GetBatchArray(batch, layer, 0, t, b)
+
+/* LSTM and GRU gradients hold the gate biases after the weights */
+#define GetGateBiasesCount(layer) \
+    ((layer)->type == LSTM ? 4 : ((layer)->type == GRU ? 3 : 0))
+
 PSRecurrentCell * PSCreateRecurrentCell(PSNeuron * neuron, int lsize);
+int PSReserveLayerStates(PSLayer * layer, int times);
 double * PSAddRecurrentState(PSNeuron * neuron, double state, int times, int t);
+int PSUpdateTransposedWeights(PSLayer * layer);
+void PSInvalidateTransposedWeights(PSNeuralNetwork * network);
 
 /* Init Functions */
 
@@ -40,6 +72,8 @@ int PSInitRecurrentLayer(PSNeuralNetwork * network, PSLayer * layer,
 /* Feedforward Functions */
 
 int PSRecurrentFeedforward(void * _net, void * _layer, ...);
+int PSRecurrentBatchFeedforward(PSLayer * layer, PSLayer * previous,
+                                PSSequenceBatch * batch, int t);
 
 /* Backpropagation Functions */
 
@@ -49,5 +83,8 @@ double * PSRecurrentBackprop(PSLayer * layer,
                              double ** last_delta_p,
                              PSGradient * lgradients,
                              int t);
+int PSRecurrentBatchBackprop(PSLayer * layer, PSLayer * previous,
+                             PSSequenceBatch * batch, double * delta,
+                             PSGradient * lgradients, int lowest_t, int t);
 
 #endif //__PS_RECURRENT_H
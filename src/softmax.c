@@ -0,0 +1,371 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "softmax.h"
+#include "recurrent.h"
+#include "utils.h"
+
+int PSSetSoftmaxSamples(PSLayer * layer, int samples) {
+    if (layer->type != SoftMax) {
+        PSErr("PSSetSoftmaxSamples", "Layer[%d] is not a Softmax layer",
+              layer->index);
+        return 0;
+    }
+    PSLayerParameters * params = layer->parameters;
+    if (params == NULL) {
+        params = PSCreateLayerParamenters(1, (double) samples);
+        if (params == NULL) return 0;
+        layer->parameters = params;
+        return 1;
+    }
+    return PSSetLayerParameter(params, PARAM_SOFTMAX_SAMPLES,
+                               (double) samples);
+}
+
+int PSGetSoftmaxSamples(PSLayer * layer) {
+    PSLayerParameters * params = layer->parameters;
+    if (layer->type != SoftMax || params == NULL || params->count < 1)
+        return 0;
+    return (int) params->parameters[PARAM_SOFTMAX_SAMPLES];
+}
+
+/* Sampled and hierarchical outputs are not computed by the training
+ * feedforward, but while backpropagating their targets. */
+
+int PSSoftmaxNeedsTargets(PSLayer * layer) {
+    if (layer->type != SoftMax) return 0;
+    return ((layer->flags & FLAG_HIERARCHICAL) ||
+            PSGetSoftmaxSamples(layer) > 0);
+}
+
+/* Class probabilities from the z-values of the internal nodes */
+
+static void setNodeProbability(PSLayer * layer, double * branches, int node,
+                               double p)
+{
+    int inner = layer->size - 1;
+    if (node < inner) branches[node] = p;
+    else layer->neurons[node - inner]->activation = p;
+}
+
+void PSHierarchicalActivations(PSLayer * layer) {
+    int size = layer->size, n;
+    double branches[size];
+    if (size == 1) {
+        layer->neurons[0]->activation = 1.0;
+        return;
+    }
+    branches[0] = 1.0;
+    for (n = 0; n < size - 1; n++) {
+        double left = sigmoid(layer->neurons[n]->z_value);
+        setNodeProbability(layer, branches, (2 * n) + 1, branches[n] * left);
+        setNodeProbability(layer, branches, (2 * n) + 2,
+                           branches[n] * (1.0 - left));
+    }
+}
+
+/* Single class queries only evaluate the internal nodes they walk, so that
+ * decoding large vocabularies costs O(log2(V) * H) per class instead of the
+ * O(V * H) of PSHierarchicalActivations. h holds the previous layer's
+ * outputs. */
+
+static double leftProbability(PSLayer * layer, int node, double * h) {
+    PSNeuron * neuron = layer->neurons[node];
+    return sigmoid(neuron->bias + PSDotProduct(neuron->weights, h,
+                                               neuron->weights_size));
+}
+
+double PSHierarchicalProbability(PSLayer * layer, double * h, int target) {
+    int node = layer->size - 1 + target;
+    double p = 1.0;
+    while (node > 0) {
+        int parent = (node - 1) / 2;
+        double left = leftProbability(layer, parent, h);
+        p *= (node == (2 * parent) + 1 ? left : 1.0 - left);
+        node = parent;
+    }
+    return p;
+}
+
+/* Draw a class from the tree distribution, one branch at a time */
+
+int PSHierarchicalSample(PSLayer * layer, double * h, unsigned int * seed,
+                         double * p)
+{
+    int inner = layer->size - 1, node = 0;
+    double prob = 1.0;
+    while (node < inner) {
+        double left = leftProbability(layer, node, h);
+        double r = (double) rand_r(seed) / ((double) RAND_MAX + 1.0);
+        if (r < left) {
+            prob *= left;
+            node = (2 * node) + 1;
+        } else {
+            prob *= (1.0 - left);
+            node = (2 * node) + 2;
+        }
+    }
+    if (p != NULL) *p = prob;
+    return node - inner;
+}
+
+/* Best-first search over the tree: path probabilities never grow going
+ * down, so leaves come out of the max-heap of open nodes likeliest first,
+ * and only the branches that can still beat the k-th class get
+ * evaluated. */
+
+typedef struct {
+    double p;
+    int node;
+} PSTreeEntry;
+
+static void pushTreeEntry(PSTreeEntry * heap, int * count, double p,
+                          int node)
+{
+    int i = (*count)++;
+    while (i > 0 && heap[(i - 1) / 2].p < p) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i].p = p;
+    heap[i].node = node;
+}
+
+static PSTreeEntry popTreeEntry(PSTreeEntry * heap, int * count) {
+    PSTreeEntry top = heap[0], last = heap[--(*count)];
+    int i = 0, child;
+    while ((child = (2 * i) + 1) < *count) {
+        if (child + 1 < *count && heap[child + 1].p > heap[child].p) child++;
+        if (heap[child].p <= last.p) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/* Fill classes and probs with the k likeliest classes, likeliest first.
+ * Returns how many were found (k, at most the layer size), 0 on error. */
+
+int PSHierarchicalTopK(PSLayer * layer, double * h, int k, int * classes,
+                       double * probs)
+{
+    int size = layer->size, inner = size - 1, count = 0, found = 0;
+    if (k > size) k = size;
+    PSTreeEntry * heap = malloc(2 * size * sizeof(PSTreeEntry));
+    if (heap == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    pushTreeEntry(heap, &count, 1.0, 0);
+    while (count > 0 && found < k) {
+        PSTreeEntry entry = popTreeEntry(heap, &count);
+        if (entry.node >= inner) {
+            classes[found] = entry.node - inner;
+            probs[found++] = entry.p;
+            continue;
+        }
+        double left = leftProbability(layer, entry.node, h);
+        pushTreeEntry(heap, &count, entry.p * left, (2 * entry.node) + 1);
+        pushTreeEntry(heap, &count, entry.p * (1.0 - left),
+                      (2 * entry.node) + 2);
+    }
+    free(heap);
+    return found;
+}
+
+/* Gradients */
+
+double * PSGetSoftmaxGradientRow(PSLayer * layer, PSGradient * gradient) {
+    if (gradient->weights == NULL) {
+        gradient->weights = PSAlignedAlloc(layer->neurons[0]->weights_size);
+        if (gradient->weights == NULL) printMemoryErrorMsg();
+    }
+    return gradient->weights;
+}
+
+/* Add dz, the loss derivative on neuron's z-value, to its gradient and
+ * its contribution to the delta for the previous layer. */
+
+static int addOutputDelta(PSLayer * layer, PSNeuron * neuron, double dz,
+                          double * h, double * delta, PSGradient * gradient)
+{
+    int size = neuron->weights_size;
+    if (PSGetSoftmaxGradientRow(layer, gradient) == NULL) return 0;
+    gradient->bias += dz;
+    PSAddScaled(gradient->weights, h, dz, size);
+    PSAddScaled(delta, neuron->weights, dz, size);
+    return 1;
+}
+
+/* Both backprops return the target probability, or -1 on error */
+
+static double hierarchicalBackprop(PSLayer * layer, double * h, int target,
+                                   double * delta, PSGradient * lgradients)
+{
+    int node = layer->size - 1 + target;
+    double p = 1.0;
+    while (node > 0) {
+        int parent = (node - 1) / 2;
+        double sign = (node == (2 * parent) + 1 ? 1.0 : -1.0);
+        PSNeuron * neuron = layer->neurons[parent];
+        double z = neuron->bias + PSDotProduct(neuron->weights, h,
+                                               neuron->weights_size);
+        double s = sigmoid(sign * z);
+        p *= s;
+        if (!addOutputDelta(layer, neuron, -sign * (1.0 - s), h, delta,
+                            &(lgradients[parent]))) return -1.0;
+        node = parent;
+    }
+    return p;
+}
+
+/* Samples are drawn with rand_r on a seed owned by the calling thread, so
+ * that Hogwild workers do not share the rand() state. Threads that did not
+ * call PSSetSoftmaxSeed take their seed from rand() on the first draw. */
+
+static __thread unsigned int sample_seed = 0;
+static __thread int sample_seeded = 0;
+
+void PSSetSoftmaxSeed(unsigned int seed) {
+    sample_seed = seed;
+    sample_seeded = 1;
+}
+
+static int sampleClass(int size) {
+    if (!sample_seeded) PSSetSoftmaxSeed((unsigned int) rand());
+    return rand_r(&sample_seed) % size;
+}
+
+/* Candidates are the target followed by samples other classes, all of them
+ * (in order) if samples reaches the vocabulary. */
+
+static double sampledBackprop(PSLayer * layer, double * h, int target,
+                              int samples, double * delta,
+                              PSGradient * lgradients)
+{
+    int size = layer->size, count = samples + 1, i, j;
+    if (count > size) count = size;
+    int candidates[count];
+    double q[count], max = 0.0, esum = 0.0, p = 0.0;
+    if (count == size) {
+        for (i = 0; i < size; i++) candidates[i] = i;
+    } else {
+        candidates[0] = target;
+        for (i = 1; i < count; i++) {
+            int c;
+            do {
+                c = sampleClass(size);
+                for (j = 0; j < i && candidates[j] != c; j++);
+            } while (j < i);
+            candidates[i] = c;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        PSNeuron * neuron = layer->neurons[candidates[i]];
+        q[i] = neuron->bias + PSDotProduct(neuron->weights, h,
+                                           neuron->weights_size);
+        if (i == 0 || q[i] > max) max = q[i];
+    }
+    for (i = 0; i < count; i++) {
+        q[i] = exp(q[i] - max);
+        esum += q[i];
+    }
+    for (i = 0; i < count; i++) {
+        int c = candidates[i];
+        q[i] /= esum;
+        if (c == target) p = q[i];
+        if (!addOutputDelta(layer, layer->neurons[c], q[i] - (c == target),
+                            h, delta, &(lgradients[c]))) return -1.0;
+    }
+    return p;
+}
+
+/* Cross-entropy gradients of the target at timestep t. delta gets the one
+ * for the previous layer, and the target state its probability (the only
+ * output state the training loss reads). */
+
+int PSSoftmaxTargetBackprop(PSLayer * layer, PSLayer * previous, int target,
+                            double * delta, PSGradient * lgradients, int t)
+{
+    int hsize = previous->size, i;
+    if (target < 0 || target >= layer->size) {
+        PSErr("PSSoftmaxTargetBackprop", "Layer[%d]: invalid target %d",
+              layer->index, target);
+        return 0;
+    }
+    double h[hsize];
+    for (i = 0; i < hsize; i++)
+        h[i] = GetRecurrentState(previous->neurons[i], t);
+    double p;
+    if (layer->flags & FLAG_HIERARCHICAL)
+        p = hierarchicalBackprop(layer, h, target, delta, lgradients);
+    else p = sampledBackprop(layer, h, target, PSGetSoftmaxSamples(layer),
+                             delta, lgradients);
+    if (p < 0) return 0;
+    PSNeuron * neuron = layer->neurons[target];
+    GetRecurrentCell(neuron)->states[t] = p;
+#ifdef USE_AVX
+    layer->avx_activation_cache[(t * layer->size) + target] = p;
+#endif
+    return 1;
+}
+
+/* Rows only src touched are moved into dest instead of being added. */
+
+void PSMergeSoftmaxGradients(PSLayer * layer, PSGradient * dest,
+                             PSGradient * src)
+{
+    int size = layer->neurons[0]->weights_size, j;
+    for (j = 0; j < layer->size; j++) {
+        if (src[j].weights == NULL) continue;
+        dest[j].bias += src[j].bias;
+        if (dest[j].weights == NULL) {
+            dest[j].weights = src[j].weights;
+            src[j].weights = NULL;
+        } else PSAddScaled(dest[j].weights, src[j].weights, 1.0, size);
+    }
+}
+
+/* Only the units the batch touched are updated, and only their weights
+ * decay, so that an update costs O(k * H) or O(log2(V) * H) per target
+ * instead of O(V * H). */
+
+double PSUpdateSoftmaxRows(PSLayer * layer, PSGradient * lgradients,
+                           double rate, double l2)
+{
+    int j, k;
+    double l2_loss = 0.0;
+    for (j = 0; j < layer->size; j++) {
+        PSGradient * g = &(lgradients[j]);
+        if (g->weights == NULL) continue;
+        PSNeuron * neuron = layer->neurons[j];
+        neuron->bias -= (rate * g->bias);
+        for (k = 0; k < neuron->weights_size; k++) {
+            if (l2 != 0.0) {
+                neuron->weights[k] *= l2;
+                l2_loss += (g->weights[k] * g->weights[k]);
+            }
+            neuron->weights[k] -= (rate * g->weights[k]);
+        }
+    }
+    return l2_loss;
+}
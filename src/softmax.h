@@ -0,0 +1,61 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_SOFTMAX_H
+#define __PS_SOFTMAX_H
+
+#include "psyc.h"
+
+/* Softmax outputs for large vocabularies, both requiring onehot labels.
+ * Sampled Softmax layers (PARAM_SOFTMAX_SAMPLES > 0) train every timestep
+ * on its target and on that many other classes drawn uniformly, normalizing
+ * over them only, while inference still uses the full Softmax.
+ * Hierarchical ones (FLAG_HIERARCHICAL) place the classes on the leaves of
+ * a binary tree laid out as a heap: neuron n is internal node n, whose
+ * children are 2n + 1 and 2n + 2, and class c is leaf size - 1 + c (the
+ * last neuron is unused). The probability of a class is the product of the
+ * branch sigmoids along its path, sigmoid(z) going left. While training,
+ * both only compute the output units their targets need, at O(k * H) or
+ * O(log2(V) * H) per timestep instead of O(V * H). Their gradients hold
+ * one PSGradient per output unit whose weights are only allocated when a
+ * target or sample reaches the unit (see PSGetSoftmaxGradientRow), so
+ * that merging and updating them only touches those rows. PSFeedforward
+ * still computes every unit; hierarchical layers also answer single
+ * class, sampling and top-k queries for decoding without computing the
+ * whole distribution. */
+
+#define PARAM_SOFTMAX_SAMPLES   0
+
+int PSSetSoftmaxSamples(PSLayer * layer, int samples);
+int PSGetSoftmaxSamples(PSLayer * layer);
+void PSSetSoftmaxSeed(unsigned int seed);
+int PSSoftmaxNeedsTargets(PSLayer * layer);
+void PSHierarchicalActivations(PSLayer * layer);
+double PSHierarchicalProbability(PSLayer * layer, double * h, int target);
+int PSHierarchicalSample(PSLayer * layer, double * h, unsigned int * seed,
+                         double * p);
+int PSHierarchicalTopK(PSLayer * layer, double * h, int k, int * classes,
+                       double * probs);
+int PSSoftmaxTargetBackprop(PSLayer * layer, PSLayer * previous, int target,
+                            double * delta, PSGradient * lgradients, int t);
+double * PSGetSoftmaxGradientRow(PSLayer * layer, PSGradient * gradient);
+void PSMergeSoftmaxGradients(PSLayer * layer, PSGradient * dest,
+                             PSGradient * src);
+double PSUpdateSoftmaxRows(PSLayer * layer, PSGradient * lgradients,
+                           double rate, double l2);
+
+#endif // __PS_SOFTMAX_H
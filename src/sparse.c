@@ -0,0 +1,160 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sparse.h"
+#include "utils.h"
+
+double PSSparseThreshold = PS_DEFAULT_SPARSE_THRESHOLD;
+
+/* Inputs and ReLU outputs (also when pooled) are the layers holding
+ * exact zeros. */
+
+static int hasZeroActivations(PSLayer * layer) {
+    if (layer->index == 0) return 1;
+    if (layer->type == Pooling) return (layer->derivative == relu_derivative);
+    return (layer->activate == relu);
+}
+
+/* Measure the density of layer and collect its nonzero activations, or mark
+ * it as dense (by setting nonzero_count to -1) if they reach the threshold.
+ * Only layers followed by a fully connected or Softmax layer are tracked. */
+
+int PSUpdateNonzeroActivations(PSLayer * layer) {
+    PSNeuralNetwork * network = (PSNeuralNetwork *) layer->network;
+    int size = layer->size, count = 0, i;
+    int max_count = (int) (PSSparseThreshold * size);
+    layer->nonzero_count = -1;
+    if ((network->flags & FLAG_RECURRENT) ||
+        layer->index >= network->size - 1 || !hasZeroActivations(layer))
+        return 1;
+    PSLayerType next_type = network->layers[layer->index + 1]->type;
+    if (next_type != FullyConnected && next_type != SoftMax) return 1;
+    if (max_count > 0 && layer->nonzero_indexes == NULL) {
+        layer->nonzero_indexes = malloc(size * sizeof(int));
+        layer->nonzero_values = malloc(size * sizeof(double));
+        if (layer->nonzero_indexes == NULL || layer->nonzero_values == NULL) {
+            PSErr("PSUpdateNonzeroActivations", "Could not allocate memory!");
+            free(layer->nonzero_indexes);
+            free(layer->nonzero_values);
+            layer->nonzero_indexes = NULL;
+            layer->nonzero_values = NULL;
+            return 0;
+        }
+    }
+    for (i = 0; i < size; i++) {
+        double a = layer->neurons[i]->activation;
+        if (a == 0.0) continue;
+        if (count < max_count) {
+            layer->nonzero_indexes[count] = i;
+            layer->nonzero_values[count] = a;
+        }
+        count++;
+    }
+    layer->activations_seen += size;
+    layer->nonzero_seen += count;
+    if (count < max_count) layer->nonzero_count = count;
+    return 1;
+}
+
+/* Dot product of the activations of a sparse layer and weights */
+
+double PSSparseDotProduct(PSLayer * layer, double * weights) {
+    int * indexes = layer->nonzero_indexes;
+    double * values = layer->nonzero_values;
+    double sum = 0.0;
+    int i;
+    for (i = 0; i < layer->nonzero_count; i++)
+        sum += (values[i] * weights[indexes[i]]);
+    return sum;
+}
+
+/* Store (or add, if add is true) value * activation into dest, only for
+ * the nonzero activations of layer: when storing, the other columns of
+ * dest must already be zero. */
+
+void PSSparseMultiplyValue(PSLayer * layer, double value, double * dest,
+                           int add)
+{
+    int * indexes = layer->nonzero_indexes;
+    double * values = layer->nonzero_values;
+    int i;
+    for (i = 0; i < layer->nonzero_count; i++) {
+        double v = values[i] * value;
+        if (add) dest[indexes[i]] += v;
+        else dest[indexes[i]] = v;
+    }
+}
+
+/* Add src to dest for the columns of the nonzero activations of layer */
+
+void PSSparseSum(PSLayer * layer, double * dest, double * src) {
+    int * indexes = layer->nonzero_indexes;
+    int i;
+    for (i = 0; i < layer->nonzero_count; i++)
+        dest[indexes[i]] += src[indexes[i]];
+}
+
+/* Average density of the activations measured since the last reset, or -1
+ * if the layer is not tracked. */
+
+double PSGetActivationDensity(PSLayer * layer) {
+    if (layer->activations_seen == 0) return -1.0;
+    return (double) layer->nonzero_seen / (double) layer->activations_seen;
+}
+
+void PSResetActivationDensity(PSNeuralNetwork * network) {
+    int i;
+    for (i = 0; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        layer->activations_seen = 0;
+        layer->nonzero_seen = 0;
+    }
+}
+
+/* Add the density counters of src, a view or clone of network, to the
+ * network's and reset them: workers measure on their own copies. Adds are
+ * atomic, since workers of the same network merge concurrently. */
+
+void PSMergeActivationDensity(PSNeuralNetwork * network,
+                              PSNeuralNetwork * src)
+{
+    int i;
+    for (i = 0; i < network->size && i < src->size; i++) {
+        PSLayer * layer = network->layers[i], * copy = src->layers[i];
+        if (copy->activations_seen == 0) continue;
+        __sync_fetch_and_add(&(layer->activations_seen),
+                             copy->activations_seen);
+        __sync_fetch_and_add(&(layer->nonzero_seen), copy->nonzero_seen);
+        copy->activations_seen = 0;
+        copy->nonzero_seen = 0;
+    }
+}
+
+void PSPrintActivationDensity(PSNeuralNetwork * network) {
+    int i;
+    printf("Activation density:\n");
+    for (i = 0; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        double density = PSGetActivationDensity(layer);
+        if (density < 0) continue;
+        printf("Layer[%d]: %s, %.2f%%\n", i, PSGetLayerTypeLabel(layer),
+               density * 100.0);
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+ 
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_SPARSE_H
+#define __PS_SPARSE_H
+
+#include "psyc.h"
+
+/* Layers whose activations are mostly zeros (bag-of-words or onehot
+ * inputs, ReLU outputs and their pooling) keep the indexes and values of
+ * their nonzero activations, so that the next fully connected layer only
+ * multiplies the matching weight columns, both in the dot products and in
+ * its weight gradients. A layer is only sparse when its density
+ * (nonzero / size) is below PSSparseThreshold, otherwise its nonzero_count
+ * is -1. The measured density is accumulated over every sample, see
+ * PSGetActivationDensity. */
+
+#define PS_DEFAULT_SPARSE_THRESHOLD 0.25
+
+#define IsSparseLayer(layer) ((layer)->nonzero_count >= 0)
+
+extern double PSSparseThreshold;
+
+int PSUpdateNonzeroActivations(PSLayer * layer);
+double PSSparseDotProduct(PSLayer * layer, double * weights);
+void PSSparseMultiplyValue(PSLayer * layer, double value, double * dest,
+                           int add);
+void PSSparseSum(PSLayer * layer, double * dest, double * src);
+double PSGetActivationDensity(PSLayer * layer);
+void PSResetActivationDensity(PSNeuralNetwork * network);
+void PSMergeActivationDensity(PSNeuralNetwork * network,
+                              PSNeuralNetwork * src);
+void PSPrintActivationDensity(PSNeuralNetwork * network);
+
+#endif // __PS_SPARSE_H
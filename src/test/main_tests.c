@@ -19,12 +19,28 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <sys/wait.h>
 #include "test.h"
 #include "../psyc.h"
 #include "../convolutional.h"
 #include "../recurrent.h"
 #include "../lstm.h"
+#include "../gru.h"
+#include "../embedding.h"
+#include "../softmax.h"
+#include "../sparse.h"
 #include "../mnist.h"
+#include "../utils.h"
+#include "../memory.h"
+#include "../affinity.h"
+#include "../threadpool.h"
+#include "../distributed.h"
+#include "../pipeline.h"
+#include "../inference.h"
+#include "../decoder.h"
 #ifdef USE_AVX
 #include "../avx.h"
 #endif
@@ -51,6 +67,8 @@
 #define LSTM_EPOCHS 1
 #define LSTM_BATCHES 1
 
+#define EMBEDDING_SIZE 3
+
 #define getNetwork(tc) ((PSNeuralNetwork*)(tc->data[0]))
 #define getTestData(tc) ((double*)(tc->data[1]))
 #define getRoundedDouble(d) (round(d * 1000000.0) / 1000000.0)
@@ -60,6 +78,8 @@ TestCase * fullNetworkTests;
 TestCase * convNetworkTests;
 TestCase * recurrentNetworkTests;
 TestCase * LSTMNetworkTests;
+TestCase * GRUNetworkTests;
+TestCase * embeddingNetworkTests;
 
 #ifdef USE_AVX
 TestCase * AVXTests;
@@ -70,20 +90,45 @@ int genericTeardown (void* test_case);
 int RNNSetup (void* test_case);
 int RNNTeardown (void* test_case);
 int LSTMSetup (void* test_case);
+int GRUSetup (void* test_case);
+int embeddingSetup (void* test_case);
 
 int testGenericClone(void* test_case, void* test);
 int testGenericSave(void* test_case, void* test);
+int testGenericMemoryPolicy(void* test_case, void* test);
+int testGenericReplicas(void* test_case, void* test);
+int testGenericThreads(void* test_case, void* test);
+int testGenericTaskGraph(void* test_case, void* test);
+int testGenericHogwild(void* test_case, void* test);
+int testGenericLocalSGD(void* test_case, void* test);
+int testTaskGraphWorkers(void* test_case, void* test);
+int testGenericAllreduce(void* test_case, void* test);
+int testStaleGroup(void* test_case, void* test);
+int testGenericPipeline(void* test_case, void* test);
+int testGenericAsync(void* test_case, void* test);
+int testGenericFeedforwardBatch(void* test_case, void* test);
+int testGenericStepState(void* test_case, void* test);
+int testGenericBPTTChunks(void* test_case, void* test);
+int testGenericBPTTCheckpoints(void* test_case, void* test);
+int testGenericBPTTChunkLoss(void* test_case, void* test);
+int testGenericDecode(void* test_case, void* test);
+int testStackedDecode(void* test_case, void* test);
+int testGenericBatchSequences(void* test_case, void* test);
 
 #ifdef USE_AVX
 int testAVXDot(void* test_case, void* test);
 int testAVXSquare(void* test_case, void* test);
 int testAVXMultiplyVal(void* tc, void* t);
+int testAVXAligned(void* tc, void* t);
 #endif
 
 int testFullLoad(void* test_case, void* test);
 int testFullFeedforward(void* test_case, void* test);
 int testFullAccuracy(void* tc, void* t);
 int testFullBackprop(void* test_case, void* test);
+int testFullSparseInput(void* test_case, void* test);
+int testFullReLUSparsity(void* test_case, void* test);
+int testPipelineDensity(void* test_case, void* test);
 
 int testConvLoad(void* test_case, void* test);
 int testConvFeedforward(void* test_case, void* test);
@@ -93,16 +138,48 @@ int testConvBackprop(void* test_case, void* test);
 int testRNNLoad(void* test_case, void* test);
 int testRNNFeedforward(void* test_case, void* test);
 int testRNNBackprop(void* test_case, void* test);
+int testRNNTransposedWeights(void* test_case, void* test);
 int testRNNStep(void* tc, void* t);
+int testRNNWavefront(void* tc, void* t);
+int testRNNBucketSeries(void* tc, void* t);
 
 int testLSTMLoad(void* test_case, void* test);
 int testLSTMTrain(void* test_case, void* test);
 
+int testGRUGradients(void* test_case, void* test);
+int testSampledSoftmax(void* test_case, void* test);
+int testSampledSoftmaxSeed(void* test_case, void* test);
+int testHierarchicalSoftmax(void* test_case, void* test);
+int testHierarchicalQueries(void* test_case, void* test);
+int testHierarchicalUpdate(void* test_case, void* test);
+int testStackedLSTMGradients(void* test_case, void* test);
+int testHiddenLayerGradients(void* test_case, void* test);
+int testOutputBiasGradients(void* test_case, void* test);
+
+int testEmbeddingFeedforward(void* test_case, void* test);
+int testEmbeddingGradients(void* test_case, void* test);
+int testEmbeddingLSTMGradients(void* test_case, void* test);
+int testEmbeddingBackprop(void* test_case, void* test);
+int testEmbeddingUpdate(void* test_case, void* test);
+
 /* psyc.c static function prototypes */
 
 PSGradient ** backprop(PSNeuralNetwork * network, double * x, double * y);
 PSGradient ** backpropThroughTime(PSNeuralNetwork * network, double * x,
                                   double * y, int times);
+PSGradient ** backpropThroughTimeChunked(PSNeuralNetwork * network,
+                                         double * x, double * y, int times,
+                                         int truncate, int chunk);
+PSGradient ** backpropThroughTimeCheckpointed(PSNeuralNetwork * network,
+                                              double * x, double * y,
+                                              int times, int truncate,
+                                              int interval);
+PSGradient ** backpropSequenceBatch(PSNeuralNetwork * network,
+                                    double ** series, int count,
+                                    int truncate);
+void bucketSeries(double ** series, int count, int batch_size,
+                  int bucket_batches, int shuffle);
+double seriesPaddingEfficiency(double ** series, int count, int batch_size);
 
 double updateWeights(PSNeuralNetwork * network, double * training_data,
                      int batch_size, int elements_count,
@@ -296,6 +373,7 @@ int main(int argc, char** argv) {
     addTest(AVXTests, "Dot Product", NULL, testAVXDot);
     addTest(AVXTests, "Square", NULL, testAVXSquare);
     addTest(AVXTests, "Multiply Value", NULL, testAVXMultiplyVal);
+    addTest(AVXTests, "Aligned", NULL, testAVXAligned);
     performTests(AVXTests);
     deleteTest(AVXTests);
 #endif
@@ -307,8 +385,25 @@ int main(int argc, char** argv) {
     addTest(fullNetworkTests, "Feedforward", NULL, testFullFeedforward);
     addTest(fullNetworkTests, "Accuracy", NULL, testFullAccuracy);
     addTest(fullNetworkTests, "Backprop", NULL, testFullBackprop);
+    addTest(fullNetworkTests, "Sparse Input", NULL, testFullSparseInput);
+    addTest(fullNetworkTests, "ReLU Sparsity", NULL, testFullReLUSparsity);
+    addTest(fullNetworkTests, "Pipeline Density", NULL, testPipelineDensity);
     addTest(fullNetworkTests, "Clone", NULL, testGenericClone);
     addTest(fullNetworkTests, "Save", NULL, testGenericSave);
+    addTest(fullNetworkTests, "Memory Policy", NULL, testGenericMemoryPolicy);
+    addTest(fullNetworkTests, "Replicas", NULL, testGenericReplicas);
+    addTest(fullNetworkTests, "Threads", NULL, testGenericThreads);
+    addTest(fullNetworkTests, "Task Graph", NULL, testGenericTaskGraph);
+    addTest(fullNetworkTests, "Hogwild", NULL, testGenericHogwild);
+    addTest(fullNetworkTests, "Local SGD", NULL, testGenericLocalSGD);
+    addTest(fullNetworkTests, "Task Graph Workers", NULL,
+            testTaskGraphWorkers);
+    addTest(fullNetworkTests, "Allreduce", NULL, testGenericAllreduce);
+    addTest(fullNetworkTests, "Stale Group", NULL, testStaleGroup);
+    addTest(fullNetworkTests, "Pipeline", NULL, testGenericPipeline);
+    addTest(fullNetworkTests, "Async", NULL, testGenericAsync);
+    addTest(fullNetworkTests, "Feedforward Batch", NULL,
+            testGenericFeedforwardBatch);
     performTests(fullNetworkTests);
     deleteTest(fullNetworkTests);
     
@@ -321,6 +416,12 @@ int main(int argc, char** argv) {
     addTest(convNetworkTests, "Accuracy", NULL, testConvAccuracy);
     addTest(convNetworkTests, "Clone", NULL, testGenericClone);
     addTest(convNetworkTests, "Save", NULL, testGenericSave);
+    addTest(convNetworkTests, "Threads", NULL, testGenericThreads);
+    addTest(convNetworkTests, "Task Graph", NULL, testGenericTaskGraph);
+    addTest(convNetworkTests, "Pipeline", NULL, testGenericPipeline);
+    addTest(convNetworkTests, "Async", NULL, testGenericAsync);
+    addTest(convNetworkTests, "Feedforward Batch", NULL,
+            testGenericFeedforwardBatch);
     performTests(convNetworkTests);
     deleteTest(convNetworkTests);
     
@@ -330,9 +431,29 @@ int main(int argc, char** argv) {
     addTest(recurrentNetworkTests, "Load", NULL, testRNNLoad);
     addTest(recurrentNetworkTests, "Feedforward", NULL, testRNNFeedforward);
     addTest(recurrentNetworkTests, "Backprop", NULL, testRNNBackprop);
+    addTest(recurrentNetworkTests, "Transposed Weights", NULL,
+            testRNNTransposedWeights);
     addTest(recurrentNetworkTests, "Step", NULL, testRNNStep);
+    addTest(recurrentNetworkTests, "Wavefront", NULL, testRNNWavefront);
+    addTest(recurrentNetworkTests, "Hidden Layer Gradients", NULL,
+            testHiddenLayerGradients);
+    addTest(recurrentNetworkTests, "Output Bias Gradients", NULL,
+            testOutputBiasGradients);
+    addTest(recurrentNetworkTests, "Step State", NULL, testGenericStepState);
+    addTest(recurrentNetworkTests, "BPTT Chunks", NULL, testGenericBPTTChunks);
+    addTest(recurrentNetworkTests, "BPTT Checkpoints", NULL,
+            testGenericBPTTCheckpoints);
+    addTest(recurrentNetworkTests, "BPTT Chunk Loss", NULL,
+            testGenericBPTTChunkLoss);
+    addTest(recurrentNetworkTests, "Decode", NULL, testGenericDecode);
+    addTest(recurrentNetworkTests, "Batch Sequences", NULL,
+            testGenericBatchSequences);
+    addTest(recurrentNetworkTests, "Bucket Series", NULL,
+            testRNNBucketSeries);
     addTest(recurrentNetworkTests, "Clone", NULL, testGenericClone);
     addTest(recurrentNetworkTests, "Save", NULL, testGenericSave);
+    addTest(recurrentNetworkTests, "Memory Policy", NULL,
+            testGenericMemoryPolicy);
     performTests(recurrentNetworkTests);
     deleteTest(recurrentNetworkTests);
     
@@ -341,11 +462,71 @@ int main(int argc, char** argv) {
     LSTMNetworkTests->teardown = RNNTeardown;
     //addTest(LSTMNetworkTests, "Load", NULL, testLSTMLoad);
     addTest(LSTMNetworkTests, "Train", NULL, testLSTMTrain);
+    addTest(LSTMNetworkTests, "Stacked Gradients", NULL,
+            testStackedLSTMGradients);
+    addTest(LSTMNetworkTests, "Step State", NULL, testGenericStepState);
+    addTest(LSTMNetworkTests, "BPTT Chunks", NULL, testGenericBPTTChunks);
+    addTest(LSTMNetworkTests, "BPTT Checkpoints", NULL,
+            testGenericBPTTCheckpoints);
+    addTest(LSTMNetworkTests, "BPTT Chunk Loss", NULL,
+            testGenericBPTTChunkLoss);
+    addTest(LSTMNetworkTests, "Decode", NULL, testGenericDecode);
+    addTest(LSTMNetworkTests, "Batch Sequences", NULL,
+            testGenericBatchSequences);
     addTest(LSTMNetworkTests, "Clone", NULL, testGenericClone);
     addTest(LSTMNetworkTests, "Save", NULL, testGenericSave);
+    addTest(LSTMNetworkTests, "Hogwild", NULL, testGenericHogwild);
+    addTest(LSTMNetworkTests, "Local SGD", NULL, testGenericLocalSGD);
     performTests(LSTMNetworkTests);
     deleteTest(LSTMNetworkTests);
     
+    GRUNetworkTests = createTest("GRU Network");
+    GRUNetworkTests->setup = GRUSetup;
+    GRUNetworkTests->teardown = RNNTeardown;
+    addTest(GRUNetworkTests, "Gradients", NULL, testGRUGradients);
+    addTest(GRUNetworkTests, "Sampled Softmax", NULL, testSampledSoftmax);
+    addTest(GRUNetworkTests, "Sampled Softmax Seed", NULL,
+            testSampledSoftmaxSeed);
+    addTest(GRUNetworkTests, "Hierarchical Softmax", NULL,
+            testHierarchicalSoftmax);
+    addTest(GRUNetworkTests, "Hierarchical Queries", NULL,
+            testHierarchicalQueries);
+    addTest(GRUNetworkTests, "Hierarchical Update", NULL,
+            testHierarchicalUpdate);
+    addTest(GRUNetworkTests, "Step State", NULL, testGenericStepState);
+    addTest(GRUNetworkTests, "BPTT Chunks", NULL, testGenericBPTTChunks);
+    addTest(GRUNetworkTests, "BPTT Checkpoints", NULL,
+            testGenericBPTTCheckpoints);
+    addTest(GRUNetworkTests, "BPTT Chunk Loss", NULL,
+            testGenericBPTTChunkLoss);
+    addTest(GRUNetworkTests, "Decode", NULL, testGenericDecode);
+    addTest(GRUNetworkTests, "Stacked Decode", NULL, testStackedDecode);
+    addTest(GRUNetworkTests, "Clone", NULL, testGenericClone);
+    addTest(GRUNetworkTests, "Save", NULL, testGenericSave);
+    addTest(GRUNetworkTests, "Hogwild", NULL, testGenericHogwild);
+    addTest(GRUNetworkTests, "Local SGD", NULL, testGenericLocalSGD);
+    performTests(GRUNetworkTests);
+    deleteTest(GRUNetworkTests);
+    
+    embeddingNetworkTests = createTest("Embedding Network");
+    embeddingNetworkTests->setup = embeddingSetup;
+    embeddingNetworkTests->teardown = RNNTeardown;
+    addTest(embeddingNetworkTests, "Feedforward", NULL,
+            testEmbeddingFeedforward);
+    addTest(embeddingNetworkTests, "Gradients", NULL, testEmbeddingGradients);
+    addTest(embeddingNetworkTests, "LSTM Gradients", NULL,
+            testEmbeddingLSTMGradients);
+    addTest(embeddingNetworkTests, "Backprop", NULL, testEmbeddingBackprop);
+    addTest(embeddingNetworkTests, "Update", NULL, testEmbeddingUpdate);
+    addTest(embeddingNetworkTests, "Clone", NULL, testGenericClone);
+    addTest(embeddingNetworkTests, "Save", NULL, testGenericSave);
+    addTest(embeddingNetworkTests, "Memory Policy", NULL,
+            testGenericMemoryPolicy);
+    addTest(embeddingNetworkTests, "Hogwild", NULL, testGenericHogwild);
+    addTest(embeddingNetworkTests, "Local SGD", NULL, testGenericLocalSGD);
+    performTests(embeddingNetworkTests);
+    deleteTest(embeddingNetworkTests);
+    
     return 0;
     
 }
@@ -515,6 +696,112 @@ int LSTMSetup (void* tc) {
     return 1;
 }
 
+int GRUSetup (void* tc) {
+    TestCase * test_case = (TestCase*) tc;
+    PSNeuralNetwork * network = PSCreateNetwork("GRU Test Network");
+    if (network == NULL) {
+        fprintf(stderr, "\nCould not create network!\n");
+        return 0;
+    }
+    network->flags |= FLAG_ONEHOT;
+    PSAddLayer(network, FullyConnected, RNN_INPUT_SIZE, NULL);
+    PSAddLayer(network, GRU, RNN_HIDDEN_SIZE, NULL);
+    PSAddLayer(network, SoftMax, RNN_INPUT_SIZE, NULL);
+    if (network->size < 3) {
+        fprintf(stderr, "\nCould not add all layers!\n");
+        return 0;
+    }
+    network->layers[network->size - 1]->flags |= FLAG_ONEHOT;
+    
+    int i, j, w;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        for (j = 0; j < layer->size; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            neuron->bias = 0.0;
+            for (w = 0; w < neuron->weights_size; w++)
+                neuron->weights[w] = 0.1 * (((w * 7 + j * 3) % 11) - 5);
+            if (layer->type != GRU) continue;
+            PSGRUCell * cell = GetGRUCell(neuron);
+            cell->candidate_bias = 0.1 * j;
+            cell->reset_bias = -0.2;
+            cell->update_bias = 0.3 - (0.1 * j);
+        }
+    }
+
+    test_case->data = malloc(2 * sizeof(void*));
+    if (test_case->data == NULL) {
+        fprintf(stderr, "\nCould not allocate memory!\n");
+        return 0;
+    }
+    test_case->data[0] = network;
+    int train_data_len = 2 + (LSTM_TIMES * 2);
+    double * training_data = malloc(train_data_len * sizeof(double));
+    if (training_data == NULL) {
+        fprintf(stderr, "\nCould not allocate memory!\n");
+        return 0;
+    }
+    memcpy(training_data, lstm_training_data, train_data_len * sizeof(double));
+    test_case->data[1] = training_data;
+    return 1;
+}
+
+/* Onehot input -> Embedding -> GRU -> Softmax */
+
+int embeddingSetup (void* tc) {
+    TestCase * test_case = (TestCase*) tc;
+    PSNeuralNetwork * network = PSCreateNetwork("Embedding Test Network");
+    if (network == NULL) {
+        fprintf(stderr, "\nCould not create network!\n");
+        return 0;
+    }
+    network->flags |= FLAG_ONEHOT;
+    PSAddLayer(network, FullyConnected, RNN_INPUT_SIZE, NULL);
+    PSAddLayer(network, Embedding, EMBEDDING_SIZE, NULL);
+    PSAddLayer(network, GRU, RNN_HIDDEN_SIZE, NULL);
+    PSAddLayer(network, SoftMax, RNN_INPUT_SIZE, NULL);
+    if (network->size < 4) {
+        fprintf(stderr, "\nCould not add all layers!\n");
+        return 0;
+    }
+    network->layers[network->size - 1]->flags |= FLAG_ONEHOT;
+    
+    PSEmbeddingTable * table = GetEmbeddingTable(network->layers[1]);
+    int i, j, w;
+    for (i = 0; i < table->rows * table->size; i++)
+        table->table[i] = 0.1 * (((i * 5) % 9) - 4);
+    for (i = 2; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        for (j = 0; j < layer->size; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            neuron->bias = 0.0;
+            for (w = 0; w < neuron->weights_size; w++)
+                neuron->weights[w] = 0.1 * (((w * 7 + j * 3) % 11) - 5);
+            if (layer->type != GRU) continue;
+            PSGRUCell * cell = GetGRUCell(neuron);
+            cell->candidate_bias = 0.1 * j;
+            cell->reset_bias = -0.2;
+            cell->update_bias = 0.3 - (0.1 * j);
+        }
+    }
+
+    test_case->data = malloc(2 * sizeof(void*));
+    if (test_case->data == NULL) {
+        fprintf(stderr, "\nCould not allocate memory!\n");
+        return 0;
+    }
+    test_case->data[0] = network;
+    int train_data_len = 2 + (LSTM_TIMES * 2);
+    double * training_data = malloc(train_data_len * sizeof(double));
+    if (training_data == NULL) {
+        fprintf(stderr, "\nCould not allocate memory!\n");
+        return 0;
+    }
+    memcpy(training_data, lstm_training_data, train_data_len * sizeof(double));
+    test_case->data[1] = training_data;
+    return 1;
+}
+
 
 int testFullLoad(void* tc, void* t) {
     TestCase * test_case = (TestCase*) tc;
@@ -615,6 +902,168 @@ int testFullBackprop(void* tc, void* t) {
     return ok;
 }
 
+/* Dense and sparse products must give the same outputs and gradients.
+ * sparse_layer must be sparse when the threshold allows it. */
+
+static int compareSparseBackprop(PSNeuralNetwork * network, double * x,
+                                 double * y, int sparse_layer, Test * test)
+{
+    PSLayer * output = network->layers[network->size - 1];
+    int ok = 1, i, j, l, w;
+    double threshold = PSSparseThreshold;
+    double outputs[output->size];
+    PSSparseThreshold = 0;
+    PSGradient ** dense = backprop(network, x, y);
+    for (i = 0; i < output->size; i++)
+        outputs[i] = output->neurons[i]->activation;
+    PSSparseThreshold = 1.0;
+    PSGradient ** sparse = backprop(network, x, y);
+    PSSparseThreshold = threshold;
+    test->error_message = malloc(255 * sizeof(char));
+    if (dense == NULL || sparse == NULL ||
+        !IsSparseLayer(network->layers[sparse_layer])) {
+        sprintf(test->error_message, "Layer[%d] sparse backprop failed",
+                sparse_layer);
+        ok = 0;
+    }
+    for (i = 0; i < output->size && ok; i++) {
+        double a = output->neurons[i]->activation;
+        if (fabs(a - outputs[i]) > 1e-9) {
+            sprintf(test->error_message, "Output[%d]-> %lf != %lf", i, a,
+                    outputs[i]);
+            ok = 0;
+        }
+    }
+    for (l = 1; l < network->size && ok; l++) {
+        PSLayer * layer = network->layers[l];
+        for (j = 0; j < layer->size && ok; j++) {
+            PSGradient * gd = &(dense[l - 1][j]);
+            PSGradient * gs = &(sparse[l - 1][j]);
+            ok = (fabs(gd->bias - gs->bias) <= 1e-9);
+            for (w = 0; w < layer->neurons[j]->weights_size && ok; w++)
+                ok = (fabs(gd->weights[w] - gs->weights[w]) <= 1e-9);
+            if (!ok) {
+                sprintf(test->error_message,
+                        "Gradient[%d][%d] differs with sparse products",
+                        l - 1, j);
+            }
+        }
+    }
+    if (dense != NULL) PSDeleteGradients(dense, network);
+    if (sparse != NULL) PSDeleteGradients(sparse, network);
+    return ok;
+}
+
+int testFullSparseInput(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * test_data = getTestData(test_case);
+    double * x = test_data;
+    double * y = test_data + network->input_size;
+    return compareSparseBackprop(network, x, y, 0, test);
+}
+
+/* Turn the first hidden layer into ReLU, with most of its units inactive */
+
+int testFullReLUSparsity(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * test_data = getTestData(test_case);
+    double * x = test_data;
+    double * y = test_data + network->input_size;
+    PSNeuralNetwork * clone = PSCloneNetwork(network, 0);
+    if (clone == NULL) {
+        test->error_message = malloc(255 * sizeof(char));
+        sprintf(test->error_message, "Could not clone network");
+        return 0;
+    }
+    PSLayer * layer = clone->layers[1];
+    int i;
+    layer->activate = relu;
+    layer->derivative = relu_derivative;
+    for (i = 0; i < layer->size; i++) {
+        if (i % 8) layer->neurons[i]->bias = -1000.0;
+    }
+    PSResetActivationDensity(clone);
+    int ok = compareSparseBackprop(clone, x, y, 1, test);
+    double density = PSGetActivationDensity(layer);
+    double expected = 1.0 / 8.0;
+    if (ok && (density <= 0.0 || density > expected)) {
+        sprintf(test->error_message, "Layer[1] density %lf > %lf", density,
+                expected);
+        ok = 0;
+    }
+    if (ok && PSGetActivationDensity(clone->layers[2]) >= 0) {
+        sprintf(test->error_message, "Layer[2] density should not be tracked");
+        ok = 0;
+    }
+    PSDeleteNetwork(clone);
+    return ok;
+}
+
+/* Stages measure density on their views (of a network with a ReLU hidden
+ * layer): the master layers must end up with the same counters as after
+ * plain feedforward. */
+
+int testPipelineDensity(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    double * data = getTestData(test_case);
+    int count = 4, tracked = 0, i, ok = 1;
+    test->error_message = malloc(255 * sizeof(char));
+    PSNeuralNetwork * network = PSCloneNetwork(getNetwork(test_case), 0);
+    if (network == NULL) {
+        sprintf(test->error_message, "Could not clone network");
+        return 0;
+    }
+    int element_size = network->input_size + network->output_size;
+    long seen[network->size], nonzero[network->size];
+    double outputs[count * network->output_size];
+    PSLayer * hidden = network->layers[1];
+    hidden->activate = relu;
+    hidden->derivative = relu_derivative;
+    for (i = 0; i < hidden->size; i++) {
+        if (i % 8) hidden->neurons[i]->bias = -1000.0;
+    }
+    PSResetActivationDensity(network);
+    for (i = 0; i < count; i++)
+        PSFeedforward(network, data + (i * element_size));
+    for (i = 0; i < network->size; i++) {
+        seen[i] = network->layers[i]->activations_seen;
+        nonzero[i] = network->layers[i]->nonzero_seen;
+        if (seen[i] > 0) tracked++;
+    }
+    PSResetActivationDensity(network);
+    PSPipeline * pipeline = PSCreatePipeline(network, network->size, NULL, 2);
+    if (pipeline == NULL ||
+        !PSPipelineFeedforward(pipeline, data, count, element_size, outputs))
+    {
+        sprintf(test->error_message, "Pipeline feedforward failed!");
+        ok = 0;
+    }
+    if (ok && tracked == 0) {
+        sprintf(test->error_message, "No layer density tracked");
+        ok = 0;
+    }
+    for (i = 0; i < network->size && ok; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->activations_seen != seen[i] ||
+            layer->nonzero_seen != nonzero[i])
+        {
+            sprintf(test->error_message,
+                    "Layer[%d] seen %ld/%ld != %ld/%ld", i,
+                    layer->nonzero_seen, layer->activations_seen,
+                    nonzero[i], seen[i]);
+            ok = 0;
+        }
+    }
+    PSDeletePipeline(pipeline);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
 int testConvLoad(void* tc, void* t) {
     TestCase * test_case = (TestCase*) tc;
     Test * test = (Test*) t;
@@ -855,6 +1304,36 @@ int testRNNBackprop(void* tc, void* t) {
     return ok;
 }
 
+/* Transposed rows are only rebuilt after the weights change */
+
+int testRNNTransposedWeights(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    PSLayer * layer = network->layers[1];
+    PSRecurrentCell * cell = GetRecurrentCell(layer->neurons[0]);
+    int size = layer->size, ok = 1;
+    double weight = cell->weights[1];
+    test->error_message = malloc(255 * sizeof(char));
+    PSInvalidateTransposedWeights(network);
+    ok = PSUpdateTransposedWeights(layer);
+    /* Row 1 holds the weight of cell 1 for each neuron */
+    ok = ok && (layer->recurrent_weights_t[size] == weight);
+    cell->weights[1] = weight + 1.0;
+    ok = ok && PSUpdateTransposedWeights(layer) &&
+         (layer->recurrent_weights_t[size] == weight);
+    if (!ok) sprintf(test->error_message, "Transposed rows rebuilt");
+    PSInvalidateTransposedWeights(network);
+    if (ok && (!PSUpdateTransposedWeights(layer) ||
+               layer->recurrent_weights_t[size] != weight + 1.0)) {
+        sprintf(test->error_message, "Transposed rows not rebuilt");
+        ok = 0;
+    }
+    cell->weights[1] = weight;
+    PSInvalidateTransposedWeights(network);
+    return ok;
+}
+
 int testRNNStep(void* tc, void* t) {
     TestCase * test_case = (TestCase*) tc;
     Test * test = (Test*) t;
@@ -1043,99 +1522,2082 @@ int testLSTMTrain(void* tc, void* tst) {
     return ok;
 }
 
-int testGenericClone(void* tc, void* t) {
+/* GRU BPTT gradients (weights and gate biases) must match the numerical
+ * derivatives of the cross-entropy loss of the series. */
+
+static double seriesLoss(PSNeuralNetwork * network, double * x, double * y) {
+    PSLayer * output = network->layers[network->size - 1];
+    int times = (int) x[0], t;
+    double loss = 0.0;
+    PSFeedforward(network, x);
+    for (t = 0; t < times; t++) {
+        PSNeuron * neuron = output->neurons[(int) y[t]];
+        loss -= log(GetRecurrentState(neuron, t));
+    }
+    return loss;
+}
+
+int testGRUGradients(void* tc, void* t) {
     TestCase * test_case = (TestCase*) tc;
     Test * test = (Test*) t;
     PSNeuralNetwork * network = getNetwork(test_case);
-    PSNeuralNetwork * clone = PSCloneNetwork(network, 0);
-    if (clone == NULL) {
+    PSLayer * layer = network->layers[1];
+    int times = (int) rnn_inputs[0], i, w, ok = 1;
+    double epsilon = 1e-6;
+    PSGradient ** gradients = backpropThroughTimeChunked(network,
+                                                         rnn_inputs + 1,
+                                                         rnn_labels, times,
+                                                         times, 0);
+    if (gradients == NULL) {
         char * msg = malloc(255 * sizeof(char));
         test->error_message = msg;
-        sprintf(msg, "Could not create network clone!\n");
+        sprintf(msg, "Backprop failed!\n");
         return 0;
     }
-    
-    int ok = compareNetworks(network, clone, test);
-    
-    PSDeleteNetwork(clone);
+    for (i = 0; i < layer->size && ok; i++) {
+        PSNeuron * neuron = layer->neurons[i];
+        PSGRUCell * cell = GetGRUCell(neuron);
+        double * biases[3] = {&(cell->candidate_bias), &(cell->reset_bias),
+                              &(cell->update_bias)};
+        for (w = 0; w < neuron->weights_size + 3 && ok; w++) {
+            double * param = (w < neuron->weights_size ? neuron->weights + w :
+                              biases[w - neuron->weights_size]);
+            double value = *param;
+            *param = value + epsilon;
+            double loss_plus = seriesLoss(network, rnn_inputs, rnn_labels);
+            *param = value - epsilon;
+            double loss_minus = seriesLoss(network, rnn_inputs, rnn_labels);
+            *param = value;
+            double expected = (loss_plus - loss_minus) / (2 * epsilon);
+            double gradient = gradients[0][i].weights[w];
+            if (fabs(gradient - expected) > 1e-6) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Neuron[%d]: gradient[%d] %lf != %lf\n",
+                        i, w, gradient, expected);
+                ok = 0;
+            }
+        }
+    }
+    PSDeleteGradients(gradients, network);
     return ok;
 }
 
-int testGenericSave(void* tc, void* t) {
+/* Sampled and hierarchical Softmax gradients only allocate the rows their
+ * targets touched: the others are zero. */
+
+static double gradientWeight(PSGradient * gradient, int w) {
+    return (gradient->weights != NULL ? gradient->weights[w] : 0.0);
+}
+
+/* A sampled Softmax drawing all the other classes must train exactly as
+ * the full one, and with a single sample it must only touch (and allocate)
+ * the target and one more output neuron. */
+
+int testSampledSoftmax(void* tc, void* t) {
     TestCase * test_case = (TestCase*) tc;
     Test * test = (Test*) t;
     PSNeuralNetwork * network = getNetwork(test_case);
-    char tmpfile[255];
-    getTmpFileName("tests-save-nn", ".data", tmpfile);
-    int ok = PSSaveNetwork(network, tmpfile);
-    if (!ok) {
+    PSNeuralNetwork * sampled = PSCloneNetwork(network, 0);
+    if (sampled == NULL) {
         char * msg = malloc(255 * sizeof(char));
         test->error_message = msg;
-        sprintf(msg, "Could not save network!\n");
+        sprintf(msg, "Could not create network clone!\n");
         return 0;
     }
-    PSNeuralNetwork * clone = PSCreateNetwork("Clone Test Network");
-    if (clone == NULL) {
+    PSLayer * output = sampled->layers[sampled->size - 1];
+    int times = (int) rnn_inputs[0], i, j, w, ok = 1;
+    PSSetSoftmaxSamples(output, RNN_INPUT_SIZE);
+    PSGradient ** expected = backpropThroughTime(network, rnn_inputs + 1,
+                                                 rnn_labels, times);
+    PSGradient ** gradients = backpropThroughTime(sampled, rnn_inputs + 1,
+                                                  rnn_labels, times);
+    if (expected == NULL || gradients == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        ok = 0;
+    }
+    for (i = 1; i < network->size && ok; i++) {
+        PSLayer * layer = network->layers[i];
+        int ws = layer->neurons[0]->weights_size + GetGateBiasesCount(layer);
+        for (j = 0; j < layer->size && ok; j++) {
+            PSGradient * g1 = &(expected[i - 1][j]);
+            PSGradient * g2 = &(gradients[i - 1][j]);
+            ok = (fabs(g1->bias - g2->bias) < 1e-9);
+            for (w = 0; ok && w < ws; w++)
+                ok = (fabs(g1->weights[w] - gradientWeight(g2, w)) < 1e-9);
+            if (!ok) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Layer[%d][%d]: gradients differ\n", i, j);
+            }
+        }
+    }
+    if (expected != NULL) PSDeleteGradients(expected, network);
+    if (gradients != NULL) PSDeleteGradients(gradients, sampled);
+    if (ok) {
+        double x[2] = {1, 2}, y[1] = {3};
+        int touched = 0, allocated = 0;
+        PSSetSoftmaxSamples(output, 1);
+        gradients = backpropThroughTime(sampled, x + 1, y, 1);
+        ok = (gradients != NULL);
+        if (ok) {
+            PSGradient * ogradients = gradients[sampled->size - 2];
+            for (j = 0; j < output->size; j++) {
+                touched += (ogradients[j].bias != 0.0);
+                allocated += (ogradients[j].weights != NULL);
+            }
+            ok = (touched == 2 && allocated == 2 && ogradients[3].bias < 0.0);
+            PSDeleteGradients(gradients, sampled);
+        }
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Single sample touched %d output neurons\n",
+                    touched);
+        }
+    }
+    PSDeleteNetwork(sampled);
+    return ok;
+}
+
+/* The same thread seed must draw the same samples. */
+
+static int sampledOutputs(PSNeuralNetwork * network, unsigned int seed,
+                          int * touched)
+{
+    PSLayer * output = network->layers[network->size - 1];
+    double x[2] = {1, 2}, y[1] = {3};
+    int j;
+    PSSetSoftmaxSeed(seed);
+    PSGradient ** gradients = backpropThroughTime(network, x + 1, y, 1);
+    if (gradients == NULL) return 0;
+    PSGradient * ogradients = gradients[network->size - 2];
+    for (j = 0; j < output->size; j++)
+        touched[j] = (ogradients[j].bias != 0.0);
+    PSDeleteGradients(gradients, network);
+    return 1;
+}
+
+int testSampledSoftmaxSeed(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * sampled = PSCloneNetwork(getNetwork(test_case), 0);
+    if (sampled == NULL) {
         char * msg = malloc(255 * sizeof(char));
         test->error_message = msg;
         sprintf(msg, "Could not create network clone!\n");
         return 0;
     }
-    ok = PSLoadNetwork(clone, tmpfile);
+    PSLayer * output = sampled->layers[sampled->size - 1];
+    int first[RNN_INPUT_SIZE], second[RNN_INPUT_SIZE], j, ok;
+    PSSetSoftmaxSamples(output, 1);
+    ok = (sampledOutputs(sampled, 7, first) &&
+          sampledOutputs(sampled, 7, second));
+    for (j = 0; j < output->size && ok; j++) ok = (first[j] == second[j]);
     if (!ok) {
         char * msg = malloc(255 * sizeof(char));
         test->error_message = msg;
-        sprintf(msg, "Could not load network!\n");
-        return 0;
+        sprintf(msg, "Seed 7 drew different samples\n");
     }
-    
-    ok = compareNetworks(network, clone, test);
-    
-    remove(tmpfile);
-    PSDeleteNetwork(clone);
+    PSDeleteNetwork(sampled);
     return ok;
 }
 
-int compareNetworks(PSNeuralNetwork * network, PSNeuralNetwork * clone,
-                    Test* test)
+/* Hierarchical Softmax: the classes of every timestep must sum to 1, and
+ * the gradients of the training pass, which only follows the target paths,
+ * must match the numerical derivatives of the loss of the full
+ * feedforward. */
+
+static int checkNumericalGradient(PSNeuralNetwork * network, double * param,
+                                  double gradient, Test * test)
 {
-    int ok = 1, i, k, w;
-    
-    ok = network->size == clone->size;
-    if (!ok) {
+    double epsilon = 1e-6, value = *param;
+    *param = value + epsilon;
+    double loss_plus = seriesLoss(network, rnn_inputs, rnn_labels);
+    *param = value - epsilon;
+    double loss_minus = seriesLoss(network, rnn_inputs, rnn_labels);
+    *param = value;
+    double expected = (loss_plus - loss_minus) / (2 * epsilon);
+    if (fabs(gradient - expected) <= 1e-6) return 1;
+    char * msg = malloc(255 * sizeof(char));
+    test->error_message = msg;
+    sprintf(msg, "Gradient %lf != %lf\n", gradient, expected);
+    return 0;
+}
+
+int testHierarchicalSoftmax(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = PSCloneNetwork(getNetwork(test_case), 0);
+    if (network == NULL) {
         char * msg = malloc(255 * sizeof(char));
         test->error_message = msg;
-        sprintf(msg, "Source size %d != Clone size %d\n",
-                network->size, clone->size);
+        sprintf(msg, "Could not create network clone!\n");
         return 0;
     }
-    
-    for (i = 0; i < network->size; i++) {
-        PSLayer * orig_l = network->layers[i];
-        PSLayer * clone_l = clone->layers[i];
-        PSLayerType otype = orig_l->type;
-        PSLayerType ctype = clone_l->type;
-        ok = (otype == ctype);
-        if (!ok) {
-            char * msg = malloc(255 * sizeof(char));
-            test->error_message = msg;
-            sprintf(msg, "Layer[%d]: Source type %s != Clone type %s\n", i,
-                    PSGetLayerTypeLabel(orig_l),
-                    PSGetLayerTypeLabel(clone_l));
-            break;
-        }
-        int o_size = orig_l->size;
-        int c_size = clone_l->size;
-        ok = (o_size == c_size);
+    PSLayer * output = network->layers[network->size - 1];
+    PSLayer * layer = network->layers[1];
+    int times = (int) rnn_inputs[0], i, j, w, ok;
+    output->flags |= FLAG_HIERARCHICAL;
+    ok = PSFeedforward(network, rnn_inputs);
+    for (i = 0; i < times && ok; i++) {
+        double sum = 0.0;
+        for (j = 0; j < output->size; j++)
+            sum += GetRecurrentState(output->neurons[j], i);
+        ok = (fabs(sum - 1.0) < 1e-12);
         if (!ok) {
             char * msg = malloc(255 * sizeof(char));
             test->error_message = msg;
-            sprintf(msg, "Layer[%d]: Source size %d != Clone size %d\n",
-                    i, o_size, c_size);
-            break;
+            sprintf(msg, "Timestep %d: probabilities sum to %lf\n", i, sum);
+        }
+    }
+    PSGradient ** gradients = NULL;
+    if (ok) {
+        gradients = backpropThroughTimeChunked(network, rnn_inputs + 1,
+                                               rnn_labels, times, times, 0);
+        ok = (gradients != NULL);
+    }
+    for (j = 0; j < output->size && ok; j++) {
+        PSNeuron * neuron = output->neurons[j];
+        PSGradient * gradient = &(gradients[network->size - 2][j]);
+        ok = checkNumericalGradient(network, &(neuron->bias), gradient->bias,
+                                    test);
+        for (w = 0; w < neuron->weights_size && ok; w++)
+            ok = checkNumericalGradient(network, neuron->weights + w,
+                                        gradientWeight(gradient, w), test);
+    }
+    for (j = 0; j < layer->size && ok; j++) {
+        PSNeuron * neuron = layer->neurons[j];
+        for (w = 0; w < neuron->weights_size && ok; w++)
+            ok = checkNumericalGradient(network, neuron->weights + w,
+                                        gradients[0][j].weights[w], test);
+    }
+    if (gradients != NULL) PSDeleteGradients(gradients, network);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+/* A single target only touches the nodes on its path: L2 decay must
+ * leave every other output row unchanged. */
+
+int testHierarchicalUpdate(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = PSCloneNetwork(getNetwork(test_case), 0);
+    if (network == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network clone!\n");
+        return 0;
+    }
+    PSLayer * output = network->layers[network->size - 1];
+    output->flags |= FLAG_HIERARCHICAL;
+    double series_data[3] = {1, 0, 3};
+    double * series = series_data;
+    int weights_size = output->neurons[0]->weights_size;
+    int count = output->size * weights_size, i, j, ok = 1, touched = 0;
+    double rate = 0.1, l2 = 1 - (rate * 0.1);
+    double before[count], bias[output->size];
+    for (j = 0; j < output->size; j++) {
+        PSNeuron * neuron = output->neurons[j];
+        bias[j] = neuron->bias;
+        memcpy(before + (j * weights_size), neuron->weights,
+               weights_size * sizeof(double));
+    }
+    PSGradient ** gradients = backpropThroughTime(network, series + 1,
+                                                  series + 2, 1);
+    if (gradients == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        PSDeleteNetwork(network);
+        return 0;
+    }
+    PSTrainingOptions opts = {.flags = 0, .l2_decay = 0.1};
+    updateWeights(network, series, 1, 1, &opts, rate, &series);
+    for (i = 0; i < count && ok; i++) {
+        j = i / weights_size;
+        PSNeuron * neuron = output->neurons[j];
+        double * g = gradients[network->size - 2][j].weights;
+        double w = neuron->weights[i % weights_size];
+        double expected = before[i];
+        if (g != NULL) {
+            expected = (expected * l2) - (rate * g[i % weights_size]);
+            ok = (getRoundedDouble(w) == getRoundedDouble(expected));
+            if (i % weights_size == 0) touched++;
+        } else ok = (w == expected && neuron->bias == bias[j]);
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Output[%d][%d]: %lf != %lf\n", j,
+                    i % weights_size, w, expected);
+        }
+    }
+    if (ok && (touched < 1 || touched == output->size)) {
+        ok = 0;
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Touched %d of %d output rows\n", touched,
+                output->size);
+    }
+    PSDeleteGradients(gradients, network);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+/* BPTT multiplies the delta of LSTM layers by the layer derivative of
+ * their output: test cells have no output activation and a unit
+ * derivative, so that their gradients are exact. */
+
+static double unitDerivative(double val) {
+    return 1.0;
+}
+
+/* Onehot series network of the given layer types, between the input and
+ * the Softmax output, with deterministic weights. */
+
+static PSNeuralNetwork * createSeriesNetwork(PSLayerType * types, int count)
+{
+    PSNeuralNetwork * network = PSCreateNetwork("Series Test Network");
+    if (network == NULL) return NULL;
+    network->flags |= FLAG_ONEHOT;
+    PSAddLayer(network, FullyConnected, RNN_INPUT_SIZE, NULL);
+    int i, j, w;
+    for (i = 0; i < count; i++) {
+        int size = (types[i] == Embedding ? EMBEDDING_SIZE : RNN_HIDDEN_SIZE);
+        PSAddLayer(network, types[i], size, NULL);
+    }
+    PSAddLayer(network, SoftMax, RNN_INPUT_SIZE, NULL);
+    if (network->size < count + 2) {
+        PSDeleteNetwork(network);
+        return NULL;
+    }
+    network->layers[network->size - 1]->flags |= FLAG_ONEHOT;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type == Embedding) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            for (j = 0; j < table->rows * table->size; j++)
+                table->table[j] = 0.1 * (((j * 5) % 9) - 4);
+            continue;
+        }
+        if (layer->type == LSTM) {
+            layer->activate = NULL;
+            layer->derivative = unitDerivative;
+        }
+        for (j = 0; j < layer->size; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            neuron->bias = 0.1 * (j % 3);
+            for (w = 0; w < neuron->weights_size; w++)
+                neuron->weights[w] = 0.1 * (((w * 7 + j * 3 + i) % 11) - 5);
+            if (layer->type != LSTM) continue;
+            PSLSTMCell * cell = GetLSTMCell(neuron);
+            cell->candidate_bias = 0.1 * j;
+            cell->input_bias = -0.2;
+            cell->output_bias = 0.2;
+            cell->forget_bias = 0.3 - (0.1 * j);
+        }
+    }
+    return network;
+}
+
+/* BPTT gradients of every weight, Embedding table row and bias (only
+ * FullyConnected and Softmax neurons use theirs) must match the numerical
+ * derivatives of the series loss. */
+
+static int checkSeriesGradients(PSNeuralNetwork * network, Test * test) {
+    int times = (int) rnn_inputs[0], i, j, w, ok = 1;
+    PSGradient ** gradients = backpropThroughTimeChunked(network,
+                                                         rnn_inputs + 1,
+                                                         rnn_labels, times,
+                                                         times, 0);
+    if (gradients == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        return 0;
+    }
+    for (i = 1; i < network->size && ok; i++) {
+        PSLayer * layer = network->layers[i];
+        PSGradient * lgradients = gradients[i - 1];
+        if (layer->type == Embedding) {
+            PSEmbeddingTable * table = GetEmbeddingTable(layer);
+            for (j = 0; j < table->rows && ok; j++) {
+                double * g = lgradients[j].weights;
+                if (g == NULL) continue;
+                double * row = GetEmbeddingRow(table, j);
+                for (w = 0; w < table->size && ok; w++)
+                    ok = checkNumericalGradient(network, row + w, g[w], test);
+            }
+        }
+        int bias = (layer->type == FullyConnected || layer->type == SoftMax);
+        for (j = 0; j < layer->size && ok; j++) {
+            PSNeuron * neuron = layer->neurons[j];
+            for (w = 0; w < neuron->weights_size && ok; w++)
+                ok = checkNumericalGradient(network, neuron->weights + w,
+                                            lgradients[j].weights[w], test);
+            if (ok && bias)
+                ok = checkNumericalGradient(network, &(neuron->bias),
+                                            lgradients[j].bias, test);
+        }
+        if (!ok) {
+            char * msg = test->error_message;
+            test->error_message = malloc(255 * sizeof(char));
+            sprintf(test->error_message, "Layer[%d]: %s", i, msg);
+            free(msg);
+        }
+    }
+    PSDeleteGradients(gradients, network);
+    return ok;
+}
+
+/* Each LSTM layer of a stack must get back its own delta from t + 1, and
+ * the lower one the delta of the upper one's inputs. */
+
+int testStackedLSTMGradients(void* tc, void* t) {
+    Test * test = (Test*) t;
+    PSLayerType types[2] = {LSTM, LSTM};
+    PSNeuralNetwork * network = createSeriesNetwork(types, 2);
+    if (network == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network!\n");
+        return 0;
+    }
+    int ok = checkSeriesGradients(network, test);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+/* A FullyConnected layer above a recurrent one must accumulate the
+ * gradient of each of its neurons. */
+
+int testHiddenLayerGradients(void* tc, void* t) {
+    Test * test = (Test*) t;
+    PSLayerType types[2] = {Recurrent, FullyConnected};
+    PSNeuralNetwork * network = createSeriesNetwork(types, 2);
+    if (network == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network!\n");
+        return 0;
+    }
+    int ok = checkSeriesGradients(network, test);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+/* The output bias gradient must sum the deltas of every timestep. */
+
+int testOutputBiasGradients(void* tc, void* t) {
+    Test * test = (Test*) t;
+    PSLayerType types[1] = {Recurrent};
+    PSNeuralNetwork * network = createSeriesNetwork(types, 1);
+    if (network == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network!\n");
+        return 0;
+    }
+    int ok = checkSeriesGradients(network, test);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+/* An LSTM layer above layer 1 must hand the delta of its inputs back at
+ * every timestep, here to the Embedding table. */
+
+int testEmbeddingLSTMGradients(void* tc, void* t) {
+    Test * test = (Test*) t;
+    PSLayerType types[2] = {Embedding, LSTM};
+    PSNeuralNetwork * network = createSeriesNetwork(types, 2);
+    if (network == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network!\n");
+        return 0;
+    }
+    int ok = checkSeriesGradients(network, test);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+/* Path probability, sampling and top-k queries on a hierarchical Softmax
+ * must agree with the full distribution of every timestep. */
+
+int testHierarchicalQueries(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = PSCloneNetwork(getNetwork(test_case), 0);
+    if (network == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network clone!\n");
+        return 0;
+    }
+    PSLayer * output = network->layers[network->size - 1];
+    PSLayer * hidden = network->layers[network->size - 2];
+    int times = (int) rnn_inputs[0], size = output->size, i, j, ok;
+    int classes[size];
+    double h[hidden->size], probs[size];
+    unsigned int seed = 3;
+    output->flags |= FLAG_HIERARCHICAL;
+    ok = PSFeedforward(network, rnn_inputs);
+    for (i = 0; i < times && ok; i++) {
+        for (j = 0; j < hidden->size; j++)
+            h[j] = GetRecurrentState(hidden->neurons[j], i);
+        int found = PSHierarchicalTopK(output, h, size, classes, probs);
+        ok = (found == size);
+        for (j = 0; j < found && ok; j++) {
+            double p = GetRecurrentState(output->neurons[classes[j]], i);
+            double q = PSHierarchicalProbability(output, h, classes[j]);
+            ok = (fabs(probs[j] - p) < 1e-12 && fabs(q - p) < 1e-12);
+            if (ok && j > 0) ok = (probs[j] <= probs[j - 1]);
+        }
+        if (ok) {
+            double p;
+            int c = PSHierarchicalSample(output, h, &seed, &p);
+            ok = (c >= 0 && c < size &&
+                  fabs(p - GetRecurrentState(output->neurons[c], i)) < 1e-12);
+        }
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Timestep %d: queries differ from the outputs\n",
+                    i);
+        }
+    }
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+/* Every timestep of an Embedding layer holds the table row of its input,
+ * and inputs out of the table must make the feedforward fail. */
+
+int testEmbeddingFeedforward(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    PSLayer * layer = network->layers[1];
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    int times = (int) rnn_inputs[0], i, j, ok = PSFeedforward(network,
+                                                                rnn_inputs);
+    if (!ok) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Feedforward failed!\n");
+        return 0;
+    }
+    for (i = 0; i < times && ok; i++) {
+        double * row = GetEmbeddingRow(table, (int) rnn_inputs[i + 1]);
+        for (j = 0; j < layer->size && ok; j++) {
+            double state = GetRecurrentState(layer->neurons[j], i);
+            ok = (state == row[j]);
+            if (!ok) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "State[%d][%d]: %lf != %lf\n",
+                        i, j, state, row[j]);
+            }
+        }
+    }
+    if (!ok) return 0;
+    double outside[3] = {2, 1, RNN_INPUT_SIZE};
+    if (PSFeedforward(network, outside)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Input %d out of the table did not fail!\n",
+                RNN_INPUT_SIZE);
+        return 0;
+    }
+    return 1;
+}
+
+/* BPTT gradients of the table must match the numerical derivatives of the
+ * series loss. Row 1 is never looked up, so it must have no gradient. */
+
+int testEmbeddingGradients(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    PSLayer * layer = network->layers[1];
+    PSEmbeddingTable * table = GetEmbeddingTable(layer);
+    double x[5] = {4, 3, 2, 0, 2};
+    int times = (int) x[0], row, k, ok = 1;
+    double epsilon = 1e-6;
+    PSGradient ** gradients = backpropThroughTimeChunked(network, x + 1,
+                                                         rnn_labels, times,
+                                                         times, 0);
+    if (gradients == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        return 0;
+    }
+    for (row = 0; row < table->rows && ok; row++) {
+        double * g = gradients[0][row].weights;
+        if ((g == NULL) != (row == 1)) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Row[%d]: unexpected gradient allocation\n", row);
+            ok = 0;
+            break;
+        }
+        if (g == NULL) continue;
+        double * weights = GetEmbeddingRow(table, row);
+        for (k = 0; k < table->size && ok; k++) {
+            double value = weights[k];
+            weights[k] = value + epsilon;
+            double loss_plus = seriesLoss(network, x, rnn_labels);
+            weights[k] = value - epsilon;
+            double loss_minus = seriesLoss(network, x, rnn_labels);
+            weights[k] = value;
+            double expected = (loss_plus - loss_minus) / (2 * epsilon);
+            if (fabs(g[k] - expected) > 1e-6) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Row[%d]: gradient[%d] %lf != %lf\n",
+                        row, k, g[k], expected);
+                ok = 0;
+            }
+        }
+    }
+    PSDeleteGradients(gradients, network);
+    return ok;
+}
+
+/* Feedforward networks: Input -> Embedding -> FullyConnected, checked
+ * against the numerical derivatives of the quadratic loss, both with a
+ * onehot input and with a vector weighting the rows. */
+
+static double embeddingQuadraticLoss(PSNeuralNetwork * network, double * x,
+                                     double * y)
+{
+    PSLayer * output = network->layers[network->size - 1];
+    double loss = 0.0;
+    int o;
+    PSFeedforward(network, x);
+    for (o = 0; o < output->size; o++) {
+        double d = output->neurons[o]->activation - y[o];
+        loss += 0.5 * d * d;
+    }
+    return loss;
+}
+
+static int checkEmbeddingBackprop(int onehot, double * x, double * y,
+                                  Test * test)
+{
+    PSNeuralNetwork * network = PSCreateNetwork("Embedding Backprop Network");
+    if (network == NULL) return 0;
+    if (onehot) network->flags |= FLAG_ONEHOT;
+    PSAddLayer(network, FullyConnected, 4, NULL);
+    PSAddLayer(network, Embedding, EMBEDDING_SIZE, NULL);
+    PSAddLayer(network, FullyConnected, 4, NULL);
+    int row, k, ok = (network->size == 3);
+    if (!ok) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not add all layers!\n");
+        PSDeleteNetwork(network);
+        return 0;
+    }
+    PSEmbeddingTable * table = GetEmbeddingTable(network->layers[1]);
+    double epsilon = 1e-6;
+    PSGradient ** gradients = backprop(network, x, y);
+    if (gradients == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        PSDeleteNetwork(network);
+        return 0;
+    }
+    for (row = 0; row < table->rows && ok; row++) {
+        double * g = gradients[0][row].weights;
+        int used = (onehot ? (row == (int) x[0]) : (x[row] != 0.0));
+        if ((g != NULL) != used) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Row[%d]: unexpected gradient allocation\n", row);
+            ok = 0;
+            break;
+        }
+        if (g == NULL) continue;
+        double * weights = GetEmbeddingRow(table, row);
+        for (k = 0; k < table->size && ok; k++) {
+            double value = weights[k];
+            weights[k] = value + epsilon;
+            double loss_plus = embeddingQuadraticLoss(network, x, y);
+            weights[k] = value - epsilon;
+            double loss_minus = embeddingQuadraticLoss(network, x, y);
+            weights[k] = value;
+            double expected = (loss_plus - loss_minus) / (2 * epsilon);
+            if (fabs(g[k] - expected) > 1e-6) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Row[%d]: gradient[%d] %lf != %lf\n",
+                        row, k, g[k], expected);
+                ok = 0;
+            }
+        }
+    }
+    PSDeleteGradients(gradients, network);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+int testEmbeddingBackprop(void* tc, void* t) {
+    Test * test = (Test*) t;
+    double index[1] = {2};
+    double vector[4] = {0.5, 0.0, -1.0, 0.0};
+    double y[4] = {0.0, 1.0, 0.0, 0.0};
+    return (checkEmbeddingBackprop(1, index, y, test) &&
+            checkEmbeddingBackprop(0, vector, y, test));
+}
+
+/* A training step must move the rows the series looked up by their
+ * gradients and leave every other row untouched. */
+
+int testEmbeddingUpdate(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    PSEmbeddingTable * table = GetEmbeddingTable(network->layers[1]);
+    double series_data[9] = {4, 3, 2, 0, 2, 3, 2, 1, 0};
+    double * series = series_data;
+    int times = (int) series_data[0], i, ok = 1;
+    int count = table->rows * table->size;
+    double rate = 0.1;
+    double before[count];
+    memcpy(before, table->table, count * sizeof(double));
+    PSGradient ** gradients = backpropThroughTime(network, series + 1,
+                                                  series + 1 + times, times);
+    if (gradients == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        return 0;
+    }
+    updateWeights(network, series, 1, 1, NULL, rate, &series);
+    for (i = 0; i < count && ok; i++) {
+        double * g = gradients[0][i / table->size].weights;
+        double expected = before[i];
+        if (g != NULL) expected -= rate * g[i % table->size];
+        ok = (getRoundedDouble(table->table[i]) ==
+              getRoundedDouble(expected));
+        if (ok && g == NULL) ok = (table->table[i] == before[i]);
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Table[%d][%d]: %lf != %lf\n", i / table->size,
+                    i % table->size, table->table[i], expected);
+        }
+    }
+    PSDeleteGradients(gradients, network);
+    return ok;
+}
+
+int testGenericClone(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    PSNeuralNetwork * clone = PSCloneNetwork(network, 0);
+    if (clone == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network clone!\n");
+        return 0;
+    }
+    
+    int ok = compareNetworks(network, clone, test);
+    
+    PSDeleteNetwork(clone);
+    return ok;
+}
+
+int testGenericMemoryPolicy(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    PSNeuralNetwork * clone = PSCloneNetwork(network, 0);
+    if (clone == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network clone!\n");
+        return 0;
+    }
+    int ok = PSSetMemoryPolicy(clone, MEMORY_HUGE_PAGES | MEMORY_PREFAULT);
+    if (!ok) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not apply memory policy!\n");
+        PSDeleteNetwork(clone);
+        return 0;
+    }
+    PSMemoryBlock * block = getNetworkMemory(clone);
+    PSNeuron * neuron = clone->layers[clone->size - 1]->neurons[0];
+    if (block == NULL || !PSMemoryBlockContains(block, neuron->weights)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Weights not moved to memory block!\n");
+        PSDeleteNetwork(clone);
+        return 0;
+    }
+    ok = compareNetworks(network, clone, test);
+    PSDeleteNetwork(clone);
+    return ok;
+}
+
+int testGenericReplicas(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    PSNeuralNetwork * clone = PSCloneNetwork(network, 1);
+    if (clone == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network clone!\n");
+        return 0;
+    }
+    int ok = PSCopyNetworkWeights(clone, network);
+    if (ok) ok = compareNetworks(network, clone, test);
+    if (!ok) {
+        PSDeleteNetwork(clone);
+        return 0;
+    }
+    PSReplicaSet * replicas = PSCreateReplicas(clone);
+    if (replicas == NULL || replicas->count != PSGetNUMANodeCount()) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create replicas!\n");
+        PSDeleteNetwork(clone);
+        return 0;
+    }
+    PSNeuron * neuron = clone->layers[1]->neurons[0];
+    neuron->weights[0] += 1.0;
+    ok = PSSyncReplicas(replicas);
+    PSNeuralNetwork * local = PSGetLocalReplica(replicas);
+    if (ok) ok = (local != NULL && compareNetworks(clone, local, test));
+    PSDeleteReplicas(replicas);
+    if (!ok) {
+        PSDeleteNetwork(clone);
+        return 0;
+    }
+    /* Inference workers read their node's replica */
+    int flags = PSGlobalFlags, i, j;
+    PSGlobalFlags |= FLAG_THREAD_AFFINITY;
+    ok = PSStartInference(clone, 2, 0);
+    PSGlobalFlags = flags;
+    if (!ok) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not start inference!\n");
+        PSDeleteNetwork(clone);
+        return 0;
+    }
+    PSInferenceEngine * engine = (PSInferenceEngine *) clone->inference;
+    replicas = engine->replicas;
+    for (i = 0; ok && i < engine->size; i++) {
+        PSNeuralNetwork * master = engine->workers[i].view->master;
+        int found = 0;
+        for (j = 0; replicas != NULL && j < replicas->count; j++)
+            found |= (replicas->networks[j] == master);
+        if (!found) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Worker %d does not read a replica\n", i);
+            ok = 0;
+        }
+    }
+    neuron->weights[0] -= 1.0;
+    if (ok) ok = PSSyncInferenceReplicas(clone);
+    if (ok && replicas != NULL) {
+        local = replicas->networks[replicas->count - 1];
+        if (local != NULL) ok = compareNetworks(clone, local, test);
+    }
+    PSStopInference(clone);
+    PSDeleteNetwork(clone);
+    return ok;
+}
+
+static int compareGradients(PSNeuralNetwork * network, PSGradient ** g1,
+                            PSGradient ** g2, Test * test)
+{
+    int i, j, w;
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        if (layer->type == Convolutional || layer->type == Pooling) continue;
+        for (j = 0; j < layer->size; j++) {
+            PSGradient * gr1 = &(g1[i - 1][j]);
+            PSGradient * gr2 = &(g2[i - 1][j]);
+            int ok = (gr1->bias == gr2->bias);
+            int ws = layer->neurons[j]->weights_size;
+            ws += GetGateBiasesCount(layer);
+            for (w = 0; ok && w < ws; w++)
+                ok = (gradientWeight(gr1, w) == gradientWeight(gr2, w));
+            if (!ok) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Layer[%d]: gradient[%d] differs\n", i, j);
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int testGenericThreads(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * x = getTestData(test_case);
+    double * y = x + network->input_size;
+    PSLayer * output = network->layers[network->size - 1];
+    int i, ok = 1, threshold = PSParallelThreshold;
+    double expected[output->size];
+    
+    PSFeedforward(network, x);
+    for (i = 0; i < output->size; i++)
+        expected[i] = output->neurons[i]->activation;
+    PSGradient ** serial_gradients = backprop(network, x, y);
+    
+    PSParallelThreshold = 0;
+    if (!PSSetThreadCount(4)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create thread pool!\n");
+        PSParallelThreshold = threshold;
+        return 0;
+    }
+    PSFeedforward(network, x);
+    for (i = 0; i < output->size; i++) {
+        double a = output->neurons[i]->activation;
+        if (a != expected[i]) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Output[%d]-> %lf != %lf\n", i, a, expected[i]);
+            ok = 0;
+            break;
+        }
+    }
+    PSGradient ** gradients = backprop(network, x, y);
+    if (ok) ok = compareGradients(network, serial_gradients, gradients, test);
+    
+    PSSetThreadCount(1);
+    PSParallelThreshold = threshold;
+    PSDeleteGradients(serial_gradients, network);
+    PSDeleteGradients(gradients, network);
+    return ok;
+}
+
+/* A stack of recurrent layers run on the wavefront must produce the same
+ * states and gradients as the serial schedule. */
+
+int testRNNWavefront(void* tc, void* t) {
+    Test * test = (Test*) t;
+    int i, j, k, ok = 1, threshold = PSParallelThreshold;
+    PSNeuralNetwork * network = PSCreateNetwork("Wavefront Network");
+    network->flags |= FLAG_ONEHOT;
+    PSAddLayer(network, FullyConnected, RNN_INPUT_SIZE, NULL);
+    PSAddLayer(network, LSTM, RNN_HIDDEN_SIZE, NULL);
+    PSAddLayer(network, Recurrent, RNN_HIDDEN_SIZE, NULL);
+    PSAddLayer(network, FullyConnected, RNN_HIDDEN_SIZE, NULL);
+    PSAddLayer(network, SoftMax, RNN_INPUT_SIZE, NULL);
+    network->layers[network->size - 1]->flags |= FLAG_ONEHOT;
+    PSGradient ** serial = backpropThroughTime(network, rnn_inputs + 1,
+                                               rnn_labels, RNN_TIMES);
+    int states_count = 0;
+    for (i = 1; i < network->size; i++)
+        states_count += network->layers[i]->size * RNN_TIMES;
+    double states[states_count];
+    for (i = 1, k = 0; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        for (j = 0; j < layer->size * RNN_TIMES; j++)
+            states[k++] = GetRecurrentState(layer->neurons[j / RNN_TIMES],
+                                            j % RNN_TIMES);
+    }
+    PSParallelThreshold = 0;
+    PSGlobalFlags |= FLAG_WAVEFRONT;
+    PSGradient ** gradients = NULL;
+    if (!PSSetThreadCount(4)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create thread pool!\n");
+        ok = 0;
+    } else {
+        gradients = backpropThroughTime(network, rnn_inputs + 1, rnn_labels,
+                                        RNN_TIMES);
+    }
+    PSSetThreadCount(1);
+    PSGlobalFlags &= ~FLAG_WAVEFRONT;
+    PSParallelThreshold = threshold;
+    if (ok && (serial == NULL || gradients == NULL)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        ok = 0;
+    }
+    for (i = 1, k = 0; ok && i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        for (j = 0; ok && j < layer->size * RNN_TIMES; j++, k++) {
+            double s = GetRecurrentState(layer->neurons[j / RNN_TIMES],
+                                         j % RNN_TIMES);
+            if (s != states[k]) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Layer[%d]: state[%d][%d] %lf != %lf\n", i,
+                        j / RNN_TIMES, j % RNN_TIMES, s, states[k]);
+                ok = 0;
+            }
+        }
+    }
+    if (ok) ok = compareGradients(network, serial, gradients, test);
+    if (serial != NULL) PSDeleteGradients(serial, network);
+    if (gradients != NULL) PSDeleteGradients(gradients, network);
+    PSDeleteNetwork(network);
+    return ok;
+}
+
+int testGenericTaskGraph(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * data = getTestData(test_case);
+    int element_size = network->input_size + network->output_size;
+    int batch_size = 4, ok = 1;
+    PSTrainingOptions opts = {.flags = 0, .l2_decay = 0.1};
+    PSNeuralNetwork * serial = PSCloneNetwork(network, 0);
+    PSNeuralNetwork * graph = PSCloneNetwork(network, 0);
+    if (serial == NULL || graph == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not clone network!\n");
+        if (serial != NULL) PSDeleteNetwork(serial);
+        return 0;
+    }
+    double batch[batch_size * element_size];
+    memcpy(batch, data, sizeof(batch));
+    double serial_loss = updateWeights(serial, batch, batch_size, testlen,
+                                       &opts, 0.5);
+    opts.flags |= TRAINING_TASK_GRAPH;
+    if (!PSSetThreadCount(4)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create thread pool!\n");
+        ok = 0;
+    }
+    double loss = 0;
+    if (ok) loss = updateWeights(graph, batch, batch_size, testlen, &opts, 0.5);
+    PSSetThreadCount(1);
+    if (ok && getRoundedDouble(loss) != getRoundedDouble(serial_loss)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Loss %.15e != %.15e\n", loss, serial_loss);
+        ok = 0;
+    }
+    if (ok) ok = compareNetworks(serial, graph, test);
+    PSDeleteNetwork(serial);
+    PSDeleteNetwork(graph);
+    return ok;
+}
+
+/* Every layer in its own stage, with rings shorter than the stream so
+ * that they wrap around: outputs must match plain feedforward. */
+
+int testGenericPipeline(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * data = getTestData(test_case);
+    int element_size = network->input_size + network->output_size;
+    int output_size = network->output_size, count = 4, i, j, ok = 1;
+    PSLayer * output = network->layers[network->size - 1];
+    double expected[count * output_size], outputs[count * output_size];
+    for (i = 0; i < count; i++) {
+        PSFeedforward(network, data + (i * element_size));
+        for (j = 0; j < output_size; j++)
+            expected[i * output_size + j] = output->neurons[j]->activation;
+    }
+    PSPipeline * pipeline = PSCreatePipeline(network, network->size, NULL, 2);
+    if (pipeline == NULL || pipeline->size != network->size - 1 ||
+        !PSPipelineFeedforward(pipeline, data, count, element_size, outputs))
+    {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Pipeline feedforward failed!\n");
+        PSDeletePipeline(pipeline);
+        return 0;
+    }
+    for (i = 0; i < count * output_size && ok; i++) {
+        if (outputs[i] != expected[i]) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Sample %d, output[%d]-> %lf != %lf\n",
+                    i / output_size, i % output_size, outputs[i],
+                    expected[i]);
+            ok = 0;
+        }
+    }
+    PSDeletePipeline(pipeline);
+    return ok;
+}
+
+static void countCompletion(PSInferenceRequest * request, int status,
+                            void * userdata)
+{
+    if (status == PS_REQUEST_DONE && request->output_size > 0)
+        __atomic_add_fetch((int *) userdata, 1, __ATOMIC_RELAXED);
+}
+
+/* A batch must give the outputs of feeding its inputs one by one, with
+ * sizes leaving partial 4 x 4 blocks too. */
+
+#define FEEDFORWARD_BATCH   7
+
+int testGenericFeedforwardBatch(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * data = getTestData(test_case);
+    int element_size = network->input_size + network->output_size;
+    int input_size = network->input_size, output_size = network->output_size;
+    int count = FEEDFORWARD_BATCH, i, j, ok = 1;
+    PSLayer * output = network->layers[network->size - 1];
+    double inputs[FEEDFORWARD_BATCH * input_size];
+    double outputs[FEEDFORWARD_BATCH * output_size];
+    double expected[FEEDFORWARD_BATCH * output_size];
+    for (i = 0; i < count; i++) {
+        double * x = data + ((i % testlen) * element_size);
+        memcpy(inputs + (i * input_size), x, input_size * sizeof(double));
+        PSFeedforward(network, x);
+        for (j = 0; j < output_size; j++)
+            expected[i * output_size + j] = output->neurons[j]->activation;
+    }
+    if (!PSFeedforwardBatch(network, inputs, count, outputs)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Batch feedforward failed!\n");
+        return 0;
+    }
+    for (i = 0; i < count * output_size && ok; i++) {
+        if (fabs(outputs[i] - expected[i]) > 1e-9) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Input %d, output[%d]-> %lf != %lf\n",
+                    i / output_size, i % output_size, outputs[i],
+                    expected[i]);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+int testGenericAsync(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * data = getTestData(test_case);
+    int element_size = network->input_size + network->output_size;
+    int output_size = network->output_size, count = 8, i, j, ok = 1;
+    int callbacks = 0;
+    PSLayer * output = network->layers[network->size - 1];
+    PSInferenceRequest * requests[count];
+    double expected[count * output_size];
+    for (i = 0; i < count; i++) {
+        PSFeedforward(network, data + (i * element_size));
+        for (j = 0; j < output_size; j++)
+            expected[i * output_size + j] = output->neurons[j]->activation;
+    }
+    if (!PSStartInference(network, 2, 2)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not start inference!\n");
+        return 0;
+    }
+    for (i = 0; i < count; i++)
+        requests[i] = PSFeedforwardAsync(network, data + (i * element_size),
+                                         countCompletion, &callbacks);
+    for (i = 0; i < count && ok; i++) {
+        if (!PSWaitRequest(requests[i])) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Request %d failed!\n", i);
+            ok = 0;
+            break;
+        }
+        /* Batches run as matrix products, summing in another order */
+        for (j = 0; j < output_size && ok; j++) {
+            double o = requests[i]->output[j];
+            if (fabs(o - expected[i * output_size + j]) > 1e-9) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Request %d, output[%d]-> %lf != %lf\n",
+                        i, j, o, expected[i * output_size + j]);
+                ok = 0;
+            }
+        }
+    }
+    /* Workers signal the descriptor after running the callbacks */
+    uint64_t completed = 0, value;
+    int fd = PSGetInferenceEventFD(network);
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (ok && fd >= 0 && completed < (uint64_t) count &&
+           poll(&pfd, 1, 1000) > 0)
+    {
+        if (read(fd, &value, sizeof(value)) > 0) completed += value;
+    }
+    if (ok && fd >= 0 && completed != (uint64_t) count) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Event counter %lu != %d\n", (unsigned long) completed,
+                count);
+        ok = 0;
+    }
+    if (ok && callbacks != count) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Callbacks %d != %d\n", callbacks, count);
+        ok = 0;
+    }
+    for (i = 0; i < count; i++) PSDeleteRequest(requests[i]);
+    PSStopInference(network);
+    return ok;
+}
+
+/* Stepping through a series must give the same outputs as running it
+ * whole, also when resumed from a cloned or reloaded state. */
+
+int testGenericStepState(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * x = rnn_inputs + 1;
+    int times = (int) rnn_inputs[0], i, j, ok = 1;
+    int input_size = network->layers[0]->size;
+    PSLayer * output = network->layers[network->size - 1];
+    double expected[times * output->size];
+    PSFeedforward(network, rnn_inputs);
+    for (i = 0; i < times; i++) {
+        for (j = 0; j < output->size; j++)
+            expected[i * output->size + j] =
+                GetRecurrentState(output->neurons[j], i);
+    }
+    char tmpfile[255];
+    getTmpFileName("tests-step-state", ".data", tmpfile);
+    PSStepState * state = PSCreateStepState(network);
+    PSStepState * clone = NULL, * loaded = PSCreateStepState(network);
+    if (state == NULL || loaded == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create step state!\n");
+        PSDeleteStepState(state);
+        PSDeleteStepState(loaded);
+        return 0;
+    }
+    /* Replay the series from step 1 out of a reloaded copy, then out of
+     * a clone, and once more from scratch after a reset. */
+    int start[4] = {0, 1, 1, 0};
+    for (i = 0; i < 4 && ok; i++) {
+        PSStepState * s = state;
+        if (i == 2) s = clone;
+        else if (i == 1) {
+            ok = PSLoadStepState(loaded, tmpfile);
+            for (j = 0; j < loaded->size && ok; j++)
+                ok = (getRoundedDouble(loaded->values[j]) ==
+                      getRoundedDouble(clone->values[j]));
+            if (!ok) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Loaded state differs from saved one!\n");
+                break;
+            }
+            /* Saved values are rounded: resume from the exact ones */
+            memcpy(loaded->values, clone->values,
+                   clone->size * sizeof(double));
+            s = loaded;
+        } else if (i == 3) PSResetStepState(s);
+        int step;
+        for (step = start[i]; step < times && ok; step++) {
+            if (!PSStep(network, s, x + (step * input_size))) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Step %d failed!\n", step);
+                ok = 0;
+                break;
+            }
+            if (i == 0 && step == 0) {
+                clone = PSCloneStepState(s);
+                ok = (clone != NULL && PSSaveStepState(clone, tmpfile));
+                if (!ok) {
+                    char * msg = malloc(255 * sizeof(char));
+                    test->error_message = msg;
+                    sprintf(msg, "Could not clone/save step state!\n");
+                    break;
+                }
+            }
+            for (j = 0; j < output->size; j++) {
+                double o = s->output[j], e = expected[step * output->size + j];
+                if (o != e) {
+                    char * msg = malloc(255 * sizeof(char));
+                    test->error_message = msg;
+                    sprintf(msg, "Run %d, step %d, output[%d]: %lf != %lf\n",
+                            i, step, j, o, e);
+                    ok = 0;
+                    break;
+                }
+            }
+        }
+    }
+    remove(tmpfile);
+    PSDeleteStepState(state);
+    PSDeleteStepState(clone);
+    PSDeleteStepState(loaded);
+    return ok;
+}
+
+/* Chunks must carry the states over: the last one ends up with the same
+ * outputs as the whole series. A chunk as long as the series changes
+ * nothing. */
+
+int testGenericBPTTChunks(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * x = rnn_inputs + 1;
+    int times = (int) rnn_inputs[0], chunk, i, j, ok = 1;
+    PSLayer * output = network->layers[network->size - 1];
+    double expected[times * output->size];
+    PSFeedforward(network, rnn_inputs);
+    for (i = 0; i < times; i++) {
+        for (j = 0; j < output->size; j++)
+            expected[i * output->size + j] =
+                GetRecurrentState(output->neurons[j], i);
+    }
+    PSGradient ** whole = backpropThroughTime(network, x, rnn_labels, times);
+    for (chunk = 1; chunk <= times && ok; chunk++) {
+        PSGradient ** gradients =
+            backpropThroughTimeChunked(network, x, rnn_labels, times, 0,
+                                       chunk);
+        if (whole == NULL || gradients == NULL) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Backprop with chunk %d failed!\n", chunk);
+            ok = 0;
+        }
+        int start = ((times - 1) / chunk) * chunk, first = (start > 0);
+        for (i = start; i < times && ok; i++) {
+            for (j = 0; j < output->size; j++) {
+                PSNeuron * neuron = output->neurons[j];
+                double o = GetRecurrentState(neuron, i - start + first);
+                double e = expected[i * output->size + j];
+                if (o != e) {
+                    char * msg = malloc(255 * sizeof(char));
+                    test->error_message = msg;
+                    sprintf(msg, "Chunk %d, step %d, output[%d]: "
+                            "%lf != %lf\n", chunk, i, j, o, e);
+                    ok = 0;
+                    break;
+                }
+            }
+        }
+        if (ok && chunk == times)
+            ok = compareGradients(network, whole, gradients, test);
+        if (gradients != NULL) PSDeleteGradients(gradients, network);
+    }
+    if (whole != NULL) PSDeleteGradients(whole, network);
+    return ok;
+}
+
+/* Recomputing segments from checkpoints must give exactly the gradients
+ * of the whole series, whatever the interval and truncation. */
+
+#define CHECKPOINT_TIMES 9
+
+int testGenericBPTTCheckpoints(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    int times = CHECKPOINT_TIMES, truncate, interval, i, ok = 1;
+    int truncates[2] = {0, 2};
+    double x[CHECKPOINT_TIMES], y[CHECKPOINT_TIMES];
+    for (i = 0; i < times; i++) {
+        x[i] = rnn_inputs[1 + (i % RNN_TIMES)];
+        y[i] = rnn_labels[i % RNN_TIMES];
+    }
+    for (truncate = 0; truncate < 2 && ok; truncate++) {
+        PSGradient ** whole =
+            backpropThroughTimeChunked(network, x, y, times,
+                                       truncates[truncate], 0);
+        for (interval = 0; interval <= 4 && ok; interval++) {
+            PSGradient ** gradients =
+                backpropThroughTimeCheckpointed(network, x, y, times,
+                                                truncates[truncate],
+                                                interval);
+            if (whole == NULL || gradients == NULL) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Backprop with interval %d failed!\n",
+                        interval);
+                ok = 0;
+            } else ok = compareGradients(network, whole, gradients, test);
+            if (gradients != NULL) PSDeleteGradients(gradients, network);
+        }
+        if (whole != NULL) PSDeleteGradients(whole, network);
+    }
+    return ok;
+}
+
+/* The loss must cover the whole series, not only the states the last chunk
+ * or checkpoint segment leaves behind. */
+
+int testGenericBPTTChunkLoss(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    int times = CHECKPOINT_TIMES, i, ok = 1;
+    double data[1 + (2 * CHECKPOINT_TIMES)];
+    double * series = data;
+    data[0] = times;
+    for (i = 0; i < times; i++) {
+        data[1 + i] = rnn_inputs[1 + (i % RNN_TIMES)];
+        data[1 + times + i] = rnn_labels[i % RNN_TIMES];
+    }
+    /* A null rate leaves the weights unchanged between the runs */
+    double expected = updateWeights(network, NULL, 1, 1, NULL, 0.0,
+                                    &series);
+    PSTrainingOptions opts = {.flags = 0};
+    for (i = 1; i <= 8 && ok; i++) {
+        opts.flags = (i > 4 ? TRAINING_CHECKPOINT : 0);
+        opts.bptt_chunk = (i > 4 ? 0 : i);
+        opts.checkpoint_interval = (i > 4 ? i - 4 : 0);
+        double loss = updateWeights(network, NULL, 1, 1, &opts, 0.0,
+                                    &series);
+        if (fabs(loss - expected) > 1e-9) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "%s %d loss: %lf != %lf\n",
+                    (i > 4 ? "Interval" : "Chunk"), (i > 4 ? i - 4 : i),
+                    loss, expected);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+/* Log probability of tokens following prefix, one PSStep at a time */
+
+static double sequenceScore(PSNeuralNetwork * network, int * prefix,
+                            int prefix_len, int * tokens, int len)
+{
+    PSStepState * state = PSCreateStepState(network);
+    double score = 0.0, x;
+    int i;
+    for (i = 0; i < prefix_len; i++) {
+        x = prefix[i];
+        PSStep(network, state, &x);
+    }
+    for (i = 0; i < len; i++) {
+        score += log(state->output[tokens[i]]);
+        x = tokens[i];
+        PSStep(network, state, &x);
+    }
+    PSDeleteStepState(state);
+    return score;
+}
+
+/* Greedy decoding must follow the argmax of PSStep, beam search as wide as
+ * every two tokens continuation must find the likeliest one, and sampling
+ * among the top token only is greedy. */
+
+#define DECODE_LEN  5
+
+static int checkDecode(PSNeuralNetwork * network, Test * test) {
+    int prefix[2] = {0, 1}, expected[DECODE_LEN], vocab = network->output_size;
+    int i, j, ok = 1;
+    if (test->error_message == NULL)
+        test->error_message = malloc(255 * sizeof(char));
+    char * msg = test->error_message;
+    PSStepState * state = PSCreateStepState(network);
+    double x;
+    for (i = 0; i < 2; i++) {
+        x = prefix[i];
+        PSStep(network, state, &x);
+    }
+    for (i = 0; i < DECODE_LEN; i++) {
+        expected[i] = 0;
+        for (j = 1; j < vocab; j++) {
+            if (state->output[j] > state->output[expected[i]])
+                expected[i] = j;
+        }
+        x = expected[i];
+        PSStep(network, state, &x);
+    }
+    PSDeleteStepState(state);
+    PSDecodeOptions options = {PSDecodeGreedy, 0, 0.0, 0, -1, 0};
+    PSDecodeResult * greedy = PSDecode(network, NULL, prefix, 2, DECODE_LEN,
+                                       &options);
+    options.mode = PSDecodeBeam;
+    options.beam_width = 1;
+    PSDecodeResult * narrow = PSDecode(network, NULL, prefix, 2, DECODE_LEN,
+                                       &options);
+    options.beam_width = vocab * vocab;
+    PSDecodeResult * wide = PSDecode(network, NULL, prefix, 2, 2, &options);
+    options.mode = PSDecodeSample;
+    options.top_k = 1;
+    options.seed = 7;
+    PSDecodeResult * sampled = PSDecode(network, NULL, prefix, 2, DECODE_LEN,
+                                        &options);
+    options.mode = PSDecodeGreedy;
+    options.end_token = expected[2];
+    PSDecodeResult * ended = PSDecode(network, NULL, prefix, 2, DECODE_LEN,
+                                      &options);
+    if (greedy == NULL || narrow == NULL || wide == NULL || sampled == NULL ||
+        ended == NULL) {
+        sprintf(msg, "Decoding failed!\n");
+        ok = 0;
+    }
+    for (i = 0; i < DECODE_LEN && ok; i++) {
+        if (greedy->tokens[0][i] != expected[i] ||
+            narrow->tokens[0][i] != expected[i] ||
+            sampled->tokens[0][i] != expected[i]) {
+            sprintf(msg, "Token %d: %d/%d/%d != %d\n", i,
+                    greedy->tokens[0][i], narrow->tokens[0][i],
+                    sampled->tokens[0][i], expected[i]);
+            ok = 0;
+        }
+    }
+    if (ok) {
+        double score = sequenceScore(network, prefix, 2, expected,
+                                     DECODE_LEN);
+        if (fabs(greedy->scores[0] - score) > 1e-9) {
+            sprintf(msg, "Greedy score %lf != %lf\n", greedy->scores[0],
+                    score);
+            ok = 0;
+        }
+    }
+    for (j = 0; expected[j] != expected[2]; j++);
+    if (ok && ended->lengths[0] != j) {
+        sprintf(msg, "End token did not end decoding (length %d != %d)\n",
+                ended->lengths[0], j);
+        ok = 0;
+    }
+    if (ok && wide->count != vocab * vocab) {
+        sprintf(msg, "Beam found %d hypotheses\n", wide->count);
+        ok = 0;
+    }
+    double best = -INFINITY;
+    for (i = 0; i < vocab * vocab && ok; i++) {
+        int tokens[2] = {i / vocab, i % vocab};
+        double score = sequenceScore(network, prefix, 2, tokens, 2);
+        if (score > best) best = score;
+        if (i > 0 && wide->scores[i] > wide->scores[i - 1]) {
+            sprintf(msg, "Beam hypotheses are not sorted\n");
+            ok = 0;
+        }
+    }
+    if (ok) {
+        double score = sequenceScore(network, prefix, 2, wide->tokens[0], 2);
+        if (fabs(wide->scores[0] - best) > 1e-9 ||
+            fabs(score - best) > 1e-9) {
+            sprintf(msg, "Beam score %lf (%lf) != %lf\n", wide->scores[0],
+                    score, best);
+            ok = 0;
+        }
+    }
+    PSDeleteDecodeResult(greedy);
+    PSDeleteDecodeResult(narrow);
+    PSDeleteDecodeResult(wide);
+    PSDeleteDecodeResult(sampled);
+    PSDeleteDecodeResult(ended);
+    return ok;
+}
+
+int testGenericDecode(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    return checkDecode(getNetwork(test_case), test);
+}
+
+/* Stacks of every layer type the decoder batches, with flat and
+ * hierarchical outputs */
+
+int testStackedDecode(void* tc, void* t) {
+    Test * test = (Test*) t;
+    PSLayerType types[4] = {Embedding, LSTM, GRU, FullyConnected};
+    int hierarchical, ok = 1;
+    for (hierarchical = 0; hierarchical < 2 && ok; hierarchical++) {
+        PSNeuralNetwork * network = createSeriesNetwork(types, 4);
+        if (network == NULL) {
+            test->error_message = malloc(255 * sizeof(char));
+            sprintf(test->error_message, "Could not create network\n");
+            return 0;
+        }
+        if (hierarchical)
+            network->layers[network->size - 1]->flags |= FLAG_HIERARCHICAL;
+        ok = checkDecode(network, test);
+        PSDeleteNetwork(network);
+    }
+    return ok;
+}
+
+/* Series of different lengths run as one batch must get the sum of the
+ * gradients they get one by one (up to the summation order). */
+
+int testGenericBatchSequences(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    int lengths[3] = {2, RNN_TIMES, 3}, count = 3, i, j, w, ok = 1;
+    double data[3][1 + (RNN_TIMES * 2)];
+    double * series[3];
+    PSGradient ** single[3];
+    for (i = 0; i < count; i++) {
+        int len = lengths[i];
+        data[i][0] = len;
+        memcpy(data[i] + 1, rnn_inputs + 1, len * sizeof(double));
+        memcpy(data[i] + 1 + len, rnn_labels, len * sizeof(double));
+        series[i] = data[i];
+        single[i] = backpropThroughTime(network, data[i] + 1,
+                                        data[i] + 1 + len, len);
+        if (single[i] == NULL) ok = 0;
+    }
+    PSGradient ** batched = backpropSequenceBatch(network, series, count, 0);
+    if (!ok || batched == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Backprop failed!\n");
+        ok = 0;
+    }
+    for (i = 1; i < network->size && ok; i++) {
+        PSLayer * layer = network->layers[i];
+        for (j = 0; j < layer->size && ok; j++) {
+            int ws = layer->neurons[j]->weights_size;
+            if (layer->type == LSTM) ws += 4;
+            for (w = -1; w < ws && ok; w++) {
+                double expected = 0.0, value;
+                int k;
+                for (k = 0; k < count; k++) {
+                    PSGradient * g = &(single[k][i - 1][j]);
+                    expected += (w < 0 ? g->bias : g->weights[w]);
+                }
+                PSGradient * g = &(batched[i - 1][j]);
+                value = (w < 0 ? g->bias : g->weights[w]);
+                if (fabs(value - expected) > 1e-9) {
+                    char * msg = malloc(255 * sizeof(char));
+                    test->error_message = msg;
+                    sprintf(msg, "Layer[%d]: gradient[%d][%d] %lf != %lf\n",
+                            i, j, w, value, expected);
+                    ok = 0;
+                }
+            }
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (single[i] != NULL) PSDeleteGradients(single[i], network);
+    }
+    if (batched != NULL) PSDeleteGradients(batched, network);
+    return ok;
+}
+
+/* Bucketed batches must keep every series and only group series whose
+ * lengths are close, padding less than the dataset order does. */
+
+int testRNNBucketSeries(void* tc, void* t) {
+    Test * test = (Test*) t;
+    int count = 34, batch_size = 4, i, j, ok = 1;
+    double lengths[34];
+    double * series[34];
+    double check = 0.0, sum = 0.0;
+    for (i = 0; i < count; i++) {
+        lengths[i] = 1 + ((i * 5) % 7);
+        series[i] = &(lengths[i]);
+        check += (i + 1) * lengths[i];
+    }
+    double before = seriesPaddingEfficiency(series, count, batch_size);
+    bucketSeries(series, count, batch_size, 2, 1);
+    double after = seriesPaddingEfficiency(series, count, batch_size);
+    for (i = 0; i < count; i++) sum += (series[i] - lengths + 1) * *series[i];
+    for (i = 0; i < count && ok; i += batch_size) {
+        double min = 99, max = 0;
+        for (j = i; j < i + batch_size && j < count - 2; j++) {
+            if (*series[j] < min) min = *series[j];
+            if (*series[j] > max) max = *series[j];
+        }
+        if (max - min > 2) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Batch %d lengths span %d..%d\n", i / batch_size,
+                    (int) min, (int) max);
+            ok = 0;
+        }
+    }
+    if (ok && (sum != check || after <= before)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Series lost or efficiency %lf <= %lf\n", after, before);
+        ok = 0;
+    }
+    bucketSeries(series, count, batch_size, 2, 0);
+    for (i = 1; i < count - 2 && ok; i++) {
+        if (*series[i] < *series[i - 1]) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Unshuffled series %d not sorted by length\n", i);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+/* With a single worker Hogwild must match plain training; with more of
+ * them it can only be checked for completing without errors. */
+
+int testGenericHogwild(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * data = getTestData(test_case);
+    int datalen = 8, batch_size = LSTM_BATCHES, ok = 1;
+    if (!(network->flags & FLAG_RECURRENT)) {
+        datalen = 64 * (network->input_size + network->output_size);
+        batch_size = 4;
+    }
+    PSTrainingOptions opts = {.flags = TRAINING_NO_SHUFFLE};
+    PSNeuralNetwork * serial = PSCloneNetwork(network, 0);
+    PSNeuralNetwork * hogwild = PSCloneNetwork(network, 0);
+    PSNeuralNetwork * async = PSCloneNetwork(network, 0);
+    if (serial == NULL || hogwild == NULL || async == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not clone network!\n");
+        ok = 0;
+    }
+    if (ok) {
+        PSTrain(serial, data, datalen, 2, 0.1, batch_size, &opts, NULL, 0);
+        opts.flags |= TRAINING_HOGWILD;
+        opts.threads = 1;
+        PSTrain(hogwild, data, datalen, 2, 0.1, batch_size, &opts, NULL, 0);
+        ok = compareNetworks(serial, hogwild, test);
+    }
+    if (ok) {
+        opts.threads = 4;
+        PSTrain(async, data, datalen, 2, 0.1, batch_size, &opts, NULL, 0);
+        ok = (async->status != STATUS_ERROR);
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Hogwild training with 4 threads failed!\n");
+        }
+    }
+    if (serial != NULL) PSDeleteNetwork(serial);
+    if (hogwild != NULL) PSDeleteNetwork(hogwild);
+    if (async != NULL) PSDeleteNetwork(async);
+    return ok;
+}
+
+/* A single local SGD worker averages only with itself, so it must match
+ * serial training whatever the number of local steps. */
+
+int testGenericLocalSGD(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * data = getTestData(test_case);
+    int datalen = 8, batch_size = LSTM_BATCHES, ok = 1;
+    if (!(network->flags & FLAG_RECURRENT)) {
+        datalen = 64 * (network->input_size + network->output_size);
+        batch_size = 4;
+    }
+    PSTrainingOptions opts = {.flags = TRAINING_NO_SHUFFLE};
+    PSNeuralNetwork * serial = PSCloneNetwork(network, 0);
+    PSNeuralNetwork * local = PSCloneNetwork(network, 0);
+    PSNeuralNetwork * averaged = PSCloneNetwork(network, 0);
+    if (serial == NULL || local == NULL || averaged == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not clone network!\n");
+        ok = 0;
+    }
+    if (ok) {
+        PSTrain(serial, data, datalen, 2, 0.1, batch_size, &opts, NULL, 0);
+        opts.flags |= TRAINING_LOCAL_SGD;
+        opts.threads = 1;
+        opts.local_steps = 3;
+        PSTrain(local, data, datalen, 2, 0.1, batch_size, &opts, NULL, 0);
+        ok = compareNetworks(serial, local, test);
+    }
+    if (ok) {
+        opts.threads = 4;
+        opts.local_warmup_epochs = 1;
+        PSTrain(averaged, data, datalen, 2, 0.1, batch_size, &opts, NULL, 0);
+        ok = (averaged->status != STATUS_ERROR);
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Local SGD training with 4 threads failed!\n");
+        }
+    }
+    if (serial != NULL) PSDeleteNetwork(serial);
+    if (local != NULL) PSDeleteNetwork(local);
+    if (averaged != NULL) PSDeleteNetwork(averaged);
+    return ok;
+}
+
+/* Hogwild and local SGD workers run the task graph on their own thread,
+ * never on the global pool: with one worker the result must match serial
+ * training, with four they must just complete. */
+
+int testTaskGraphWorkers(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * data = getTestData(test_case);
+    int datalen = 64 * (network->input_size + network->output_size);
+    int flags[2] = {TRAINING_HOGWILD, TRAINING_LOCAL_SGD}, ok = 1, i;
+    PSTrainingOptions opts = {.flags = TRAINING_NO_SHUFFLE};
+    PSNeuralNetwork * serial = PSCloneNetwork(network, 0);
+    if (serial == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not clone network!\n");
+        return 0;
+    }
+    PSTrain(serial, data, datalen, 2, 0.1, 4, &opts, NULL, 0);
+    if (!PSSetThreadCount(4)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create thread pool!\n");
+        ok = 0;
+    }
+    for (i = 0; i < 2 && ok; i++) {
+        PSNeuralNetwork * single = PSCloneNetwork(network, 0);
+        PSNeuralNetwork * workers = PSCloneNetwork(network, 0);
+        if (single == NULL || workers == NULL) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Could not clone network!\n");
+            ok = 0;
+        }
+        opts.flags = TRAINING_NO_SHUFFLE | TRAINING_TASK_GRAPH | flags[i];
+        opts.threads = 1;
+        if (ok) {
+            PSTrain(single, data, datalen, 2, 0.1, 4, &opts, NULL, 0);
+            ok = compareNetworks(serial, single, test);
+        }
+        opts.threads = 4;
+        if (ok) {
+            PSTrain(workers, data, datalen, 2, 0.1, 4, &opts, NULL, 0);
+            ok = (workers->status != STATUS_ERROR);
+            if (!ok) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "%s training with the task graph failed!\n",
+                        (i == 0 ? "Hogwild" : "Local SGD"));
+            }
+        }
+        if (single != NULL) PSDeleteNetwork(single);
+        if (workers != NULL) PSDeleteNetwork(workers);
+    }
+    PSSetThreadCount(1);
+    PSDeleteNetwork(serial);
+    return ok;
+}
+
+/* Two ranks (this process and a forked one) backprop different samples:
+ * after the allreduce both must hold the average of the two gradients.
+ * The forked rank also starts from altered weights, which the broadcast
+ * must replace with the ones of rank 0. */
+
+int testGenericAllreduce(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    double * x0 = getTestData(test_case);
+    double * y0 = x0 + network->input_size;
+    double * x1 = y0 + network->output_size;
+    double * y1 = x1 + network->input_size;
+    int i, j, w, ok = 1;
+    char name[64];
+    sprintf(name, "/psyc-tests-%d", (int) getpid());
+    PSGradient ** expected = backprop(network, x0, y0);
+    PSGradient ** other = backprop(network, x1, y1);
+    for (i = 1; i < network->size; i++) {
+        PSLayer * layer = network->layers[i];
+        for (j = 0; j < layer->size; j++) {
+            PSGradient * g = &(expected[i - 1][j]);
+            PSGradient * o = &(other[i - 1][j]);
+            g->bias = (g->bias + o->bias) / 2.0;
+            for (w = 0; w < layer->neurons[j]->weights_size; w++)
+                g->weights[w] = (g->weights[w] + o->weights[w]) / 2.0;
+        }
+    }
+    PSDeleteGradients(other, network);
+    double weight = network->layers[1]->neurons[0]->weights[0];
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        network->layers[1]->neurons[0]->weights[0] = 42.0;
+        PSGradient ** gradients = backprop(network, x1, y1);
+        PSProcessGroup * group = PSJoinProcessGroup(name, 1, 2, network);
+        ok = (group != NULL && PSBroadcastWeights(group, network) &&
+              network->layers[1]->neurons[0]->weights[0] == weight &&
+              PSAllreduceGradients(group, network, gradients) &&
+              compareGradients(network, gradients, expected, test));
+        _exit(ok ? 0 : 1);
+    }
+    PSGradient ** gradients = backprop(network, x0, y0);
+    PSProcessGroup * group = PSJoinProcessGroup(name, 0, 2, network);
+    ok = (group != NULL && PSBroadcastWeights(group, network) &&
+          PSAllreduceGradients(group, network, gradients));
+    if (ok) ok = compareGradients(network, gradients, expected, test);
+    else {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Rank 0 allreduce failed!\n");
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (ok && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Rank 1 failed!\n");
+        ok = 0;
+    }
+    PSLeaveProcessGroup(group);
+    PSDeleteGradients(gradients, network);
+    PSDeleteGradients(expected, network);
+    return ok;
+}
+
+/* A rank 0 that dies without leaving the group leaves a ready segment
+ * behind: a rank joining before the next rank 0 must not attach to it. */
+
+int testStaleGroup(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    int ok = 1, status = 0;
+    char name[64];
+    sprintf(name, "/psyc-tests-stale-%d", (int) getpid());
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        PSProcessGroup * group = PSJoinProcessGroup(name, 0, 2, network);
+        _exit(group != NULL ? 0 : 1);
+    }
+    waitpid(pid, &status, 0);
+    pid = fork();
+    if (pid == 0) {
+        PSProcessGroup * group = PSJoinProcessGroup(name, 1, 2, network);
+        _exit(group != NULL && PSBroadcastWeights(group, network) ? 0 : 1);
+    }
+    /* Give rank 1 the time to find the stale segment */
+    usleep(200000);
+    PSProcessGroup * group = PSJoinProcessGroup(name, 0, 2, network);
+    ok = (group != NULL && PSBroadcastWeights(group, network));
+    waitpid(pid, &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Rank %d could not join the new group!\n", (ok ? 1 : 0));
+        ok = 0;
+    }
+    PSLeaveProcessGroup(group);
+    return ok;
+}
+
+int testGenericSave(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    PSNeuralNetwork * network = getNetwork(test_case);
+    char tmpfile[255];
+    getTmpFileName("tests-save-nn", ".data", tmpfile);
+    int ok = PSSaveNetwork(network, tmpfile);
+    if (!ok) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not save network!\n");
+        return 0;
+    }
+    PSNeuralNetwork * clone = PSCreateNetwork("Clone Test Network");
+    if (clone == NULL) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not create network clone!\n");
+        return 0;
+    }
+    ok = PSLoadNetwork(clone, tmpfile);
+    if (!ok) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Could not load network!\n");
+        return 0;
+    }
+    
+    ok = compareNetworks(network, clone, test);
+    
+    remove(tmpfile);
+    PSDeleteNetwork(clone);
+    return ok;
+}
+
+int compareNetworks(PSNeuralNetwork * network, PSNeuralNetwork * clone,
+                    Test* test)
+{
+    int ok = 1, i, k, w;
+    
+    ok = network->size == clone->size;
+    if (!ok) {
+        char * msg = malloc(255 * sizeof(char));
+        test->error_message = msg;
+        sprintf(msg, "Source size %d != Clone size %d\n",
+                network->size, clone->size);
+        return 0;
+    }
+    
+    for (i = 0; i < network->size; i++) {
+        PSLayer * orig_l = network->layers[i];
+        PSLayer * clone_l = clone->layers[i];
+        PSLayerType otype = orig_l->type;
+        PSLayerType ctype = clone_l->type;
+        ok = (otype == ctype);
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Layer[%d]: Source type %s != Clone type %s\n", i,
+                    PSGetLayerTypeLabel(orig_l),
+                    PSGetLayerTypeLabel(clone_l));
+            break;
+        }
+        int o_size = orig_l->size;
+        int c_size = clone_l->size;
+        ok = (o_size == c_size);
+        if (!ok) {
+            char * msg = malloc(255 * sizeof(char));
+            test->error_message = msg;
+            sprintf(msg, "Layer[%d]: Source size %d != Clone size %d\n",
+                    i, o_size, c_size);
+            break;
         }
         if (i == 0) continue;
         if (otype == Pooling) continue;
+        if (otype == Embedding) {
+            PSEmbeddingTable * otable = GetEmbeddingTable(orig_l);
+            PSEmbeddingTable * ctable = GetEmbeddingTable(clone_l);
+            ok = (otable->rows == ctable->rows);
+            for (w = 0; ok && w < otable->rows * otable->size; w++) {
+                ok = (getRoundedDouble(otable->table[w]) ==
+                      getRoundedDouble(ctable->table[w]));
+            }
+            if (!ok) {
+                char * msg = malloc(255 * sizeof(char));
+                test->error_message = msg;
+                sprintf(msg, "Layer[%d]: embedding tables differ\n", i);
+                break;
+            }
+            continue;
+        }
         int conv_features_checked = 0;
         for (k = 0; k < o_size; k++) {
             PSNeuron * orig_n = orig_l->neurons[k];
@@ -1169,10 +3631,26 @@ int compareNetworks(PSNeuralNetwork * network, PSNeuralNetwork * clone,
                             i, fidx, obias, cbias);
                     break;
                 }
-            } else if (otype != Recurrent && otype != LSTM) {
+            } else if (otype != Recurrent && otype != LSTM && otype != GRU) {
                 double obias = getRoundedDouble(orig_n->bias);
                 double cbias = getRoundedDouble(clone_n->bias);
                 ok = (obias == cbias);
+            } else if (otype == GRU) {
+                PSGRUCell * ocell = GetGRUCell(orig_n);
+                PSGRUCell * ccell = GetGRUCell(clone_n);
+                ok = (getRoundedDouble(ocell->candidate_bias) ==
+                      getRoundedDouble(ccell->candidate_bias) &&
+                      getRoundedDouble(ocell->reset_bias) ==
+                      getRoundedDouble(ccell->reset_bias) &&
+                      getRoundedDouble(ocell->update_bias) ==
+                      getRoundedDouble(ccell->update_bias));
+                if (!ok) {
+                    char * msg = malloc(255 * sizeof(char));
+                    test->error_message = msg;
+                    sprintf(msg, "Layer[%d][%d]: GRU gate biases differ\n",
+                            i, k);
+                    break;
+                }
             } else if (otype == LSTM) {
                 PSLSTMCell * ocell =  GetLSTMCell(orig_n);
                 PSLSTMCell * ccell =  GetLSTMCell(clone_n);
@@ -1447,4 +3925,73 @@ int testAVXMultiplyVal(void* tc, void* t) {
     return ok;
 }
 
+int testAVXAligned(void* tc, void* t) {
+    TestCase * test_case = (TestCase*) tc;
+    Test * test = (Test*) t;
+    int ok = 1, i, size = 19, padded = PSPaddedSize(size);
+    double * x = PSAlignedAlloc(size);
+    double * y = PSAlignedAlloc(size);
+    double * dest = PSAlignedAlloc(size);
+    char * msg = malloc(255 * sizeof(char));
+    if (x == NULL || y == NULL || dest == NULL) {
+        sprintf(msg, "Could not allocate aligned memory!\n");
+        ok = 0;
+    } else if (!AVXIsAligned(x) || !AVXIsAligned(y) || !AVXIsAligned(dest)) {
+        sprintf(msg, "Memory is not aligned!\n");
+        ok = 0;
+    }
+    for (i = size; i < padded && ok; i++) {
+        if (x[i] != 0.0) {
+            sprintf(msg, "Padding is not zeroed!\n");
+            ok = 0;
+        }
+    }
+    for (i = 0; i < size && ok; i++) {
+        x[i] = (double) (i % 4);
+        y[i] = 0.5 * (double) (i % 3);
+    }
+    
+    double avx_res = 0.0, cmp_res = 0.0;
+    if (ok) {
+        i = 0;
+        AVXDotProduct(padded, x, y, avx_res, i, 0, 0);
+        cmp_res = test_dot(x, y, size);
+        ok = (i == padded && avx_res == cmp_res);
+        if (!ok) sprintf(msg, "Dot: Expected %lf != %lf\n", cmp_res, avx_res);
+    }
+    
+    if (ok) {
+        avx_res = avx_dot_product4_aligned(x, y) +
+                  avx_dot_product2_aligned(x + 4, y + 4);
+        cmp_res = test_dot(x, y, 6);
+        ok = avx_res == cmp_res;
+        if (!ok) {
+            sprintf(msg, "Dot[4,2]: Expected %lf != %lf\n", cmp_res,
+                    avx_res);
+        }
+    }
+    
+    if (ok) {
+        i = 0;
+        AVXMultiplyValue(padded, x, 2.0, dest, i, 0, 0, AVX_STORE_MODE_NORM);
+        i = 0;
+        AVXSum(padded, dest, y, dest, i, 0);
+    }
+    for (i = 0; i < padded && ok; i++) {
+        double expected = (x[i] * 2.0) + y[i];
+        ok = dest[i] == expected;
+        if (!ok) {
+            sprintf(msg, "Multiply/Sum[%d]: Expected %lf != %lf\n",
+                    i, expected, dest[i]);
+        }
+    }
+    
+    PSAlignedFree(x);
+    PSAlignedFree(y);
+    PSAlignedFree(dest);
+    if (!ok) test->error_message = msg;
+    else free(msg);
+    return ok;
+}
+
 #endif
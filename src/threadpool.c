@@ -0,0 +1,373 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "psyc.h"
+#include "threadpool.h"
+#include "affinity.h"
+#include "utils.h"
+
+/* Chunks handed out per thread: more than one so that uneven neurons
+ * (ie. LSTM cells vs. plain ones) still balance. */
+#define CHUNKS_PER_THREAD 4
+
+PSThreadPool * PSGlobalThreadPool = NULL;
+int PSParallelThreshold = PS_DEFAULT_PARALLEL_THRESHOLD;
+__thread int PSSerialThread = 0;
+
+typedef struct {
+    PSThreadPool * pool;
+    int index;
+} PSWorkerInfo;
+
+static void runChunks(PSThreadPool * pool) {
+    int count = pool->count, chunk = pool->chunk;
+    while (1) {
+        int start = __sync_fetch_and_add(&(pool->next), chunk);
+        if (start >= count) break;
+        int end = start + chunk;
+        if (end > count) end = count;
+        pool->task(pool->data, start, end);
+    }
+}
+
+static void * workerLoop(void * arg) {
+    PSWorkerInfo * info = (PSWorkerInfo *) arg;
+    PSThreadPool * pool = info->pool;
+    /* The calling thread takes CPU 0, workers the following ones */
+    if (PSGlobalFlags & FLAG_THREAD_AFFINITY) PSPinThread(info->index + 1);
+    free(info);
+    unsigned long seen = 0;
+    pthread_mutex_lock(&(pool->lock));
+    while (1) {
+        while (pool->generation == seen && !pool->shutdown)
+            pthread_cond_wait(&(pool->work_cond), &(pool->lock));
+        if (pool->shutdown) break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&(pool->lock));
+        runChunks(pool);
+        pthread_mutex_lock(&(pool->lock));
+        if (--(pool->running) == 0)
+            pthread_cond_signal(&(pool->done_cond));
+    }
+    pthread_mutex_unlock(&(pool->lock));
+    return NULL;
+}
+
+PSThreadPool * PSCreateThreadPool(int size) {
+    char * func = "PSCreateThreadPool";
+    if (size < 1) {
+        PSErr(func, "Thread pool size must be >= 1 (found %d)", size);
+        return NULL;
+    }
+    PSThreadPool * pool = malloc(sizeof(PSThreadPool));
+    if (pool == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    pool->threads = malloc(size * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        printMemoryErrorMsg();
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&(pool->lock), NULL);
+    pthread_cond_init(&(pool->work_cond), NULL);
+    pthread_cond_init(&(pool->done_cond), NULL);
+    pool->size = 0;
+    pool->generation = 0;
+    pool->shutdown = 0;
+    pool->running = 0;
+    pool->task = NULL;
+    pool->data = NULL;
+    pool->count = 0;
+    pool->chunk = 1;
+    pool->next = 0;
+    int i;
+    for (i = 0; i < size; i++) {
+        PSWorkerInfo * info = malloc(sizeof(PSWorkerInfo));
+        if (info == NULL) {
+            printMemoryErrorMsg();
+            PSDeleteThreadPool(pool);
+            return NULL;
+        }
+        info->pool = pool;
+        info->index = i;
+        if (pthread_create(&(pool->threads[i]), NULL, workerLoop, info)) {
+            PSErr(func, "Could not create thread %d!", i);
+            free(info);
+            PSDeleteThreadPool(pool);
+            return NULL;
+        }
+        pool->size++;
+    }
+    return pool;
+}
+
+void PSDeleteThreadPool(PSThreadPool * pool) {
+    if (pool == NULL) return;
+    int i;
+    pthread_mutex_lock(&(pool->lock));
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&(pool->work_cond));
+    pthread_mutex_unlock(&(pool->lock));
+    for (i = 0; i < pool->size; i++) pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&(pool->lock));
+    pthread_cond_destroy(&(pool->work_cond));
+    pthread_cond_destroy(&(pool->done_cond));
+    free(pool->threads);
+    free(pool);
+}
+
+/* Split [0, count) into chunks run by the workers and by the calling
+ * thread, returning once every chunk is done (a barrier). */
+
+void PSParallelFor(PSThreadPool * pool, int count, PSParallelTask task,
+                   void * data)
+{
+    if (count <= 0) return;
+    if (pool == NULL || pool->size == 0 || count == 1) {
+        task(data, 0, count);
+        return;
+    }
+    int threads = pool->size + 1;
+    int chunk = count / (threads * CHUNKS_PER_THREAD);
+    if (chunk < 1) chunk = 1;
+    pthread_mutex_lock(&(pool->lock));
+    pool->task = task;
+    pool->data = data;
+    pool->count = count;
+    pool->chunk = chunk;
+    pool->next = 0;
+    pool->running = pool->size;
+    pool->generation++;
+    pthread_cond_broadcast(&(pool->work_cond));
+    pthread_mutex_unlock(&(pool->lock));
+    runChunks(pool);
+    pthread_mutex_lock(&(pool->lock));
+    while (pool->running > 0)
+        pthread_cond_wait(&(pool->done_cond), &(pool->lock));
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+/* Task Graph */
+
+PSTaskGraph * PSCreateTaskGraph(int capacity) {
+    if (capacity < 1) capacity = 1;
+    PSTaskGraph * graph = malloc(sizeof(PSTaskGraph));
+    if (graph == NULL) {
+        printMemoryErrorMsg();
+        return NULL;
+    }
+    graph->tasks = malloc(capacity * sizeof(PSTaskNode));
+    graph->ready = malloc(capacity * sizeof(int));
+    if (graph->tasks == NULL || graph->ready == NULL) {
+        printMemoryErrorMsg();
+        free(graph->tasks);
+        free(graph->ready);
+        free(graph);
+        return NULL;
+    }
+    graph->size = 0;
+    graph->capacity = capacity;
+    graph->ready_head = 0;
+    graph->ready_tail = 0;
+    graph->completed = 0;
+    pthread_mutex_init(&(graph->lock), NULL);
+    pthread_cond_init(&(graph->ready_cond), NULL);
+    return graph;
+}
+
+void PSDeleteTaskGraph(PSTaskGraph * graph) {
+    if (graph == NULL) return;
+    int i;
+    for (i = 0; i < graph->size; i++) free(graph->tasks[i].dependents);
+    pthread_mutex_destroy(&(graph->lock));
+    pthread_cond_destroy(&(graph->ready_cond));
+    free(graph->tasks);
+    free(graph->ready);
+    free(graph);
+}
+
+/* Returns the new task id, or -1 on failure. */
+
+int PSAddTask(PSTaskGraph * graph, PSGraphTask run, void * data, int arg) {
+    if (graph == NULL || run == NULL) return -1;
+    if (graph->size == graph->capacity) {
+        int capacity = graph->capacity * 2;
+        PSTaskNode * tasks = realloc(graph->tasks,
+                                     capacity * sizeof(PSTaskNode));
+        if (tasks == NULL) {
+            printMemoryErrorMsg();
+            return -1;
+        }
+        graph->tasks = tasks;
+        int * ready = realloc(graph->ready, capacity * sizeof(int));
+        if (ready == NULL) {
+            printMemoryErrorMsg();
+            return -1;
+        }
+        graph->ready = ready;
+        graph->capacity = capacity;
+    }
+    int id = graph->size++;
+    PSTaskNode * node = &(graph->tasks[id]);
+    memset(node, 0, sizeof(PSTaskNode));
+    node->run = run;
+    node->data = data;
+    node->arg = arg;
+    return id;
+}
+
+/* Make task wait for dependency: tasks can only depend on tasks added
+ * before them, which keeps the graph acyclic. */
+
+int PSAddTaskDependency(PSTaskGraph * graph, int task, int dependency) {
+    char * func = "PSAddTaskDependency";
+    if (graph == NULL) return 0;
+    if (task < 0 || task >= graph->size || dependency < 0 ||
+        dependency >= task) {
+        PSErr(func, "Invalid dependency %d -> %d", task, dependency);
+        return 0;
+    }
+    PSTaskNode * dep = &(graph->tasks[dependency]);
+    int * dependents = realloc(dep->dependents,
+                               (dep->dependents_count + 1) * sizeof(int));
+    if (dependents == NULL) {
+        printMemoryErrorMsg();
+        return 0;
+    }
+    dependents[dep->dependents_count++] = task;
+    dep->dependents = dependents;
+    graph->tasks[task].dependencies++;
+    return 1;
+}
+
+/* Every thread of the pool runs this once, whatever its range: it keeps
+ * picking ready tasks until the whole graph is done. */
+
+static void runGraphTasks(void * data, int start, int end) {
+    PSTaskGraph * graph = (PSTaskGraph *) data;
+    int i;
+    (void) start;
+    (void) end;
+    pthread_mutex_lock(&(graph->lock));
+    while (1) {
+        while (graph->ready_head == graph->ready_tail &&
+               graph->completed < graph->size)
+            pthread_cond_wait(&(graph->ready_cond), &(graph->lock));
+        if (graph->completed == graph->size) break;
+        PSTaskNode * node = &(graph->tasks[graph->ready[graph->ready_head++]]);
+        pthread_mutex_unlock(&(graph->lock));
+        node->run(node->data, node->arg);
+        pthread_mutex_lock(&(graph->lock));
+        int released = 0;
+        for (i = 0; i < node->dependents_count; i++) {
+            PSTaskNode * dependent = &(graph->tasks[node->dependents[i]]);
+            if (--(dependent->pending) == 0) {
+                graph->ready[graph->ready_tail++] = node->dependents[i];
+                released++;
+            }
+        }
+        graph->completed++;
+        if (released > 1 || graph->completed == graph->size)
+            pthread_cond_broadcast(&(graph->ready_cond));
+        else if (released)
+            pthread_cond_signal(&(graph->ready_cond));
+    }
+    pthread_mutex_unlock(&(graph->lock));
+}
+
+/* Run every task of the graph on the pool threads and on the calling one,
+ * returning when all of them are done. Independent tasks (ie. a layer's
+ * gradients and the deltas of the layer below it) run concurrently. */
+
+void PSRunTaskGraph(PSThreadPool * pool, PSTaskGraph * graph) {
+    if (graph == NULL || graph->size == 0) return;
+    int i;
+    graph->ready_head = 0;
+    graph->ready_tail = 0;
+    graph->completed = 0;
+    for (i = 0; i < graph->size; i++) {
+        PSTaskNode * node = &(graph->tasks[i]);
+        node->pending = node->dependencies;
+        if (node->pending == 0) graph->ready[graph->ready_tail++] = i;
+    }
+    int threads = (pool != NULL ? pool->size + 1 : 1);
+    PSParallelFor(pool, threads, runGraphTasks, graph);
+}
+
+/* Wavefront */
+
+typedef struct {
+    PSWavefrontTask task;
+    void * data;
+    int diagonal;
+    int first_row;
+} PSWavefront;
+
+static void runWavefrontCells(void * data, int start, int end) {
+    PSWavefront * wavefront = (PSWavefront *) data;
+    /* Cells replace intra-layer parallelism */
+    int serial = PSSerialThread, i;
+    PSSerialThread = 1;
+    for (i = start; i < end; i++) {
+        int row = wavefront->first_row + i;
+        wavefront->task(wavefront->data, row, wavefront->diagonal - row);
+    }
+    PSSerialThread = serial;
+}
+
+/* Run task over a rows x cols grid where cell (r, c) depends on (r - 1, c)
+ * and (r, c - 1): cells on the same anti-diagonal are independent, so
+ * each diagonal runs in parallel, one after the other. Cells run with
+ * PSSerialThread set, so layers never split their work across the pool. */
+
+void PSParallelWavefront(PSThreadPool * pool, int rows, int cols,
+                         PSWavefrontTask task, void * data)
+{
+    PSWavefront wavefront = {task, data, 0, 0};
+    int d;
+    for (d = 0; d < rows + cols - 1; d++) {
+        int first = (d >= cols ? d - cols + 1 : 0);
+        int last = (d < rows ? d : rows - 1);
+        wavefront.diagonal = d;
+        wavefront.first_row = first;
+        PSParallelFor(pool, last - first + 1, runWavefrontCells, &wavefront);
+    }
+}
+
+/* Global pool: count is the total number of threads, the caller included,
+ * so 1 (or less) disables intra-layer parallelism. */
+
+int PSSetThreadCount(int count) {
+    if (PSGlobalThreadPool != NULL) {
+        PSDeleteThreadPool(PSGlobalThreadPool);
+        PSGlobalThreadPool = NULL;
+    }
+    if (count <= 1) return 1;
+    PSGlobalThreadPool = PSCreateThreadPool(count - 1);
+    return (PSGlobalThreadPool != NULL);
+}
+
+int PSGetThreadCount() {
+    if (PSGlobalThreadPool == NULL) return 1;
+    return PSGlobalThreadPool->size + 1;
+}
@@ -0,0 +1,100 @@
+/*
+ Copyright (c) 2016 Fabio Nicotra.
+ All rights reserved.
+
+ Redistribution and use in source and binary forms are permitted
+ provided that the above copyright notice and this paragraph are
+ duplicated in all such forms and that any documentation,
+ advertising materials, and other materials related to such
+ distribution and use acknowledge that the software was developed
+ by the copyright holder. The name of the
+ copyright holder may not be used to endorse or promote products derived
+ from this software without specific prior written permission.
+ THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef __PS_THREADPOOL_H
+#define __PS_THREADPOOL_H
+
+#include <pthread.h>
+
+/* Minimum number of multiply-adds a layer loop must perform before it is
+ * split across the pool: below it, waking the workers costs more than it
+ * saves. */
+#define PS_DEFAULT_PARALLEL_THRESHOLD   50000
+
+#define PSShouldRunParallel(work) (PSGlobalThreadPool != NULL && \
+    !PSSerialThread && (work) >= PSParallelThreshold)
+
+typedef void (*PSParallelTask) (void * data, int start, int end);
+typedef void (*PSGraphTask) (void * data, int arg);
+typedef void (*PSWavefrontTask) (void * data, int row, int col);
+
+typedef struct {
+    int size;
+    pthread_t * threads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    unsigned long generation;
+    int shutdown;
+    int running;
+    PSParallelTask task;
+    void * data;
+    int count;
+    int chunk;
+    int next;
+} PSThreadPool;
+
+/* Task graph: each task runs once every task it depends on is done.
+ * Pending counts are reset on every run, so a graph can be built once and
+ * executed many times. */
+
+typedef struct {
+    PSGraphTask run;
+    void * data;
+    int arg;
+    int dependencies;
+    int pending;
+    int * dependents;
+    int dependents_count;
+} PSTaskNode;
+
+typedef struct {
+    int size;
+    int capacity;
+    PSTaskNode * tasks;
+    int * ready;
+    int ready_head;
+    int ready_tail;
+    int completed;
+    pthread_mutex_t lock;
+    pthread_cond_t ready_cond;
+} PSTaskGraph;
+
+extern PSThreadPool * PSGlobalThreadPool;
+extern int PSParallelThreshold;
+/* Set by threads that run layers concurrently with the global pool's
+ * owner (e.g. inference workers): they never split work across it. */
+extern __thread int PSSerialThread;
+
+PSThreadPool * PSCreateThreadPool(int size);
+void PSDeleteThreadPool(PSThreadPool * pool);
+void PSParallelFor(PSThreadPool * pool, int count, PSParallelTask task,
+                   void * data);
+
+PSTaskGraph * PSCreateTaskGraph(int capacity);
+int PSAddTask(PSTaskGraph * graph, PSGraphTask run, void * data, int arg);
+int PSAddTaskDependency(PSTaskGraph * graph, int task, int dependency);
+void PSRunTaskGraph(PSThreadPool * pool, PSTaskGraph * graph);
+void PSDeleteTaskGraph(PSTaskGraph * graph);
+
+void PSParallelWavefront(PSThreadPool * pool, int rows, int cols,
+                         PSWavefrontTask task, void * data);
+
+int PSSetThreadCount(int count);
+int PSGetThreadCount();
+
+#endif //__PS_THREADPOOL_H
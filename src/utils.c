@@ -18,10 +18,14 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include "psyc.h"
 #include "utils.h"
+#ifdef USE_AVX
+#include "avx.h"
+#endif
 
 static unsigned char randomSeeded = 0;
 
@@ -42,6 +46,21 @@ void PSErr(const char* tag, char* fmt, ...) {
     if (PSGlobalFlags & FLAG_LOG_COLORS) fprintf(stderr, WHITE);
 }
 
+/* Memory Functions */
+
+double * PSAlignedAlloc(int count) {
+    void * ptr = NULL;
+    size_t size = PSPaddedSize(count) * sizeof(double);
+    if (size == 0) size = PS_PADDING_SIZE * sizeof(double);
+    if (posix_memalign(&ptr, PS_MEMORY_ALIGNMENT, size) != 0) return NULL;
+    memset(ptr, 0, size);
+    return (double *) ptr;
+}
+
+void PSAlignedFree(double * ptr) {
+    free(ptr);
+}
+
 /* Activation Functions */
 
 double sigmoid(double val) {
@@ -65,6 +84,82 @@ double tanh_derivative(double val) {
     return (1 - (val * val));
 }
 
+/* Vector Functions */
+
+double PSDotProduct(double * x, double * y, int size) {
+    double sum = 0.0;
+    int i = 0;
+#ifdef USE_AVX
+    AVXDotProduct(size, x, y, sum, i, 0, 0);
+#endif
+    for (; i < size; i++) sum += (x[i] * y[i]);
+    return sum;
+}
+
+/* dest += value * x */
+
+void PSAddScaled(double * dest, double * x, double value, int size) {
+    int i = 0;
+#ifdef USE_AVX
+    AVXMultiplyValue(size, x, value, dest, i, 0, 0, AVX_STORE_MODE_ADD);
+#endif
+    for (; i < size; i++) dest[i] += (value * x[i]);
+}
+
+/* Matrix product of the rows x vectors by the cols w ones (size values
+ * each): dest[(r * stride) + c] = x[r] . w[c]. Products are computed in
+ * 4 x 4 blocks, so every vector load serves 4 of them; blocks walk down
+ * the rows first, keeping the 4 w vectors in cache. */
+
+void PSMatrixProduct(double ** x, int rows, double ** w, int cols, int size,
+                     double * dest, int stride)
+{
+    int r, c, i, j;
+    for (c = 0; c < cols; c += 4) {
+        int nc = (cols - c < 4 ? cols - c : 4);
+        for (r = 0; r < rows; r += 4) {
+            int nr = (rows - r < 4 ? rows - r : 4);
+            double block[16];
+            if (nr == 4 && nc == 4) {
+#ifdef USE_AVX
+                avx_dot_product4x4(x + r, w + c, size, block);
+#else
+                int k;
+                memset(block, 0, sizeof(block));
+                for (k = 0; k < size; k++) {
+                    double w0 = w[c][k], w1 = w[c + 1][k];
+                    double w2 = w[c + 2][k], w3 = w[c + 3][k];
+                    for (i = 0; i < 4; i++) {
+                        double xk = x[r + i][k];
+                        block[i * 4] += xk * w0;
+                        block[i * 4 + 1] += xk * w1;
+                        block[i * 4 + 2] += xk * w2;
+                        block[i * 4 + 3] += xk * w3;
+                    }
+                }
+#endif
+            } else {
+                for (i = 0; i < nr; i++) {
+#ifdef USE_AVX
+                    if (nc == 4) {
+                        avx_dot_product1x4(x[r + i], w + c, size,
+                                           block + (i * 4));
+                        continue;
+                    }
+#endif
+                    for (j = 0; j < nc; j++)
+                        block[i * 4 + j] = PSDotProduct(x[r + i], w[c + j],
+                                                        size);
+                }
+            }
+            for (i = 0; i < nr; i++) {
+                for (j = 0; j < nc; j++)
+                    dest[((r + i) * stride) + c + j] = block[i * 4 + j];
+            }
+        }
+    }
+}
+
 /* Network Functions */
 
 void PSAbortLayer(PSNeuralNetwork * network, PSLayer * layer) {
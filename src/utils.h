@@ -28,11 +28,26 @@
 #define getLayerNetwork(layer) ((PSNeuralNetwork*) layer->network)
 #define shouldApplyDerivative(network) (network->loss != PSCrossEntropyLoss)
 
+/* Memory alignment and padding.
+ * Weights, activation caches, gradients and deltas are allocated aligned to
+ * a cache line and padded to the widest AVX step (16 doubles), with the
+ * padding zeroed, so that vector kernels can use aligned loads and can run
+ * over the padded size without a scalar tail loop. */
+
+#define PS_MEMORY_ALIGNMENT 64
+#define PS_PADDING_SIZE     16
+#define PSPaddedSize(n) ((((n) + PS_PADDING_SIZE - 1) / PS_PADDING_SIZE) * \
+    PS_PADDING_SIZE)
+
 #ifdef USE_AVX
 
 #define AVXDotProduct(size, x, y, res, i, is_recurrent, t) do { \
     int avx_step_len = AVXGetDotStepLen(size); \
-    avx_dot_product dot_product = AVXGetDotProductFunc(size); \
+    double * avx_x = x + i; \
+    if (is_recurrent) avx_x += (t * size); \
+    avx_dot_product dot_product = \
+        (AVXIsAligned(avx_x) && AVXIsAligned(y + i) ? \
+         AVXGetAlignedDotProductFunc(size) : AVXGetDotProductFunc(size)); \
     int avx_steps = size / avx_step_len, avx_step; \
     for (avx_step = 0; avx_step < avx_steps; avx_step++) { \
         double * x_vector = x + i; \
@@ -46,7 +61,10 @@
 
 #define AVXDotSquare(size, x, res, i, is_recurrent, t) do {\
     int avx_step_len = AVXGetDotStepLen(size); \
-    avx_dot_product dot_product = AVXGetDotProductFunc(size); \
+    double * avx_x = x + i; \
+    if (is_recurrent) avx_x += (t * size); \
+    avx_dot_product dot_product = (AVXIsAligned(avx_x) ? \
+        AVXGetAlignedDotProductFunc(size) : AVXGetDotProductFunc(size)); \
     int avx_steps = size / avx_step_len, avx_step; \
     for (avx_step = 0; avx_step < avx_steps; avx_step++) { \
         double * x_vector = x + i; \
@@ -59,7 +77,11 @@
 #define AVXMultiplyValue(size, x, val, dest, i, is_recurrent, t, mode) do { \
     int avx_step_len = AVXGetStepLen(size); \
     int avx_steps = size / avx_step_len, avx_step; \
-    avx_multiply_value multiply_val = AVXGetMultiplyValFunc(size); \
+    double * avx_x = x + i; \
+    if (is_recurrent) avx_x += (t * size); \
+    avx_multiply_value multiply_val = \
+        (AVXIsAligned(avx_x) && AVXIsAligned(dest + i) ? \
+         AVXGetAlignedMultiplyValFunc(size) : AVXGetMultiplyValFunc(size)); \
     for (avx_step = 0; avx_step < avx_steps; avx_step++) { \
         double * x_vector = x + i; \
         if (is_recurrent) x_vector += (t * size); \
@@ -71,7 +93,11 @@
 #define AVXMultiplyValues(size, x1, v1, x2, v2, d, i, is_rec, t, m1, m2) do {\
     int avx_step_len = AVXGetStepLen(size); \
     int avx_steps = size / avx_step_len, avx_step; \
-    avx_multiply_value multiply_val = AVXGetMultiplyValFunc(size); \
+    int avx_offs = (is_rec ? (t * size) : 0); \
+    avx_multiply_value multiply_val = \
+        (AVXIsAligned(x1 + i + avx_offs) && AVXIsAligned(x2 + i + avx_offs) \
+         && AVXIsAligned(d + i) ? \
+         AVXGetAlignedMultiplyValFunc(size) : AVXGetMultiplyValFunc(size)); \
     for (avx_step = 0; avx_step < avx_steps; avx_step++) { \
         double * xv1 = x1 + i; \
         double * xv2 = x2 + i; \
@@ -90,7 +116,10 @@
     int avx_step_len = AVXGetStepLen(size); \
     int avx_steps = size / avx_step_len, avx_step; \
     int x_is_dest = (x == dest); \
-    avx_sum __avx_sum = AVXGetSumFunc(size); \
+    avx_sum __avx_sum = \
+        (AVXIsAligned(x + i) && AVXIsAligned(y + i) && \
+         AVXIsAligned(dest + (x_is_dest ? i : 0)) ? \
+         AVXGetAlignedSumFunc(size) : AVXGetSumFunc(size)); \
     for (avx_step = 0; avx_step < avx_steps; avx_step++) { \
         int doffs = (x_is_dest ? i : 0); \
         __avx_sum(x + i, y + i, dest + doffs, mode); \
@@ -129,6 +158,11 @@
 
 void PSErr(const char* tag, char* fmt, ...);
 
+/* Memory Functions */
+
+double * PSAlignedAlloc(int count);
+void PSAlignedFree(double * ptr);
+
 /* Activation Functions */
 
 double sigmoid(double val);
@@ -141,6 +175,13 @@ double relu_derivative(double val);
 
 double tanh_derivative(double val);
 
+/* Vector Functions */
+
+double PSDotProduct(double * x, double * y, int size);
+void PSAddScaled(double * dest, double * x, double value, int size);
+void PSMatrixProduct(double ** x, int rows, double ** w, int cols, int size,
+                     double * dest, int stride);
+
 /* Network Functions */
 
 void PSAbortLayer(PSNeuralNetwork * network, PSLayer * layer);